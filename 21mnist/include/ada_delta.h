@@ -6,6 +6,7 @@
 
 #include "mnist_util.h"
 #include "tensor.h"
+#include "checkpoint.h"
 
 template<idx_t N0,idx_t N1=1,idx_t N2=1,idx_t N3=1>
 struct AdaDelta {
@@ -28,6 +29,13 @@ struct AdaDelta {
     std.set_n0(N0);
     dx.set_n0(N0);
   }
+  /**
+     @brief the cost of an update (16 flops per parameter; w, gw, v and u are read and w, v and u written)
+  */
+  static constexpr layer_cost update_cost() {
+    return layer_cost{ 16 * (uint64_t)N0 * N1 * N2 * N3,
+                       7 * (uint64_t)sizeof(real) * N0 * N1 * N2 * N3 };
+  }
   /**
      @brief set the device pointer for this and all subobjects
      @param (dev) a device memory or null
@@ -53,6 +61,15 @@ struct AdaDelta {
     u.mul_(rho).addcmul_(1 - rho, dx, dx);     //  u(t) = ρu(t-1) + (1-ρ)Δx^2
     w.add_(-lr, dx);                           // θ(t) = θ(t-1) - γΔx
   }
+  /**
+     @brief register the optimizer state (v and u) to a checkpoint
+     @param (ck) the checkpoint
+     @param (name) name of this optimizer (e.g., "conv1.opt_w")
+  */
+  void ckpt_sections(checkpoint& ck, const char * name) {
+    ck.add(name, "v", &v.w, sizeof(v.w));
+    ck.add(name, "u", &u.w, sizeof(u.w));
+  }
 };
 
 int ada_delta_main(int argc, char ** argv) {
@@ -0,0 +1,631 @@
+/**
+   @file async_log.h
+   @brief an asynchronous logger (--async-log 1)
+   @details with it, logger::log (mnist_util.h) neither formats nor
+   writes anything on the calling thread. it packs the entry into
+   fixed-size binary records -- the format string (its address is
+   the id of the format), the timestamp, the level and the raw
+   arguments (strings are copied) -- and appends them to the ring
+   of the calling thread, a single-producer single-consumer queue
+   (no locks; an acquire load and a release store per entry). the
+   types of the arguments of a format are parsed on its first use
+   and remembered by its address, so formats must be string
+   literals (as they are in calls of logger::log).
+
+   a background thread takes entries from all rings in the order of
+   timestamps, formats them with their formats and writes them to
+   the log file through a large buffer (and to the standard output
+   if verbose enough). the log is therefore the same text as the
+   synchronous one (parse_log.py reads either), only written a
+   little later.
+
+   an entry whose arguments do not fit in the first record continues
+   in the following ones. when a ring is full, the caller waits for
+   the background thread, so no entry is dropped. a format the
+   packer does not understand (e.g., a '*' width) is formatted on
+   the calling thread and passed as a string.
+ */
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+/** @brief records in the ring of a thread */
+#ifndef ASYNC_LOG_RING_RECORDS
+#define ASYNC_LOG_RING_RECORDS (1 << 16)
+#endif
+/** @brief maximum number of threads that log */
+#define ASYNC_LOG_MAX_THREADS 256
+/** @brief bytes of the buffer of the log file */
+#define ASYNC_LOG_BUF_BYTES (1 << 20)
+/** @brief formats whose argument types a thread remembers */
+#define ASYNC_LOG_FMT_CACHE 256
+
+/**
+   @brief a record (the first one of an entry; the following ones
+   are raw bytes of its arguments)
+*/
+struct async_log_rec {
+  long t;                       /**< timestamp (ns since the log started) */
+  const char * fmt;             /**< format */
+  int32_t level;                /**< level of the entry */
+  uint32_t len;                 /**< bytes of packed arguments */
+  char args[40];                /**< packed arguments (the first 40 bytes) */
+};
+
+/** @brief bytes of arguments packed in the first record */
+enum { ASYNC_LOG_ARGS0 = sizeof(((async_log_rec *)0)->args) };
+
+/**
+   @brief types of arguments of conversions
+*/
+typedef enum {
+  async_log_int,                /**< int (%d, %c, %hd, ...) */
+  async_log_long,               /**< long (%ld, ...) */
+  async_log_llong,              /**< long long (%lld, ...) */
+  async_log_size,               /**< size_t (%zu, ...) */
+  async_log_double,             /**< double (%f, %g, ...) */
+  async_log_str,                /**< string (%s) */
+  async_log_ptr,                /**< pointer (%p) */
+  async_log_none,               /**< no argument (%%) */
+  async_log_bad,                /**< anything else */
+} async_log_arg_t;
+
+/**
+   @brief types of arguments of a format, parsed once
+*/
+struct async_log_fmt {
+  const char * fmt;             /**< the format */
+  int n;                        /**< the number of arguments (-1 if not understood) */
+  uint8_t ty[20];               /**< type of each (async_log_arg_t) */
+};
+
+/**
+   @brief records of a thread
+*/
+struct async_log_ring {
+  async_log_rec rec[ASYNC_LOG_RING_RECORDS]; /**< records (rec[i % ASYNC_LOG_RING_RECORDS]) */
+  async_log_fmt fmts[ASYNC_LOG_FMT_CACHE]; /**< formats seen by the owner (direct mapped by address) */
+  uint64_t head __attribute__((aligned(64))); /**< records consumed so far (by the background thread) */
+  uint64_t tail __attribute__((aligned(64))); /**< records produced so far (by the owner) */
+};
+
+/**
+   @brief parse a conversion specification
+   @param (p) the '%' starting it
+   @param (ty) gets the type of its argument
+   @return the character following it
+*/
+static const char * async_log_spec(const char * p, async_log_arg_t * ty) {
+  p++;
+  if (*p == '%') {
+    *ty = async_log_none;
+    return p + 1;
+  }
+  while (*p && strchr("-+ #0", *p)) p++;
+  while (*p >= '0' && *p <= '9') p++;
+  if (*p == '.') {
+    p++;
+    while (*p >= '0' && *p <= '9') p++;
+  }
+  int l = 0, z = 0;
+  while (*p == 'h') p++;
+  while (*p == 'l') { l++; p++; }
+  if (*p == 'z') { z = 1; p++; }
+  if (*p && strchr("diouxXc", *p)) {
+    *ty = (z ? async_log_size : l == 0 ? async_log_int : l == 1 ? async_log_long : async_log_llong);
+  } else if (*p && strchr("fFeEgGaA", *p) && l <= 1 && !z) {
+    *ty = async_log_double;
+  } else if (*p == 's' && l == 0 && !z) {
+    *ty = async_log_str;
+  } else if (*p == 'p') {
+    *ty = async_log_ptr;
+  } else {
+    *ty = async_log_bad;
+    return p;
+  }
+  return p + 1;
+}
+
+/**
+   @brief parse a format for the types of its arguments
+   @param (f) gets the types
+*/
+static void async_log_parse(const char * fmt, async_log_fmt * f) {
+  f->fmt = fmt;
+  f->n = 0;
+  for (const char * p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+    async_log_arg_t ty;
+    p = async_log_spec(p, &ty);
+    if (ty == async_log_none) continue;
+    if (ty == async_log_bad || f->n == (int)sizeof(f->ty)) {
+      f->n = -1;
+      return;
+    }
+    f->ty[f->n++] = ty;
+  }
+}
+
+/**
+   @brief pack the arguments of a format
+   @param (f) types of the arguments
+   @param (buf) gets the arguments
+   @param (cap) bytes of buf
+   @return bytes packed, or -1 if the format is not understood or buf is too small
+*/
+static long async_log_pack(const async_log_fmt * f, va_list ap, char * buf, long cap) {
+  if (f->n < 0) return -1;
+  long n = 0;
+  for (int k = 0; k < f->n; k++) {
+    if (n + 8 > cap) return -1;
+    switch (f->ty[k]) {
+    case async_log_int:    { int v = va_arg(ap, int);             memcpy(buf + n, &v, sizeof(v)); n += sizeof(v); break; }
+    case async_log_long:   { long v = va_arg(ap, long);           memcpy(buf + n, &v, sizeof(v)); n += sizeof(v); break; }
+    case async_log_llong:  { long long v = va_arg(ap, long long); memcpy(buf + n, &v, sizeof(v)); n += sizeof(v); break; }
+    case async_log_size:   { size_t v = va_arg(ap, size_t);       memcpy(buf + n, &v, sizeof(v)); n += sizeof(v); break; }
+    case async_log_double: { double v = va_arg(ap, double);       memcpy(buf + n, &v, sizeof(v)); n += sizeof(v); break; }
+    case async_log_ptr:    { void * v = va_arg(ap, void *);       memcpy(buf + n, &v, sizeof(v)); n += sizeof(v); break; }
+    default: {
+      const char * s = va_arg(ap, const char *);
+      if (!s) s = "(null)";
+      long sz = strlen(s) + 1;
+      if (n + sz > cap) return -1;
+      memcpy(buf + n, s, sz);
+      n += sz;
+      break;
+    }
+    }
+  }
+  return n;
+}
+
+/**
+   @brief format packed arguments with their format and write it to a file
+   @param (fp) the file
+   @param (fmt) the format
+   @param (args) arguments packed by async_log_pack
+*/
+static void async_log_print(FILE * fp, const char * fmt, const char * args) {
+  const char * p = fmt;
+  while (*p) {
+    const char * q = strchr(p, '%');
+    if (!q) {
+      fputs(p, fp);
+      break;
+    }
+    fwrite(p, 1, q - p, fp);
+    async_log_arg_t ty;
+    p = async_log_spec(q, &ty);
+    char spec[32];
+    long sl = p - q;
+    if (sl >= (long)sizeof(spec)) sl = sizeof(spec) - 1;
+    memcpy(spec, q, sl);
+    spec[sl] = 0;
+    switch (ty) {
+    case async_log_int:    { int v;       memcpy(&v, args, sizeof(v)); args += sizeof(v); fprintf(fp, spec, v); break; }
+    case async_log_long:   { long v;      memcpy(&v, args, sizeof(v)); args += sizeof(v); fprintf(fp, spec, v); break; }
+    case async_log_llong:  { long long v; memcpy(&v, args, sizeof(v)); args += sizeof(v); fprintf(fp, spec, v); break; }
+    case async_log_size:   { size_t v;    memcpy(&v, args, sizeof(v)); args += sizeof(v); fprintf(fp, spec, v); break; }
+    case async_log_double: { double v;    memcpy(&v, args, sizeof(v)); args += sizeof(v); fprintf(fp, spec, v); break; }
+    case async_log_ptr:    { void * v;    memcpy(&v, args, sizeof(v)); args += sizeof(v); fprintf(fp, spec, v); break; }
+    case async_log_str:    fprintf(fp, spec, args); args += strlen(args) + 1; break;
+    case async_log_none:   fputc('%', fp); break;
+    default:               fputs(spec, fp); break;
+    }
+  }
+}
+
+struct async_log;
+/** @brief the ring of this thread */
+static __thread async_log_ring * async_log_my_ring = 0;
+/** @brief the generation of the async_log the ring belongs to */
+static __thread uint64_t async_log_my_gen = 0;
+/** @brief generations given to async_logs so far */
+static uint64_t async_log_n_gens = 0;
+/** @brief the running async_log, finished at exit if not yet */
+static async_log * async_log_active = 0;
+static void async_log_atexit();
+
+/**
+   @brief an asynchronous logger
+*/
+struct async_log {
+  FILE * fp;                    /**< the log file */
+  int verbose;                  /**< entries of levels up to this also go to the standard output */
+  uint64_t gen;                 /**< generation (tells rings of an older async_log at the same address) */
+  async_log_ring * volatile rings[ASYNC_LOG_MAX_THREADS]; /**< ring of each thread */
+  volatile int n_rings;         /**< rings created so far */
+  volatile int stop;            /**< set to stop the background thread once all entries are written */
+  pthread_t th;                 /**< the background thread */
+  char * fbuf;                  /**< buffer of fp */
+  char * scratch;               /**< arguments of the entry being formatted */
+  long scratch_sz;              /**< bytes of scratch */
+  long n_entries;               /**< entries written so far */
+
+  /**
+     @brief start the background thread
+     @param (fp) the log file
+     @param (verbose) entries of levels up to this go to the standard output too
+  */
+  void start(FILE * fp, int verbose) {
+    this->fp = fp;
+    this->verbose = verbose;
+    gen = __sync_add_and_fetch(&async_log_n_gens, 1);
+    memset((void *)rings, 0, sizeof(rings));
+    n_rings = 0;
+    stop = 0;
+    n_entries = 0;
+    scratch_sz = 4096;
+    scratch = (char *)malloc(scratch_sz);
+    fbuf = (char *)malloc(ASYNC_LOG_BUF_BYTES);
+    if (!scratch || !fbuf) {
+      perror("malloc");
+      exit(1);
+    }
+    setvbuf(fp, fbuf, _IOFBF, ASYNC_LOG_BUF_BYTES);
+    if (!async_log_active) {
+      static int registered = 0;
+      if (!registered) atexit(async_log_atexit);
+      registered = 1;
+    }
+    async_log_active = this;
+    pthread_create(&th, 0, thread_fun, this);
+  }
+  /**
+     @brief the ring of the calling thread (created by its first entry)
+  */
+  async_log_ring * my_ring() {
+    if (async_log_my_gen == gen) return async_log_my_ring;
+    async_log_ring * r = (async_log_ring *)calloc(1, sizeof(async_log_ring));
+    if (!r) {
+      perror("calloc");
+      exit(1);
+    }
+    int i = __sync_fetch_and_add(&n_rings, 1);
+    if (i >= ASYNC_LOG_MAX_THREADS) {
+      fprintf(stderr, "error: more than %d threads log\n", ASYNC_LOG_MAX_THREADS);
+      exit(1);
+    }
+    __atomic_store_n(&rings[i], r, __ATOMIC_RELEASE);
+    async_log_my_ring = r;
+    async_log_my_gen = gen;
+    return r;
+  }
+  /**
+     @brief append an entry to the ring of the calling thread
+     @param (level) level of the entry
+     @param (t) timestamp
+     @param (fmt) printf-like format, which must live until the entry is written
+     (a string literal)
+     @param (ap) arguments
+  */
+  void push(int level, long t, const char * fmt, va_list ap) {
+    async_log_ring * r = my_ring();
+    async_log_fmt * f = &r->fmts[((uintptr_t)fmt >> 3) % ASYNC_LOG_FMT_CACHE];
+    if (f->fmt != fmt) async_log_parse(fmt, f);
+    char buf[1024];
+    char * args = buf;
+    va_list aq;
+    va_copy(aq, ap);
+    long len = async_log_pack(f, aq, buf, sizeof(buf));
+    va_end(aq);
+    if (len < 0) {
+      /* format here and pass it as a string */
+      va_copy(aq, ap);
+      long n = vsnprintf(0, 0, fmt, aq);
+      va_end(aq);
+      const long max_len = (ASYNC_LOG_RING_RECORDS / 2) * sizeof(async_log_rec);
+      len = (n + 1 < max_len ? n + 1 : max_len);
+      args = (char *)malloc(n + 1);
+      if (!args) {
+        perror("malloc");
+        exit(1);
+      }
+      va_copy(aq, ap);
+      vsnprintf(args, n + 1, fmt, aq);
+      va_end(aq);
+      args[len - 1] = 0;
+      fmt = "%s";
+    }
+    const long R = sizeof(async_log_rec);
+    uint64_t n_recs = 1 + (len > (long)ASYNC_LOG_ARGS0 ? (len - ASYNC_LOG_ARGS0 + R - 1) / R : 0);
+    uint64_t tail = r->tail;
+    while (tail + n_recs - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > ASYNC_LOG_RING_RECORDS) {
+      sched_yield();            /* full; wait for the background thread */
+    }
+    async_log_rec * rec = &r->rec[tail % ASYNC_LOG_RING_RECORDS];
+    rec->t = t;
+    rec->fmt = fmt;
+    rec->level = level;
+    rec->len = len;
+    long k = (len < (long)ASYNC_LOG_ARGS0 ? len : (long)ASYNC_LOG_ARGS0);
+    memcpy(rec->args, args, k);
+    for (uint64_t j = 1; j < n_recs; j++, k += R) {
+      long m = (len - k < R ? len - k : R);
+      memcpy(&r->rec[(tail + j) % ASYNC_LOG_RING_RECORDS], args + k, m);
+    }
+    if (args != buf) free(args);
+    __atomic_store_n(&r->tail, tail + n_recs, __ATOMIC_RELEASE);
+  }
+  /**
+     @brief write all entries in the rings
+     @return the number of entries written
+  */
+  long drain() {
+    long n = 0;
+    const long R = sizeof(async_log_rec);
+    while (1) {
+      /* the ring whose first entry is the oldest */
+      async_log_ring * r = 0;
+      int nr = __atomic_load_n(&n_rings, __ATOMIC_ACQUIRE);
+      for (int i = 0; i < nr && i < ASYNC_LOG_MAX_THREADS; i++) {
+        async_log_ring * q = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+        if (!q || q->head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) continue;
+        if (!r || q->rec[q->head % ASYNC_LOG_RING_RECORDS].t < r->rec[r->head % ASYNC_LOG_RING_RECORDS].t) r = q;
+      }
+      if (!r) break;
+      uint64_t head = r->head;
+      async_log_rec * rec = &r->rec[head % ASYNC_LOG_RING_RECORDS];
+      long len = rec->len;
+      if (len > scratch_sz) {
+        scratch_sz = len;
+        scratch = (char *)realloc(scratch, scratch_sz);
+        if (!scratch) {
+          perror("realloc");
+          exit(1);
+        }
+      }
+      long k = (len < (long)ASYNC_LOG_ARGS0 ? len : (long)ASYNC_LOG_ARGS0);
+      memcpy(scratch, rec->args, k);
+      uint64_t j = 1;
+      for (; k < len; j++, k += R) {
+        long m = (len - k < R ? len - k : R);
+        memcpy(scratch + k, &r->rec[(head + j) % ASYNC_LOG_RING_RECORDS], m);
+      }
+      long t = rec->t;
+      const char * fmt = rec->fmt;
+      int level = rec->level;
+      __atomic_store_n(&r->head, head + j, __ATOMIC_RELEASE);
+      fprintf(fp, "%ld: ", t);
+      async_log_print(fp, fmt, scratch);
+      fputc('\n', fp);
+      if (verbose >= level) {
+        fprintf(stdout, "%ld: ", t);
+        async_log_print(stdout, fmt, scratch);
+        fputc('\n', stdout);
+      }
+      n++;
+    }
+    n_entries += n;
+    return n;
+  }
+  /**
+     @brief the body of the background thread
+  */
+  static void * thread_fun(void * arg) {
+    async_log * a = (async_log *)arg;
+    int dirty = 0;
+    while (1) {
+      int s = __atomic_load_n(&a->stop, __ATOMIC_ACQUIRE);
+      if (a->drain()) {
+        dirty = 1;
+      } else if (s) {
+        break;
+      } else {
+        /* idle; let what has been written so far be seen */
+        if (dirty) {
+          fflush(a->fp);
+          fflush(stdout);
+          dirty = 0;
+        }
+        struct timespec ts = { 0, 200 * 1000 };
+        nanosleep(&ts, 0);
+      }
+    }
+    fflush(a->fp);
+    fflush(stdout);
+    return 0;
+  }
+  /**
+     @brief write all entries, stop the background thread and free everything
+     @details entries must not be pushed any more. the file is not closed
+     (but its buffer is detached)
+  */
+  void finish() {
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    pthread_join(th, 0);
+    setvbuf(fp, 0, _IOFBF, BUFSIZ);
+    for (int i = 0; i < n_rings && i < ASYNC_LOG_MAX_THREADS; i++) free(rings[i]);
+    free(scratch);
+    free(fbuf);
+    if (async_log_active == this) async_log_active = 0;
+    gen = 0;
+  }
+};
+
+/**
+   @brief write entries of the running async_log at exit (e.g., bail())
+*/
+static void async_log_atexit() {
+  if (async_log_active) async_log_active->finish();
+}
+
+/**
+   @brief an entry of the test, pushed to a (if not null) or written to ref
+*/
+static void async_log_test_entry(async_log * a, FILE * ref, int level, long t, const char * fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  if (a) {
+    a->push(level, t, fmt, ap);
+  } else {
+    fprintf(ref, "%ld: ", t);
+    vfprintf(ref, fmt, ap);
+    fputc('\n', ref);
+  }
+  va_end(ap);
+}
+
+/**
+   @brief the i-th entry of thread tid in the test (timestamp i * 10 + tid)
+*/
+static void async_log_test_entries(async_log * a, FILE * ref, int tid, long n) {
+  static char long_str[3000];
+  memset(long_str, 'x', sizeof(long_str) - 1);
+  for (long i = 0; i < n; i++) {
+    long t = i * 10 + tid;
+    double x = i * 0.001;
+    switch (i % 4) {
+    case 0:
+      async_log_test_entry(a, ref, 1, t, "thread %d entry %ld loss %.4f (%.0f%%) %s",
+                           tid, i, x, 100.0 * x, "ok");
+      break;
+    case 1:
+      async_log_test_entry(a, ref, 3, t, "sample %d image %d pred %d truth %d",
+                           tid, (int)i, (int)(i % 10), (int)(i % 7));
+      break;
+    case 2:
+      async_log_test_entry(a, ref, 2, t, "thread %d %zu %lld %c %5.2e [%-6s] %p",
+                           tid, (size_t)i, -(long long)i, 'a' + (int)(i % 26), i * 1.5, "s", (void *)0);
+      break;
+    default:
+      /* longer than a record, too long to pack and a '*' width (formatted by the caller) */
+      async_log_test_entry(a, ref, 2, t, "thread %d long %s", tid, long_str + 2900 - (i % 100));
+      async_log_test_entry(a, ref, 2, t, "thread %d long %s", tid, long_str + (i % 2000));
+      async_log_test_entry(a, ref, 2, t, "thread %d width [%*d]", tid, 7, (int)i);
+      break;
+    }
+  }
+}
+
+/**
+   @brief argument of a thread of the test
+*/
+struct async_log_test_arg {
+  async_log * a;                /**< the logger */
+  int tid;                      /**< thread index */
+  long n;                       /**< entries to push */
+};
+
+/**
+   @brief CPU time of the calling thread in ns (for the test; the
+   background thread may take the same core)
+*/
+static long async_log_test_ns() {
+  struct timespec ts[1];
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, ts);
+  return ts->tv_sec * 1000000000L + ts->tv_nsec;
+}
+
+/**
+   @brief a thread of the test
+*/
+static void * async_log_test_thread(void * arg_) {
+  async_log_test_arg * arg = (async_log_test_arg *)arg_;
+  async_log_test_entries(arg->a, 0, arg->tid, arg->n);
+  return 0;
+}
+
+/**
+   @brief entry point of this header file
+   @details if this header file is included from
+   a main C++ file and define async_log_main to be main
+   (e.g., with -Dasync_log_main=main), then this
+   function becomes th main function of the executable.
+   it first compares the time the calling thread spends on an entry
+   like those of log_prediction with fprintf and with async_log.
+   4 threads then push entries of various formats to an async_log
+   at once; entries of each thread in the file must be the same as
+   those fprintf writes, in the same order.
+*/
+int async_log_main(int argc, char ** argv) {
+  const char * file = (argc > 1 ? argv[1] : "async_log_test.log");
+  const long n = (argc > 2 ? atol(argv[2]) : 20000);
+  const int n_threads = 4;
+  /* the time of the caller (entries fit in the ring) */
+  const long n_time = ASYNC_LOG_RING_RECORDS / 2;
+  double ns_per_entry[2];
+  for (int r = 0; r < 2; r++) {
+    FILE * fp = fopen(file, "wb");
+    if (!fp) {
+      perror(file);
+      return 1;
+    }
+    async_log * a = (r ? (async_log *)malloc(sizeof(async_log)) : 0);
+    if (a) a->start(fp, 0);
+    long t0 = async_log_test_ns();
+    for (long i = 0; i < n_time; i++) {
+      async_log_test_entry(a, fp, 3, i, "sample %ld image %d pred %d truth %d",
+                           i, (int)i, (int)(i % 10), (int)(i % 7));
+    }
+    ns_per_entry[r] = (double)(async_log_test_ns() - t0) / n_time;
+    if (a) {
+      a->finish();
+      free(a);
+    }
+    fclose(fp);
+  }
+  printf("CPU time of the caller: fprintf %.1f ns/entry, async_log %.1f ns/entry\n", ns_per_entry[0], ns_per_entry[1]);
+  /* entries of various formats from threads at once */
+  FILE * fp = fopen(file, "wb");
+  async_log * a = (async_log *)malloc(sizeof(async_log));
+  a->start(fp, 0);
+  pthread_t th[n_threads];
+  async_log_test_arg args[n_threads];
+  for (int i = 0; i < n_threads; i++) {
+    args[i].a = a;
+    args[i].tid = i;
+    args[i].n = n;
+    pthread_create(&th[i], 0, async_log_test_thread, &args[i]);
+  }
+  for (int i = 0; i < n_threads; i++) pthread_join(th[i], 0);
+  long n_entries = 0;
+  a->finish();
+  n_entries = a->n_entries;
+  fclose(fp);
+  free(a);
+  /* entries of each thread in the file must be those of the reference, in order */
+  int ok = 1;
+  fp = fopen(file, "rb");
+  char * ref_buf[n_threads];
+  size_t ref_sz[n_threads];
+  char * ref_p[n_threads];
+  for (int i = 0; i < n_threads; i++) {
+    FILE * ref = open_memstream(&ref_buf[i], &ref_sz[i]);
+    async_log_test_entries(0, ref, i, n);
+    fclose(ref);
+    ref_p[i] = ref_buf[i];
+  }
+  char * line = 0;
+  size_t cap = 0;
+  long n_lines = 0;
+  while (getline(&line, &cap, fp) > 0) {
+    int tid = atol(line) % 10;
+    char * nl = strchr(ref_p[tid], '\n');
+    size_t len = nl - ref_p[tid] + 1;
+    if (tid >= n_threads || strncmp(line, ref_p[tid], len) != 0 || strlen(line) != len) {
+      if (ok) printf("NG: line %ld: %.80s\n", n_lines, line);
+      ok = 0;
+      break;
+    }
+    ref_p[tid] += len;
+    n_lines++;
+  }
+  for (int i = 0; i < n_threads; i++) {
+    ok = ok && (*ref_p[i] == 0);
+    free(ref_buf[i]);
+  }
+  free(line);
+  fclose(fp);
+  unlink(file);
+  printf("%ld entries from %d threads (%ld lines checked)\n", n_entries, n_threads, n_lines);
+  printf("%s\n", ok ? "OK" : "NG");
+  return ok ? 0 : 1;
+}
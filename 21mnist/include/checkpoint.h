@@ -0,0 +1,411 @@
+/**
+   @file checkpoint.h
+   @brief saving and restoring the training state (weights, optimizer
+   states and random number generators) in a single binary file
+   @details the file consists of a header, a section table and
+   sections. each section is the raw bytes of a tensor (or a few
+   scalars), starting at a CKPT_ALIGN-byte aligned offset, so a
+   mapped file can be read (or even used) in place.
+
+   |header|section table|pad|section 0|pad|section 1|pad|...
+
+   layers register their sections by name with ckpt_sections, in
+   the same way they provide rand_grad/copy_grad/etc.  the layout
+   (offsets) is computed once from the registered sections.
+
+   saving is asynchronous: snapshot copies all sections into one
+   of two staging buffers laid out exactly like the file and hands
+   it to a writer thread, which writes it to FILE.tmp and renames
+   it to FILE. training only pays for the memcpy; if the writer is
+   still busy with the previous snapshot, the next one goes to the
+   other buffer (and replaces a staged snapshot the writer has not
+   picked up yet).
+
+   restoring maps the file, checks the header and sizes of all
+   sections and copies them to the registered locations.
+ */
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "mnist_util.h"
+
+/** @brief magic string at the beginning of a checkpoint file */
+#define CKPT_MAGIC "MNISTCKP"
+/** @brief file format version; bump when the layout changes */
+#define CKPT_VERSION 1
+/** @brief alignment of sections in the file (and staging buffers) */
+#define CKPT_ALIGN 4096
+/** @brief maximum length of a section name (including the terminating null) */
+#define CKPT_NAME_MAX 48
+/** @brief maximum number of sections */
+#define CKPT_MAX_SECTIONS 64
+
+/**
+   @brief header at the beginning of a checkpoint file
+*/
+struct ckpt_header {
+  char magic[8];                /**< CKPT_MAGIC (not null-terminated) */
+  uint32_t version;             /**< CKPT_VERSION */
+  uint32_t real_size;           /**< sizeof(real) of the program that wrote it */
+  uint64_t file_size;           /**< size of the whole file in bytes */
+  uint32_t n_sections;          /**< number of entries in the section table */
+  uint32_t align;               /**< alignment of sections */
+  int64_t epoch;                /**< number of epochs completed when written */
+};
+
+/**
+   @brief an entry of the section table
+*/
+struct ckpt_section {
+  char name[CKPT_NAME_MAX];     /**< e.g., "conv1.opt_w.u" */
+  uint64_t offset;              /**< offset of the data from the beginning of the file */
+  uint64_t bytes;               /**< size of the data */
+};
+
+/**
+   @brief round x up to a multiple of CKPT_ALIGN
+*/
+static uint64_t ckpt_round_up(uint64_t x) {
+  return (x + CKPT_ALIGN - 1) / CKPT_ALIGN * CKPT_ALIGN;
+}
+
+/**
+   @brief checkpoint of a network (layout, staging buffers and writer thread)
+*/
+struct checkpoint {
+  ckpt_section sections[CKPT_MAX_SECTIONS]; /**< the section table */
+  void * ptrs[CKPT_MAX_SECTIONS];  /**< where the data of each section lives in memory */
+  uint32_t n_sections;          /**< number of registered sections */
+  uint64_t file_size;           /**< size of the file (and a staging buffer) */
+  char * stage[2];              /**< staging buffers */
+  const char * path;            /**< file snapshots are written to */
+  pthread_t writer;             /**< writer thread */
+  pthread_mutex_t mu;           /**< protects fields below */
+  pthread_cond_t cv;            /**< signals a new snapshot or quit */
+  int pending;                  /**< staging buffer waiting to be written (-1 if none) */
+  int writing;                  /**< staging buffer being written (-1 if none) */
+  int quit;                     /**< 1 when the writer should exit after draining */
+  int started;                  /**< 1 if the writer thread is running */
+  long n_written;               /**< snapshots written so far */
+  long n_replaced;              /**< staged snapshots replaced before being written */
+  long n_errors;                /**< snapshots whose write failed */
+  long last_write_ns;           /**< time the last write (incl. fsync and rename) took */
+  int64_t last_epoch;           /**< epoch of the last snapshot written */
+
+  /**
+     @brief initialize an empty checkpoint (no sections)
+  */
+  void init() {
+    n_sections = 0;
+    file_size = 0;
+    stage[0] = stage[1] = 0;
+    path = 0;
+    pending = writing = -1;
+    quit = started = 0;
+    n_written = n_replaced = n_errors = 0;
+    last_write_ns = 0;
+    last_epoch = -1;
+    pthread_mutex_init(&mu, 0);
+    pthread_cond_init(&cv, 0);
+  }
+  /**
+     @brief register a section
+     @param (prefix) name of the object the section belongs to (e.g., "conv1")
+     @param (name) name of the section within the object (e.g., "w")
+     @param (p) the address of the data
+     @param (bytes) the size of the data
+  */
+  void add(const char * prefix, const char * name, void * p, size_t bytes) {
+    if (n_sections >= CKPT_MAX_SECTIONS) {
+      fprintf(stderr, "error: too many checkpoint sections (increase CKPT_MAX_SECTIONS)\n");
+      bail();
+    }
+    ckpt_section& s = sections[n_sections];
+    memset(s.name, 0, sizeof(s.name));
+    int n = snprintf(s.name, sizeof(s.name), "%s.%s", prefix, name);
+    if (n >= (int)sizeof(s.name)) {
+      fprintf(stderr, "error: checkpoint section name too long (%s.%s)\n", prefix, name);
+      bail();
+    }
+    s.bytes = bytes;
+    s.offset = 0;
+    ptrs[n_sections] = p;
+    n_sections++;
+  }
+  /**
+     @brief compute offsets of all registered sections
+     @details called once after all sections are registered
+  */
+  void layout() {
+    uint64_t off = ckpt_round_up(sizeof(ckpt_header) + n_sections * sizeof(ckpt_section));
+    for (uint32_t i = 0; i < n_sections; i++) {
+      sections[i].offset = off;
+      off = ckpt_round_up(off + sections[i].bytes);
+    }
+    file_size = off;
+  }
+  /**
+     @brief write the header and the section table to a staging buffer
+  */
+  void fill_header(char * buf, int64_t epoch) {
+    ckpt_header * h = (ckpt_header *)buf;
+    memcpy(h->magic, CKPT_MAGIC, sizeof(h->magic));
+    h->version = CKPT_VERSION;
+    h->real_size = sizeof(real);
+    h->file_size = file_size;
+    h->n_sections = n_sections;
+    h->align = CKPT_ALIGN;
+    h->epoch = epoch;
+    memcpy(buf + sizeof(ckpt_header), sections, n_sections * sizeof(ckpt_section));
+  }
+  /**
+     @brief allocate a staging buffer (page-aligned, zero-filled)
+  */
+  char * alloc_stage() {
+    void * p = 0;
+    if (posix_memalign(&p, CKPT_ALIGN, file_size) != 0) {
+      perror("posix_memalign"); bail();
+    }
+    memset(p, 0, file_size);
+    return (char *)p;
+  }
+  /**
+     @brief write a staging buffer to path atomically (path.tmp, fsync, rename)
+     @return 0 on success, -1 on failure
+  */
+  int write_file(const char * buf) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return -1;
+    uint64_t done = 0;
+    while (done < file_size) {
+      ssize_t n = write(fd, buf + done, file_size - done);
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        close(fd);
+        return -1;
+      }
+      done += n;
+    }
+    if (fsync(fd) == -1 || close(fd) == -1) return -1;
+    if (rename(tmp, path) == -1) return -1;
+    return 0;
+  }
+  /**
+     @brief the body of the writer thread
+  */
+  void writer_loop() {
+    pthread_mutex_lock(&mu);
+    while (1) {
+      while (pending < 0 && !quit) {
+        pthread_cond_wait(&cv, &mu);
+      }
+      if (pending < 0) break;   /* quit and nothing left to write */
+      writing = pending;
+      pending = -1;
+      pthread_mutex_unlock(&mu);
+      const char * buf = stage[writing];
+      tsc_t t0 = get_tsc();
+      int r = write_file(buf);
+      tsc_t t1 = get_tsc();
+      pthread_mutex_lock(&mu);
+      if (r == 0) {
+        n_written++;
+        last_epoch = ((ckpt_header *)buf)->epoch;
+      } else {
+        n_errors++;
+      }
+      last_write_ns = t1.ns - t0.ns;
+      writing = -1;
+    }
+    pthread_mutex_unlock(&mu);
+  }
+  /**
+     @brief entry point of the writer thread
+  */
+  static void * writer_main(void * arg) {
+    ((checkpoint *)arg)->writer_loop();
+    return 0;
+  }
+  /**
+     @brief start the writer thread writing snapshots to path
+  */
+  void start_writer(const char * path) {
+    this->path = path;
+    stage[0] = alloc_stage();
+    stage[1] = alloc_stage();
+    if (pthread_create(&writer, 0, writer_main, this) != 0) {
+      perror("pthread_create"); bail();
+    }
+    started = 1;
+  }
+  /**
+     @brief take a snapshot of all sections and hand it to the writer
+     @param (epoch) the number of completed epochs recorded in the file
+     @return the time spent copying (nanoseconds)
+     @details data of all sections must be on the host
+  */
+  long snapshot(int64_t epoch) {
+    tsc_t t0 = get_tsc();
+    pthread_mutex_lock(&mu);
+    int b;
+    if (pending >= 0) {
+      /* the writer has not picked up the last snapshot; replace it */
+      b = pending;
+      pending = -1;
+      n_replaced++;
+    } else {
+      b = (writing == 0 ? 1 : 0);
+    }
+    pthread_mutex_unlock(&mu);
+    char * buf = stage[b];
+    fill_header(buf, epoch);
+    for (uint32_t i = 0; i < n_sections; i++) {
+      memcpy(buf + sections[i].offset, ptrs[i], sections[i].bytes);
+    }
+    pthread_mutex_lock(&mu);
+    pending = b;
+    pthread_cond_signal(&cv);
+    pthread_mutex_unlock(&mu);
+    tsc_t t1 = get_tsc();
+    return t1.ns - t0.ns;
+  }
+  /**
+     @brief wait for the writer to write all staged snapshots and stop it
+  */
+  void finish() {
+    if (!started) return;
+    pthread_mutex_lock(&mu);
+    quit = 1;
+    pthread_cond_signal(&cv);
+    pthread_mutex_unlock(&mu);
+    pthread_join(writer, 0);
+    started = 0;
+    free(stage[0]);
+    free(stage[1]);
+    stage[0] = stage[1] = 0;
+  }
+  /**
+     @brief log what the writer has done so far
+  */
+  void log_stats(logger * lgr) {
+    pthread_mutex_lock(&mu);
+    lgr->log(1, "# checkpoint: %ld written (last: epoch %ld, %ld bytes, %ld nsec), %ld replaced, %ld failed",
+             n_written, (long)last_epoch, (long)file_size, last_write_ns, n_replaced, n_errors);
+    pthread_mutex_unlock(&mu);
+  }
+  /**
+     @brief restore all registered sections from a file
+     @param (file) the checkpoint file
+     @param (epoch) set to the number of epochs completed when the file was written
+     @param (populate) 1 to read the whole file in advance (fastest when
+     all sections are restored); 0 to read only the pages of the
+     registered sections (when only a part of them are needed)
+     @return 0 on success, -1 on failure (with a message to stderr)
+     @details the file is mapped and data are copied from the mapping.
+     every registered section must be in the file with the same size
+  */
+  int restore(const char * file, int64_t * epoch, int populate = 1) {
+    int fd = open(file, O_RDONLY);
+    if (fd == -1) { perror(file); return -1; }
+    struct stat sb[1];
+    if (fstat(fd, sb) == -1) { perror("fstat"); close(fd); return -1; }
+    size_t sz = sb->st_size;
+    if (sz < sizeof(ckpt_header)) {
+      fprintf(stderr, "error: %s: too small for a checkpoint\n", file);
+      close(fd);
+      return -1;
+    }
+    char * a = (char *)mmap(0, sz, PROT_READ, MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+    close(fd);
+    if (a == MAP_FAILED) { perror("mmap"); return -1; }
+    int r = restore_from(file, a, sz, epoch);
+    munmap(a, sz);
+    return r;
+  }
+  /**
+     @brief restore all registered sections from a mapped file
+     @sa restore
+  */
+  int restore_from(const char * file, const char * a, size_t sz, int64_t * epoch) {
+    const ckpt_header * h = (const ckpt_header *)a;
+    if (memcmp(h->magic, CKPT_MAGIC, sizeof(h->magic)) != 0) {
+      fprintf(stderr, "error: %s: not a checkpoint\n", file);
+      return -1;
+    }
+    if (h->version != CKPT_VERSION || h->real_size != sizeof(real)) {
+      fprintf(stderr, "error: %s: version %u with %u-byte reals (expected %u with %u-byte reals)\n",
+              file, h->version, h->real_size, CKPT_VERSION, (uint32_t)sizeof(real));
+      return -1;
+    }
+    if (h->file_size != sz
+        || sizeof(ckpt_header) + h->n_sections * sizeof(ckpt_section) > sz) {
+      fprintf(stderr, "error: %s: truncated (%lu bytes, header says %lu)\n",
+              file, (unsigned long)sz, (unsigned long)h->file_size);
+      return -1;
+    }
+    const ckpt_section * tab = (const ckpt_section *)(a + sizeof(ckpt_header));
+    for (uint32_t i = 0; i < n_sections; i++) {
+      const ckpt_section * s = 0;
+      for (uint32_t j = 0; j < h->n_sections; j++) {
+        if (strncmp(tab[j].name, sections[i].name, CKPT_NAME_MAX) == 0) {
+          s = &tab[j];
+          break;
+        }
+      }
+      if (!s) {
+        fprintf(stderr, "error: %s: no section %s\n", file, sections[i].name);
+        return -1;
+      }
+      if (s->bytes != sections[i].bytes || s->offset + s->bytes > sz) {
+        fprintf(stderr, "error: %s: section %s has %lu bytes (expected %lu)\n",
+                file, sections[i].name, (unsigned long)s->bytes,
+                (unsigned long)sections[i].bytes);
+        return -1;
+      }
+      memcpy(ptrs[i], a + s->offset, s->bytes);
+    }
+    *epoch = h->epoch;
+    return 0;
+  }
+};
+
+/**
+   @brief entry point of this header file
+   @param (argc) the number of command line args
+   @param (argv) command line args
+   @details registers two small arrays, writes a snapshot
+   with the writer thread, overwrites the arrays and restores
+   them from the file, checking they come back.
+*/
+int checkpoint_main(int argc, char ** argv) {
+  cmdline_opt opt = parse_args(argc, argv);
+  if (opt.error || opt.help) usage(argv[0]);
+  const int n = 1000;
+  real a[n];
+  long x = 12345;
+  for (int i = 0; i < n; i++) a[i] = i;
+  checkpoint ck;
+  ck.init();
+  ck.add("a", "w", a, sizeof(a));
+  ck.add("x", "state", &x, sizeof(x));
+  ck.layout();
+  ck.start_writer("checkpoint_test.ckpt");
+  ck.snapshot(3);
+  ck.finish();
+  for (int i = 0; i < n; i++) a[i] = 0;
+  x = 0;
+  int64_t epoch = 0;
+  if (ck.restore("checkpoint_test.ckpt", &epoch) != 0) return 1;
+  unlink("checkpoint_test.ckpt");
+  int ok = (epoch == 3 && x == 12345);
+  for (int i = 0; i < n; i++) ok = ok && (a[i] == i);
+  printf("%s\n", ok ? "OK" : "NG");
+  return ok ? 0 : 1;
+}
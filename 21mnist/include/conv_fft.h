@@ -0,0 +1,616 @@
+/**
+   @file conv_fft.h
+   @brief convolution by fast Fourier transforms (--conv-fft on/auto)
+   @details direct convolution costs IC*OC*K*K multiply-adds per
+   output pixel, so it grows as K^2. a convolution is a pointwise
+   product in the frequency domain, whose cost does not depend on K:
+
+   - y = irfft(sum_ic X(s,ic) * conj(Wf(oc,ic))) + b(oc)
+   - gx = irfft(sum_oc GY(s,oc) * Wf(oc,ic))
+   - gw = irfft(sum_s X(s,ic) * conj(GY(s,oc))), the first KxK elements
+
+   X, GY and Wf are 2D real FFTs of x, gy and w zero padded to
+   NH x NW (H and W rounded up to powers of two; as they are not
+   smaller than H and W, the circular correlation never wraps into
+   the elements we take). each 2D transform is
+   a complex FFT of half length along rows (pairs of rows packed
+   into one complex row), then a complex FFT along columns of the
+   NH/2+1 non-redundant frequencies; both vectorize across the
+   sequences they transform at a time (fft_plan::run). zero
+   padding is skipped (only the columns of data are transformed in
+   the first pass, and inverse transforms stop at the columns they
+   are asked for).
+
+   spectra of filters are cached per layer (conj(Wf), recomputed when
+   w differs from the copy they were made from, i.e., after every
+   update in training but only once in testing); forward keeps
+   spectra of its input for gw, backward those of gy of the whole
+   mini batch, so gw needs no reduction across threads (threads
+   split output channels) and is the same with any number of
+   threads. these take (IC + OC) * maxB + IC * OC spectra of
+   NW * (NH/2+1) complex numbers per layer.
+
+   the gain is K-dependent: conv_fft_pays estimates both costs
+   (--conv-fft auto), and convolution_main with --conv-fft
+   measures where FFT overtakes the direct and im2col kernels.
+ */
+#pragma once
+
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include "mnist_util.h"
+#include "tensor.h"
+
+/**
+   @brief when convolutions run on FFT (--conv-fft)
+*/
+typedef enum {
+  conv_fft_off,                 /**< never (direct kernels of the algorithm) */
+  conv_fft_on,                  /**< always (cpu algorithms) */
+  conv_fft_auto,                /**< layers conv_fft_pays says gain from it */
+} conv_fft_t;
+
+/** @brief auto chooses FFT when direct convolution takes more than
+    this times its flops. below 1, as flops of the transforms and
+    pointwise products (vectorized across long rows) ran 1.9-4.3 times
+    faster than those of the direct cpu_simd kernels at -O3 in
+    convolution_main with --conv-fft, which measures the crossover;
+    0.5 is the break-even of the closest shapes measured */
+#define CONV_FFT_MIN_GAIN 0.5
+
+/**
+   @brief parse the name of a mode (--conv-fft)
+*/
+__attribute__((unused))
+static conv_fft_t parse_conv_fft(const char * s) {
+  if (strcmp(s, "on") == 0) return conv_fft_on;
+  if (strcmp(s, "auto") == 0) return conv_fft_auto;
+  return conv_fft_off;
+}
+
+/**
+   @brief the smallest power of two not smaller than n
+*/
+static constexpr idx_t fft_size(idx_t n) {
+  return (n <= 1 ? 1 : 2 * fft_size((n + 1) / 2));
+}
+
+/**
+   @brief the base 2 logarithm of a power of two
+*/
+static constexpr idx_t fft_log2(idx_t n) {
+  return (n <= 1 ? 0 : 1 + fft_log2(n / 2));
+}
+
+/**
+   @brief a scratch buffer of (at least) n reals for transforms
+   @details it only grows and is per thread, like par_reduce_buf
+*/
+static real * conv_fft_buf(size_t n) {
+  static thread_local real * buf = 0;
+  static thread_local size_t cap = 0;
+  if (cap < n) {
+    free(buf);
+    buf = (real *)malloc(sizeof(real) * n);
+    if (!buf) { perror("malloc"); bail(); }
+    cap = n;
+  }
+  return buf;
+}
+
+/**
+   @brief (a, b) = (a + w * b, a - w * b) on n complex numbers
+   (real and imaginary parts in separate arrays)
+*/
+static void fft_butterfly(real * ar, real * ai, real * br, real * bi,
+                          real wr, real wi, idx_t n) {
+#ifdef __ARM_64BIT_STATE
+  for (idx_t c = 0; c < n; c++) {
+    real tr = br[c] * wr - bi[c] * wi;
+    real ti = br[c] * wi + bi[c] * wr;
+    br[c] = ar[c] - tr; bi[c] = ai[c] - ti;
+    ar[c] += tr;        ai[c] += ti;
+  }
+#else
+  const __m512 vwr = _mm512_set1_ps(wr), vwi = _mm512_set1_ps(wi);
+  for (idx_t c = 0; c < n; c += L) {
+    const __mmask16 m = (c + L <= n ? (__mmask16)0xffff : (__mmask16)((1u << (n - c)) - 1));
+    __m512 xr = _mm512_maskz_loadu_ps(m, ar + c), xi = _mm512_maskz_loadu_ps(m, ai + c);
+    __m512 yr = _mm512_maskz_loadu_ps(m, br + c), yi = _mm512_maskz_loadu_ps(m, bi + c);
+    __m512 tr = _mm512_fmsub_ps(yr, vwr, _mm512_mul_ps(yi, vwi));
+    __m512 ti = _mm512_fmadd_ps(yr, vwi, _mm512_mul_ps(yi, vwr));
+    _mm512_mask_storeu_ps(br + c, m, _mm512_sub_ps(xr, tr));
+    _mm512_mask_storeu_ps(bi + c, m, _mm512_sub_ps(xi, ti));
+    _mm512_mask_storeu_ps(ar + c, m, _mm512_add_ps(xr, tr));
+    _mm512_mask_storeu_ps(ai + c, m, _mm512_add_ps(xi, ti));
+  }
+#endif
+}
+
+/**
+   @brief acc += a * b (or a * conj(b)) on n complex numbers
+   @param (acc) real parts of the sums (the imaginary parts follow at acc + n)
+   @param (a) ditto for a
+   @param (b) ditto for b
+   @param (n) the number of elements
+   @param (conj_b) 1 to multiply by the complex conjugate of b
+*/
+static void fft_cmac(real * acc, const real * a, const real * b, idx_t n, int conj_b) {
+  real * cr = acc, * ci = acc + n;
+  const real * ar = a, * ai = a + n, * br = b, * bi = b + n;
+#ifdef __ARM_64BIT_STATE
+  const real sg = (conj_b ? -1 : 1);
+  for (idx_t e = 0; e < n; e++) {
+    cr[e] += ar[e] * br[e] - sg * ai[e] * bi[e];
+    ci[e] += ai[e] * br[e] + sg * ar[e] * bi[e];
+  }
+#else
+  const __m512 sg = _mm512_set1_ps(conj_b ? -1.0f : 1.0f);
+  for (idx_t e = 0; e < n; e += L) {
+    const __mmask16 m = (e + L <= n ? (__mmask16)0xffff : (__mmask16)((1u << (n - e)) - 1));
+    __m512 xr = _mm512_maskz_loadu_ps(m, ar + e), xi = _mm512_maskz_loadu_ps(m, ai + e);
+    __m512 yr = _mm512_maskz_loadu_ps(m, br + e);
+    __m512 yi = _mm512_mul_ps(sg, _mm512_maskz_loadu_ps(m, bi + e));
+    __m512 vr = _mm512_maskz_loadu_ps(m, cr + e), vi = _mm512_maskz_loadu_ps(m, ci + e);
+    vr = _mm512_fnmadd_ps(xi, yi, _mm512_fmadd_ps(xr, yr, vr));
+    vi = _mm512_fmadd_ps(xr, yi, _mm512_fmadd_ps(xi, yr, vi));
+    _mm512_mask_storeu_ps(cr + e, m, vr);
+    _mm512_mask_storeu_ps(ci + e, m, vi);
+  }
+#endif
+}
+
+/**
+   @brief twiddle factors and bit reversal of complex FFTs of length N
+   @param (N) length (a power of two)
+*/
+template<idx_t N>
+struct fft_plan {
+  real cr[N / 2 + 1];           /**< cos(2 pi q / N) */
+  real ci[N / 2 + 1];           /**< -sin(2 pi q / N) */
+  idx_t rev[N];                 /**< bit reversal of indexes */
+  /**
+     @brief make the tables
+  */
+  void init() {
+    const idx_t lg = fft_log2(N);
+    for (idx_t t = 0; t < N; t++) {
+      idx_t r = 0;
+      for (idx_t b = 0; b < lg; b++) {
+        if ((t >> b) & 1) r |= 1 << (lg - 1 - b);
+      }
+      rev[t] = r;
+    }
+    for (idx_t q = 0; q <= N / 2; q++) {
+      cr[q] = cos(2.0 * M_PI * q / N);
+      ci[q] = -sin(2.0 * M_PI * q / N);
+    }
+  }
+  /**
+     @brief transform n sequences at a time, in place
+     @param (re) real parts; element t of sequence c is re[t * ts + c]
+     @param (im) imaginary parts, laid out likewise
+     @param (ts) distance between consecutive elements of a sequence
+     @param (n) the number of sequences (contiguous)
+     @param (inverse) 1 for the inverse transform (not scaled by 1/N)
+     @details radix-2, decimation in time; each butterfly runs
+     across the n sequences, so it vectorizes however short N is
+  */
+  void run(real * re, real * im, idx_t ts, idx_t n, int inverse) const {
+    for (idx_t t = 0; t < N; t++) {
+      const idx_t r = rev[t];
+      if (r <= t) continue;
+      for (idx_t c = 0; c < n; c++) {
+        real u = re[t * ts + c]; re[t * ts + c] = re[r * ts + c]; re[r * ts + c] = u;
+        real v = im[t * ts + c]; im[t * ts + c] = im[r * ts + c]; im[r * ts + c] = v;
+      }
+    }
+    for (idx_t len = 2; len <= N; len *= 2) {
+      const idx_t half = len / 2, step = N / len;
+      for (idx_t s0 = 0; s0 < N; s0 += len) {
+        for (idx_t q = 0; q < half; q++) {
+          const idx_t a = (s0 + q) * ts, b = (s0 + q + half) * ts;
+          fft_butterfly(re + a, im + a, re + b, im + b,
+                        cr[q * step], (inverse ? -ci[q * step] : ci[q * step]), n);
+        }
+      }
+    }
+  }
+};
+
+/**
+   @brief 2D FFTs of real H x W images (zero padded to NH x NW)
+   @details a spectrum has S = NW * NHF complex numbers (real parts,
+   then imaginary parts), frequency (k,l) (0 <= k < NHF along the
+   height, 0 <= l < NW along the width) at l * NHF + k; the other
+   half along the height is the conjugate of these.
+*/
+template<idx_t H,idx_t W>
+struct rfft2d {
+  static_assert(H >= 2 && W >= 2, "rfft2d needs at least 2x2 images");
+  static const idx_t NH = fft_size(H);  /**< padded height */
+  static const idx_t NW = fft_size(W);  /**< padded width */
+  static const idx_t M = NH / 2;        /**< length of complex FFTs along the height */
+  static const idx_t NHF = M + 1;       /**< non-redundant frequencies along the height */
+  static const idx_t S = NW * NHF;      /**< complex numbers of a spectrum */
+  static const idx_t WORK = 2 * M * NW; /**< reals of scratch a transform needs */
+  fft_plan<M> ph;                       /**< complex FFT along the height */
+  fft_plan<NW> pw;                      /**< complex FFT along the width */
+  real hr[M + 1];                       /**< cos(2 pi k / NH) */
+  real hi[M + 1];                       /**< -sin(2 pi k / NH) */
+  /**
+     @brief make the tables
+  */
+  void init() {
+    ph.init();
+    pw.init();
+    for (idx_t k = 0; k <= M; k++) {
+      hr[k] = cos(2.0 * M_PI * k / NH);
+      hi[k] = -sin(2.0 * M_PI * k / NH);
+    }
+  }
+  /**
+     @brief the spectrum of an image
+     @param (x) the image; pixel (i,j) at x[i * ld + j]
+     @param (rows) its height (<= H; rows below are zero)
+     @param (cols) its width (<= W; columns to the right are zero)
+     @param (ld) distance between its rows
+     @param (sp) 2 * S reals the spectrum goes to
+     @param (work) WORK reals of scratch
+  */
+  void forward(const real * x, idx_t rows, idx_t cols, idx_t ld, real * sp, real * work) const {
+    real * zr = work, * zi = work + M * NW;
+    real * sr = sp, * si = sp + S;
+    /* pack rows 2m and 2m+1 into the real and imaginary parts of row m */
+    for (idx_t m = 0; m < M; m++) {
+      for (idx_t j = 0; j < cols; j++) {
+        zr[m * NW + j] = (2 * m < rows ? x[2 * m * ld + j] : 0);
+        zi[m * NW + j] = (2 * m + 1 < rows ? x[(2 * m + 1) * ld + j] : 0);
+      }
+    }
+    ph.run(zr, zi, NW, cols, 0);
+    /* split into transforms of even and odd rows and combine them;
+       written transposed, so the next pass runs across frequencies */
+    for (idx_t k = 0; k <= M; k++) {
+      const idx_t a = (k % M) * NW, b = ((M - k) % M) * NW;
+      for (idx_t j = 0; j < cols; j++) {
+        const real dr = zr[a + j] - zr[b + j], di = zi[a + j] + zi[b + j];
+        const real er = 0.5 * (zr[a + j] + zr[b + j]), ei = 0.5 * (zi[a + j] - zi[b + j]);
+        const real or_ = 0.5 * di, oi = -0.5 * dr;
+        sr[j * NHF + k] = er + hr[k] * or_ - hi[k] * oi;
+        si[j * NHF + k] = ei + hr[k] * oi + hi[k] * or_;
+      }
+    }
+    memset(sr + cols * NHF, 0, sizeof(real) * (NW - cols) * NHF);
+    memset(si + cols * NHF, 0, sizeof(real) * (NW - cols) * NHF);
+    pw.run(sr, si, NHF, NHF, 0);
+  }
+  /**
+     @brief out = (acc ? out : 0) + scale * the image of a spectrum + bias
+     @param (sp) the spectrum (2 * S reals; overwritten)
+     @param (out) the image; pixel (i,j) at out[i * ld + j]
+     @param (rows) rows of the image wanted (<= NH)
+     @param (cols) columns of the image wanted (<= NW)
+     @param (ld) distance between rows of out
+     @param (scale) scale factor (1/(NH*NW) for the inverse of forward)
+     @param (bias) value added to every pixel
+     @param (acc) 1 to add to out
+     @param (work) WORK reals of scratch
+  */
+  void inverse(real * sp, real * out, idx_t rows, idx_t cols, idx_t ld,
+               real scale, real bias, int acc, real * work) const {
+    real * zr = work, * zi = work + M * NW;
+    real * sr = sp, * si = sp + S;
+    pw.run(sr, si, NHF, NHF, 1);
+    /* rebuild the transform of packed rows (twice of it) from
+       frequencies k and M - k */
+    for (idx_t k = 0; k < M; k++) {
+      for (idx_t j = 0; j < cols; j++) {
+        const real xr = sr[j * NHF + k], xi = si[j * NHF + k];
+        const real yr = sr[j * NHF + M - k], yi = -si[j * NHF + M - k];
+        const real er = xr + yr, ei = xi + yi;
+        const real dr = xr - yr, di = xi - yi;
+        const real or_ = dr * hr[k] + di * hi[k], oi = di * hr[k] - dr * hi[k];
+        zr[k * NW + j] = er - oi;
+        zi[k * NW + j] = ei + or_;
+      }
+    }
+    ph.run(zr, zi, NW, cols, 1);
+    for (idx_t i = 0; i < rows; i++) {
+      const real * z = (i % 2 == 0 ? zr : zi) + (i / 2) * NW;
+      real * o = out + i * ld;
+      for (idx_t j = 0; j < cols; j++) {
+        o[j] = (acc ? o[j] : 0) + scale * z[j] + bias;
+      }
+    }
+  }
+};
+
+/**
+   @brief estimated flops of FFT convolution per sample (forward
+   and backward) of Convolution2D<maxB,IC,H,W,K,OC>
+*/
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t K,idx_t OC>
+static constexpr double conv_fft_flops() {
+  typedef rfft2d<H,W> f;
+  /* 5 flops per complex element per stage of each pass */
+  return ((double)(IC + OC) * 2 + (double)IC * OC / maxB)
+    * 5.0 * ((double)f::NW * f::M * fft_log2(f::M) + (double)f::S * fft_log2(f::NW))
+    + 3.0 * IC * OC * 8.0 * f::S;
+}
+
+/**
+   @brief flops of direct convolution per sample (forward and
+   backward) of Convolution2D<maxB,IC,H,W,K,OC>
+*/
+template<idx_t IC,idx_t H,idx_t W,idx_t K,idx_t OC>
+static constexpr double conv_direct_flops() {
+  return 3.0 * 2.0 * IC * OC * (H - K + 1) * (W - K + 1) * K * K;
+}
+
+/**
+   @brief 1 if --conv-fft auto runs Convolution2D<maxB,IC,H,W,K,OC> on FFT
+*/
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t K,idx_t OC>
+static constexpr int conv_fft_pays() {
+  return conv_direct_flops<IC,H,W,K,OC>() > CONV_FFT_MIN_GAIN * conv_fft_flops<maxB,IC,H,W,K,OC>();
+}
+
+/**
+   @brief state of FFT convolution of a Convolution2D<maxB,IC,H,W,K,OC>
+   (cached spectra of filters, input and gy)
+*/
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t K,idx_t OC>
+struct conv_fft {
+  typedef rfft2d<H,W> fft_t;
+  static const idx_t OH = H - K + 1;    /**< output height */
+  static const idx_t OW = W - K + 1;    /**< output width */
+  static const idx_t S = fft_t::S;      /**< complex numbers of a spectrum */
+  fft_t f;                              /**< transforms */
+  real cw[OC][IC][2 * S];               /**< conj(Wf), spectra of filters conjugated */
+  real w_seen[OC][IC][K][K];            /**< the weights cw was made from */
+  int w_valid;                          /**< 1 if cw has been made */
+  real xs[maxB][IC][2 * S];             /**< spectra of the input of the last forward */
+  real gs[maxB][OC][2 * S];             /**< spectra of gy of the last backward */
+
+  /**
+     @brief initialize (tables, no valid filter spectra)
+  */
+  void init() {
+    f.init();
+    w_valid = 0;
+  }
+  /**
+     @brief scale factor of inverse transforms
+  */
+  static real scale() {
+    return 1.0 / ((double)fft_t::NH * fft_t::NW);
+  }
+  /**
+     @brief make spectra of filters unless w is the same as last time
+  */
+  void filters(tensor<real,OC,IC,K,K>& w) {
+    if (w_valid && memcmp(w_seen, w.w, sizeof(w_seen)) == 0) return;
+#pragma omp parallel for schedule(static)
+    for (idx_t oc = 0; oc < OC; oc++) {
+      real * work = conv_fft_buf(fft_t::WORK);
+      for (idx_t ic = 0; ic < IC; ic++) {
+        f.forward(&w.w[oc][ic][0][0], K, K, K, cw[oc][ic], work);
+        for (idx_t e = S; e < 2 * S; e++) cw[oc][ic][e] = -cw[oc][ic][e];
+      }
+    }
+    memcpy(w_seen, w.w, sizeof(w_seen));
+    w_valid = 1;
+  }
+  /**
+     @brief y = w * x + b
+     @details samples are split among threads
+  */
+  void forward(tensor<real,maxB,IC,H,W>& x, tensor<real,OC,IC,K,K>& w,
+               tensor<real,OC>& b, tensor<real,maxB,OC,OH,OW>& y) {
+    filters(w);
+    const idx_t B = x.n0;
+    const real sc = scale();
+#pragma omp parallel for schedule(static)
+    for (idx_t s = 0; s < B; s++) {
+      real * work = conv_fft_buf(fft_t::WORK + 2 * S);
+      real * acc = work + fft_t::WORK;
+      for (idx_t ic = 0; ic < IC; ic++) {
+        f.forward(&x.w[s][ic][0][0], H, W, W, xs[s][ic], work);
+      }
+      for (idx_t oc = 0; oc < OC; oc++) {
+        memset(acc, 0, sizeof(real) * 2 * S);
+        for (idx_t ic = 0; ic < IC; ic++) {
+          fft_cmac(acc, xs[s][ic], cw[oc][ic], S, 0);
+        }
+        f.inverse(acc, &y.w[s][oc][0][0], OH, OW, OW, sc, b(oc), 0, work);
+      }
+    }
+  }
+  /**
+     @brief gx and gw (gb is left to the caller) from gy and the
+     input of the last forward
+     @param (accumulate) 1 to add to gw
+     @details samples are split among threads for gx, output
+     channels for gw
+  */
+  void backward(tensor<real,maxB,OC,OH,OW>& gy, tensor<real,maxB,IC,H,W>& gx,
+                tensor<real,OC,IC,K,K>& gw, int accumulate) {
+    const idx_t B = gy.n0;
+    const real sc = scale();
+#pragma omp parallel for schedule(static)
+    for (idx_t s = 0; s < B; s++) {
+      real * work = conv_fft_buf(fft_t::WORK + 2 * S);
+      real * acc = work + fft_t::WORK;
+      for (idx_t oc = 0; oc < OC; oc++) {
+        f.forward(&gy.w[s][oc][0][0], OH, OW, OW, gs[s][oc], work);
+      }
+      for (idx_t ic = 0; ic < IC; ic++) {
+        memset(acc, 0, sizeof(real) * 2 * S);
+        for (idx_t oc = 0; oc < OC; oc++) {
+          fft_cmac(acc, gs[s][oc], cw[oc][ic], S, 1);
+        }
+        f.inverse(acc, &gx.w[s][ic][0][0], H, W, W, sc, 0, 0, work);
+      }
+    }
+#pragma omp parallel for schedule(static)
+    for (idx_t oc = 0; oc < OC; oc++) {
+      real * work = conv_fft_buf(fft_t::WORK + 2 * S);
+      real * acc = work + fft_t::WORK;
+      for (idx_t ic = 0; ic < IC; ic++) {
+        memset(acc, 0, sizeof(real) * 2 * S);
+        for (idx_t s = 0; s < B; s++) {
+          fft_cmac(acc, xs[s][ic], gs[s][oc], S, 1);
+        }
+        f.inverse(acc, &gw.w[oc][ic][0][0], K, K, K, sc, 0, accumulate, work);
+      }
+    }
+  }
+};
+
+/**
+   @brief an owning pointer to a conv_fft (null until allocated)
+   @details layers are copied (e.g., make_copy in gradient checks);
+   a copy gets its own spectra (a deep copy), so it neither shares
+   the input spectra forward keeps for backward nor frees them twice.
+*/
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t K,idx_t OC>
+struct conv_fft_ptr {
+  typedef conv_fft<maxB,IC,H,W,K,OC> fft_t;
+  fft_t * p;                    /**< the state (null if none) */
+  conv_fft_ptr() : p(0) { }
+  conv_fft_ptr(const conv_fft_ptr& o) : p(o.p ? new fft_t(*o.p) : 0) { }
+  conv_fft_ptr& operator=(const conv_fft_ptr& o) {
+    if (this != &o) {
+      delete p;
+      p = (o.p ? new fft_t(*o.p) : 0);
+    }
+    return *this;
+  }
+  ~conv_fft_ptr() { delete p; }
+  /**
+     @brief allocate and initialize the state unless it exists
+  */
+  fft_t * get() {
+    if (!p) {
+      p = new fft_t();
+      p->init();
+    }
+    return p;
+  }
+};
+
+/**
+   @brief check conv_fft against direct loops in double precision
+   @return the max error relative to the max magnitude of y, gx and gw
+*/
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t K,idx_t OC>
+static double conv_fft_check(rnd_gen_t& rg, idx_t B) {
+  typedef conv_fft<maxB,IC,H,W,K,OC> cf_t;
+  const idx_t OH = cf_t::OH, OW = cf_t::OW;
+  cf_t * cf = new cf_t();
+  cf->init();
+  tensor<real,maxB,IC,H,W> * x = new tensor<real,maxB,IC,H,W>();
+  tensor<real,maxB,IC,H,W> * gx = new tensor<real,maxB,IC,H,W>();
+  tensor<real,OC,IC,K,K> * w = new tensor<real,OC,IC,K,K>();
+  tensor<real,OC,IC,K,K> * gw = new tensor<real,OC,IC,K,K>();
+  tensor<real,OC> * b = new tensor<real,OC>();
+  tensor<real,maxB,OC,OH,OW> * y = new tensor<real,maxB,OC,OH,OW>();
+  tensor<real,maxB,OC,OH,OW> * gy = new tensor<real,maxB,OC,OH,OW>();
+  x->init_uniform(B, rg, -1.0, 1.0);
+  gy->init_uniform(B, rg, -1.0, 1.0);
+  w->init_uniform(OC, rg, -1.0, 1.0);
+  b->init_uniform(OC, rg, -1.0, 1.0);
+  y->set_n0(B);
+  gx->set_n0(B);
+  gw->set_n0(OC);
+  cf->forward(*x, *w, *b, *y);
+  cf->backward(*gy, *gx, *gw, 0);
+  double ey = 0, my = 0, ex = 0, mx = 0, ew = 0, mw = 0;
+  for (idx_t s = 0; s < B; s++) {
+    for (idx_t oc = 0; oc < OC; oc++) {
+      for (idx_t i = 0; i < OH; i++) {
+        for (idx_t j = 0; j < OW; j++) {
+          double v = (*b)(oc);
+          for (idx_t ic = 0; ic < IC; ic++) {
+            for (idx_t di = 0; di < K; di++) {
+              for (idx_t dj = 0; dj < K; dj++) {
+                v += (double)w->w[oc][ic][di][dj] * x->w[s][ic][i + di][j + dj];
+              }
+            }
+          }
+          ey = max_r(ey, fabs(v - y->w[s][oc][i][j]));
+          my = max_r(my, fabs(v));
+        }
+      }
+    }
+    for (idx_t ic = 0; ic < IC; ic++) {
+      for (idx_t i = 0; i < H; i++) {
+        for (idx_t j = 0; j < W; j++) {
+          double v = 0;
+          for (idx_t oc = 0; oc < OC; oc++) {
+            /* filter elements whose output (i - di, j - dj) is in gy */
+            for (idx_t di = max_i(0, i - OH + 1); di <= min_i(K - 1, i); di++) {
+              for (idx_t dj = max_i(0, j - OW + 1); dj <= min_i(K - 1, j); dj++) {
+                v += (double)w->w[oc][ic][di][dj] * gy->w[s][oc][i - di][j - dj];
+              }
+            }
+          }
+          ex = max_r(ex, fabs(v - gx->w[s][ic][i][j]));
+          mx = max_r(mx, fabs(v));
+        }
+      }
+    }
+  }
+  for (idx_t oc = 0; oc < OC; oc++) {
+    for (idx_t ic = 0; ic < IC; ic++) {
+      for (idx_t di = 0; di < K; di++) {
+        for (idx_t dj = 0; dj < K; dj++) {
+          double v = 0;
+          for (idx_t s = 0; s < B; s++) {
+            for (idx_t i = 0; i < OH; i++) {
+              for (idx_t j = 0; j < OW; j++) {
+                v += (double)gy->w[s][oc][i][j] * x->w[s][ic][i + di][j + dj];
+              }
+            }
+          }
+          ew = max_r(ew, fabs(v - gw->w[oc][ic][di][dj]));
+          mw = max_r(mw, fabs(v));
+        }
+      }
+    }
+  }
+  double e = max_r(ey / my, max_r(ex / mx, ew / mw));
+  printf("conv_fft<%d,%d,%d,%d,%d,%d> (%dx%d transforms), %d samples: rel err y %.3e gx %.3e gw %.3e\n",
+         (int)maxB, (int)IC, (int)H, (int)W, (int)K, (int)OC,
+         (int)cf_t::fft_t::NH, (int)cf_t::fft_t::NW, (int)B, ey / my, ex / mx, ew / mw);
+  delete cf; delete x; delete gx; delete w; delete gw; delete b; delete y; delete gy;
+  return e;
+}
+
+/**
+   @brief entry point of this header file
+   @details if this header file is included from
+   a main C++ file and define conv_fft_main to be main
+   (e.g., with -Dconv_fft_main=main), then this
+   function becomes th main function of the executable.
+   it checks y, gx and gw of FFT convolution against direct
+   loops in several shapes (including odd and non power of two
+   sizes, and a filter as large as the image).
+*/
+int conv_fft_main(int argc, char ** argv) {
+  (void)argc;
+  (void)argv;
+  rnd_gen_t rg;
+  rg.seed(1234);
+  double e = 0;
+  e = max_r(e, conv_fft_check<4,1,28,28,3,8>(rg, 4));
+  e = max_r(e, conv_fft_check<4,3,13,9,5,2>(rg, 3));
+  e = max_r(e, conv_fft_check<2,2,16,16,7,3>(rg, 2));
+  e = max_r(e, conv_fft_check<2,2,6,6,6,2>(rg, 2));
+  e = max_r(e, conv_fft_check<2,1,2,2,1,1>(rg, 1));
+  int ok = (e < 1.0e-4);
+  printf("%s\n", ok ? "OK" : "NG");
+  return ok ? 0 : 1;
+}
@@ -8,6 +8,58 @@
 #include "tensor.h"
 #include "ada_delta.h"
 #include "grad_check.h"
+#include "par_reduce.h"
+#include "im2col_cache.h"
+#include "conv_fft.h"
+
+/**
+   @brief how backward treats zeros of gy (--sparse-backward)
+   @details gy of a convolution followed by ReLU (and max pooling)
+   is mostly exact zeros, which contribute nothing to gw, gb or gx.
+*/
+typedef enum {
+  conv_sparse_off,              /**< dense kernels of the algorithm */
+  conv_sparse_mask,             /**< skip vectors of gy whose elements are all zero */
+  conv_sparse_lists,            /**< work on compacted lists of nonzeros of gy */
+  conv_sparse_auto,             /**< choose one of the above by the fraction of zeros of gy */
+} conv_sparse_t;
+
+/** @brief the fraction of zeros of gy from which auto uses nonzero
+    lists in a layer of fewer than L input channels (lists pad them to
+    L). convolution_main with --sparse-backward measures the crossover:
+    with one input channel, mask was faster up to 75% zeros and lists
+    from 90%; with L or more input channels, lists were faster at every
+    fraction, and mask was faster than dense kernels at every fraction
+    in both */
+#define CONV_SPARSE_LISTS_MIN 0.9
+
+/**
+   @brief parse the name of a mode (--sparse-backward)
+*/
+static conv_sparse_t parse_conv_sparse(const char * s) {
+  if (strcmp(s, "mask") == 0) return conv_sparse_mask;
+  if (strcmp(s, "lists") == 0) return conv_sparse_lists;
+  if (strcmp(s, "auto") == 0) return conv_sparse_auto;
+  return conv_sparse_off;
+}
+
+/**
+   @brief a scratch buffer of (at least) n reals, aligned to 64 bytes
+   @param (slot) 0 for scratch of a thread working on samples,
+   1 for data the calling thread prepares for them
+   @details it only grows and is per thread, like par_reduce_buf
+*/
+static real * conv_sparse_buf(int slot, size_t n) {
+  static thread_local real * buf[2] = { 0, 0 };
+  static thread_local size_t cap[2] = { 0, 0 };
+  if (cap[slot] < n) {
+    free(buf[slot]);
+    buf[slot] = (real *)aligned_alloc(64, (sizeof(real) * n + 63) / 64 * 64);
+    if (!buf[slot]) { perror("aligned_alloc"); bail(); }
+    cap[slot] = n;
+  }
+  return buf[slot];
+}
 
 /**
      @brief configuration data for Convolution2D
@@ -48,6 +100,16 @@ struct Convolution2D{
     tensor<real,maxB,IC,H,W> gx;           /**< ∂L/∂x */
     AdaDelta<OC,IC,K,K> opt_w;             /**< optimizer for w */
     AdaDelta<OC> opt_b;                    /**< optimizer for b */
+    int accumulate;                        /**< 1 if backward adds to gw/gb instead of overwriting them */
+    conv_patches<maxB,IC,H,W,K> * patches; /**< precomputed patches of the input (--conv1-patches; null if none) */
+    int used_patches;                      /**< 1 if the last forward ran on patches */
+    int sparse;                            /**< how backward treats zeros of gy (conv_sparse_t) */
+    long gy_zeros;                         /**< zeros of gy seen by backward since the last log_sparsity */
+    long gy_elems;                         /**< elements of gy seen by backward since the last log_sparsity */
+    long n_sparse[3];                      /**< backward calls that ran dense, mask and lists kernels */
+    int use_fft;                           /**< 1 if forward/backward run on FFT (--conv-fft) */
+    int used_fft;                          /**< 1 if the last forward ran on FFT */
+    conv_fft_ptr<maxB,IC,H,W,K,OC> fft;   /**< cached spectra of FFT convolution (allocated when first used) */
 
     /**
      @brief initialize the layer
@@ -67,6 +129,84 @@ struct Convolution2D{
         /* init optimizers */
         opt_w.init(opt.lr);
         opt_b.init(opt.lr);
+        accumulate = 0;
+        patches = 0;
+        used_patches = 0;
+        sparse = parse_conv_sparse(opt.sparse_backward);
+        gy_zeros = gy_elems = 0;
+        n_sparse[conv_sparse_off] = n_sparse[conv_sparse_mask] = n_sparse[conv_sparse_lists] = 0;
+        const int fm = parse_conv_fft(opt.conv_fft);
+        set_fft(!opt.cuda_algo && (fm == conv_fft_on
+                                   || (fm == conv_fft_auto && conv_fft_pays<maxB,IC,H,W,K,OC>())));
+    }
+
+    /**
+     @brief run forward/backward on FFT (on = 1) or the kernels
+     of the algorithm (on = 0)
+     @details spectra are allocated the first time it is turned on
+    */
+    void set_fft(int on){
+        use_fft = on;
+        used_fft = 0;
+        if(on){
+            fft.get();
+        }
+    }
+
+    /**
+     @brief the static footprint of the layer (layer_mem)
+    */
+    static constexpr layer_mem memory(){
+        return layer_mem{ sizeof(w) + sizeof(b), sizeof(gw) + sizeof(gb),
+                          sizeof(opt_w) + sizeof(opt_b), sizeof(y) + sizeof(gx),
+                          sizeof(Convolution2D<maxB,IC,H,W,K,OC>) };
+    }
+    /**
+     @brief the cost of forward with B images (layer_cost)
+     @param (B) the number of images
+    */
+    static constexpr layer_cost forward_cost(idx_t B){
+        return layer_cost{ (uint64_t)B * OC * (H-K+1) * (W-K+1) * (2 * IC * K * K + 1),
+                           (uint64_t)sizeof(real) * ((uint64_t)B * IC * H * W + OC * IC * K * K + OC
+                                                     + (uint64_t)B * OC * (H-K+1) * (W-K+1)) };
+    }
+
+    /**
+     @brief the cost of backward with B images (layer_cost)
+     @param (B) the number of images
+     @details gw and gx each take as many multiply-adds as forward
+    */
+    static constexpr layer_cost backward_cost(idx_t B){
+        return layer_cost{ (uint64_t)B * OC * (H-K+1) * (W-K+1) * (4 * IC * K * K + 1),
+                           (uint64_t)sizeof(real) * ((uint64_t)B * OC * (H-K+1) * (W-K+1)
+                                                     + 2 * (uint64_t)B * IC * H * W
+                                                     + 2 * OC * IC * K * K + OC) };
+    }
+
+    /**
+     @brief the cost of update (layer_cost)
+    */
+    static constexpr layer_cost update_cost(){
+        return layer_cost{ AdaDelta<OC,IC,K,K>::update_cost().flops + AdaDelta<OC>::update_cost().flops,
+                           AdaDelta<OC,IC,K,K>::update_cost().bytes + AdaDelta<OC>::update_cost().bytes };
+    }
+
+    /**
+     @brief choose whether backward overwrites gw/gb (0) or adds
+     to them (1)
+     @param (accumulate) 1 to accumulate gradients over several
+     backward calls (gradient accumulation over micro-batches)
+     @details for cuda algorithms the flag is copied to the device
+     shadow as well, as backward kernels read it there
+    */
+    void set_accumulate(int accumulate){
+        if(this->accumulate == accumulate) return;
+        this->accumulate = accumulate;
+        #if __CUDACC__
+            if(dev){
+                ::to_dev(&dev->accumulate, &this->accumulate, sizeof(int));
+            }
+        #endif
     }
 
     /**
@@ -185,6 +325,7 @@ struct Convolution2D{
             break;
         }
         tsc_t t1 = get_tsc();
+        log_cost(update_cost());
         log_end_fun(lgr, t0, t1);
     }
 
@@ -395,6 +536,59 @@ struct Convolution2D{
         forward_simd(x, training);
     }
 
+    /**
+     @brief forward as a dense matrix product over precomputed
+     patches of x (im2col_cache.h)
+     @param (x) input images (patches must match them)
+     @param (training) 1 if it is called in training not testing
+     @details for each image, the panel (IC*K*K rows x output pixels)
+     is unpacked into a buffer and y(s,oc,:) = w(oc,:) * panel + b(oc),
+     L output pixels at a time with all rows of the panel in
+     registers. any cpu algorithm runs this when patches match x.
+     @sa forward
+     @sa backward_patches
+    */
+    void forward_patches(tensor<real,maxB,IC,H,W>& x, int training){
+        (void)training;
+        typedef conv_patches<maxB,IC,H,W,K> cp_t;
+        const idx_t KK = cp_t::KK, P = cp_t::P, PP = cp_t::PP;
+        idx_t B = x.n0;
+        y.set_n0(B);
+        x_ptr = &x;
+        real * buf = conv_patch_buf(KK * PP);
+        const real * wf = &w.w[0][0][0][0];
+        for(idx_t s = 0;s < B;s++){
+            patches->decode(s, buf);
+            real * ys = &y.w[s][0][0][0];
+            #ifdef __ARM_64BIT_STATE
+                for(idx_t oc = 0;oc < OC;oc++){
+                    for(idx_t p = 0;p < P;p++){
+                        real v = b(oc);
+                        for(idx_t k = 0;k < KK;k++){
+                            v += wf[oc * KK + k] * buf[k * PP + p];
+                        }
+                        ys[oc * P + p] = v;
+                    }
+                }
+            #else
+                for(idx_t p = 0;p < PP;p += L){
+                    const __mmask16 m = (p + L <= P ? (__mmask16)0xffff : (__mmask16)((1u << (P - p)) - 1));
+                    __m512 pk[KK];
+                    for(idx_t k = 0;k < KK;k++){
+                        pk[k] = _mm512_loadu_ps(buf + k * PP + p);
+                    }
+                    for(idx_t oc = 0;oc < OC;oc++){
+                        __m512 v = _mm512_set1_ps(b(oc));
+                        for(idx_t k = 0;k < KK;k++){
+                            v = _mm512_fmadd_ps(_mm512_set1_ps(wf[oc * KK + k]), pk[k], v);
+                        }
+                        _mm512_mask_storeu_ps(ys + oc * P + p, m, v);
+                    }
+                }
+            #endif
+        }
+    }
+
     /**
      @brief forward phase of the layer
      @param (x) input images
@@ -410,7 +604,13 @@ struct Convolution2D{
     tensor<real,maxB,OC,H-K+1,W-K+1>& forward(tensor<real,maxB,IC,H,W>& x, int training){
         log_start_fun(lgr);
         tsc_t t0 = get_tsc();
-        switch(opt.algo){
+        used_patches = (patches && patches->matches(&x, x.n0));
+        used_fft = (!used_patches && use_fft);
+        if(used_patches){
+            forward_patches(x, training);
+        }else if(used_fft){
+            forward_fft(x, training);
+        }else switch(opt.algo){
             /* add case for your implementations here */
         case algo_cpu_base:
             forward_cpu_base(x, training); break;
@@ -428,6 +628,7 @@ struct Convolution2D{
             }                
         }
         tsc_t t1 = get_tsc();
+        log_cost(forward_cost(x.n0));
         log_end_fun(lgr, t0, t1);
         return y;
     }
@@ -458,7 +659,7 @@ struct Convolution2D{
             for(idx_t ic = 0;ic < IC;ic++){                                     // input channel
                 for(idx_t di = 0;di < K;di++){                                  // kernel pixel
                     for(idx_t dj = 0;dj < K;dj++){                              // kernel pixel
-                        real v = 0.0;
+                        real v = (accumulate ? gw(oc,ic,di,dj) : 0);
                         for(idx_t s = 0;s < B;s++){                             // training samples
                             for(idx_t i = 0;i < H - K + 1;i++){                 // sample pixel
                                 for(idx_t j = 0;j < W - K + 1;j++){             // sample pixel
@@ -473,7 +674,7 @@ struct Convolution2D{
         }
 
         for(idx_t oc = 0;oc < OC;oc++){
-            real v = 0.0;
+            real v = (accumulate ? gb(oc) : 0);
             for(idx_t s = 0;s < B;s++){
                 for(idx_t i = 0;i < H - K + 1;i++){
                     for(idx_t j = 0;j < W - K + 1;j++){
@@ -506,6 +707,99 @@ struct Convolution2D{
         }
     }
 
+    /**
+     @brief add the gradient wrt w of samples [lo,hi) to acc
+     (multi-tap filter gradient)
+     @param (gy) gradient of loss with respect to the output
+     @param (x) input of forward
+     @param (lo) the first sample
+     @param (hi) one past the last sample
+     @param (acc) OC*IC*K*K partial sums (in the layout of gw) added to
+     @param (skip_zero) 1 to skip vectors of gy whose elements are all
+     zero (--sparse-backward mask)
+     @details the straightforward loop nest (oc, ic, di, dj outside
+     and s, i, j inside) streams the gy and x slices of an output
+     channel IC*K*K times. here, for a block of GW_ICB input
+     channels, all K*K taps of the block are accumulated at once in
+     registers (GW_ICB*K*K vectors of L output pixels), so each row
+     of gy is read IC/GW_ICB times per output channel and each row
+     of x is loaded once per tap. lanes beyond the output width are
+     masked, so rows of any width work. the accumulators are summed
+     across lanes once per (oc, block of input channels).
+     @sa backward_simd
+     @sa backward_omp
+    */
+    void gw_taps(tensor<real,maxB,OC,H-K+1,W-K+1>& gy, tensor<real,maxB,IC,H,W>& x,
+                 idx_t lo, idx_t hi, real * acc, int skip_zero = 0){
+        const idx_t OH = H - K + 1, OW = W - K + 1;
+        enum { GW_ICB = (IC % 2 == 0 ? 2 : 1) };
+        for(idx_t oc = 0;oc < OC;oc++){
+            for(idx_t ic0 = 0;ic0 < IC;ic0 += GW_ICB){
+                #ifdef __ARM_64BIT_STATE
+                    real a[GW_ICB][K][K] = {};
+                    for(idx_t s = lo;s < hi;s++){
+                        for(idx_t i = 0;i < OH;i++){
+                            for(idx_t j = 0;j < OW;j++){
+                                real g = gy(s,oc,i,j);
+                                if(skip_zero && g == 0) continue;
+                                for(idx_t c = 0;c < GW_ICB;c++){
+                                    for(idx_t di = 0;di < K;di++){
+                                        for(idx_t dj = 0;dj < K;dj++){
+                                            a[c][di][dj] += g * x(s,ic0+c,i+di,j+dj);
+                                        }
+                                    }
+                                }
+                            }
+                        }
+                    }
+                    for(idx_t c = 0;c < GW_ICB;c++){
+                        for(idx_t di = 0;di < K;di++){
+                            for(idx_t dj = 0;dj < K;dj++){
+                                acc[((oc * IC + ic0 + c) * K + di) * K + dj] += a[c][di][dj];
+                            }
+                        }
+                    }
+                #else
+                    __m512 a[GW_ICB][K][K];
+                    for(idx_t c = 0;c < GW_ICB;c++){
+                        for(idx_t di = 0;di < K;di++){
+                            for(idx_t dj = 0;dj < K;dj++){
+                                a[c][di][dj] = _mm512_setzero_ps();
+                            }
+                        }
+                    }
+                    for(idx_t s = lo;s < hi;s++){
+                        for(idx_t i = 0;i < OH;i++){
+                            const real * gr = &gy.w[s][oc][i][0];
+                            for(idx_t j = 0;j < OW;j += L){
+                                const __mmask16 m = (j + L <= OW ? (__mmask16)0xffff
+                                                     : (__mmask16)((1u << (OW - j)) - 1));
+                                const __m512 g = _mm512_maskz_loadu_ps(m, gr + j);
+                                if(skip_zero && !_mm512_cmpneq_ps_mask(g, _mm512_setzero_ps())) continue;
+                                for(idx_t c = 0;c < GW_ICB;c++){
+                                    for(idx_t di = 0;di < K;di++){
+                                        const real * xr = &x.w[s][ic0 + c][i + di][j];
+                                        for(idx_t dj = 0;dj < K;dj++){
+                                            a[c][di][dj] = _mm512_fmadd_ps(g, _mm512_maskz_loadu_ps(m, xr + dj),
+                                                                           a[c][di][dj]);
+                                        }
+                                    }
+                                }
+                            }
+                        }
+                    }
+                    for(idx_t c = 0;c < GW_ICB;c++){
+                        for(idx_t di = 0;di < K;di++){
+                            for(idx_t dj = 0;dj < K;dj++){
+                                acc[((oc * IC + ic0 + c) * K + di) * K + dj] += _mm512_reduce_add_ps(a[c][di][dj]);
+                            }
+                        }
+                    }
+                #endif
+            }
+        }
+    }
+
     /**
      @brief A simd implementation of backward on ARM / x86.
      @param (gy) gradient of loss with respect to the output
@@ -537,49 +831,12 @@ struct Convolution2D{
 
         tensor<real,maxB,IC,H,W>& x = *x_ptr;
             
-        for(idx_t oc = 0;oc < OC;oc++){                                         // output channel
-            for(idx_t ic = 0;ic < IC;ic++){                                     // input channel
-                for(idx_t di = 0;di < K;di++){                                  // kernel pixel
-                    for(idx_t dj = 0;dj < K;dj++){                              // kernel pixel
-                        // I will parallelize the loop over j since it accesses elements in the
-                        // last dimension of gy. The elements of the vector are summed in the end
-                        // using vaddvq_f32.
-                        v = 0;
-                        #ifdef __ARM_64BIT_STATE
-                            vec = vdupq_n_f32(0);
-                        #else
-                            vec = _mm512_set1_ps(0);
-                        #endif
-
-                        for(idx_t s = 0;s < B;s++){                             // training samples
-                            for(idx_t i = 0;i < H - K + 1;i++){                 // sample pixel
-                                idx_t j = 0;
-                                #ifdef __ARM_64BIT_STATE
-                                    for(;j + 3 < W - K + 1;j+=4){                   // sample pixel
-                                        vec = vfmaq_f32(vec,gy.V4(s,oc,i,j),x.V4(s,ic,i+di,j+dj));
-                                            // vfma(a,b,c) = a + b * c
-                                    }
-                                #else
-                                    for(;j + L - 1 < W - K + 1;j+=L){                   // sample pixel
-                                        vec = _mm512_fmadd_ps(gy.V16(s,oc,i,j),x.V16(s,ic,i+di,j+dj),vec);
-                                            // _mm512_fmadd_ps(a,b,c) = a * b + c
-                                    }
-                                #endif
-
-                                for(;j < W - K + 1;j++){                        // remainder iterations
-                                    v += gy(s,oc,i,j) * x(s,ic,i+di,j+dj);
-                                }
-                            }
-                        }
-                        #ifdef __ARM_64BIT_STATE
-                            gw(oc,ic,di,dj) = v + vaddvq_f32(vec);
-                        #else
-                            gw(oc,ic,di,dj) = v + _mm512_reduce_add_ps(vec);
-                        #endif
-                    }
-                }
-            }
+        /* gw: all taps of a block of input channels at once */
+        real * gwf = &gw.w[0][0][0][0];
+        if(!accumulate){
+            memset(gwf, 0, sizeof(real) * OC * IC * K * K);
         }
+        gw_taps(gy, x, 0, B, gwf);
 
         for(idx_t oc = 0;oc < OC;oc++){
             #ifdef __ARM_64BIT_STATE
@@ -587,7 +844,7 @@ struct Convolution2D{
             #else
                 vec = _mm512_set1_ps(0);
             #endif
-            v = 0;
+            v = (accumulate ? gb(oc) : 0);
             for(idx_t s = 0;s < B;s++){
                 for(idx_t i = 0;i < H - K + 1;i++){
                     idx_t j = 0;
@@ -726,6 +983,74 @@ struct Convolution2D{
         backward_base(gy);
     }
 
+    /**
+     @brief an omp version of backward
+     @param (gy) gradient of loss with respect to the output
+     @details samples are split among threads. gw and gb are
+     reductions over samples, added up by par_reduce in the mode
+     given by --deterministic (par_reduce.h); gx is computed
+     per sample and needs no reduction.
+     @sa backward
+     @sa backward_base
+    */
+    void backward_omp(tensor<real,maxB,OC,H-K+1,W-K+1>& gy){
+        idx_t B = gy.n0;
+        gw.set_n0(OC);
+        gb.set_n0(OC);
+        gx.set_n0(B);
+        tensor<real,maxB,IC,H,W>& x = *x_ptr;
+        par_reduce(&gw.w[0][0][0][0], OC * IC * K * K, B, accumulate, opt.deterministic,
+                   [&](long lo, long hi, real * acc){
+                       gw_taps(gy, x, lo, hi, acc);
+                   });
+        par_reduce(&gb.w[0][0][0][0], OC, B, accumulate, opt.deterministic,
+                   [&](long lo, long hi, real * acc){
+                       for(idx_t oc = 0;oc < OC;oc++){
+                           real v = 0;
+                           for(idx_t s = lo;s < hi;s++){
+                               for(idx_t i = 0;i < H - K + 1;i++){
+                                   for(idx_t j = 0;j < W - K + 1;j++){
+                                       v += gy(s,oc,i,j);
+                                   }
+                               }
+                           }
+                           acc[oc] += v;
+                       }
+                   });
+        #pragma omp parallel for schedule(static)
+        for(idx_t s = 0;s < B;s++){
+            for(idx_t ic = 0;ic < IC;ic++){
+                for(idx_t i = 0;i < H;i++){
+                    for(idx_t j = 0;j < W;j++){
+                        real v = 0.0;
+                        for(idx_t oc = 0;oc < OC;oc++){
+                            for(idx_t di = 0;di < K;di++){
+                                for(idx_t dj = 0;dj < K;dj++){
+                                    if(0 <= i - di && i - di < H - K + 1
+                                            && 0 <= j - dj && j - dj < W - K + 1){
+                                        v += gy(s,oc,i-di,j-dj) * w(oc,ic,di,dj);
+                                    }
+                                }
+                            }
+                        }
+                        gx(s,ic,i,j) = v;
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     @brief an omp version of backward called from the 
+     entry function (backward)
+     @param (gy) gradient of loss with respect to the output
+     @sa backward
+     @sa backward_omp
+    */
+    void backward_cpu_omp(tensor<real,maxB,OC,H-K+1,W-K+1>& gy){
+        backward_omp(gy);
+    }
+
     /**
      @brief an ARM / x86 simd version of baseline code called from the 
      entry function (backward)
@@ -737,6 +1062,480 @@ struct Convolution2D{
         backward_simd(gy);
     }
 
+    /**
+     @brief backward of forward_patches
+     @param (gy) gradient of loss with respect to the output
+     @details gw(oc,:) = sum over images of gy(s,oc,:) * panel^T and
+     gb(oc) = sum of gy(s,oc,:), over the same panels as forward.
+     gx is not computed: patches are only made for the network
+     input, whose gradient nothing uses.
+     @sa backward
+     @sa forward_patches
+    */
+    void backward_patches(tensor<real,maxB,OC,H-K+1,W-K+1>& gy){
+        typedef conv_patches<maxB,IC,H,W,K> cp_t;
+        const idx_t KK = cp_t::KK, P = cp_t::P, PP = cp_t::PP;
+        idx_t B = gy.n0;
+        gw.set_n0(OC);
+        gb.set_n0(OC);
+        gx.set_n0(B);
+        real * gwf = &gw.w[0][0][0][0];
+        for(idx_t oc = 0;oc < OC;oc++){
+            for(idx_t k = 0;k < KK;k++){
+                gwf[oc * KK + k] = (accumulate ? gwf[oc * KK + k] : 0);
+            }
+            gb(oc) = (accumulate ? gb(oc) : 0);
+        }
+        real * buf = conv_patch_buf(KK * PP);
+        for(idx_t s = 0;s < B;s++){
+            patches->decode(s, buf);
+            const real * gys = &gy.w[s][0][0][0];
+            for(idx_t oc = 0;oc < OC;oc++){
+                #ifdef __ARM_64BIT_STATE
+                    real vb = 0;
+                    for(idx_t p = 0;p < P;p++){
+                        vb += gys[oc * P + p];
+                    }
+                    for(idx_t k = 0;k < KK;k++){
+                        real v = 0;
+                        for(idx_t p = 0;p < P;p++){
+                            v += gys[oc * P + p] * buf[k * PP + p];
+                        }
+                        gwf[oc * KK + k] += v;
+                    }
+                    gb(oc) += vb;
+                #else
+                    __m512 acc[KK];
+                    __m512 accb = _mm512_setzero_ps();
+                    for(idx_t k = 0;k < KK;k++){
+                        acc[k] = _mm512_setzero_ps();
+                    }
+                    for(idx_t p = 0;p < PP;p += L){
+                        const __mmask16 m = (p + L <= P ? (__mmask16)0xffff : (__mmask16)((1u << (P - p)) - 1));
+                        __m512 g = _mm512_maskz_loadu_ps(m, gys + oc * P + p);
+                        accb = _mm512_add_ps(accb, g);
+                        for(idx_t k = 0;k < KK;k++){
+                            acc[k] = _mm512_fmadd_ps(g, _mm512_loadu_ps(buf + k * PP + p), acc[k]);
+                        }
+                    }
+                    for(idx_t k = 0;k < KK;k++){
+                        gwf[oc * KK + k] += _mm512_reduce_add_ps(acc[k]);
+                    }
+                    gb(oc) += _mm512_reduce_add_ps(accb);
+                #endif
+            }
+        }
+    }
+
+    /**
+     @brief forward by FFT (conv_fft.h)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @details spectra of filters are remade only when w has changed
+     since the last call; spectra of x are kept for backward_fft.
+     any cpu algorithm runs this with --conv-fft on (or auto, if
+     conv_fft_pays).
+     @sa forward
+     @sa backward_fft
+    */
+    void forward_fft(tensor<real,maxB,IC,H,W>& x, int training){
+        (void)training;
+        y.set_n0(x.n0);
+        x_ptr = &x;
+        fft.p->forward(x, w, b, y);
+    }
+
+    /**
+     @brief backward of forward_fft
+     @param (gy) gradient of loss with respect to the output
+     @details gx and gw by products of spectra (conv_fft::backward);
+     gb is summed over gy as in other kernels.
+     @sa backward
+     @sa forward_fft
+    */
+    void backward_fft(tensor<real,maxB,OC,H-K+1,W-K+1>& gy){
+        idx_t B = gy.n0;
+        gw.set_n0(OC);
+        gb.set_n0(OC);
+        gx.set_n0(B);
+        fft.p->backward(gy, gx, gw, accumulate);
+        par_reduce(&gb.w[0][0][0][0], OC, B, accumulate, opt.deterministic,
+                   [&](long lo, long hi, real * acc){
+                       gb_sum(gy, lo, hi, acc);
+                   });
+    }
+
+    /**
+     @brief the number of zero elements of gy
+     @param (gy) gradient of loss with respect to the output
+    */
+    long count_zeros(tensor<real,maxB,OC,H-K+1,W-K+1>& gy){
+        const long n = (long)gy.n0 * OC * (H - K + 1) * (W - K + 1);
+        const real * g = &gy.w[0][0][0][0];
+        long z = 0;
+        long e = 0;
+        #ifndef __ARM_64BIT_STATE
+            for(;e + L <= n;e += L){
+                z += _mm_popcnt_u32(_mm512_cmpeq_ps_mask(_mm512_loadu_ps(g + e), _mm512_setzero_ps()));
+            }
+        #endif
+        for(;e < n;e++){
+            z += (g[e] == 0);
+        }
+        return z;
+    }
+
+    /**
+     @brief choose the kernels backward runs on gy (--sparse-backward)
+     @param (gy) gradient of loss with respect to the output
+     @return conv_sparse_off (the dense kernels of the algorithm),
+     conv_sparse_mask or conv_sparse_lists
+     @details sparse kernels are for cpu_simd and cpu_omp. unless
+     the mode is off, zeros of gy are counted (for log_sparsity)
+     and auto chooses lists when IC >= L or their fraction is
+     CONV_SPARSE_LISTS_MIN or more, and mask otherwise (never the
+     dense kernels, which were slower than both at every fraction
+     measured).
+    */
+    int sparse_mode(tensor<real,maxB,OC,H-K+1,W-K+1>& gy){
+        if(sparse == conv_sparse_off || (opt.algo != algo_cpu_simd && opt.algo != algo_cpu_omp)){
+            return conv_sparse_off;
+        }
+        const long n = (long)gy.n0 * OC * (H - K + 1) * (W - K + 1);
+        const long z = count_zeros(gy);
+        gy_zeros += z;
+        gy_elems += n;
+        int mode = sparse;
+        if(mode == conv_sparse_auto){
+            const double f = (n ? (double)z / n : 0.0);
+            mode = (IC >= L || f >= CONV_SPARSE_LISTS_MIN ? conv_sparse_lists : conv_sparse_mask);
+        }
+        n_sparse[mode]++;
+        return mode;
+    }
+
+    /**
+     @brief add the gradient wrt b of samples [lo,hi) to acc
+     @param (gy) gradient of loss with respect to the output
+     @param (lo) the first sample
+     @param (hi) one past the last sample
+     @param (acc) OC partial sums added to
+    */
+    void gb_sum(tensor<real,maxB,OC,H-K+1,W-K+1>& gy, idx_t lo, idx_t hi, real * acc){
+        const idx_t P = (H - K + 1) * (W - K + 1);
+        for(idx_t oc = 0;oc < OC;oc++){
+            for(idx_t s = lo;s < hi;s++){
+                const real * g = &gy.w[s][oc][0][0];
+                #ifdef __ARM_64BIT_STATE
+                    real v = 0;
+                    for(idx_t p = 0;p < P;p++){
+                        v += g[p];
+                    }
+                    acc[oc] += v;
+                #else
+                    __m512 v = _mm512_setzero_ps();
+                    for(idx_t p = 0;p < P;p += L){
+                        const __mmask16 m = (p + L <= P ? (__mmask16)0xffff : (__mmask16)((1u << (P - p)) - 1));
+                        v = _mm512_add_ps(v, _mm512_maskz_loadu_ps(m, g + p));
+                    }
+                    acc[oc] += _mm512_reduce_add_ps(v);
+                #endif
+            }
+        }
+    }
+
+    /**
+     @brief gx of sample s, skipping vectors of gy whose elements are all zero
+     @param (gy) gradient of loss with respect to the output
+     @param (s) the sample
+     @details gy is scattered: a vector of L pixels of a row of
+     gx(s,ic) gets, from each output channel and kernel row, K
+     vectors of gy shifted by 0..K-1 columns times the weights, and
+     is left alone when all of them are zero. lanes outside rows
+     are masked (masked lanes of loads do not fault).
+     @sa backward_sparse_mask
+    */
+    void gx_mask(tensor<real,maxB,OC,H-K+1,W-K+1>& gy, idx_t s){
+        const idx_t OH = H - K + 1, OW = W - K + 1;
+        memset(&gx.w[s][0][0][0], 0, sizeof(real) * IC * H * W);
+        for(idx_t oc = 0;oc < OC;oc++){
+            for(idx_t i = 0;i < OH;i++){
+                const real * gr = &gy.w[s][oc][i][0];
+                #ifdef __ARM_64BIT_STATE
+                    for(idx_t j = 0;j < OW;j++){
+                        const real g = gr[j];
+                        if(g == 0) continue;
+                        for(idx_t ic = 0;ic < IC;ic++){
+                            for(idx_t di = 0;di < K;di++){
+                                for(idx_t dj = 0;dj < K;dj++){
+                                    gx(s,ic,i+di,j+dj) += g * w(oc,ic,di,dj);
+                                }
+                            }
+                        }
+                    }
+                #else
+                    for(idx_t j = 0;j < W;j += L){
+                        __m512 g[K];
+                        __mmask16 nz = 0;
+                        const __mmask16 mw = (j + L <= W ? (__mmask16)0xffff : (__mmask16)((1u << (W - j)) - 1));
+                        for(idx_t dj = 0;dj < K;dj++){
+                            /* lanes l with 0 <= j + l - dj < OW */
+                            const long a = dj - j, b = OW + dj - j;
+                            const __mmask16 lo_m = (a <= 0 ? (__mmask16)0xffff : (__mmask16)(0xffffu << a));
+                            const __mmask16 hi_m = (b >= L ? (__mmask16)0xffff : (__mmask16)((1u << b) - 1));
+                            g[dj] = _mm512_maskz_loadu_ps(lo_m & hi_m & mw, gr + j - dj);
+                            nz |= _mm512_cmpneq_ps_mask(g[dj], _mm512_setzero_ps());
+                        }
+                        if(!nz) continue;
+                        for(idx_t ic = 0;ic < IC;ic++){
+                            for(idx_t di = 0;di < K;di++){
+                                real * xr = &gx.w[s][ic][i + di][j];
+                                __m512 v = _mm512_maskz_loadu_ps(mw, xr);
+                                for(idx_t dj = 0;dj < K;dj++){
+                                    v = _mm512_fmadd_ps(g[dj], _mm512_set1_ps(w(oc,ic,di,dj)), v);
+                                }
+                                _mm512_mask_storeu_ps(xr, mw, v);
+                            }
+                        }
+                    }
+                #endif
+            }
+        }
+    }
+
+    /**
+     @brief out[0:m] = (accumulate ? out[0:m] : 0) + contributions of
+     all samples, for the sparse kernels
+     @param (out) m elements the sum goes to
+     @param (m) the number of elements
+     @param (B) the number of samples
+     @param (part) part(lo, hi, acc) adds contributions of samples [lo,hi) to acc[0:m]
+     @details cpu_omp splits samples among threads (par_reduce);
+     cpu_simd stays on the calling thread and adds all samples to
+     out directly, so it is compared with its own dense kernels
+     (sparse_mode) on the same number of threads.
+    */
+    template<typename F>
+    void sparse_reduce(real * out, long m, idx_t B, F part){
+        if(opt.algo == algo_cpu_omp){
+            par_reduce(out, m, B, accumulate, opt.deterministic, part);
+        }else{
+            if(!accumulate) memset(out, 0, sizeof(real) * m);
+            part(0, B, out);
+        }
+    }
+
+    /**
+     @brief backward skipping vectors of gy whose elements are all zero
+     (--sparse-backward mask)
+     @param (gy) gradient of loss with respect to the output
+     @details gw is gw_taps skipping zero vectors, gx is gx_mask.
+     a vector is skipped only when all of its L elements are zero, so
+     it pays off with zeros in runs (e.g., channels ReLU turned off
+     for a whole image) or at very high sparsity; zeros scattered at
+     random rarely fill a vector. with cpu_omp, samples are split
+     among threads as in backward_omp; cpu_simd runs on one thread.
+     @sa backward
+    */
+    void backward_sparse_mask(tensor<real,maxB,OC,H-K+1,W-K+1>& gy){
+        idx_t B = gy.n0;
+        gw.set_n0(OC);
+        gb.set_n0(OC);
+        gx.set_n0(B);
+        tensor<real,maxB,IC,H,W>& x = *x_ptr;
+        sparse_reduce(&gw.w[0][0][0][0], OC * IC * K * K, B,
+                      [&](long lo, long hi, real * acc){
+                          gw_taps(gy, x, lo, hi, acc, 1);
+                      });
+        sparse_reduce(&gb.w[0][0][0][0], OC, B,
+                      [&](long lo, long hi, real * acc){
+                          gb_sum(gy, lo, hi, acc);
+                      });
+        #pragma omp parallel for schedule(static) if(opt.algo == algo_cpu_omp)
+        for(idx_t s = 0;s < B;s++){
+            gx_mask(gy, s);
+        }
+    }
+
+    /**
+     @brief backward on compacted lists of nonzeros of gy
+     (--sparse-backward lists)
+     @param (gy) gradient of loss with respect to the output
+     @details for each sample, x(s) is transposed to channels-last
+     (xT[i][j][ic], channels padded to a multiple of L), and for each
+     output channel the nonzeros of gy(s,oc) (its rows one after
+     another) are compacted into a list of values and pixel indices.
+     each nonzero g at (i,j) then does
+
+     - gw(oc,:,di,dj) += g * xT[i+di][j+dj][:] for all K*K taps,
+       into K*K*IC/L vector registers, and
+     - gxT[i+di][j+dj][:] += g * w(oc,:,di,dj), the weights of oc
+       held in registers (channels-last as well, wT),
+
+     so work is proportional to the nonzeros rather than to gy, at
+     the cost of the compaction and two transposes per sample.
+     with cpu_omp, samples are split among threads as in
+     backward_omp (gx of a sample is written by the thread that
+     computes it); cpu_simd runs on one thread.
+     @sa backward
+    */
+    void backward_sparse_lists(tensor<real,maxB,OC,H-K+1,W-K+1>& gy){
+        const idx_t OW = W - K + 1, P = (H - K + 1) * (W - K + 1);
+        enum { ICP = (IC + L - 1) / L * L, ICV = ICP / L, KK = K * K };
+        idx_t B = gy.n0;
+        gw.set_n0(OC);
+        gb.set_n0(OC);
+        gx.set_n0(B);
+        tensor<real,maxB,IC,H,W>& x = *x_ptr;
+        /* weights channels-last: wT[oc][di][dj][ic] */
+        real * wT = conv_sparse_buf(1, OC * KK * ICP);
+        for(idx_t oc = 0;oc < OC;oc++){
+            for(idx_t di = 0;di < K;di++){
+                for(idx_t dj = 0;dj < K;dj++){
+                    for(idx_t ic = 0;ic < ICP;ic++){
+                        wT[((oc * K + di) * K + dj) * ICP + ic] = (ic < IC ? w(oc,ic,di,dj) : 0);
+                    }
+                }
+            }
+        }
+        sparse_reduce(&gw.w[0][0][0][0], OC * IC * KK, B,
+                      [&](long lo, long hi, real * acc){
+                          real * xT = conv_sparse_buf(0, 2 * H * W * ICP + OC * KK * ICP + 2 * (P + L));
+                          real * gxT = xT + H * W * ICP;
+                          real * gwT = gxT + H * W * ICP;
+                          real * val = gwT + OC * KK * ICP;
+                          int32_t * idx = (int32_t *)(val + P + L);
+                          memset(gwT, 0, sizeof(real) * OC * KK * ICP);
+                          for(idx_t s = lo;s < hi;s++){
+                              memset(xT, 0, sizeof(real) * 2 * H * W * ICP);
+                              for(idx_t ic = 0;ic < IC;ic++){
+                                  for(idx_t i = 0;i < H;i++){
+                                      for(idx_t j = 0;j < W;j++){
+                                          xT[(i * W + j) * ICP + ic] = x(s,ic,i,j);
+                                      }
+                                  }
+                              }
+                              for(idx_t oc = 0;oc < OC;oc++){
+                                  /* compact nonzeros of gy(s,oc) */
+                                  const real * gs = &gy.w[s][oc][0][0];
+                                  idx_t n = 0;
+                                  #ifdef __ARM_64BIT_STATE
+                                      for(idx_t p = 0;p < P;p++){
+                                          if(gs[p] != 0){
+                                              val[n] = gs[p];
+                                              idx[n] = p;
+                                              n++;
+                                          }
+                                      }
+                                  #else
+                                      const __m512i iota = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+                                                                            7, 6, 5, 4, 3, 2, 1, 0);
+                                      for(idx_t p = 0;p < P;p += L){
+                                          const __mmask16 m = (p + L <= P ? (__mmask16)0xffff : (__mmask16)((1u << (P - p)) - 1));
+                                          const __m512 g = _mm512_maskz_loadu_ps(m, gs + p);
+                                          const __mmask16 nz = _mm512_cmpneq_ps_mask(g, _mm512_setzero_ps());
+                                          _mm512_storeu_ps(val + n, _mm512_maskz_compress_ps(nz, g));
+                                          _mm512_storeu_si512((void *)(idx + n),
+                                                              _mm512_maskz_compress_epi32(nz, _mm512_add_epi32(iota, _mm512_set1_epi32(p))));
+                                          n += _mm_popcnt_u32(nz);
+                                      }
+                                  #endif
+                                  if(n == 0) continue;
+                                  real * gwo = gwT + oc * KK * ICP;
+                                  const real * wo = wT + oc * KK * ICP;
+                                  #ifdef __ARM_64BIT_STATE
+                                      for(idx_t e = 0;e < n;e++){
+                                          const real g = val[e];
+                                          const idx_t i = idx[e] / OW, j = idx[e] % OW;
+                                          for(idx_t t = 0;t < KK;t++){
+                                              const idx_t q = ((i + t / K) * W + j + t % K) * ICP;
+                                              for(idx_t ic = 0;ic < IC;ic++){
+                                                  gwo[t * ICP + ic] += g * xT[q + ic];
+                                                  gxT[q + ic] += g * wo[t * ICP + ic];
+                                              }
+                                          }
+                                      }
+                                  #else
+                                      /* gw: taps of oc in registers */
+                                      __m512 a[KK][ICV];
+                                      for(idx_t t = 0;t < KK;t++){
+                                          for(idx_t v = 0;v < ICV;v++){
+                                              a[t][v] = _mm512_setzero_ps();
+                                          }
+                                      }
+                                      for(idx_t e = 0;e < n;e++){
+                                          const __m512 g = _mm512_set1_ps(val[e]);
+                                          const real * xe = xT + ((idx[e] / OW) * W + idx[e] % OW) * ICP;
+                                          for(idx_t t = 0;t < KK;t++){
+                                              for(idx_t v = 0;v < ICV;v++){
+                                                  a[t][v] = _mm512_fmadd_ps(g, _mm512_load_ps(xe + ((t / K) * W + t % K) * ICP + v * L), a[t][v]);
+                                              }
+                                          }
+                                      }
+                                      for(idx_t t = 0;t < KK;t++){
+                                          for(idx_t v = 0;v < ICV;v++){
+                                              _mm512_store_ps(gwo + t * ICP + v * L,
+                                                              _mm512_add_ps(_mm512_load_ps(gwo + t * ICP + v * L), a[t][v]));
+                                          }
+                                      }
+                                      /* gx: weights of oc in registers */
+                                      __m512 wr[KK][ICV];
+                                      for(idx_t t = 0;t < KK;t++){
+                                          for(idx_t v = 0;v < ICV;v++){
+                                              wr[t][v] = _mm512_load_ps(wo + t * ICP + v * L);
+                                          }
+                                      }
+                                      for(idx_t e = 0;e < n;e++){
+                                          const __m512 g = _mm512_set1_ps(val[e]);
+                                          real * ge = gxT + ((idx[e] / OW) * W + idx[e] % OW) * ICP;
+                                          for(idx_t t = 0;t < KK;t++){
+                                              for(idx_t v = 0;v < ICV;v++){
+                                                  real * q = ge + ((t / K) * W + t % K) * ICP + v * L;
+                                                  _mm512_store_ps(q, _mm512_fmadd_ps(g, wr[t][v], _mm512_load_ps(q)));
+                                              }
+                                          }
+                                      }
+                                  #endif
+                              }
+                              for(idx_t ic = 0;ic < IC;ic++){
+                                  for(idx_t i = 0;i < H;i++){
+                                      for(idx_t j = 0;j < W;j++){
+                                          gx(s,ic,i,j) = gxT[(i * W + j) * ICP + ic];
+                                      }
+                                  }
+                              }
+                          }
+                          for(idx_t oc = 0;oc < OC;oc++){
+                              for(idx_t ic = 0;ic < IC;ic++){
+                                  for(idx_t t = 0;t < KK;t++){
+                                      acc[(oc * IC + ic) * KK + t] += gwT[(oc * KK + t) * ICP + ic];
+                                  }
+                              }
+                          }
+                      });
+        sparse_reduce(&gb.w[0][0][0][0], OC, B,
+                      [&](long lo, long hi, real * acc){
+                          gb_sum(gy, lo, hi, acc);
+                      });
+    }
+
+    /**
+     @brief log the fraction of zeros of gy backward saw and how many
+     calls ran which kernels since the last call, and reset the counts
+     @param (name) name of this layer (e.g., "conv2")
+     @param (epoch) the epoch
+     @details nothing is logged when zeros were not counted
+     (--sparse-backward off or an algorithm without sparse kernels)
+    */
+    void log_sparsity(const char * name, long epoch){
+        if(gy_elems == 0) return;
+        lgr->log(1, "# sparse backward: epoch %ld %s gy %.1f%% zeros, %ld dense %ld mask %ld lists calls",
+                 epoch, name, 100.0 * gy_zeros / gy_elems, n_sparse[conv_sparse_off],
+                 n_sparse[conv_sparse_mask], n_sparse[conv_sparse_lists]);
+        gy_zeros = gy_elems = 0;
+        n_sparse[conv_sparse_off] = n_sparse[conv_sparse_mask] = n_sparse[conv_sparse_lists] = 0;
+    }
+
     /**
      @brief calc the gradient of loss wrt the input (x)
      @param (gy) gradient of loss with respect to the output
@@ -756,7 +1555,16 @@ struct Convolution2D{
     tensor<real,maxB,IC,H,W>& backward(tensor<real,maxB,OC,H-K+1,W-K+1>& gy){
         log_start_fun(lgr);
         tsc_t t0 = get_tsc();
-        switch(opt.algo){
+        const int mode = (used_patches || used_fft ? (int)conv_sparse_off : sparse_mode(gy));
+        if(used_patches){
+            backward_patches(gy);
+        }else if(used_fft){
+            backward_fft(gy);
+        }else if(mode == conv_sparse_mask){
+            backward_sparse_mask(gy);
+        }else if(mode == conv_sparse_lists){
+            backward_sparse_lists(gy);
+        }else switch(opt.algo){
             /* add case for your implementations here */
         case algo_cpu_base:
             backward_cpu_base(gy); break;
@@ -764,6 +1572,8 @@ struct Convolution2D{
             backward_cuda_base(gy); break;
         case algo_cpu_simd:
             backward_cpu_simd(gy); break;
+        case algo_cpu_omp:
+            backward_cpu_omp(gy); break;
         default:
             if(opt.cuda_algo){
                 backward_cuda_base(gy);
@@ -772,10 +1582,27 @@ struct Convolution2D{
             }                
         }
         tsc_t t1 = get_tsc();
+        log_cost(backward_cost(gy.n0));
         log_end_fun(lgr, t0, t1);
         return gx;
     }
 
+    /**
+     @brief backward from the gradient wrt the output of the
+     elementwise layers after this one (--fuse-backward 1)
+     @param (gp) gradient of loss wrt the output of the last of them
+     @param (r) how it reaches the output of this layer (grad_route)
+     @param (gy) the tensor the gradient wrt the output is made in
+     @details r makes gy in one pass (dropout mask, max pooling
+     routing and ReLU mask at once), and backward takes it as usual;
+     gx of those layers is never written. cpu algorithms only.
+     @sa backward
+    */
+    template<typename GP,typename R>
+    tensor<real,maxB,IC,H,W>& backward_routed(GP& gp, R& r, tensor<real,maxB,OC,H-K+1,W-K+1>& gy){
+        return backward(r.backward(gp, gy));
+    }
+
     /*
      member functions below assume data is on the host.
      they are only for checking (debugging) implementations
@@ -821,8 +1648,221 @@ struct Convolution2D{
     double grad_dot_grad(Convolution2D<maxB,IC,H,W,K,OC>& o){
         return gw.dot(o.gw) + gb.dot(o.gb);
     }
+
+    /**
+     @brief register weights and optimizer states to a checkpoint
+     @param (ck) the checkpoint
+     @param (name) name of this layer (e.g., "conv1")
+     @details data must be on the host when the checkpoint is
+         saved or restored
+    */
+    void ckpt_sections(checkpoint& ck, const char * name){
+        char sub[CKPT_NAME_MAX];
+        ck.add(name, "w", &w.w, sizeof(w.w));
+        ck.add(name, "b", &b.w, sizeof(b.w));
+        snprintf(sub, sizeof(sub), "%s.opt_w", name);
+        opt_w.ckpt_sections(ck, sub);
+        snprintf(sub, sizeof(sub), "%s.opt_b", name);
+        opt_b.ckpt_sections(ck, sub);
+    }
 };
 
+/**
+ @brief compare backward of each --sparse-backward mode with the
+ dense one on gy of several fractions of zeros, and time them
+ @param (opt) command line options (the algorithm)
+ @param (lgr) logger
+ @param (rg) random number generator
+ @param (B) batch size
+ @return 0 if all results agree with dense ones
+ @details zeros are placed at random (each element is zero with
+ the given probability). the times give the crossover point
+ auto chooses modes by (CONV_SPARSE_LISTS_MIN).
+*/
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t K,idx_t OC>
+static int convolution_sparse_check(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, idx_t B){
+    typedef Convolution2D<maxB,IC,H,W,K,OC> conv_t;
+    const int reps = 3;
+    conv_t * c = new conv_t();
+    c->init(opt, lgr, rg, Convolution2DCfg());
+    tensor<real,maxB,IC,H,W> * x = new tensor<real,maxB,IC,H,W>();
+    tensor<real,maxB,OC,H-K+1,W-K+1> * gy = new tensor<real,maxB,OC,H-K+1,W-K+1>();
+    tensor<real,OC,IC,K,K> * gw0 = new tensor<real,OC,IC,K,K>();
+    tensor<real,OC> * gb0 = new tensor<real,OC>();
+    tensor<real,maxB,IC,H,W> * gx0 = new tensor<real,maxB,IC,H,W>();
+    x->init_uniform(B, rg, -1.0, 1.0);
+    c->forward(*x, 1);
+    printf("Convolution2D<%d,%d,%d,%d,%d,%d> %s, %d samples (ms per backward)\n",
+           (int)maxB, (int)IC, (int)H, (int)W, (int)K, (int)OC, opt.algo_s, (int)B);
+    printf("%8s %10s %10s %10s %12s\n", "zeros", "dense", "mask", "lists", "max rel err");
+    const double zs[] = { 0.0, 0.25, 0.5, 0.75, 0.9, 0.97, 0.99 };
+    const int modes[3] = { conv_sparse_off, conv_sparse_mask, conv_sparse_lists };
+    int ok = 1;
+    for(double z : zs){
+        gy->init_uniform(B, rg, -1.0, 1.0);
+        for(idx_t s = 0;s < B;s++){
+            for(idx_t oc = 0;oc < OC;oc++){
+                for(idx_t i = 0;i < H - K + 1;i++){
+                    for(idx_t j = 0;j < W - K + 1;j++){
+                        if(rg.rand01() < z) (*gy)(s,oc,i,j) = 0;
+                    }
+                }
+            }
+        }
+        double ms[3];
+        double max_e = 0.0;
+        for(int k = 0;k < 3;k++){
+            c->sparse = modes[k];
+            double t = 0.0;
+            for(int r = 0;r < reps;r++){
+                struct timespec ts0, ts1;
+                clock_gettime(CLOCK_MONOTONIC, &ts0);
+                c->backward(*gy);
+                clock_gettime(CLOCK_MONOTONIC, &ts1);
+                t += (ts1.tv_sec - ts0.tv_sec) * 1.0e3 + (ts1.tv_nsec - ts0.tv_nsec) * 1.0e-6;
+            }
+            ms[k] = t / reps;
+            if(k == 0){
+                *gw0 = c->gw;
+                *gb0 = c->gb;
+                *gx0 = c->gx;
+                continue;
+            }
+            double d = 0.0, m = 0.0;
+            for(idx_t oc = 0;oc < OC;oc++){
+                for(idx_t ic = 0;ic < IC;ic++){
+                    for(idx_t di = 0;di < K;di++){
+                        for(idx_t dj = 0;dj < K;dj++){
+                            d = max_r(d, fabs(c->gw(oc,ic,di,dj) - (*gw0)(oc,ic,di,dj)));
+                            m = max_r(m, fabs((*gw0)(oc,ic,di,dj)));
+                        }
+                    }
+                }
+                d = max_r(d, fabs(c->gb(oc) - (*gb0)(oc)));
+                m = max_r(m, fabs((*gb0)(oc)));
+            }
+            double dx = 0.0, mx = 0.0;
+            for(idx_t s = 0;s < B;s++){
+                for(idx_t ic = 0;ic < IC;ic++){
+                    for(idx_t i = 0;i < H;i++){
+                        for(idx_t j = 0;j < W;j++){
+                            dx = max_r(dx, fabs(c->gx(s,ic,i,j) - (*gx0)(s,ic,i,j)));
+                            mx = max_r(mx, fabs((*gx0)(s,ic,i,j)));
+                        }
+                    }
+                }
+            }
+            max_e = max_r(max_e, max_r(d / (m + 1.0e-30), dx / (mx + 1.0e-30)));
+        }
+        printf("%7.1f%% %10.3f %10.3f %10.3f %12.3e\n",
+               100.0 * c->count_zeros(*gy) / ((double)B * OC * (H - K + 1) * (W - K + 1)),
+               ms[0], ms[1], ms[2], max_e);
+        ok = ok && max_e < 1.0e-4;
+    }
+    delete c; delete x; delete gy; delete gw0; delete gb0; delete gx0;
+    return ok ? 0 : 1;
+}
+
+/**
+ @brief time forward and backward of direct, im2col (fp16 patches)
+ and FFT convolution in one shape, and compare FFT with direct
+ @param (opt) command line options (the algorithm of direct kernels)
+ @param (lgr) logger
+ @param (rg) random number generator
+ @param (B) batch size
+ @return 0 if FFT agrees with direct
+ @details backward of im2col computes gw and gb only (see
+ backward_patches). the last column is what --conv-fft auto would
+ choose (conv_fft_pays); the times show where it should switch.
+*/
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t K,idx_t OC>
+static int convolution_fft_check(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, idx_t B){
+    typedef Convolution2D<maxB,IC,H,W,K,OC> conv_t;
+    typedef conv_patches<maxB,IC,H,W,K> cp_t;
+    const idx_t OH = H - K + 1, OW = W - K + 1;
+    const int reps = 3;
+    conv_t * c = new conv_t();
+    c->init(opt, lgr, rg, Convolution2DCfg());
+    tensor<real,maxB,IC,H,W> * x = new tensor<real,maxB,IC,H,W>();
+    tensor<real,maxB,OC,OH,OW> * gy = new tensor<real,maxB,OC,OH,OW>();
+    tensor<real,maxB,OC,OH,OW> * y0 = new tensor<real,maxB,OC,OH,OW>();
+    tensor<real,OC,IC,K,K> * gw0 = new tensor<real,OC,IC,K,K>();
+    tensor<real,maxB,IC,H,W> * gx0 = new tensor<real,maxB,IC,H,W>();
+    cp_t * cp = new cp_t();
+    static unsigned char rgb[IC][H][W];
+    x->init_uniform(B, rg, -1.0, 1.0);
+    gy->init_uniform(B, rg, -1.0, 1.0);
+    cp->fmt = patch_fmt_fp16;
+    cp->n0 = B;
+    cp->x = x;
+    for(idx_t s = 0;s < B;s++){
+        cp_t::encode(patch_fmt_fp16, rgb, x->w[s], cp->w[s]);
+    }
+    c->sparse = conv_sparse_off;
+    double ms[3][2];
+    double ey = 0.0, my = 0.0, ew = 0.0, mw = 0.0, ex = 0.0, mx = 0.0;
+    for(int k = 0;k < 3;k++){
+        /* 0 : direct, 1 : im2col, 2 : fft */
+        c->patches = (k == 1 ? cp : 0);
+        c->set_fft(k == 2);
+        ms[k][0] = ms[k][1] = 0.0;
+        for(int r = 0;r < reps + 1;r++){
+            struct timespec ts0, ts1, ts2;
+            clock_gettime(CLOCK_MONOTONIC, &ts0);
+            c->forward(*x, 1);
+            clock_gettime(CLOCK_MONOTONIC, &ts1);
+            c->backward(*gy);
+            clock_gettime(CLOCK_MONOTONIC, &ts2);
+            /* the first round is a warm up (spectra of filters, scratch buffers) */
+            if(r == 0) continue;
+            ms[k][0] += (ts1.tv_sec - ts0.tv_sec) * 1.0e3 + (ts1.tv_nsec - ts0.tv_nsec) * 1.0e-6;
+            ms[k][1] += (ts2.tv_sec - ts1.tv_sec) * 1.0e3 + (ts2.tv_nsec - ts1.tv_nsec) * 1.0e-6;
+        }
+        ms[k][0] /= reps;
+        ms[k][1] /= reps;
+        if(k == 0){
+            *y0 = c->y;
+            *gw0 = c->gw;
+            *gx0 = c->gx;
+        }
+    }
+    for(idx_t s = 0;s < B;s++){
+        for(idx_t oc = 0;oc < OC;oc++){
+            for(idx_t i = 0;i < OH;i++){
+                for(idx_t j = 0;j < OW;j++){
+                    ey = max_r(ey, fabs(c->y(s,oc,i,j) - (*y0)(s,oc,i,j)));
+                    my = max_r(my, fabs((*y0)(s,oc,i,j)));
+                }
+            }
+        }
+        for(idx_t ic = 0;ic < IC;ic++){
+            for(idx_t i = 0;i < H;i++){
+                for(idx_t j = 0;j < W;j++){
+                    ex = max_r(ex, fabs(c->gx(s,ic,i,j) - (*gx0)(s,ic,i,j)));
+                    mx = max_r(mx, fabs((*gx0)(s,ic,i,j)));
+                }
+            }
+        }
+    }
+    for(idx_t oc = 0;oc < OC;oc++){
+        for(idx_t ic = 0;ic < IC;ic++){
+            for(idx_t di = 0;di < K;di++){
+                for(idx_t dj = 0;dj < K;dj++){
+                    ew = max_r(ew, fabs(c->gw(oc,ic,di,dj) - (*gw0)(oc,ic,di,dj)));
+                    mw = max_r(mw, fabs((*gw0)(oc,ic,di,dj)));
+                }
+            }
+        }
+    }
+    const double e = max_r(ey / (my + 1.0e-30), max_r(ex / (mx + 1.0e-30), ew / (mw + 1.0e-30)));
+    printf("%4d %4d %4d %4d %3d %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %10.3e %6s\n",
+           (int)IC, (int)OC, (int)H, (int)W, (int)K,
+           ms[0][0], ms[0][1], ms[1][0], ms[1][1], ms[2][0], ms[2][1], e,
+           (conv_fft_pays<maxB,IC,H,W,K,OC>() ? "fft" : "direct"));
+    delete c; delete x; delete gy; delete y0; delete gw0; delete gx0; delete cp;
+    return e < 1.0e-4 ? 0 : 1;
+}
+
 /**
  @brief entry point of this header file
  @param (argc) the number of command line args
@@ -834,6 +1874,11 @@ struct Convolution2D{
  function becomes th main function of the executable.
  it calls grad_check repeatedly to test
  the implementation of backward of convolution.
+ with --sparse-backward other than off, it also compares sparse
+ backward with dense one in the shapes of conv1 and conv2 of MNIST
+ (convolution_sparse_check), and with --conv-fft other than off,
+ it times direct, im2col and FFT convolution across kernel and
+ image sizes (convolution_fft_check).
 */
 int convolution_main(int argc, char ** argv){
     cmdline_opt opt = parse_args(argc, argv);
@@ -867,6 +1912,29 @@ int convolution_main(int argc, char ** argv){
     }
     printf("max relative error = %.9f\n", max_e);
     printf("avg relative error = %.9f\n", sum_e / n_checks);
+    int err = 0;
+    if(strcmp(opt.sparse_backward, "off") != 0){
+        err |= convolution_sparse_check<maxB,1,28,28,3,32>(opt, &lgr, rg, B);
+        err |= convolution_sparse_check<maxB,32,26,26,3,64>(opt, &lgr, rg, B);
+        printf("%s\n", err ? "NG" : "OK");
+    }
+    if(strcmp(opt.conv_fft, "off") != 0){
+        printf("%s, %d samples (ms per call; im2col backward is gw/gb only)\n", opt.algo_s, (int)B);
+        printf("%4s %4s %4s %4s %3s %9s %9s %9s %9s %9s %9s %10s %6s\n",
+               "IC", "OC", "H", "W", "K", "direct_f", "direct_b", "im2col_f", "im2col_b",
+               "fft_f", "fft_b", "fft err", "auto");
+        err |= convolution_fft_check<maxB,1,28,28,3,32>(opt, &lgr, rg, B);
+        err |= convolution_fft_check<maxB,1,28,28,5,32>(opt, &lgr, rg, B);
+        err |= convolution_fft_check<maxB,1,28,28,7,32>(opt, &lgr, rg, B);
+        err |= convolution_fft_check<maxB,1,28,28,11,32>(opt, &lgr, rg, B);
+        err |= convolution_fft_check<maxB,1,56,56,3,32>(opt, &lgr, rg, B);
+        err |= convolution_fft_check<maxB,1,56,56,7,32>(opt, &lgr, rg, B);
+        err |= convolution_fft_check<maxB,1,56,56,11,32>(opt, &lgr, rg, B);
+        err |= convolution_fft_check<maxB,32,26,26,3,64>(opt, &lgr, rg, B);
+        err |= convolution_fft_check<maxB,32,26,26,5,64>(opt, &lgr, rg, B);
+        err |= convolution_fft_check<maxB,32,26,26,7,64>(opt, &lgr, rg, B);
+        printf("%s\n", err ? "NG" : "OK");
+    }
     lgr.end_log();
-    return 0;
+    return err;
 }
\ No newline at end of file
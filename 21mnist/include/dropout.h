@@ -6,6 +6,7 @@
 
 #include "mnist_util.h"
 #include "tensor.h"
+#include "checkpoint.h"
 #include "grad_check.h"
 
 /**
@@ -16,6 +17,45 @@ struct DropoutCfg {
   long seed;                    /**< random number seed */
 };
 
+/**
+   @brief which of the next n elements dropout keeps
+   @param (rg) the generator of dropout, at the state before them
+   (not advanced)
+   @param (ratio) drop probability
+   @param (n) the number of elements
+   @param (keep) keep[k] = 1 if element k is kept (output)
+   @details the same decisions as n calls of rg.rand01() < ratio:
+   rand01 returns x / 2^48 for the 48 bit state x, which is exact, so
+   the test is x < ceil(ratio * 2^48) on integers. the generator is
+   a linear congruential one whose steps depend on each other; four
+   interleaved states, each advanced by four steps at a time, let
+   the multiplies overlap.
+*/
+static void dropout_keep(rnd_gen_t rg, real ratio, long n, unsigned char * keep) {
+  const uint64_t mask = (1UL << 48) - 1;
+  const uint64_t thr = (uint64_t)ceil((double)ratio * (double)(1UL << 48));
+  const uint64_t a = 0x5deece66dull, c = 0xb;
+  uint64_t x[4];
+  uint64_t y = rg.x;
+  for (int l = 0; l < 4; l++) {
+    y = (y * a + c) & mask;
+    x[l] = y;
+  }
+  /* four steps at a time: x -> a4 * x + c4 */
+  const uint64_t a2 = (a * a) & mask, c2 = (a * c + c) & mask;
+  const uint64_t a4 = (a2 * a2) & mask, c4 = (a2 * c2 + c2) & mask;
+  long k = 0;
+  for (; k + 4 <= n; k += 4) {
+    for (int l = 0; l < 4; l++) {
+      keep[k + l] = (x[l] >= thr);
+      x[l] = (x[l] * a4 + c4) & mask;
+    }
+  }
+  for (int l = 0; l < 4 && k < n; k++, l++) {
+    keep[k] = (x[l] >= thr);
+  }
+}
+
 /**
    @brief dropout layer
 
@@ -39,6 +79,7 @@ struct Dropout {
   rnd_gen_t rg;                 /**< random number generator to choose dropout */
   tensor<real,N0,N1,N2,N3> y;        /**< output of the forward */
   tensor<real,N0,N1,N2,N3> gx;      /**< gradient of loss wrt to input x */
+  tensor<unsigned char,N0,N1,N2,N3> keep; /**< 1 for elements the last forward_mask kept (--fuse-dropout) */
   real drop_ratio;              /**< drop probability */
   long state_forward;           /**< random number state at the forward function */
   /**
@@ -55,6 +96,37 @@ struct Dropout {
     this->drop_ratio = cfg.ratio;
     this->rg.seed(cfg.seed);
   }
+  /**
+     @brief the static footprint of the layer (layer_mem; no parameters)
+  */
+  static constexpr layer_mem memory() {
+    return layer_mem{ 0, 0, 0, sizeof(y) + sizeof(gx) + sizeof(keep), sizeof(Dropout<N0,N1,N2,N3>) };
+  }
+  /**
+     @brief the cost of forward with B samples (a multiply per element; layer_cost)
+     @param (B) the number of samples
+     @details random numbers are not counted; the mask is not stored
+     but regenerated in backward
+  */
+  static constexpr layer_cost forward_cost(idx_t B) {
+    return layer_cost{ (uint64_t)B * N1 * N2 * N3,
+                       2 * (uint64_t)sizeof(real) * B * N1 * N2 * N3 };
+  }
+  /**
+     @brief the cost of backward with B samples (layer_cost)
+     @param (B) the number of samples
+  */
+  static constexpr layer_cost backward_cost(idx_t B) {
+    return forward_cost(B);
+  }
+  /**
+     @brief the cost of forward_mask with B samples (layer_cost)
+     @param (B) the number of samples
+     @details no arithmetic on reals; a byte per element is written
+  */
+  static constexpr layer_cost mask_cost(idx_t B) {
+    return layer_cost{ 0, (uint64_t)B * N1 * N2 * N3 };
+  }
   /**
      @brief set the device pointer for this and all subobjects
      @param (dev) a device memory or null
@@ -68,6 +140,7 @@ struct Dropout {
     this->dev = dev;
     y.set_dev(dev ? &dev->y : 0);
     gx.set_dev(dev ? &dev->gx : 0);
+    keep.set_dev(dev ? &dev->keep : 0);
 #else
     (void)dev;
 #endif
@@ -91,8 +164,23 @@ struct Dropout {
   */
   __device__ __host__
   void forward_base(tensor<real,N0,N1,N2,N3>& x, int training) {
+    forward_base_to(x, y, training);
+  }
+  /**
+     @brief the baseline (serial) implementation of forward writing
+     its output to an arbitrary tensor (y_) instead of y
+     @param (x) input images
+     @param (y_) the tensor the output is written to
+     @param (training) 1 if it is called in training not testing
+     @sa forward_base
+     @sa forward_to
+     @sa recompute_to
+  */
+  __device__ __host__
+  void forward_base_to(tensor<real,N0,N1,N2,N3>& x,
+                       tensor<real,N0,N1,N2,N3>& y_, int training) {
     const idx_t n0 = x.n0;
-    y.set_n0(n0);
+    y_.set_n0(n0);
     /* zero elements with probability of ratio and
        scale others by 1/(1-ratio) so that the sum 
        will stay approximately the same */
@@ -104,9 +192,9 @@ struct Dropout {
         for (idx_t i2 = 0; i2 < N2; i2++) {
           for (idx_t i3 = 0; i3 < N3; i3++) {
             if (rg.rand01() < p) {
-              y(i0,i1,i2,i3) = 0.0;
+              y_(i0,i1,i2,i3) = 0.0;
             } else {
-              y(i0,i1,i2,i3) = x(i0,i1,i2,i3) * scale;
+              y_(i0,i1,i2,i3) = x(i0,i1,i2,i3) * scale;
             }
           }
         }
@@ -186,9 +274,90 @@ struct Dropout {
       }        
     }
     tsc_t t1 = get_tsc();
+    log_cost(forward_cost(x.n0));
     log_end_fun(lgr, t0, t1);
     return y;
   }
+  /**
+     @brief forward phase of the layer writing its output to y_
+     @param (x) input images
+     @param (y_) the tensor the output is written to (host memory)
+     @param (training) 1 if it is called in training not testing
+     @details the same as forward except for the output tensor.
+     only cpu algorithms are supported
+     @sa forward
+     @sa forward_base_to
+  */
+  tensor<real,N0,N1,N2,N3>& forward_to(tensor<real,N0,N1,N2,N3>& x,
+                                       tensor<real,N0,N1,N2,N3>& y_, int training) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    forward_base_to(x, y_, training);
+    tsc_t t1 = get_tsc();
+    log_cost(forward_cost(x.n0));
+    log_end_fun(lgr, t0, t1);
+    return y_;
+  }
+  /**
+     @brief forward phase of the layer when the layer after it
+     applies dropout as it reads its input (--fuse-dropout)
+     @param (n0) the number of samples
+     @param (training) 1 if it is called in training not testing
+     @details y is not written. in training, keep gets the decisions
+     forward would make (element kept = keep is 1, to be multiplied by
+     scale(1)); when not training, nothing is dropped and keep is left
+     alone. either way, the generator advances and state_forward is
+     set as by forward, so a run drops the same elements as without
+     --fuse-dropout. samples are independent (the generator jumps to
+     each), so they are split among threads. only cpu algorithms are
+     supported
+     @sa forward_base_to
+     @sa scale
+  */
+  void forward_mask(idx_t n0, int training) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    keep.set_n0(n0);
+    state_forward = rg.get_state();
+    if (training) {
+      const int par = (opt.algo != algo_cpu_base);
+      #pragma omp parallel for schedule(static) if(par)
+      for (idx_t i0 = 0; i0 < n0; i0++) {
+        rnd_gen_t r = rg;
+        r.skip((uint64_t)i0 * N1 * N2 * N3);
+        dropout_keep(r, drop_ratio, N1 * N2 * N3, &keep.w[i0][0][0][0]);
+      }
+      (void)par;
+    }
+    skip_forward(n0);
+    tsc_t t1 = get_tsc();
+    log_cost(mask_cost(training ? n0 : 0));
+    log_end_fun(lgr, t0, t1);
+  }
+  /**
+     @brief the factor forward multiplies kept elements by
+     @param (training) 1 if it is called in training not testing
+  */
+  real scale(int training) const {
+    real p = training ? drop_ratio : 0.0;
+    return 1.0 / (1 - p);
+  }
+  /**
+     @brief regenerate the output of the last (training) forward into y_
+     @param (x) the input passed to the last forward
+     @param (y_) the tensor the output is written to (host memory)
+     @details rewinds the random number generator to the state
+     at the last forward, so the same elements get dropped. the
+     generator ends up in the same state as after that forward,
+     exactly as backward does.
+     @sa forward_to
+     @sa backward_base
+  */
+  tensor<real,N0,N1,N2,N3>& recompute_to(tensor<real,N0,N1,N2,N3>& x,
+                                         tensor<real,N0,N1,N2,N3>& y_) {
+    rg.seed(state_forward);
+    return forward_to(x, y_, 1);
+  }
   /**
      @brief the baseline (serial) implementation of backward
      @param (gy) gradient of loss with respect to the output
@@ -297,6 +466,7 @@ struct Dropout {
       }        
     }
     tsc_t t1 = get_tsc();
+    log_cost(backward_cost(gy.n0));
     log_end_fun(lgr, t0, t1);
     return gx;
   }
@@ -338,6 +508,26 @@ struct Dropout {
     (void)o;
     return 0.0;
   }
+  /**
+     @brief register the random number generator states to a checkpoint
+     @param (ck) the checkpoint
+     @param (name) name of this layer (e.g., "dropout1")
+     @details restoring them makes a resumed run drop the same
+     elements as an uninterrupted one
+  */
+  void ckpt_sections(checkpoint& ck, const char * name) {
+    ck.add(name, "rg", &rg.x, sizeof(rg.x));
+    ck.add(name, "state_forward", &state_forward, sizeof(state_forward));
+  }
+  /**
+     @brief advance the random number generator as forward on n0 samples would
+     @details forward draws a random number for every element even
+     when not training; this lets samples evaluated elsewhere
+     (parallel_eval.h) have the same effect on later epochs
+  */
+  void skip_forward(long n0) {
+    rg.skip((uint64_t)n0 * N1 * N2 * N3);
+  }
 };
 
 /**
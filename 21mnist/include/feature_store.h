@@ -0,0 +1,256 @@
+/**
+   @file feature_store.h
+   @brief a store of per-image features in a mapped file, for
+   training the classifier on frozen convolutions (--freeze-conv 1)
+   @details when conv1 and conv2 are not updated, the output of
+   max_pooling_2d for a training image is the same in every epoch.
+   the first epoch computes it and puts it into the store; later
+   epochs get it from the store and start at dropout1.
+
+   the store is n items of m elements, one after another, in a
+   file mapped shared (--feature-store FILE) or in anonymous
+   memory (""). a file lets the kernel write pages back and drop
+   them under memory pressure (the whole training set is about
+   2.2GB of floats). elements are reals or, with fp16, IEEE
+   half-precision numbers (half the bytes; features are in the
+   range of activations, where the relative error is below 2^-11).
+
+   the contents are only valid within a run (which items were put
+   is kept in memory, not in the file).
+ */
+#pragma once
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "mnist_util.h"
+
+/**
+   @brief convert a float to IEEE half precision (round to nearest even)
+*/
+static uint16_t feature_float_to_half(float f) {
+  uint32_t x;
+  memcpy(&x, &f, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  int32_t e = (int32_t)((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mant = x & 0x7fffff;
+  if (((x >> 23) & 0xff) == 0xff) {         /* inf or nan */
+    return (uint16_t)(sign | 0x7c00 | (mant ? 0x200 : 0));
+  }
+  if (e >= 31) return (uint16_t)(sign | 0x7c00); /* overflow */
+  if (e <= 0) {                             /* subnormal or zero */
+    if (e < -10) return (uint16_t)sign;
+    mant |= 0x800000;
+    uint32_t shift = (uint32_t)(14 - e);
+    uint32_t h = mant >> shift;
+    uint32_t rem = mant & ((1u << shift) - 1);
+    uint32_t half = 1u << (shift - 1);
+    if (rem > half || (rem == half && (h & 1))) h++;
+    return (uint16_t)(sign | h);
+  }
+  uint32_t h = ((uint32_t)e << 10) | (mant >> 13);
+  uint32_t rem = mant & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++; /* may carry into the exponent, as it should */
+  return (uint16_t)(sign | h);
+}
+
+/**
+   @brief convert an IEEE half precision number to a float
+*/
+static float feature_half_to_float(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t e = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t x;
+  if (e == 0x1f) {
+    x = sign | 0x7f800000 | (mant << 13);
+  } else if (e == 0) {
+    if (mant == 0) {
+      x = sign;
+    } else {                                /* subnormal; normalize */
+      e = 1;
+      while (!(mant & 0x400)) { mant <<= 1; e--; }
+      mant &= 0x3ff;
+      x = sign | ((e + 127 - 15) << 23) | (mant << 13);
+    }
+  } else {
+    x = sign | ((e + 127 - 15) << 23) | (mant << 13);
+  }
+  float f;
+  memcpy(&f, &x, sizeof(f));
+  return f;
+}
+
+/**
+   @brief n items of m features each, in a mapped file or anonymous memory
+*/
+struct feature_store {
+  long n;                       /**< the number of items */
+  long m;                       /**< features per item */
+  int fp16;                     /**< 1 if features are kept in half precision */
+  size_t bytes;                 /**< bytes mapped */
+  char * base;                  /**< mapped address (null if not open) */
+  char * filled;                /**< filled[i] = 1 if item i has been put */
+  long n_filled;                /**< the number of items put */
+  /**
+     @brief bytes of an item
+  */
+  size_t item_bytes() const {
+    return (size_t)m * (fp16 ? sizeof(uint16_t) : sizeof(real));
+  }
+  /**
+     @brief map a store of n items of m features
+     @param (file) the file backing it ("" for anonymous memory)
+     @param (n) the number of items
+     @param (m) features per item
+     @param (fp16) 1 to keep features in half precision
+     @return 0 if succeeded
+  */
+  int open(const char * file, long n, long m, int fp16) {
+    this->n = n;
+    this->m = m;
+    this->fp16 = fp16;
+    bytes = item_bytes() * n;
+    base = 0;
+    filled = 0;
+    n_filled = 0;
+    size_t sz = (bytes ? bytes : 1);
+    void * a;
+    if (file[0]) {
+      int fd = ::open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (fd == -1) { perror(file); return -1; }
+      if (ftruncate(fd, sz) == -1) { perror("ftruncate"); ::close(fd); return -1; }
+      a = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      ::close(fd);
+    } else {
+      a = mmap(0, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (a == MAP_FAILED) { perror("mmap"); return -1; }
+    base = (char *)a;
+    filled = (char *)calloc(n > 0 ? n : 1, 1);
+    if (!filled) { perror("calloc"); munmap(base, sz); base = 0; return -1; }
+    return 0;
+  }
+  /**
+     @brief unmap the store
+  */
+  void close() {
+    if (base) munmap(base, (bytes ? bytes : 1));
+    free(filled);
+    base = 0;
+    filled = 0;
+  }
+  /**
+     @brief 1 if item i has been put
+  */
+  int has(long i) const {
+    return 0 <= i && i < n && filled[i];
+  }
+  /**
+     @brief put features f[0:m] of item i
+  */
+  void put(long i, const real * f) {
+    assert(0 <= i && i < n);
+    char * p = base + item_bytes() * i;
+    if (fp16) {
+      uint16_t * h = (uint16_t *)p;
+      for (long j = 0; j < m; j++) h[j] = feature_float_to_half((float)f[j]);
+    } else {
+      memcpy(p, f, sizeof(real) * m);
+    }
+    if (!filled[i]) {
+      filled[i] = 1;
+      n_filled++;
+    }
+  }
+  /**
+     @brief get features of item i into f[0:m]
+  */
+  void get(long i, real * f) const {
+    assert(has(i));
+    const char * p = base + item_bytes() * i;
+    if (fp16) {
+      const uint16_t * h = (const uint16_t *)p;
+      for (long j = 0; j < m; j++) f[j] = (real)feature_half_to_float(h[j]);
+    } else {
+      memcpy(f, p, sizeof(real) * m);
+    }
+  }
+};
+
+/**
+   @brief entry point of this header file
+   @details if this header file is included from
+   a main C++ file and define feature_store_main to be main
+   (e.g., with -Dfeature_store_main=main), then this
+   function becomes th main function of the executable.
+   it checks half precision conversions of special and
+   random values, and puts and gets items of a store in
+   anonymous memory and in a file (argv[1]), in both precisions.
+*/
+int feature_store_main(int argc, char ** argv) {
+  const char * file = (argc > 1 ? argv[1] : "feature_store_test.dat");
+  int ok = 1;
+  /* conversions */
+  const float exact[] = { 0.0f, -0.0f, 1.0f, -2.0f, 0.5f, 65504.0f, 6.103515625e-05f, 5.9604645e-08f };
+  for (float v : exact) {
+    float w = feature_half_to_float(feature_float_to_half(v));
+    if (w != v || signbit(w) != signbit(v)) {
+      printf("%g -> %g\n", v, w);
+      ok = 0;
+    }
+  }
+  ok = ok && feature_float_to_half(1.0e6f) == 0x7c00;
+  ok = ok && feature_float_to_half(1.0f + 1.0f / 2048) == 0x3c00; /* a tie rounds to even */
+  ok = ok && feature_float_to_half(1.0f + 3.0f / 2048) == 0x3c02;
+  double max_rel = 0.0;
+  for (uint32_t h = 0; h < 0x7c00; h++) {
+    float v = feature_half_to_float((uint16_t)h);
+    ok = ok && feature_float_to_half(v) == h;
+  }
+  /* store */
+  const long n = 100, m = 9216;
+  real * f = (real *)malloc(sizeof(real) * m);
+  real * g = (real *)malloc(sizeof(real) * m);
+  rnd_gen_t rg;
+  rg.seed(12345);
+  for (int in_file = 0; in_file < 2; in_file++) {
+    for (int fp16 = 0; fp16 < 2; fp16++) {
+      feature_store fs;
+      if (fs.open(in_file ? file : "", n, m, fp16) != 0) return 1;
+      for (long i = 0; i < n; i += 3) {
+        rg.seed(i + 1);
+        for (long j = 0; j < m; j++) f[j] = (real)rg.rand(0.001, 4.0);
+        fs.put(i, f);
+      }
+      for (long i = 0; i < n; i++) {
+        ok = ok && fs.has(i) == (i % 3 == 0);
+        if (!fs.has(i)) continue;
+        rg.seed(i + 1);
+        for (long j = 0; j < m; j++) f[j] = (real)rg.rand(0.001, 4.0);
+        fs.get(i, g);
+        for (long j = 0; j < m; j++) {
+          double e = fabs((double)g[j] - f[j]) / (fabs((double)f[j]) + 1.0e-30);
+          if (fp16) max_rel = (e > max_rel ? e : max_rel);
+          else ok = ok && g[j] == f[j];
+        }
+      }
+      printf("%s, %s: %ld of %ld items put, %lu bytes\n",
+             (in_file ? file : "anonymous"), (fp16 ? "fp16" : "fp32"),
+             fs.n_filled, fs.n, (unsigned long)fs.bytes);
+      ok = ok && fs.n_filled == (n + 2) / 3 && fs.bytes == fs.item_bytes() * n;
+      fs.close();
+    }
+  }
+  printf("fp16 max relative error %.3g\n", max_rel);
+  ok = ok && max_rel <= 1.0 / 2048;
+  unlink(file);
+  free(f);
+  free(g);
+  printf("%s\n", ok ? "OK" : "NG");
+  return ok ? 0 : 1;
+}
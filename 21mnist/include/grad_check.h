@@ -13,6 +13,7 @@
    @param (lgr) logger 
    @param (rg) random number generator
    @param (B) the number of images
+   @param (verbose) 1 to show the numbers (show_error), 0 to only return the error
    @sa convolution_main
    @details it first makes a layer object with initial weights W 
    and generates an input (x and t).
@@ -28,7 +29,8 @@
 */
 
 template<typename T, typename I, typename O, typename C>
-static double grad_check(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, C cfg, idx_t B) {
+static double grad_check(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, C cfg, idx_t B,
+                         int verbose = 1) {
   /* make weight (layer struct or entire mnist) */
   T * w = new T();
   w->init(opt, lgr, rg, cfg);
@@ -87,7 +89,8 @@ static double grad_check(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, C cfg, id
   double gx_dx = gx.dot(*dx);                /* ∂L/∂x・dx */
   double gw_dw = w->grad_dot_grad(*w_minus); /* ∂L/∂w・dw */
   
-  double rel_e = show_error(gx_dx, gw_dw, L_minus, L, L_plus);
+  double rel_e = (verbose ? show_error(gx_dx, gw_dw, L_minus, L, L_plus)
+                  : rel_error(gx_dx, gw_dw, L_minus, L_plus));
   /* clean up */
   del_dev(w, opt.cuda_algo);
   del_dev(w_minus, opt.cuda_algo);
@@ -109,8 +112,16 @@ static double grad_check(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, C cfg, id
   return rel_e;
 }
 
+/**
+   @brief check the gradient computation of a layer (or the whole
+   network) taking true labels besides inputs (i.e., ending with the loss)
+   @details the same as grad_check, except that forward and
+   backward also take labels (t) of nC classes
+   @sa grad_check
+*/
 template<typename T, typename I0, typename I1, typename O, typename C>
-static double grad_check_loss(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, C cfg, idx_t B, idx_t nC) {
+static double grad_check_loss(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, C cfg, idx_t B, idx_t nC,
+                              int verbose = 1) {
   /* make weight (layer struct or entire mnist) */
   T * w = new T();
   w->init(opt, lgr, rg, cfg);
@@ -170,7 +181,8 @@ static double grad_check_loss(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, C cf
   double gx_dx = gx.dot(*dx);                /* ∂L/∂x・dx */
   double gw_dw = w->grad_dot_grad(*w_minus); /* ∂L/∂w・dw */
   
-  double rel_e = show_error(gx_dx, gw_dw, L_minus, L, L_plus);
+  double rel_e = (verbose ? show_error(gx_dx, gw_dw, L_minus, L, L_plus)
+                  : rel_error(gx_dx, gw_dw, L_minus, L_plus));
   /* clean up */
   del_dev(alpha, opt.cuda_algo);
   del_dev(x, opt.cuda_algo);
@@ -0,0 +1,385 @@
+/**
+   @file grad_check_all.h
+   @brief gradient checks of every layer with every algorithm,
+   run concurrently on a pool of threads
+   @details grad_check (grad_check.h) checks a layer in a random
+   direction; the main function of each layer header runs it
+   serially for a single algorithm. this runs many checks of
+   every layer of the network (at its real shape, as layer_bench.h
+   does) and of the whole network (mnist) for each algorithm
+   (algo_t) as independent jobs taken by a pool of threads.
+
+   each check uses its own random numbers, seeded by the seed and
+   the index of the check, so the errors do not depend on the
+   number of threads or the order jobs are taken in, and every
+   algorithm is checked in the same directions. for each layer and
+   algorithm, it reports the maximum, average, median and 90th
+   percentile of the relative errors, checks whose error exceeds a
+   tolerance, the largest excess of the error over that of cpu_base
+   on the same check, and the CPU time the checks took; for each
+   algorithm, the total CPU time.
+
+   a check of mnist makes three copies of the network (about
+   100MB each with MAX_BATCH_SIZE=64), so it takes memory in
+   proportion to the number of threads.
+ */
+#pragma once
+
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include "mnist_util.h"
+#include "tensor.h"
+#include "mnist.h"
+
+/** @brief layers (and the network) checked, in the order of the network */
+static const char * grad_check_all_layers[] = {
+  "conv1", "relu1", "conv2", "relu2", "max_pooling_2d", "dropout1",
+  "fc1", "relu3", "dropout2", "fc2", "nll_softmax", "mnist", 0
+};
+
+/**
+   @brief a check (a job of the pool)
+*/
+struct grad_check_all_job {
+  int layer;                    /**< index in grad_check_all_layers */
+  int algo;                     /**< algo_t */
+  int k;                        /**< index of the check */
+  double e;                     /**< relative error */
+  long cpu_ns;                  /**< CPU time it took */
+};
+
+/**
+   @brief the pool of threads, jobs and options given to layers
+*/
+struct grad_check_all {
+  cmdline_opt opt;              /**< options given to layers (except the algorithm) */
+  logger * lgr;                 /**< logger given to layers */
+  idx_t B;                      /**< batch size */
+  long seed;                    /**< seed of random numbers of checks */
+  grad_check_all_job * jobs;    /**< all jobs */
+  long n_jobs;                  /**< the number of jobs */
+  long next;                    /**< the next job to take */
+
+  /**
+     @brief CPU time of the calling thread
+  */
+  static long thread_cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+  }
+  /**
+     @brief run a check of layer (index in grad_check_all_layers)
+     with options o and random numbers rg
+     @details shapes are those of MNIST<maxB,1,28,28,10> (mnist.h)
+  */
+  double check(int layer, cmdline_opt o, rnd_gen_t& rg) {
+    const idx_t maxB = MAX_BATCH_SIZE;
+    const idx_t C0 = 1, H0 = 28, W0 = 28, K = 3, nC = 10;
+    const idx_t C1 = 32, H1 = H0 - K + 1, W1 = W0 - K + 1;
+    const idx_t C2 = 64, H2 = H1 - K + 1, W2 = W1 - K + 1;
+    const idx_t S = 2, H3 = H2 / S, W3 = W2 / S;
+    const idx_t nF = 128;
+    DropoutCfg d1 = { 0.25f, o.dropout_seed_1 };
+    DropoutCfg d2 = { 0.5f, o.dropout_seed_2 };
+    switch (layer) {
+    case 0:
+      return grad_check<Convolution2D<maxB,C0,H0,W0,K,C1>, tensor<real,maxB,C0,H0,W0>,
+                        tensor<real,maxB,C1,H1,W1>, Convolution2DCfg>(o, lgr, rg, Convolution2DCfg(), B, 0);
+    case 1:
+      return grad_check<Relu<maxB,C1,H1,W1>, tensor<real,maxB,C1,H1,W1>,
+                        tensor<real,maxB,C1,H1,W1>, ReluCfg>(o, lgr, rg, ReluCfg(), B, 0);
+    case 2:
+      return grad_check<Convolution2D<maxB,C1,H1,W1,K,C2>, tensor<real,maxB,C1,H1,W1>,
+                        tensor<real,maxB,C2,H2,W2>, Convolution2DCfg>(o, lgr, rg, Convolution2DCfg(), B, 0);
+    case 3:
+      return grad_check<Relu<maxB,C2,H2,W2>, tensor<real,maxB,C2,H2,W2>,
+                        tensor<real,maxB,C2,H2,W2>, ReluCfg>(o, lgr, rg, ReluCfg(), B, 0);
+    case 4:
+      return grad_check<MaxPooling2D<maxB,C2,H2,W2,S>, tensor<real,maxB,C2,H2,W2>,
+                        tensor<real,maxB,C2,H3,W3>, MaxPooling2DCfg>(o, lgr, rg, MaxPooling2DCfg(), B, 0);
+    case 5:
+      return grad_check<Dropout<maxB,C2,H3,W3>, tensor<real,maxB,C2,H3,W3>,
+                        tensor<real,maxB,C2,H3,W3>, DropoutCfg>(o, lgr, rg, d1, B, 0);
+    case 6:
+      return grad_check<Linear<maxB,nF,C2,H3,W3>, tensor<real,maxB,C2,H3,W3>,
+                        tensor<real,maxB,nF>, LinearCfg>(o, lgr, rg, LinearCfg(), B, 0);
+    case 7:
+      return grad_check<Relu<maxB,nF>, tensor<real,maxB,nF>,
+                        tensor<real,maxB,nF>, ReluCfg>(o, lgr, rg, ReluCfg(), B, 0);
+    case 8:
+      return grad_check<Dropout<maxB,nF>, tensor<real,maxB,nF>,
+                        tensor<real,maxB,nF>, DropoutCfg>(o, lgr, rg, d2, B, 0);
+    case 9:
+      return grad_check<Linear<maxB,nC,nF>, tensor<real,maxB,nF>,
+                        tensor<real,maxB,nC>, LinearCfg>(o, lgr, rg, LinearCfg(), B, 0);
+    case 10:
+      return grad_check_loss<NLLSoftmax<maxB,nC>, tensor<real,maxB,nC>, tensor<idx_t,maxB>,
+                             tensor<real,maxB>, NLLSoftmaxCfg>(o, lgr, rg, NLLSoftmaxCfg(), B, nC, 0);
+    case 11: {
+      MNISTCfg cfg = {
+        .conv1 = {},
+        .relu1 = {},
+        .conv2 = {},
+        .relu2 = {},
+        .max_pooling_2d = {},
+        .dropout1 = d1,
+        .fc1 = {},
+        .relu3 = {},
+        .dropout2 = d2,
+        .fc2 = {},
+        .nll_softmax = {},
+        .recompute = {}
+      };
+      return grad_check_loss<MNIST<maxB,C0,H0,W0,nC>, tensor<real,maxB,C0,H0,W0>, tensor<idx_t,maxB>,
+                             tensor<real,maxB>, MNISTCfg>(o, lgr, rg, cfg, B, nC, 0);
+    }
+    default:
+      assert(0);
+      return 0.0;
+    }
+  }
+  /**
+     @brief run job j
+  */
+  void run(grad_check_all_job& j) {
+    cmdline_opt o = opt;
+    o.algo = (algo_t)j.algo;
+    o.algo_s = algo_name(o.algo);
+    o.cuda_algo = algo_is_cuda(o.algo_s, o.algo);
+    rnd_gen_t rg;
+    rg.seed(seed + 1000003L * j.k + 7919L * j.layer);
+    long t0 = thread_cpu_ns();
+    j.e = check(j.layer, o, rg);
+    j.cpu_ns = thread_cpu_ns() - t0;
+  }
+  /**
+     @brief a thread of the pool; takes jobs until none is left
+  */
+  static void * worker(void * arg) {
+    grad_check_all * g = (grad_check_all *)arg;
+    while (1) {
+      long i = __sync_fetch_and_add(&g->next, 1);
+      if (i >= g->n_jobs) break;
+      g->run(g->jobs[i]);
+    }
+    return 0;
+  }
+  /**
+     @brief run all jobs with n_threads threads
+  */
+  void run_all(int n_threads) {
+    next = 0;
+    pthread_t * th = (pthread_t *)malloc(sizeof(pthread_t) * n_threads);
+    for (int t = 0; t < n_threads; t++) {
+      if (pthread_create(&th[t], 0, worker, this) != 0) {
+        perror("pthread_create");
+        exit(1);
+      }
+    }
+    for (int t = 0; t < n_threads; t++) {
+      pthread_join(th[t], 0);
+    }
+    free(th);
+  }
+  /**
+     @brief comparison of errors for qsort
+  */
+  static int cmp_double(const void * a, const void * b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x < y ? -1 : x > y ? 1 : 0);
+  }
+  /**
+     @brief the error of cpu_base on the same check as job j (-1 if cpu_base is not checked)
+  */
+  double base_error(const grad_check_all_job& j) {
+    for (long i = 0; i < n_jobs; i++) {
+      grad_check_all_job& b = jobs[i];
+      if (b.algo == algo_cpu_base && b.layer == j.layer && b.k == j.k) return b.e;
+    }
+    return -1.0;
+  }
+  /**
+     @brief report errors of each layer and algorithm and time of each algorithm
+     @param (tolerance) relative error above which a check is counted as bad
+     @param (n_worse) gets the number of checks of an algorithm other than cpu_base
+     whose error exceeds that of cpu_base on the same check by more than tolerance
+     (or exceeds tolerance, if cpu_base is not checked)
+     @details a check crossing a kink of relu or max pooling (x + dx and x - dx
+     on different sides) has a large error whatever the algorithm, so cpu_base
+     on the same directions is the reference other algorithms are judged against
+  */
+  void report(double tolerance, long * n_worse) {
+    *n_worse = 0;
+    double * e = (double *)malloc(sizeof(double) * (n_jobs + 1));
+    printf("%-14s %-10s %6s %10s %10s %10s %10s %5s %10s %9s\n",
+           "layer", "algo", "checks", "max err", "avg err", "median err", "p90 err", "bad",
+           "vs base", "cpu sec");
+    for (int a = 0; a < algo_invalid; a++) {
+      long algo_ns = 0, algo_n = 0;
+      for (int l = 0; grad_check_all_layers[l]; l++) {
+        long n = 0, bad = 0, ns = 0;
+        double sum = 0.0, vs_base = -1.0;
+        for (long i = 0; i < n_jobs; i++) {
+          grad_check_all_job& j = jobs[i];
+          if (j.algo != a || j.layer != l) continue;
+          e[n++] = j.e;
+          sum += j.e;
+          ns += j.cpu_ns;
+          bad += !(j.e <= tolerance);
+          if (a == algo_cpu_base) continue;
+          double eb = base_error(j);
+          double d = (eb >= 0.0 ? j.e - eb : j.e);
+          vs_base = (d > vs_base ? d : vs_base);
+          *n_worse += !(d <= tolerance);
+        }
+        if (n == 0) continue;
+        qsort(e, n, sizeof(double), cmp_double);
+        long i90 = (long)ceil(0.9 * n) - 1;
+        char vs[32] = "-";
+        if (a != algo_cpu_base) snprintf(vs, sizeof(vs), "%.3e", vs_base);
+        printf("%-14s %-10s %6ld %10.3e %10.3e %10.3e %10.3e %5ld %10s %9.3f\n",
+               grad_check_all_layers[l], algo_name((algo_t)a), n,
+               e[n - 1], sum / n, e[n / 2], e[i90 < 0 ? 0 : i90], bad, vs, ns * 1.0e-9);
+        algo_ns += ns;
+        algo_n += n;
+      }
+      if (algo_n > 0) {
+        printf("%-14s %-10s %6ld %68s %9.3f\n", "(all)", algo_name((algo_t)a), algo_n, "", algo_ns * 1.0e-9);
+      }
+    }
+    free(e);
+  }
+};
+
+/**
+   @brief 1 if name is in a comma-separated list (or the list is "all")
+*/
+static int grad_check_all_in(const char * list, const char * name) {
+  if (strcmp(list, "all") == 0) return 1;
+  size_t n = strlen(name);
+  for (const char * p = list; *p; ) {
+    size_t m = strcspn(p, ",");
+    if (m == n && strncmp(p, name, n) == 0) return 1;
+    p += m + (p[m] == ',');
+  }
+  return 0;
+}
+
+/**
+   @brief command line options for getopt
+*/
+static struct option grad_check_all_long_options[] = {
+  {"algos",             required_argument, 0, 'a' },
+  {"batch-size",        required_argument, 0, 'b' },
+  {"layers",            required_argument, 0, 'l' },
+  {"checks",            required_argument, 0, 'n' },
+  {"threads",           required_argument, 0, 'j' },
+  {"tolerance",         required_argument, 0, 't' },
+  {"seed",              required_argument, 0, 's' },
+  {"help",              no_argument,       0, 'h' },
+  {0,                   0,                 0,  0  }
+};
+
+/**
+   @brief show usage of grad_check_all
+*/
+static void grad_check_all_usage(const char * prog) {
+  fprintf(stderr,
+          "usage:\n"
+          "\n"
+          "%s [options]\n"
+          "\n"
+          " -a,--algos A,B,... : algorithms to check (\"all\" for all available) [all]\n"
+          " -b,--batch-size N : batch size (<= %d) [%d]\n"
+          " -l,--layers L,M,... : layers to check (conv1, relu1, conv2, relu2, max_pooling_2d,\n"
+          "                       dropout1, fc1, relu3, dropout2, fc2, nll_softmax, mnist or all) [all]\n"
+          " -n,--checks N : checks (random directions) of each layer and algorithm [16]\n"
+          " -j,--threads N : threads running checks (0 for the number of processors) [0]\n"
+          " -t,--tolerance E : relative error above which a check is bad; a check of an algorithm fails\n"
+          "                    (exit status 1) if its error exceeds that of cpu_base by more than it [0.01]\n"
+          " -s,--seed S : seed of random numbers of checks [%ld]\n"
+          " -h,--help\n",
+          prog, (int)MAX_BATCH_SIZE, (int)MAX_BATCH_SIZE, cmdline_opt().weight_seed);
+  exit(1);
+}
+
+/**
+   @brief entry point of this header file
+   @param (argc) the number of command line args
+   @param (argv) command line args
+   @details if this header file is included from
+   a main C++ file and define grad_check_all_main to be main
+   (e.g., with -Dgrad_check_all_main=main), then this
+   function becomes th main function of the executable.
+   it checks gradients of all layers with all algorithms.
+*/
+int grad_check_all_main(int argc, char ** argv) {
+  const char * algos = "all";
+  const char * layers = "all";
+  int n_checks = 16;
+  int n_threads = 0;
+  double tolerance = 0.01;
+  grad_check_all g;
+  g.B = MAX_BATCH_SIZE;
+  g.seed = g.opt.weight_seed;
+  while (1) {
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "a:b:l:n:j:t:s:h", grad_check_all_long_options, &option_index);
+    if (c == -1) break;
+    switch (c) {
+    case 'a': algos = strdup(optarg); break;
+    case 'b': g.B = atoi(optarg); break;
+    case 'l': layers = strdup(optarg); break;
+    case 'n': n_checks = atoi(optarg); break;
+    case 'j': n_threads = atoi(optarg); break;
+    case 't': tolerance = atof(optarg); break;
+    case 's': g.seed = atol(optarg); break;
+    default: grad_check_all_usage(argv[0]);
+    }
+  }
+  if (g.B < 1 || g.B > MAX_BATCH_SIZE || n_checks < 1 || n_threads < 0) grad_check_all_usage(argv[0]);
+  if (n_threads == 0) n_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_threads < 1) n_threads = 1;
+  /* layers log at level 4; nothing goes to stdout and the log is discarded */
+  g.opt.verbose = 0;
+  g.opt.log = "/dev/null";
+  g.opt.records = 0;
+  logger lgr;
+  lgr.start_log(g.opt);
+  g.lgr = &lgr;
+  /* jobs: checks of each layer with each algorithm */
+  int n_layers = 0;
+  while (grad_check_all_layers[n_layers]) n_layers++;
+  g.jobs = (grad_check_all_job *)malloc(sizeof(grad_check_all_job) * n_layers * algo_invalid * n_checks);
+  g.n_jobs = 0;
+  for (int a = 0; a < algo_invalid; a++) {
+    const char * name = algo_name((algo_t)a);
+    if (!name) continue;
+#if !__CUDACC__
+    /* cuda algorithms need nvcc */
+    if (algo_is_cuda(name, (algo_t)a)) continue;
+#endif
+    if (!grad_check_all_in(algos, name)) continue;
+    for (int l = 0; l < n_layers; l++) {
+      if (!grad_check_all_in(layers, grad_check_all_layers[l])) continue;
+      for (int k = 0; k < n_checks; k++) {
+        grad_check_all_job j = { l, a, k, 0.0, 0 };
+        g.jobs[g.n_jobs++] = j;
+      }
+    }
+  }
+  if (g.n_jobs == 0) grad_check_all_usage(argv[0]);
+  long t0 = trace_wall_ns();
+  g.run_all(n_threads);
+  long t1 = trace_wall_ns();
+  long n_worse;
+  g.report(tolerance, &n_worse);
+  printf("%ld checks on %d threads in %.3f sec, %ld worse than cpu_base by > %g\n",
+         g.n_jobs, n_threads, (t1 - t0) * 1.0e-9, n_worse, tolerance);
+  lgr.end_log();
+  free(g.jobs);
+  return (n_worse == 0 ? 0 : 1);
+}
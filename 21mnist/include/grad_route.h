@@ -0,0 +1,285 @@
+/**
+   @file grad_route.h
+   @brief the gradient a layer with weights gets through the
+   elementwise layers after it, in one pass (--fuse-backward 1)
+   @details in MNIST, conv2 is followed by relu2, max_pooling_2d and
+   dropout1, and fc1 by relu3 and dropout2. none of them has weights;
+   their backward only masks and routes the gradient, yet each one
+   writes a full gx the next reads back:
+
+   - dropout1.backward : gp -> gx (C*(H/S)*(W/S) per sample)
+   - max_pooling_2d.backward : zero C*H*W, scatter to argmax
+   - relu2.backward : read x and gx of max pooling, write C*H*W
+
+   grad_route does all three at once. for each pooled element it
+   regenerates the dropout mask (from the random number state saved
+   at forward, jumping to the sample; dropout_keep), and if kept and the ReLU input
+   at the argmax is not negative, scale * gp goes to the argmax of
+   gy, the gradient the producer's backward reads; all other elements
+   of gy are zero. S = 1 means no pooling (relu3 and dropout2 of fc1).
+   the values are bitwise the same as those of the separate layers.
+   samples are independent, so they are split among threads.
+ */
+#pragma once
+
+#include <string.h>
+#include "mnist_util.h"
+#include "tensor.h"
+#include "relu.h"
+#include "max_pooling.h"
+#include "dropout.h"
+
+/**
+   @brief the gradient wrt the output of a layer, made from the
+   gradient wrt the output of the ReLU -> SxS max pooling -> dropout
+   after it
+   @param (maxB) the maximum number of samples
+   @param (C) channels of the output of the layer
+   @param (H) height of the output of the layer
+   @param (W) width of the output of the layer
+   @param (S) pooling factor (1 : no pooling)
+*/
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t S>
+struct grad_route {
+  cmdline_opt opt;              /**< command line option */
+  logger * lgr;                 /**< logger */
+  tensor<real,maxB,C,H,W> * relu_x; /**< input of the ReLU (the output of the layer) */
+  tensor<idx_t,maxB,C,H/S,W/S> * argmax_i; /**< rows max pooling took each output from (null when S == 1) */
+  tensor<idx_t,maxB,C,H/S,W/S> * argmax_j; /**< columns max pooling took each output from (null when S == 1) */
+  uint64_t drop_state;          /**< random number state of dropout at the last forward */
+  real drop_ratio;              /**< drop probability of dropout */
+  /**
+     @brief initialize
+     @param (opt) command line options
+     @param (lgr) logger
+  */
+  void init(cmdline_opt opt, logger * lgr) {
+    this->opt = opt;
+    this->lgr = lgr;
+    relu_x = 0;
+    argmax_i = argmax_j = 0;
+    drop_state = 0;
+    drop_ratio = 0;
+  }
+  /**
+     @brief take the state of the layers after the last forward
+     @param (relu) the ReLU right after the layer
+     @param (pool) the max pooling after it (null when S == 1)
+     @param (drop) the dropout after them (null when the consumer of
+     pooled values already applied it to gp; --fuse-dropout)
+  */
+  void set(Relu<maxB,C,H,W>& relu, MaxPooling2D<maxB,C,H,W,S> * pool, Dropout<maxB,C,H/S,W/S> * drop) {
+    relu_x = relu.x_ptr;
+    argmax_i = (pool ? &pool->argmax_i : 0);
+    argmax_j = (pool ? &pool->argmax_j : 0);
+    drop_state = (drop ? drop->state_forward : 0);
+    drop_ratio = (drop ? drop->drop_ratio : 0);
+  }
+  /**
+     @brief the cost of routing B samples (layer_cost)
+     @param (B) the number of samples
+     @details a multiply per element of gp; gy is written once,
+     gp and the argmax read once and x read at the argmax only
+  */
+  static constexpr layer_cost cost(idx_t B) {
+    return layer_cost{ (uint64_t)B * C * (H/S) * (W/S),
+                       (uint64_t)sizeof(real) * B * C * (H * W + 2 * (H/S) * (W/S))
+                       + (S > 1 ? 2 * (uint64_t)sizeof(idx_t) * B * C * (H/S) * (W/S) : 0) };
+  }
+  /**
+     @brief route the gradient of sample s
+     @param (gp) gradient wrt the output of dropout
+     @param (s) the sample
+     @param (gy) gradient wrt the output of the layer (output)
+     @details gy is written row by row, each element once: for a row
+     of pooled elements, the dropout mask gives v (scale * gp or 0),
+     and each of the S rows under it gets v where the argmax is and
+     the ReLU input is not negative, 0 elsewhere. there is no zero
+     fill followed by a scatter, nor branches on the data (the sign
+     of the ReLU input is as good as random). on x86, a pooled row
+     that fits a vector is spread to the S rows by permutes.
+  */
+  void route_sample(tensor<real,maxB,C,H/S,W/S>& gp, idx_t s, tensor<real,maxB,C,H,W>& gy) {
+    const idx_t PH = H / S, PW = W / S;
+    unsigned char keep[C * PH * PW + L]; /* + L : rows are read a vector at a time */
+    if (drop_ratio > 0) {
+      rnd_gen_t rg;
+      rg.seed(drop_state);
+      rg.skip((uint64_t)s * C * PH * PW);
+      dropout_keep(rg, drop_ratio, C * PH * PW, keep);
+    } else {
+      memset(keep, 1, C * PH * PW);
+    }
+    const real scale = 1.0 / (1 - drop_ratio);
+    real v[PW];
+    idx_t jq[W + L];              /* the pooled column of each column */
+    for (idx_t q = 0; q < W + L; q++) jq[q] = q / S;
+    for (idx_t c = 0; c < C; c++) {
+      const real * x = &relu_x->w[s][c][0][0];
+      real * g = &gy.w[s][c][0][0];
+      for (idx_t i = 0; i < PH; i++) {
+        const unsigned char * kp = keep + (c * PH + i) * PW;
+        if (S == 1) {
+          for (idx_t j = 0; j < PW; j++) {
+            v[j] = (kp[j] ? scale * gp(s,c,i,j) : (real)0);
+          }
+          for (idx_t j = 0; j < PW; j++) {
+            g[i * W + j] = (x[i * W + j] >= 0 ? v[j] : 0);
+          }
+          continue;
+        }
+        const idx_t * ai = &argmax_i->w[s][c][i][0];
+        const idx_t * aj = &argmax_j->w[s][c][i][0];
+#ifndef __ARM_64BIT_STATE
+        if (PW <= L && sizeof(idx_t) == 4) {
+          /* a pooled row fits a vector; spread ai, aj and v to the
+             S * PW elements of a row by permutes */
+          const __mmask16 pm = (__mmask16)((1u << PW) - 1);
+          const __m512i vai = _mm512_maskz_loadu_epi32(pm, ai);
+          const __m512i vaj = _mm512_maskz_loadu_epi32(pm, aj);
+          const __m512i vk = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)kp));
+          const __mmask16 km = pm & _mm512_test_epi32_mask(vk, vk);
+          const __m512 vv = _mm512_maskz_mul_ps(km, _mm512_set1_ps(scale),
+                                                _mm512_maskz_loadu_ps(km, &gp.w[s][c][i][0]));
+          const __m512i iota = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+          for (idx_t di = 0; di < S; di++) {
+            const idx_t r = S * i + di;
+            const __m512i vr = _mm512_set1_epi32(r);
+            for (idx_t q = 0; q < W; q += L) {
+              const __mmask16 m = (q + L <= W ? (__mmask16)0xffff : (__mmask16)((1u << (W - q)) - 1));
+              const __m512i vq = _mm512_add_epi32(iota, _mm512_set1_epi32(q));
+              const __m512i vj = _mm512_loadu_si512((const void *)(jq + q));
+              const __mmask16 at = _mm512_cmpeq_epi32_mask(_mm512_permutexvar_epi32(vj, vai), vr)
+                & _mm512_cmpeq_epi32_mask(_mm512_permutexvar_epi32(vj, vaj), vq)
+                & _mm512_cmp_ps_mask(_mm512_maskz_loadu_ps(m, x + r * W + q), _mm512_setzero_ps(), _CMP_GE_OQ)
+                & _mm512_cmplt_epi32_mask(vq, _mm512_set1_epi32(S * PW));
+              _mm512_mask_storeu_ps(g + r * W + q, m, _mm512_maskz_mov_ps(at, _mm512_permutexvar_ps(vj, vv)));
+            }
+          }
+          continue;
+        }
+#endif
+        for (idx_t j = 0; j < PW; j++) {
+          v[j] = (kp[j] ? scale * gp(s,c,i,j) : (real)0);
+        }
+        for (idx_t di = 0; di < S; di++) {
+          const idx_t r = S * i + di;
+          for (idx_t j = 0; j < PW; j++) {
+            for (idx_t dj = 0; dj < S; dj++) {
+              const idx_t q = r * W + S * j + dj;
+              const int at = (ai[j] == r) & (aj[j] == S * j + dj) & (x[q] >= 0);
+              g[q] = (at ? v[j] : 0);
+            }
+          }
+          for (idx_t q = r * W + S * PW; q < (r + 1) * W; q++) g[q] = 0;
+        }
+      }
+      for (idx_t q = S * PH * W; q < H * W; q++) g[q] = 0;
+    }
+  }
+  /**
+     @brief route the gradient of all samples (cpu algorithms)
+     @param (gp) gradient wrt the output of dropout
+     @param (gy) gradient wrt the output of the layer (output)
+     @return gy
+  */
+  tensor<real,maxB,C,H,W>& backward(tensor<real,maxB,C,H/S,W/S>& gp, tensor<real,maxB,C,H,W>& gy) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    const idx_t B = gp.n0;
+    gy.set_n0(B);
+    const int par = (opt.algo != algo_cpu_base);
+    #pragma omp parallel for schedule(static) if(par)
+    for (idx_t s = 0; s < B; s++) {
+      route_sample(gp, s, gy);
+    }
+    (void)par;
+    tsc_t t1 = get_tsc();
+    log_cost(cost(B));
+    log_end_fun(lgr, t0, t1);
+    return gy;
+  }
+};
+
+/**
+   @brief compare grad_route with backward of the separate layers
+   and time both
+   @return 1 if the results are bitwise the same
+*/
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t S>
+static int grad_route_check(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, idx_t B, int reps) {
+  typedef MaxPooling2D<maxB,C,H,W,S> pool_t;
+  Relu<maxB,C,H,W> * relu = new Relu<maxB,C,H,W>();
+  pool_t * pool = (S > 1 ? new pool_t() : 0);
+  Dropout<maxB,C,H/S,W/S> * drop = new Dropout<maxB,C,H/S,W/S>();
+  tensor<real,maxB,C,H,W> * x = new tensor<real,maxB,C,H,W>();
+  tensor<real,maxB,C,H/S,W/S> * gp = new tensor<real,maxB,C,H/S,W/S>();
+  tensor<real,maxB,C,H,W> * gy = new tensor<real,maxB,C,H,W>();
+  grad_route<maxB,C,H,W,S> r;
+  relu->init(opt, lgr, rg, ReluCfg());
+  if (pool) pool->init(opt, lgr, rg, MaxPooling2DCfg());
+  drop->init(opt, lgr, rg, DropoutCfg{ 0.25, opt.dropout_seed_1 });
+  r.init(opt, lgr);
+  x->init_uniform(B, rg, -1.0, 1.0);
+  /* exact zeros, which ReLU passes the gradient of */
+  for (idx_t s = 0; s < B; s++) (*x)(s,0,0,0) = 0;
+  gp->init_uniform(B, rg, -1.0, 1.0);
+  /* forward; max pooling and dropout take the output of ReLU */
+  tensor<real,maxB,C,H,W>& x1 = relu->forward(*x, 1);
+  if (pool) {
+    drop->forward(pool->forward(x1, 1), 1);
+  } else {
+    drop->forward(*(tensor<real,maxB,C,H/S,W/S> *)&x1, 1);
+  }
+  const long state = drop->rg.get_state();
+  double ms[2] = { 0.0, 0.0 };
+  tensor<real,maxB,C,H,W> * ref = 0;
+  for (int r_ = 0; r_ < reps; r_++) {
+    struct timespec ts0, ts1, ts2;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    tensor<real,maxB,C,H/S,W/S>& g5 = drop->backward(*gp);
+    ref = (pool ? &relu->backward(pool->backward(g5)) : &relu->backward(*(tensor<real,maxB,C,H,W> *)&g5));
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    r.set(*relu, pool, drop);
+    r.backward(*gp, *gy);
+    clock_gettime(CLOCK_MONOTONIC, &ts2);
+    ms[0] += (ts1.tv_sec - ts0.tv_sec) * 1.0e3 + (ts1.tv_nsec - ts0.tv_nsec) * 1.0e-6;
+    ms[1] += (ts2.tv_sec - ts1.tv_sec) * 1.0e3 + (ts2.tv_nsec - ts1.tv_nsec) * 1.0e-6;
+  }
+  int same = (memcmp(&ref->w[0][0][0][0], &gy->w[0][0][0][0], sizeof(real) * B * C * H * W) == 0);
+  /* the generator of dropout is left where forward left it */
+  same = same && drop->rg.get_state() == state;
+  printf("C=%d H=%d W=%d S=%d, %d samples: separate %.3f ms, routed %.3f ms, %s\n",
+         (int)C, (int)H, (int)W, (int)S, (int)B, ms[0] / reps, ms[1] / reps,
+         (same ? "bitwise same" : "DIFFER"));
+  delete relu; delete pool; delete drop; delete x; delete gp; delete gy;
+  return same;
+}
+
+/**
+   @brief entry point of this header file
+   @details if this header file is included from
+   a main C++ file and define grad_route_main to be main
+   (e.g., with -Dgrad_route_main=main), then this
+   function becomes th main function of the executable.
+   in the shapes of conv2 (ReLU, 2x2 max pooling, dropout) and
+   fc1 (ReLU, dropout) of MNIST, it checks grad_route gives bitwise
+   the same gradient as backward of the separate layers and
+   reports time per call of both.
+*/
+int grad_route_main(int argc, char ** argv) {
+  cmdline_opt opt = parse_args(argc, argv);
+  if (opt.error || opt.help) usage(argv[0]);
+  const idx_t maxB = MAX_BATCH_SIZE;
+  const idx_t B = min_i(maxB, opt.batch_size);
+  logger lgr;
+  lgr.start_log(opt);
+  rnd_gen_t rg;
+  rg.seed(opt.weight_seed);
+  int ok = 1;
+  ok = grad_route_check<maxB,64,24,24,2>(opt, &lgr, rg, B, 20) && ok;
+  ok = grad_route_check<maxB,128,1,1,1>(opt, &lgr, rg, B, 20) && ok;
+  lgr.end_log();
+  printf("%s\n", ok ? "OK" : "NG");
+  return ok ? 0 : 1;
+}
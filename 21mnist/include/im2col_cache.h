@@ -0,0 +1,233 @@
+/**
+   @file im2col_cache.h
+   @brief precomputed input patches of the first convolution
+   (--conv1-patches u8/fp16)
+   @details the network input never changes, yet conv1 gathers
+   the same KxK neighborhoods of each image in every epoch. with
+   --conv1-patches, the dataset packs them once at load time
+   (im2col), one panel of IC*K*K rows x (H-K+1)*(W-K+1) columns
+   per image (row k = (ic*K+di)*K+dj, column p = i*(W-K+1)+j holds
+   x(ic,i+di,j+dj)), each row padded to a multiple of L columns.
+
+   - u8 : the original pixel bytes; the value is scale * byte + shift
+     (the normalization of mnist_data.h), so it is exact
+   - fp16 : normalized values in half precision
+
+   get_data copies the panels of a mini batch into conv_patches
+   next to x, and conv1 forward and its gw/gb then run as dense
+   matrix products over the panels (Convolution2D::forward_patches
+   and backward_patches), with no gathering of neighborhoods.
+
+   the cost is memory: IC*K*K*(H-K+1)*(W-K+1) bytes (u8) or twice as
+   much (fp16) per image, against IC*H*W floats of the image itself
+   (about 6KB or 12KB against 3KB for MNIST); mnist_dataset logs it.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include "mnist_util.h"
+#include "tensor.h"
+#include "feature_store.h"
+
+/**
+   @brief formats of patches
+*/
+typedef enum {
+  patch_fmt_none,               /**< no patches (gather from x) */
+  patch_fmt_u8,                 /**< pixel bytes */
+  patch_fmt_fp16,               /**< half precision */
+  patch_fmt_invalid,            /**< invalid */
+} patch_fmt_t;
+
+/**
+   @brief parse the name of a format (--conv1-patches)
+*/
+__attribute__((unused))
+static patch_fmt_t parse_patch_fmt(const char * s) {
+  if (strcmp(s, "none") == 0) return patch_fmt_none;
+  if (strcmp(s, "u8") == 0) return patch_fmt_u8;
+  if (strcmp(s, "fp16") == 0) return patch_fmt_fp16;
+  return patch_fmt_invalid;
+}
+
+/**
+   @brief a scratch buffer of (at least) n reals a panel is unpacked into
+   @details it only grows and is per thread, like par_reduce_buf
+*/
+__attribute__((unused))
+static real * conv_patch_buf(size_t n) {
+  static thread_local real * buf = 0;
+  static thread_local size_t cap = 0;
+  if (cap < n) {
+    free(buf);
+    buf = (real *)malloc(sizeof(real) * n);
+    if (!buf) { perror("malloc"); bail(); }
+    cap = n;
+  }
+  return buf;
+}
+
+/**
+   @brief patches (im2col panels) of a mini batch, the input
+   of Convolution2D<maxB,IC,H,W,K,OC>
+*/
+template<idx_t maxB,idx_t IC,idx_t H,idx_t W,idx_t K>
+struct conv_patches {
+  static const idx_t OH = H - K + 1;          /**< output height */
+  static const idx_t OW = W - K + 1;          /**< output width */
+  static const idx_t P = OH * OW;             /**< columns (output pixels) */
+  static const idx_t PP = (P + L - 1) / L * L; /**< columns padded to a multiple of L */
+  static const idx_t KK = IC * K * K;         /**< rows */
+  patch_fmt_t fmt;              /**< format of elements */
+  idx_t n0;                     /**< the number of images */
+  const void * x;               /**< the input tensor they were made for (conv1 checks it) */
+  real scale;                   /**< value = scale * byte + shift (u8) */
+  real shift;                   /**< ditto */
+  unsigned char w[maxB][KK * PP * 2]; /**< panels (bytes of fp16 elements; the first half for u8) */
+  /**
+     @brief bytes of the panel of an image
+  */
+  static size_t item_bytes(patch_fmt_t fmt) {
+    return (size_t)KK * PP * (fmt == patch_fmt_fp16 ? 2 : 1);
+  }
+  /**
+     @brief pack the panel of an image
+     @param (fmt) format
+     @param (rgb) pixel bytes of the image
+     @param (img) normalized pixels of the image
+     @param (out) item_bytes(fmt) bytes the panel goes to
+  */
+  static void encode(patch_fmt_t fmt, const unsigned char (&rgb)[IC][H][W],
+                     const real (&img)[IC][H][W], unsigned char * out) {
+    memset(out, 0, item_bytes(fmt));
+    uint16_t * h = (uint16_t *)out;
+    for (idx_t ic = 0; ic < IC; ic++) {
+      for (idx_t di = 0; di < K; di++) {
+        for (idx_t dj = 0; dj < K; dj++) {
+          const idx_t k = (ic * K + di) * K + dj;
+          for (idx_t i = 0; i < OH; i++) {
+            for (idx_t j = 0; j < OW; j++) {
+              const idx_t p = i * OW + j;
+              if (fmt == patch_fmt_u8) {
+                out[k * PP + p] = rgb[ic][i + di][j + dj];
+              } else {
+                h[k * PP + p] = feature_float_to_half((float)img[ic][i + di][j + dj]);
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+  /**
+     @brief 1 if these are the patches of x (of n images)
+  */
+  int matches(const void * x, idx_t n) const {
+    return fmt != patch_fmt_none && this->x == x && n0 == n;
+  }
+  /**
+     @brief unpack the panel of image s into buf[KK][PP] (floats;
+     padding columns become 0)
+  */
+  void decode(idx_t s, real * buf) const {
+    const unsigned char * u = w[s];
+    const uint16_t * h = (const uint16_t *)w[s];
+#ifdef __ARM_64BIT_STATE
+    for (idx_t e = 0; e < KK * PP; e++) {
+      buf[e] = (fmt == patch_fmt_u8 ? scale * u[e] + shift : (real)feature_half_to_float(h[e]));
+    }
+#else
+    const __m512 vs = _mm512_set1_ps(scale), vt = _mm512_set1_ps(shift);
+    for (idx_t e = 0; e < KK * PP; e += L) {
+      __m512 v;
+      if (fmt == patch_fmt_u8) {
+        __m512i q = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(u + e)));
+        v = _mm512_fmadd_ps(_mm512_cvtepi32_ps(q), vs, vt);
+      } else {
+        v = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(h + e)));
+      }
+      _mm512_storeu_ps(buf + e, v);
+    }
+    /* u8 padding decodes to shift; zero it so padding contributes nothing */
+    if (fmt == patch_fmt_u8) {
+      for (idx_t k = 0; k < KK; k++) {
+        for (idx_t p = P; p < PP; p++) buf[k * PP + p] = 0;
+      }
+    }
+#endif
+  }
+};
+
+/**
+   @brief entry point of this header file
+   @details if this header file is included from
+   a main C++ file and define im2col_cache_main to be main
+   (e.g., with -Dim2col_cache_main=main), then this
+   function becomes th main function of the executable.
+   it packs random 28x28 images in both formats, unpacks them
+   and checks each element against the pixel it comes from
+   (exact for u8, within half precision for fp16) and
+   that padding is zero.
+*/
+int im2col_cache_main(int argc, char ** argv) {
+  (void)argc;
+  (void)argv;
+  const idx_t maxB = 4, IC = 1, H = 28, W = 28, K = 3;
+  typedef conv_patches<maxB,IC,H,W,K> cp_t;
+  cp_t * cp = new cp_t;
+  cp->x = 0;
+  static unsigned char rgb[maxB][IC][H][W];
+  static real img[maxB][IC][H][W];
+  const real mean = 0.1307, std = 0.3081;
+  rnd_gen_t rg;
+  rg.seed(1234);
+  for (idx_t s = 0; s < maxB; s++) {
+    for (idx_t i = 0; i < H; i++) {
+      for (idx_t j = 0; j < W; j++) {
+        rgb[s][0][i][j] = (unsigned char)(rg.rand01() * 256);
+        img[s][0][i][j] = ((rgb[s][0][i][j] / 255.0) - mean) / std;
+      }
+    }
+  }
+  real * buf = (real *)malloc(sizeof(real) * cp_t::KK * cp_t::PP);
+  int ok = 1;
+  for (int f = patch_fmt_u8; f <= patch_fmt_fp16; f++) {
+    patch_fmt_t fmt = (patch_fmt_t)f;
+    cp->fmt = fmt;
+    cp->n0 = maxB;
+    cp->scale = 1.0 / (255.0 * std);
+    cp->shift = -mean / std;
+    double max_err = 0;
+    for (idx_t s = 0; s < maxB; s++) {
+      cp_t::encode(fmt, rgb[s], img[s], cp->w[s]);
+      cp->decode(s, buf);
+      for (idx_t di = 0; di < K; di++) {
+        for (idx_t dj = 0; dj < K; dj++) {
+          const idx_t k = di * K + dj;
+          for (idx_t p = 0; p < cp_t::PP; p++) {
+            real v = buf[k * cp_t::PP + p];
+            if (p >= cp_t::P) {
+              ok = ok && v == 0;
+              continue;
+            }
+            real x = img[s][0][p / cp_t::OW + di][p % cp_t::OW + dj];
+            double e = fabs((double)v - x);
+            max_err = (e > max_err ? e : max_err);
+          }
+        }
+      }
+    }
+    printf("%s: %lu bytes/image (image %lu bytes), max error %.3g\n",
+           (fmt == patch_fmt_u8 ? "u8  " : "fp16"), (unsigned long)cp_t::item_bytes(fmt),
+           (unsigned long)sizeof(img[0]), max_err);
+    ok = ok && max_err < (fmt == patch_fmt_u8 ? 1.0e-5 : 3.0e-3);
+  }
+  ok = ok && cp->matches(cp, maxB) == 0;
+  cp->x = cp;
+  ok = ok && cp->matches(cp, maxB) && !cp->matches(cp, maxB - 1);
+  free(buf);
+  delete cp;
+  printf("%s\n", ok ? "OK" : "NG");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,707 @@
+/**
+   @file infer_server.h
+   @brief a local inference server with dynamic batching, and a load
+   generator for it
+   @details the server listens on a UNIX-domain socket. a client
+   sends one image per request and gets one reply per request, in
+   the order of its requests. a reader thread per connection puts
+   requests into a single queue; a batcher thread takes up to
+   max_batch requests from it, waiting at most max_delay after the
+   oldest of them arrived for more to come, classifies them with a
+   single MNISTInfer::forward and replies to each of them.
+
+   so a lone request is answered after at most max_delay (plus the
+   time to classify it), while many concurrent requests share the
+   cost of a forward pass.
+
+   the load generator opens a number of connections, each of which
+   sends a request and waits for its reply (closed loop), and
+   reports latency seen by clients.
+ */
+#pragma once
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "mnist_util.h"
+#include "mnist_infer.h"
+
+/** @brief bytes of an image in a request (1 x 28 x 28) */
+#define SERVE_IMAGE_BYTES (28 * 28)
+/** @brief maximum number of requests waiting in the queue (more are rejected) */
+#define SERVE_QUEUE_MAX 4096
+/** @brief maximum number of latency samples kept for percentiles */
+#define SERVE_LAT_SAMPLES (1 << 20)
+
+/**
+   @brief a request (client to server)
+*/
+struct serve_req {
+  uint32_t id;                  /**< chosen by the client, returned in the reply */
+  unsigned char px[SERVE_IMAGE_BYTES]; /**< pixels (0-255) */
+};
+
+/**
+   @brief a reply (server to client)
+*/
+struct serve_rep {
+  uint32_t id;                  /**< id of the request */
+  int32_t pred;                 /**< predicted class (-1 if rejected because the queue was full) */
+  uint32_t batch;               /**< the number of requests classified together with it */
+  uint32_t server_us;           /**< time from its arrival to its reply in the server */
+};
+
+/**
+   @brief read exactly sz bytes
+   @return 1 on success, 0 on EOF before any byte, -1 on error or EOF in the middle
+*/
+static int read_full(int fd, void * buf, size_t sz) {
+  size_t done = 0;
+  while (done < sz) {
+    ssize_t n = read(fd, (char *)buf + done, sz - done);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (n == 0) return (done == 0 ? 0 : -1);
+    done += n;
+  }
+  return 1;
+}
+
+/**
+   @brief write exactly sz bytes to a socket (no SIGPIPE if the peer has gone)
+   @return 0 on success, -1 on error
+*/
+static int write_full(int fd, const void * buf, size_t sz) {
+  size_t done = 0;
+  while (done < sz) {
+    ssize_t n = send(fd, (const char *)buf + done, sz - done, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+/**
+   @brief fill a sockaddr_un with path
+   @return 0 on success, -1 if path is too long
+*/
+static int serve_addr(struct sockaddr_un * a, const char * path) {
+  memset(a, 0, sizeof(*a));
+  a->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(a->sun_path)) {
+    fprintf(stderr, "error: socket path too long (%s)\n", path);
+    return -1;
+  }
+  strcpy(a->sun_path, path);
+  return 0;
+}
+
+/**
+   @brief latency samples and their percentiles
+*/
+struct lat_stats {
+  long * v;                     /**< samples (ns) */
+  long n;                       /**< samples recorded */
+  long cap;                     /**< samples kept (the first cap of them) */
+  long sum;                     /**< sum of all samples */
+  /**
+     @brief initialize with no samples
+  */
+  void init(long cap) {
+    this->cap = cap;
+    v = (long *)malloc(sizeof(long) * cap);
+    n = 0;
+    sum = 0;
+  }
+  /**
+     @brief record a sample
+  */
+  void add(long x) {
+    if (n < cap) v[n] = x;
+    n++;
+    sum += x;
+  }
+  /**
+     @brief compare two longs (for qsort)
+  */
+  static int cmp(const void * a, const void * b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x < y ? -1 : (x > y ? 1 : 0));
+  }
+  /**
+     @brief print mean and p50/p90/p99/max in us
+  */
+  void report(const char * label) {
+    long m = (n < cap ? n : cap);
+    if (m == 0) {
+      printf("%s [us]: no samples\n", label);
+      return;
+    }
+    qsort(v, m, sizeof(long), cmp);
+    printf("%s [us]: mean %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+           label, sum * 1.0e-3 / n,
+           pct(m, 50) * 1.0e-3, pct(m, 90) * 1.0e-3,
+           pct(m, 99) * 1.0e-3, v[m - 1] * 1.0e-3);
+  }
+  /**
+     @brief the p-th percentile of m sorted samples
+  */
+  long pct(long m, double p) {
+    return v[(long)(p / 100.0 * (m - 1) + 0.5)];
+  }
+  /**
+     @brief free samples
+  */
+  void fini() {
+    free(v);
+  }
+};
+
+/**
+   @brief set (e.g., by a SIGINT handler) to stop the server
+*/
+static volatile sig_atomic_t serve_interrupted = 0;
+
+/**
+   @brief a client connection of the server
+   @details freed when the reader has seen EOF and the batcher
+   has replied to all its requests (refs drops to zero)
+*/
+struct serve_conn {
+  int fd;                       /**< the socket */
+  int refs;                     /**< the reader + requests in the queue or in a batch */
+  pthread_mutex_t wmu;          /**< serializes replies */
+  void * server;                /**< the server it belongs to */
+};
+
+/**
+   @brief the inference server
+   @param (maxB) the maximum batch size the network is allocated for
+   @param (C) number of channels in the input
+   @param (H) image height
+   @param (W) image width
+   @param (nC) number of classes
+*/
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC>
+struct infer_server {
+  typedef MNISTInferWeights<C,H,W,nC> weights_t;
+  typedef MNISTInfer<maxB,C,H,W,nC> infer_t;
+  /**
+     @brief a request waiting in the queue
+  */
+  struct pending {
+    serve_conn * c;             /**< connection to reply to */
+    long arrival;               /**< time it was read */
+    serve_req req;              /**< the request */
+  };
+  infer_t * net;                /**< the network (buffers for maxB images) */
+  const char * path;            /**< the socket path */
+  int listen_fd;                /**< the listening socket */
+  idx_t max_batch;              /**< maximum requests classified at a time */
+  long max_delay_ns;            /**< maximum time the oldest request waits for others */
+  long max_requests;            /**< stop after this many requests (0 : never) */
+  pending * q;                  /**< the queue (a ring buffer of SERVE_QUEUE_MAX) */
+  long q_head;                  /**< index of the oldest request in q */
+  long q_n;                     /**< number of requests in q */
+  pthread_mutex_t mu;           /**< protects the queue, connections and stats */
+  pthread_cond_t cv;            /**< signals a new request or stop */
+  volatile int stop;            /**< 1 when the server should stop */
+  pthread_t batcher;            /**< the batcher thread */
+  /* stats */
+  long n_conns;                 /**< connections accepted */
+  long n_requests;              /**< requests classified */
+  long n_rejected;              /**< requests rejected (queue full) */
+  long n_batches;               /**< forward passes */
+  long batch_hist[maxB + 1];    /**< batch_hist[b] = number of batches of size b */
+  long compute_ns;              /**< time spent in forward passes */
+  long t_first;                 /**< arrival of the first request */
+  long t_last;                  /**< reply to the last request */
+  lat_stats wait;               /**< arrival to the start of its forward pass */
+  lat_stats lat;                /**< arrival to the reply */
+
+  /**
+     @brief create the listening socket and the network
+     @param (wt) weights (shared, not copied)
+     @param (path) the socket path (an existing file is removed)
+     @param (max_batch) the maximum batch size (<= maxB)
+     @param (max_delay_us) the maximum time the oldest request waits for others
+     @param (max_requests) stop after this many requests (0 : never)
+     @return 0 on success, -1 on failure
+  */
+  int init(const weights_t * wt, const char * path, idx_t max_batch,
+           long max_delay_us, long max_requests) {
+    this->path = path;
+    this->max_batch = max_batch;
+    this->max_delay_ns = max_delay_us * 1000L;
+    this->max_requests = max_requests;
+    struct sockaddr_un a;
+    if (serve_addr(&a, path) != 0) return -1;
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd == -1) { perror("socket"); return -1; }
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *)&a, sizeof(a)) == -1) {
+      perror(path); close(listen_fd); return -1;
+    }
+    if (listen(listen_fd, 128) == -1) {
+      perror("listen"); close(listen_fd); return -1;
+    }
+    net = new_lazy<infer_t>();
+    net->init(wt);
+    q = (pending *)malloc(sizeof(pending) * SERVE_QUEUE_MAX);
+    q_head = q_n = 0;
+    pthread_mutex_init(&mu, 0);
+    pthread_cond_init(&cv, 0);
+    stop = 0;
+    n_conns = n_requests = n_rejected = n_batches = 0;
+    for (idx_t b = 0; b <= maxB; b++) batch_hist[b] = 0;
+    compute_ns = 0;
+    t_first = t_last = 0;
+    wait.init(SERVE_LAT_SAMPLES);
+    lat.init(SERVE_LAT_SAMPLES);
+    return 0;
+  }
+  /**
+     @brief the body of the batcher thread
+  */
+  static void * batcher_thread(void * arg) {
+    ((infer_server *)arg)->batcher_loop();
+    return 0;
+  }
+  /**
+     @brief the body of a reader thread
+  */
+  static void * reader_thread(void * arg) {
+    serve_conn * c = (serve_conn *)arg;
+    ((infer_server *)c->server)->reader(c);
+    return 0;
+  }
+  /**
+     @brief start the batcher thread
+  */
+  void start() {
+    pthread_create(&batcher, 0, batcher_thread, this);
+  }
+  /**
+     @brief accept connections until stopped (by a signal or max_requests)
+     @details a detached reader thread serves each connection
+  */
+  void run() {
+    while (!stop && !serve_interrupted) {
+      struct pollfd p = { listen_fd, POLLIN, 0 };
+      int r = poll(&p, 1, 100);
+      if (r <= 0) continue;
+      int fd = accept(listen_fd, 0, 0);
+      if (fd == -1) continue;
+      serve_conn * c = (serve_conn *)malloc(sizeof(serve_conn));
+      c->fd = fd;
+      c->refs = 1;
+      c->server = this;
+      pthread_mutex_init(&c->wmu, 0);
+      pthread_mutex_lock(&mu);
+      n_conns++;
+      pthread_mutex_unlock(&mu);
+      pthread_t th;
+      if (pthread_create(&th, 0, reader_thread, c) != 0) {
+        close(fd); free(c); continue;
+      }
+      pthread_detach(th);
+    }
+  }
+  /**
+     @brief drop a reference to a connection (mu must be held)
+  */
+  void release(serve_conn * c) {
+    if (--c->refs == 0) {
+      close(c->fd);
+      pthread_mutex_destroy(&c->wmu);
+      free(c);
+    }
+  }
+  /**
+     @brief send a reply
+  */
+  void reply(serve_conn * c, uint32_t id, int32_t pred, uint32_t batch, long dt) {
+    serve_rep r = { id, pred, batch, (uint32_t)(dt / 1000) };
+    pthread_mutex_lock(&c->wmu);
+    /* a client that has gone just does not get its reply */
+    (void)write_full(c->fd, &r, sizeof(r));
+    pthread_mutex_unlock(&c->wmu);
+  }
+  /**
+     @brief read requests of a connection and put them in the queue
+  */
+  void reader(serve_conn * c) {
+    while (1) {
+      pending p;
+      if (read_full(c->fd, &p.req, sizeof(p.req)) != 1) break;
+      p.c = c;
+      p.arrival = get_tsc().ns;
+      pthread_mutex_lock(&mu);
+      int full = (q_n == SERVE_QUEUE_MAX);
+      if (!full) {
+        q[(q_head + q_n) % SERVE_QUEUE_MAX] = p;
+        q_n++;
+        c->refs++;
+        if (t_first == 0) t_first = p.arrival;
+        pthread_cond_signal(&cv);
+      } else {
+        n_rejected++;
+      }
+      pthread_mutex_unlock(&mu);
+      if (full) reply(c, p.req.id, -1, 0, 0);
+    }
+    pthread_mutex_lock(&mu);
+    release(c);
+    pthread_mutex_unlock(&mu);
+  }
+  /**
+     @brief wait until the condition variable is signaled or time passes deadline (ns)
+  */
+  void wait_until(long deadline) {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000L;
+    ts.tv_nsec = deadline % 1000000000L;
+    pthread_cond_timedwait(&cv, &mu, &ts); /* get_tsc is CLOCK_REALTIME, like the default cv */
+  }
+  /**
+     @brief take batches from the queue, classify and reply
+  */
+  void batcher_loop() {
+    pending * batch = (pending *)malloc(sizeof(pending) * max_batch);
+    pthread_mutex_lock(&mu);
+    while (1) {
+      while (!stop && q_n == 0) pthread_cond_wait(&cv, &mu);
+      if (q_n == 0) break;      /* stopped and drained */
+      /* wait for more requests until the oldest one has waited max_delay */
+      long deadline = q[q_head].arrival + max_delay_ns;
+      while (!stop && q_n < max_batch && get_tsc().ns < deadline) {
+        wait_until(deadline);
+      }
+      idx_t B = (q_n < max_batch ? q_n : max_batch);
+      for (idx_t i = 0; i < B; i++) {
+        batch[i] = q[q_head];
+        q_head = (q_head + 1) % SERVE_QUEUE_MAX;
+      }
+      q_n -= B;
+      pthread_mutex_unlock(&mu);
+      /* classify */
+      tsc_t t0 = get_tsc();
+      for (idx_t i = 0; i < B; i++) {
+        net->set_image(i, batch[i].req.px);
+      }
+      net->forward(B);
+      tsc_t t1 = get_tsc();
+      for (idx_t i = 0; i < B; i++) {
+        reply(batch[i].c, batch[i].req.id, net->pred(i), B, get_tsc().ns - batch[i].arrival);
+      }
+      tsc_t t2 = get_tsc();
+      /* stats */
+      pthread_mutex_lock(&mu);
+      for (idx_t i = 0; i < B; i++) {
+        wait.add(t0.ns - batch[i].arrival);
+        lat.add(t2.ns - batch[i].arrival);
+        release(batch[i].c);
+      }
+      n_requests += B;
+      n_batches++;
+      batch_hist[B]++;
+      compute_ns += t1.ns - t0.ns;
+      t_last = t2.ns;
+      if (max_requests > 0 && n_requests >= max_requests) stop = 1;
+    }
+    pthread_mutex_unlock(&mu);
+    free(batch);
+  }
+  /**
+     @brief stop the batcher (after it drains the queue) and close the socket
+  */
+  void fini() {
+    pthread_mutex_lock(&mu);
+    stop = 1;
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mu);
+    pthread_join(batcher, 0);
+    close(listen_fd);
+    unlink(path);
+  }
+  /**
+     @brief print stats
+  */
+  void report() {
+    printf("connections: %ld, requests: %ld, rejected: %ld, batches: %ld (mean size %.2f)\n",
+           n_conns, n_requests, n_rejected, n_batches,
+           n_batches ? (double)n_requests / n_batches : 0.0);
+    printf("batch sizes:");
+    for (idx_t b = 1; b <= max_batch; b++) {
+      if (batch_hist[b]) printf(" %d:%ld", b, batch_hist[b]);
+    }
+    printf("\n");
+    if (n_requests > 0) {
+      double elapsed = (t_last - t_first) * 1.0e-9;
+      printf("throughput: %.1f requests/sec (forward %.1f%% of the time, %.1f us per batch)\n",
+             elapsed > 0 ? n_requests / elapsed : 0.0,
+             elapsed > 0 ? 100.0 * compute_ns * 1.0e-9 / elapsed : 0.0,
+             compute_ns * 1.0e-3 / n_batches);
+    }
+    wait.report("queueing delay");
+    lat.report("server latency");
+  }
+  /**
+     @brief free everything
+  */
+  void free_all() {
+    wait.fini();
+    lat.fini();
+    free(q);
+    delete_lazy(net);
+  }
+};
+
+/**
+   @brief closed-loop load generator
+   @details n_conns connections send n_requests requests in total;
+   request k carries image k % n_images and is sent by
+   connection k % n_conns after the reply to its previous request
+*/
+struct infer_loadgen {
+  const char * path;            /**< the socket path */
+  int n_conns;                  /**< concurrent connections */
+  long n_requests;              /**< requests in total */
+  const unsigned char * images; /**< n_images images of SERVE_IMAGE_BYTES */
+  long n_images;                /**< number of images */
+  int * preds;                  /**< preds[k] = reply to request k (-1 : rejected, -2 : no reply) */
+  uint32_t * batches;           /**< batches[k] = batch size of request k */
+  lat_stats lat;                /**< latency seen by clients */
+  long n_errors;                /**< connections that failed */
+  long elapsed_ns;              /**< time from the first request to the last reply */
+  pthread_mutex_t mu;           /**< protects lat and n_errors */
+  /**
+     @brief a connection
+  */
+  struct client {
+    infer_loadgen * g;          /**< the load generator */
+    int j;                      /**< the index of the connection */
+  };
+  /**
+     @brief set parameters
+  */
+  void init(const char * path, int n_conns, long n_requests,
+            const unsigned char * images, long n_images) {
+    this->path = path;
+    this->n_conns = n_conns;
+    this->n_requests = n_requests;
+    this->images = images;
+    this->n_images = n_images;
+    preds = (int *)malloc(sizeof(int) * (n_requests > 0 ? n_requests : 1));
+    batches = (uint32_t *)malloc(sizeof(uint32_t) * (n_requests > 0 ? n_requests : 1));
+    for (long k = 0; k < n_requests; k++) {
+      preds[k] = -2;
+      batches[k] = 0;
+    }
+    lat.init(SERVE_LAT_SAMPLES);
+    n_errors = 0;
+    elapsed_ns = 0;
+    pthread_mutex_init(&mu, 0);
+  }
+  /**
+     @brief the body of a client thread
+  */
+  static void * client_thread(void * arg) {
+    client * cl = (client *)arg;
+    cl->g->client_loop(cl->j);
+    return 0;
+  }
+  /**
+     @brief connect to the server
+     @return the socket or -1
+  */
+  int connect_server() {
+    struct sockaddr_un a;
+    if (serve_addr(&a, path) != 0) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) { perror("socket"); return -1; }
+    if (connect(fd, (struct sockaddr *)&a, sizeof(a)) == -1) {
+      perror(path); close(fd); return -1;
+    }
+    return fd;
+  }
+  /**
+     @brief send requests j, j + n_conns, ... one at a time
+  */
+  void client_loop(int j) {
+    int fd = connect_server();
+    if (fd == -1) {
+      pthread_mutex_lock(&mu);
+      n_errors++;
+      pthread_mutex_unlock(&mu);
+      return;
+    }
+    for (long k = j; k < n_requests; k += n_conns) {
+      serve_req req;
+      req.id = (uint32_t)k;
+      memcpy(req.px, images + (k % n_images) * SERVE_IMAGE_BYTES, SERVE_IMAGE_BYTES);
+      serve_rep rep;
+      tsc_t t0 = get_tsc();
+      if (write_full(fd, &req, sizeof(req)) != 0
+          || read_full(fd, &rep, sizeof(rep)) != 1
+          || rep.id != req.id) {
+        pthread_mutex_lock(&mu);
+        n_errors++;
+        pthread_mutex_unlock(&mu);
+        break;
+      }
+      tsc_t t1 = get_tsc();
+      preds[k] = rep.pred;
+      batches[k] = rep.batch;
+      pthread_mutex_lock(&mu);
+      lat.add(t1.ns - t0.ns);
+      pthread_mutex_unlock(&mu);
+    }
+    close(fd);
+  }
+  /**
+     @brief run all connections to completion
+  */
+  void run() {
+    pthread_t * th = (pthread_t *)malloc(sizeof(pthread_t) * n_conns);
+    client * cl = (client *)malloc(sizeof(client) * n_conns);
+    tsc_t t0 = get_tsc();
+    for (int j = 0; j < n_conns; j++) {
+      cl[j].g = this;
+      cl[j].j = j;
+      pthread_create(&th[j], 0, client_thread, &cl[j]);
+    }
+    for (int j = 0; j < n_conns; j++) {
+      pthread_join(th[j], 0);
+    }
+    tsc_t t1 = get_tsc();
+    elapsed_ns = t1.ns - t0.ns;
+    free(th);
+    free(cl);
+  }
+  /**
+     @brief print stats
+     @param (labels) labels of images (0 if none)
+  */
+  void report(const unsigned char * labels) {
+    long done = 0, rejected = 0, correct = 0, batch_sum = 0;
+    for (long k = 0; k < n_requests; k++) {
+      if (preds[k] == -2) continue;
+      if (preds[k] == -1) {
+        rejected++;
+        continue;
+      }
+      done++;
+      batch_sum += batches[k];
+      if (labels) correct += (preds[k] == labels[k % n_images]);
+    }
+    printf("connections: %d, requests: %ld, replied: %ld, rejected: %ld, errors: %ld\n",
+           n_conns, n_requests, done, rejected, n_errors);
+    printf("throughput: %.1f requests/sec, mean batch size %.2f\n",
+           elapsed_ns > 0 ? lat.n / (elapsed_ns * 1.0e-9) : 0.0,
+           done ? (double)batch_sum / done : 0.0);
+    lat.report("client latency");
+    if (labels && done) {
+      printf("accuracy: %ld/%ld (%.2f%%)\n", correct, done, 100.0 * correct / done);
+    }
+  }
+  /**
+     @brief free everything
+  */
+  void fini() {
+    free(preds);
+    free(batches);
+    lat.fini();
+  }
+};
+
+/**
+   @brief the body of the thread that accepts connections (for the test)
+*/
+template<typename S>
+static void * infer_server_accept_thread(void * arg) {
+  ((S *)arg)->run();
+  return 0;
+}
+
+/**
+   @brief entry point of this header file
+   @param (argc) the number of command line args
+   @param (argv) command line args
+   @details if this header file is included from
+   a main C++ file and define infer_server_main to be main
+   (e.g., with -Dinfer_server_main=main), then this
+   function becomes th main function of the executable.
+   it starts a server with random weights, sends random images
+   from several connections and checks every reply against
+   the prediction of a separate network for that image alone.
+*/
+int infer_server_main(int argc, char ** argv) {
+  cmdline_opt opt = parse_args(argc, argv);
+  if (opt.error || opt.help) usage(argv[0]);
+  const idx_t maxB = 16;
+  const idx_t C = 1;
+  const idx_t H = 28;
+  const idx_t W = 28;
+  const idx_t nC = 10;
+  typedef infer_server<maxB,C,H,W,nC> server_t;
+  rnd_gen_t rg;
+  rg.seed(opt.weight_seed);
+  /* random weights via the training network */
+  logger lgr;
+  lgr.start_log(opt);
+  MNISTCfg cfg = {};
+  MNIST<maxB,C,H,W,nC> * mnist = new_lazy<MNIST<maxB,C,H,W,nC> >();
+  mnist->init(opt, &lgr, rg, cfg);
+  MNISTInferWeights<C,H,W,nC> * wt = new_lazy<MNISTInferWeights<C,H,W,nC> >();
+  copy_infer_weights(*wt, *mnist);
+  /* random images */
+  const long n_images = 100;
+  const long n_requests = 400;
+  const int n_conns = 8;
+  unsigned char * images = (unsigned char *)malloc(n_images * SERVE_IMAGE_BYTES);
+  for (long i = 0; i < n_images * SERVE_IMAGE_BYTES; i++) {
+    images[i] = rg.randi(0, 256);
+  }
+  /* serve them */
+  server_t * sv = (server_t *)calloc(1, sizeof(server_t));
+  if (sv->init(wt, "infer_server_test.sock", maxB, 2000, n_requests) != 0) return 1;
+  sv->start();
+  pthread_t acc;
+  pthread_create(&acc, 0, infer_server_accept_thread<server_t>, sv);
+  infer_loadgen g;
+  g.init("infer_server_test.sock", n_conns, n_requests, images, n_images);
+  g.run();
+  pthread_join(acc, 0);
+  sv->fini();
+  sv->report();
+  g.report(0);
+  /* check against one image at a time */
+  MNISTInfer<maxB,C,H,W,nC> * ref = new_lazy<MNISTInfer<maxB,C,H,W,nC> >();
+  ref->init(wt);
+  long mismatch = 0;
+  for (long k = 0; k < n_requests; k++) {
+    ref->set_image(0, images + (k % n_images) * SERVE_IMAGE_BYTES);
+    ref->forward(1);
+    mismatch += (g.preds[k] != ref->pred(0));
+  }
+  int ok = (mismatch == 0 && g.n_errors == 0 && sv->n_requests == n_requests);
+  printf("mismatches: %ld\n%s\n", mismatch, ok ? "OK" : "NG");
+  g.fini();
+  sv->free_all();
+  free(sv);
+  delete_lazy(ref);
+  free(images);
+  delete_lazy(wt);
+  mnist->fini();
+  delete_lazy(mnist);
+  lgr.end_log();
+  return ok ? 0 : 1;
+}
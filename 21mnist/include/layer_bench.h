@@ -0,0 +1,483 @@
+/**
+   @file layer_bench.h
+   @brief micro benchmarks of each layer for each algorithm
+   @details instantiates every layer of the MNIST network at its
+   real shape, and for each algorithm (algo_t) warms it up and
+   times forward, backward and update (if the layer has weights)
+   many times. each function is reported with the median and the
+   95th percentile latency, and GFLOP/s and GB/s at the median
+   (with the costs layers compute, layer_cost in perf_counters.h).
+
+   results are written as JSON, one result per line, so that
+   runs can be kept for tracking and compared with --diff, which
+   flags functions whose median got slower by more than the
+   noise of the two runs (the gap between the median and the 95th
+   percentile) or --tolerance, whichever is larger.
+
+   algorithms that do not implement a function fall back to
+   cpu_base (or cuda_base) in the layer, so they show the same
+   numbers as those.
+ */
+#pragma once
+
+#include <getopt.h>
+#include "mnist_util.h"
+#include "tensor.h"
+#include "convolution.h"
+#include "linear.h"
+#include "relu.h"
+#include "dropout.h"
+#include "max_pooling.h"
+#include "nll_softmax.h"
+
+/**
+   @brief statistics of a function
+*/
+struct layer_bench_result {
+  char layer[32];               /**< layer name in the network (e.g., conv1) */
+  char algo[32];                /**< algorithm */
+  char phase[16];               /**< forward, backward or update */
+  double median_us;             /**< median latency */
+  double p95_us;                /**< 95th percentile latency */
+  double gflops;                /**< GFLOP/s at the median */
+  double gbs;                   /**< GB/s at the median */
+};
+
+/**
+   @brief options and results of the benchmark
+*/
+struct layer_bench {
+  cmdline_opt opt;              /**< options given to layers (the algorithm) */
+  logger * lgr;                 /**< logger given to layers */
+  rnd_gen_t rg;                 /**< random numbers for weights and inputs */
+  idx_t B;                      /**< batch size */
+  int warmup;                   /**< calls not timed */
+  int reps;                     /**< calls timed */
+  const char * layers;          /**< comma-separated layers to run ("all" for all) */
+  layer_bench_result * results; /**< results */
+  int n_results;                /**< results so far */
+  int cap_results;              /**< capacity of results */
+  long * t;                     /**< latency of each call (ns) */
+
+  /**
+     @brief 1 if layer is selected by --layers
+  */
+  int selected(const char * layer) {
+    if (strcmp(layers, "all") == 0) return 1;
+    size_t n = strlen(layer);
+    for (const char * p = layers; *p; ) {
+      size_t m = strcspn(p, ",");
+      if (m == n && strncmp(p, layer, n) == 0) return 1;
+      p += m + (p[m] == ',');
+    }
+    return 0;
+  }
+  /**
+     @brief record the latencies in t[0:reps] of a function with cost c
+  */
+  void record(const char * layer, const char * phase, layer_cost c) {
+    qsort(t, reps, sizeof(long), cmp_long);
+    int i95 = (int)ceil(0.95 * reps) - 1;
+    if (i95 < 0) i95 = 0;
+    if (n_results == cap_results) {
+      cap_results = (cap_results ? 2 * cap_results : 64);
+      results = (layer_bench_result *)realloc(results, sizeof(layer_bench_result) * cap_results);
+    }
+    layer_bench_result& r = results[n_results++];
+    snprintf(r.layer, sizeof(r.layer), "%s", layer);
+    snprintf(r.algo, sizeof(r.algo), "%s", opt.algo_s);
+    snprintf(r.phase, sizeof(r.phase), "%s", phase);
+    long med = t[reps / 2];
+    r.median_us = med * 1.0e-3;
+    r.p95_us = t[i95] * 1.0e-3;
+    r.gflops = (med > 0 ? (double)c.flops / med : 0.0);
+    r.gbs = (med > 0 ? (double)c.bytes / med : 0.0);
+    printf("%-14s %-10s %-9s %12.1f %12.1f %9.2f %9.2f\n",
+           r.layer, r.algo, r.phase, r.median_us, r.p95_us, r.gflops, r.gbs);
+    fflush(stdout);
+  }
+  /**
+     @brief comparison of latencies for qsort
+  */
+  static int cmp_long(const void * a, const void * b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x < y ? -1 : x > y ? 1 : 0);
+  }
+  /**
+     @brief run an update of a layer with weights
+     @return its cost
+  */
+  template<typename T>
+  static layer_cost update_of(T * w) {
+    w->update();
+    return T::update_cost();
+  }
+  /**
+     @brief benchmark a layer
+     @param (layer) name of the layer in the network
+     @param (cfg) configuration of the layer
+     @param (update) a function calling update of the layer (0 if it has no weights)
+  */
+  template<typename T, typename I, typename O, typename C>
+  void run_layer(const char * layer, C cfg, layer_cost (*update)(T *)) {
+    if (!selected(layer)) return;
+    T * w = new T();
+    w->init(opt, lgr, rg, cfg);
+    I * x = new I();
+    x->init_uniform(B, rg, -1.0, 1.0);
+    O * gy = new O();
+    gy->init_uniform(B, rg, -1.0, 1.0);
+    to_dev(w, opt.cuda_algo);
+    to_dev(x, opt.cuda_algo);
+    to_dev(gy, opt.cuda_algo);
+    for (int i = 0; i < warmup + reps; i++) {
+      long t0 = trace_wall_ns();
+      w->forward(*x, 1);
+      long t1 = trace_wall_ns();
+      if (i >= warmup) t[i - warmup] = t1 - t0;
+    }
+    record(layer, "forward", T::forward_cost(B));
+    for (int i = 0; i < warmup + reps; i++) {
+      long t0 = trace_wall_ns();
+      w->backward(*gy);
+      long t1 = trace_wall_ns();
+      if (i >= warmup) t[i - warmup] = t1 - t0;
+    }
+    record(layer, "backward", T::backward_cost(B));
+    if (update) {
+      layer_cost c = {};
+      for (int i = 0; i < warmup + reps; i++) {
+        long t0 = trace_wall_ns();
+        c = update(w);
+        long t1 = trace_wall_ns();
+        if (i >= warmup) t[i - warmup] = t1 - t0;
+      }
+      record(layer, "update", c);
+    }
+    del_dev(w, opt.cuda_algo);
+    del_dev(x, opt.cuda_algo);
+    del_dev(gy, opt.cuda_algo);
+    delete w;
+    delete x;
+    delete gy;
+  }
+  /**
+     @brief benchmark the loss layer (whose forward/backward also take labels)
+  */
+  template<idx_t maxB, idx_t nC>
+  void run_loss(const char * layer) {
+    if (!selected(layer)) return;
+    typedef NLLSoftmax<maxB,nC> T;
+    T * w = new T();
+    NLLSoftmaxCfg cfg;
+    w->init(opt, lgr, rg, cfg);
+    tensor<real,maxB,nC> * x = new tensor<real,maxB,nC>();
+    x->init_uniform(B, rg, -1.0, 1.0);
+    tensor<idx_t,maxB> * lab = new tensor<idx_t,maxB>();
+    lab->init_uniform_i(B, rg, 0, nC);
+    tensor<real,maxB> * gy = new tensor<real,maxB>();
+    gy->init_const(B, 1.0);
+    to_dev(w, opt.cuda_algo);
+    to_dev(x, opt.cuda_algo);
+    to_dev(lab, opt.cuda_algo);
+    to_dev(gy, opt.cuda_algo);
+    for (int i = 0; i < warmup + reps; i++) {
+      long t0 = trace_wall_ns();
+      w->forward(*x, *lab, 1);
+      long t1 = trace_wall_ns();
+      if (i >= warmup) t[i - warmup] = t1 - t0;
+    }
+    record(layer, "forward", T::forward_cost(B));
+    for (int i = 0; i < warmup + reps; i++) {
+      long t0 = trace_wall_ns();
+      w->backward(*gy, *lab);
+      long t1 = trace_wall_ns();
+      if (i >= warmup) t[i - warmup] = t1 - t0;
+    }
+    record(layer, "backward", T::backward_cost(B));
+    del_dev(w, opt.cuda_algo);
+    del_dev(x, opt.cuda_algo);
+    del_dev(lab, opt.cuda_algo);
+    del_dev(gy, opt.cuda_algo);
+    delete w;
+    delete x;
+    delete lab;
+    delete gy;
+  }
+  /**
+     @brief benchmark all layers of the network with the current algorithm
+     @details shapes are those of MNIST<maxB,1,28,28,10> (mnist.h)
+  */
+  void run_all() {
+    const idx_t maxB = MAX_BATCH_SIZE;
+    const idx_t C0 = 1, H0 = 28, W0 = 28, K = 3, nC = 10;
+    const idx_t C1 = 32, H1 = H0 - K + 1, W1 = W0 - K + 1;
+    const idx_t C2 = 64, H2 = H1 - K + 1, W2 = W1 - K + 1;
+    const idx_t S = 2, H3 = H2 / S, W3 = W2 / S;
+    const idx_t nF = 128;
+    typedef Convolution2D<maxB,C0,H0,W0,K,C1> conv1_t;
+    typedef Convolution2D<maxB,C1,H1,W1,K,C2> conv2_t;
+    typedef Linear<maxB,nF,C2,H3,W3> fc1_t;
+    typedef Linear<maxB,nC,nF> fc2_t;
+    DropoutCfg d1 = { 0.25f, opt.dropout_seed_1 };
+    DropoutCfg d2 = { 0.5f, opt.dropout_seed_2 };
+    run_layer<conv1_t, tensor<real,maxB,C0,H0,W0>, tensor<real,maxB,C1,H1,W1> >
+      ("conv1", Convolution2DCfg(), update_of<conv1_t>);
+    run_layer<Relu<maxB,C1,H1,W1>, tensor<real,maxB,C1,H1,W1>, tensor<real,maxB,C1,H1,W1> >
+      ("relu1", ReluCfg(), 0);
+    run_layer<conv2_t, tensor<real,maxB,C1,H1,W1>, tensor<real,maxB,C2,H2,W2> >
+      ("conv2", Convolution2DCfg(), update_of<conv2_t>);
+    run_layer<Relu<maxB,C2,H2,W2>, tensor<real,maxB,C2,H2,W2>, tensor<real,maxB,C2,H2,W2> >
+      ("relu2", ReluCfg(), 0);
+    run_layer<MaxPooling2D<maxB,C2,H2,W2,S>, tensor<real,maxB,C2,H2,W2>, tensor<real,maxB,C2,H3,W3> >
+      ("max_pooling_2d", MaxPooling2DCfg(), 0);
+    run_layer<Dropout<maxB,C2,H3,W3>, tensor<real,maxB,C2,H3,W3>, tensor<real,maxB,C2,H3,W3> >
+      ("dropout1", d1, 0);
+    run_layer<fc1_t, tensor<real,maxB,C2,H3,W3>, tensor<real,maxB,nF> >
+      ("fc1", LinearCfg(), update_of<fc1_t>);
+    run_layer<Relu<maxB,nF>, tensor<real,maxB,nF>, tensor<real,maxB,nF> >
+      ("relu3", ReluCfg(), 0);
+    run_layer<Dropout<maxB,nF>, tensor<real,maxB,nF>, tensor<real,maxB,nF> >
+      ("dropout2", d2, 0);
+    run_layer<fc2_t, tensor<real,maxB,nF>, tensor<real,maxB,nC> >
+      ("fc2", LinearCfg(), update_of<fc2_t>);
+    run_loss<maxB,nC>("nll_softmax");
+  }
+  /**
+     @brief write results as JSON (one result per line)
+     @return 0 on success
+  */
+  int write_json(const char * file) {
+    FILE * fp = fopen(file, "wb");
+    if (!fp) {
+      perror(file);
+      return -1;
+    }
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    fprintf(fp, "{\"host\": \"%s\", \"batch_size\": %d, \"warmup\": %d, \"reps\": %d,"
+            " \"max_batch_size\": %d, \"real_bytes\": %d, \"array_index_check\": %d,\n",
+            host, B, warmup, reps, (int)MAX_BATCH_SIZE, (int)sizeof(real), ARRAY_INDEX_CHECK);
+    fprintf(fp, "\"results\": [\n");
+    for (int i = 0; i < n_results; i++) {
+      layer_bench_result& r = results[i];
+      fprintf(fp, "{\"layer\": \"%s\", \"algo\": \"%s\", \"phase\": \"%s\", \"median_us\": %.3f,"
+              " \"p95_us\": %.3f, \"gflops\": %.4f, \"gbs\": %.4f}%s\n",
+              r.layer, r.algo, r.phase, r.median_us, r.p95_us, r.gflops, r.gbs,
+              (i + 1 < n_results ? "," : ""));
+    }
+    fprintf(fp, "]}\n");
+    if (fclose(fp) != 0) {
+      perror(file);
+      return -1;
+    }
+    return 0;
+  }
+};
+
+/**
+   @brief read results written by layer_bench::write_json
+   @param (file) the file
+   @param (n) gets the number of results
+   @return the results (malloc'ed) or null on error
+*/
+static layer_bench_result * layer_bench_read_json(const char * file, int * n) {
+  FILE * fp = fopen(file, "rb");
+  if (!fp) {
+    perror(file);
+    return 0;
+  }
+  int cap = 64;
+  layer_bench_result * rs = (layer_bench_result *)malloc(sizeof(layer_bench_result) * cap);
+  *n = 0;
+  char line[1024];
+  while (fgets(line, sizeof(line), fp)) {
+    layer_bench_result r;
+    if (sscanf(line, "{\"layer\": \"%31[^\"]\", \"algo\": \"%31[^\"]\", \"phase\": \"%15[^\"]\","
+               " \"median_us\": %lf, \"p95_us\": %lf, \"gflops\": %lf, \"gbs\": %lf",
+               r.layer, r.algo, r.phase, &r.median_us, &r.p95_us, &r.gflops, &r.gbs) != 7) continue;
+    if (*n == cap) {
+      cap *= 2;
+      rs = (layer_bench_result *)realloc(rs, sizeof(layer_bench_result) * cap);
+    }
+    rs[(*n)++] = r;
+  }
+  fclose(fp);
+  return rs;
+}
+
+/**
+   @brief compare two runs
+   @param (old_file) results of the baseline run
+   @param (new_file) results of the new run
+   @param (tolerance) relative slowdown always tolerated (e.g., 0.05)
+   @return the number of regressions (-1 on error)
+   @details a function regressed if its new median exceeds the old
+   one by more than the noise, max(tolerance, (p95 - median) / median
+   of either run)
+*/
+static int layer_bench_diff(const char * old_file, const char * new_file, double tolerance) {
+  int n_old, n_new;
+  layer_bench_result * o = layer_bench_read_json(old_file, &n_old);
+  layer_bench_result * r = layer_bench_read_json(new_file, &n_new);
+  if (!o || !r) return -1;
+  int n_reg = 0, n_imp = 0, n_cmp = 0;
+  printf("%-14s %-10s %-9s %12s %12s %8s %7s\n",
+         "layer", "algo", "phase", "old us", "new us", "change", "noise");
+  for (int i = 0; i < n_new; i++) {
+    layer_bench_result * a = 0;
+    for (int j = 0; j < n_old; j++) {
+      if (strcmp(o[j].layer, r[i].layer) == 0 && strcmp(o[j].algo, r[i].algo) == 0
+          && strcmp(o[j].phase, r[i].phase) == 0) a = &o[j];
+    }
+    if (!a || a->median_us <= 0 || r[i].median_us <= 0) continue;
+    double noise = tolerance;
+    double na = (a->p95_us - a->median_us) / a->median_us;
+    double nb = (r[i].p95_us - r[i].median_us) / r[i].median_us;
+    if (na > noise) noise = na;
+    if (nb > noise) noise = nb;
+    double change = r[i].median_us / a->median_us - 1.0;
+    const char * flag = "";
+    if (change > noise) {
+      flag = "REGRESSION";
+      n_reg++;
+    } else if (change < -noise) {
+      flag = "improved";
+      n_imp++;
+    }
+    n_cmp++;
+    printf("%-14s %-10s %-9s %12.1f %12.1f %+7.1f%% %6.1f%% %s\n",
+           r[i].layer, r[i].algo, r[i].phase, a->median_us, r[i].median_us,
+           100.0 * change, 100.0 * noise, flag);
+  }
+  printf("%d compared, %d regressions, %d improvements\n", n_cmp, n_reg, n_imp);
+  free(o);
+  free(r);
+  return n_reg;
+}
+
+/**
+   @brief command line options for getopt
+*/
+static struct option layer_bench_long_options[] = {
+  {"algos",             required_argument, 0, 'a' },
+  {"batch-size",        required_argument, 0, 'b' },
+  {"layers",            required_argument, 0, 'l' },
+  {"reps",              required_argument, 0, 'r' },
+  {"warmup",            required_argument, 0, 'w' },
+  {"output",            required_argument, 0, 'o' },
+  {"diff",              no_argument,       0, 'd' },
+  {"tolerance",         required_argument, 0, 't' },
+  {"help",              no_argument,       0, 'h' },
+  {0,                   0,                 0,  0  }
+};
+
+/**
+   @brief show usage of layer_bench
+*/
+static void layer_bench_usage(const char * prog) {
+  fprintf(stderr,
+          "usage:\n"
+          "\n"
+          "%s [options]\n"
+          "%s --diff OLD.json NEW.json [--tolerance PCT]\n"
+          "\n"
+          " -a,--algos A,B,... : algorithms to run (\"all\" for all available) [all]\n"
+          " -b,--batch-size N : batch size (<= %d) [%d]\n"
+          " -l,--layers L,M,... : layers to run (conv1, relu1, conv2, relu2, max_pooling_2d,\n"
+          "                       dropout1, fc1, relu3, dropout2, fc2, nll_softmax or all) [all]\n"
+          " -r,--reps N : timed calls of each function [20]\n"
+          " -w,--warmup N : calls not timed before them [3]\n"
+          " -o,--output FILE : write results as JSON to FILE [layer_bench.json]\n"
+          " -d,--diff : compare two results and flag regressions (exit status 1 if any)\n"
+          " -t,--tolerance PCT : slowdown tolerated in addition to the noise of the runs [5]\n"
+          " -h,--help\n",
+          prog, prog, (int)MAX_BATCH_SIZE, (int)MAX_BATCH_SIZE);
+  exit(1);
+}
+
+/**
+   @brief entry point of this header file
+   @param (argc) the number of command line args
+   @param (argv) command line args
+   @details if this header file is included from
+   a main C++ file and define layer_bench_main to be main
+   (e.g., with -Dlayer_bench_main=main), then this
+   function becomes th main function of the executable.
+   it benchmarks all layers with all algorithms (or compares two
+   results with --diff).
+*/
+int layer_bench_main(int argc, char ** argv) {
+  const char * algos = "all";
+  const char * output = "layer_bench.json";
+  int diff = 0;
+  double tolerance = 5.0;
+  layer_bench lb;
+  lb.B = MAX_BATCH_SIZE;
+  lb.layers = "all";
+  lb.reps = 20;
+  lb.warmup = 3;
+  lb.results = 0;
+  lb.n_results = lb.cap_results = 0;
+  while (1) {
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "a:b:l:r:w:o:dt:h", layer_bench_long_options, &option_index);
+    if (c == -1) break;
+    switch (c) {
+    case 'a': algos = strdup(optarg); break;
+    case 'b': lb.B = atoi(optarg); break;
+    case 'l': lb.layers = strdup(optarg); break;
+    case 'r': lb.reps = atoi(optarg); break;
+    case 'w': lb.warmup = atoi(optarg); break;
+    case 'o': output = strdup(optarg); break;
+    case 'd': diff = 1; break;
+    case 't': tolerance = atof(optarg); break;
+    default: layer_bench_usage(argv[0]);
+    }
+  }
+  if (diff) {
+    if (argc - optind != 2) layer_bench_usage(argv[0]);
+    int n_reg = layer_bench_diff(argv[optind], argv[optind + 1], tolerance / 100.0);
+    return (n_reg == 0 ? 0 : 1);
+  }
+  if (lb.B < 1 || lb.B > MAX_BATCH_SIZE || lb.reps < 1 || lb.warmup < 0) layer_bench_usage(argv[0]);
+  lb.t = (long *)malloc(sizeof(long) * lb.reps);
+  /* layers log at level 4; nothing goes to stdout and the log is discarded */
+  lb.opt.verbose = 0;
+  lb.opt.log = "/dev/null";
+  logger lgr;
+  lgr.start_log(lb.opt);
+  lb.lgr = &lgr;
+  printf("%-14s %-10s %-9s %12s %12s %9s %9s\n",
+         "layer", "algo", "phase", "median us", "p95 us", "GFLOP/s", "GB/s");
+  for (int a = 0; a < algo_invalid; a++) {
+    const char * name = algo_name((algo_t)a);
+    if (!name) continue;
+#if !__CUDACC__
+    /* cuda algorithms need nvcc */
+    if (algo_is_cuda(name, (algo_t)a)) continue;
+#endif
+    if (strcmp(algos, "all") != 0) {
+      size_t n = strlen(name);
+      int found = 0;
+      for (const char * p = algos; *p; ) {
+        size_t m = strcspn(p, ",");
+        if (m == n && strncmp(p, name, n) == 0) found = 1;
+        p += m + (p[m] == ',');
+      }
+      if (!found) continue;
+    }
+    lb.opt.algo_s = name;
+    lb.opt.algo = (algo_t)a;
+    lb.opt.cuda_algo = algo_is_cuda(name, (algo_t)a);
+    lb.rg.seed(lb.opt.weight_seed);
+    lb.run_all();
+  }
+  int ok = (lb.n_results > 0 && lb.write_json(output) == 0);
+  if (ok) printf("%d results written to %s\n", lb.n_results, output);
+  lgr.end_log();
+  free(lb.t);
+  free(lb.results);
+  return ok ? 0 : 1;
+}
@@ -9,6 +9,8 @@
 #include "tensor.h"
 #include "ada_delta.h"
 #include "grad_check.h"
+#include "par_reduce.h"
+#include "dropout.h"
 
 /**
  @brief configuration data for Linear
@@ -43,6 +45,9 @@ struct Linear{
     tensor<real,M,K0,K1,K2> gx;         /**< gradient of loss wrt to input x */
     AdaDelta<K0,K1,K2,N> opt_w;         /**< AdaDelta optimizer for w */
     AdaDelta<N> opt_b;                  /**< AdaDelta optimizer for b */
+    int accumulate;                     /**< 1 if backward adds to gw/gb instead of overwriting them */
+    tensor<unsigned char,M,K0,K1,K2>* x_keep; /**< null, or which elements of x a dropout before this layer keeps (set_input_dropout) */
+    real x_scale;                       /**< the factor the dropout multiplies kept elements by */
 
     /**
      @brief initialize the layer
@@ -60,6 +65,110 @@ struct Linear{
         b.init_uniform(N, rg, -bound, bound);
         opt_w.init(opt.lr);
         opt_b.init(opt.lr);
+        accumulate = 0;
+        x_keep = 0;
+        x_scale = 1;
+    }
+
+    /**
+     @brief the static footprint of the layer (layer_mem)
+    */
+    static constexpr layer_mem memory(){
+        return layer_mem{ sizeof(w) + sizeof(b), sizeof(gw) + sizeof(gb),
+                          sizeof(opt_w) + sizeof(opt_b), sizeof(y) + sizeof(gx),
+                          sizeof(Linear<M,N,K0,K1,K2>) };
+    }
+    /**
+     @brief the cost of forward with B samples (layer_cost)
+     @param (B) the number of samples
+    */
+    static constexpr layer_cost forward_cost(idx_t B){
+        return layer_cost{ (uint64_t)B * N * (2 * K0 * K1 * K2 + 1),
+                           (uint64_t)sizeof(real) * ((uint64_t)B * K0 * K1 * K2 + (uint64_t)K0 * K1 * K2 * N
+                                                     + N + (uint64_t)B * N) };
+    }
+
+    /**
+     @brief the cost of backward with B samples (layer_cost)
+     @param (B) the number of samples
+     @details gw and gx each take as many multiply-adds as forward
+    */
+    static constexpr layer_cost backward_cost(idx_t B){
+        return layer_cost{ (uint64_t)B * N * (4 * K0 * K1 * K2 + 1),
+                           (uint64_t)sizeof(real) * ((uint64_t)B * N + 2 * (uint64_t)B * K0 * K1 * K2
+                                                     + 2 * (uint64_t)K0 * K1 * K2 * N + N) };
+    }
+
+    /**
+     @brief the cost of update (layer_cost)
+    */
+    static constexpr layer_cost update_cost(){
+        return layer_cost{ AdaDelta<K0,K1,K2,N>::update_cost().flops + AdaDelta<N>::update_cost().flops,
+                           AdaDelta<K0,K1,K2,N>::update_cost().bytes + AdaDelta<N>::update_cost().bytes };
+    }
+
+    /**
+     @brief choose whether backward overwrites gw/gb (0) or adds
+     to them (1)
+     @param (accumulate) 1 to accumulate gradients over several
+     backward calls (gradient accumulation over micro-batches)
+     @details for cuda algorithms the flag is copied to the device
+     shadow as well, as backward kernels read it there
+    */
+    void set_accumulate(int accumulate){
+        if(this->accumulate == accumulate) return;
+        this->accumulate = accumulate;
+        #if __CUDACC__
+            if(dev){
+                ::to_dev(&dev->accumulate, &this->accumulate, sizeof(int));
+            }
+        #endif
+    }
+
+    /**
+     @brief make the layer apply the dropout before it as it reads x
+     (--fuse-dropout)
+     @param (keep) which elements of x are kept (null : x is used as is)
+     @param (scale) the factor kept elements are multiplied by
+     @details x passed to forward is then the input of the dropout.
+     forward and gw see its output (x * scale where keep is 1, 0
+     elsewhere), computed as x is read, and gx written by backward
+     is the gradient wrt its input (scale times the gradient wrt its
+     output where keep is 1, 0 elsewhere). the dropout itself only
+     decides keep (Dropout::forward_mask), and neither its output
+     nor its gradient is written. the values are bitwise the same as
+     with the separate dropout. only cpu algorithms are supported
+     (MNIST uses it with cpu_simd and cpu_omp, --fuse-dropout 1)
+    */
+    void set_input_dropout(tensor<unsigned char,M,K0,K1,K2>* keep, real scale){
+        x_keep = keep;
+        x_scale = scale;
+    }
+
+    /**
+     @brief an element of the input as the layer sees it (the output
+     of the dropout set by set_input_dropout, if any)
+     @details keep is as good as random, so it selects by indexing
+     rather than by a branch
+    */
+    __device__ __host__
+    real x_in(tensor<real,M,K0,K1,K2>& x, idx_t i, idx_t k0, idx_t k1, idx_t k2){
+        real v = x(i,k0,k1,k2);
+        if(x_keep == 0) return v;
+        const real z[2] = { 0, v * x_scale };
+        return z[(*x_keep)(i,k0,k1,k2)];
+    }
+
+    /**
+     @brief an element of gx from the gradient wrt the input as the
+     layer sees it (through the dropout set by set_input_dropout, if any)
+     @sa x_in
+    */
+    __device__ __host__
+    real gx_out(idx_t i, idx_t k0, idx_t k1, idx_t k2, real v){
+        if(x_keep == 0) return v;
+        const real z[2] = { 0, x_scale * v };
+        return z[(*x_keep)(i,k0,k1,k2)];
     }
 
     /**
@@ -174,6 +283,7 @@ struct Linear{
             }                
         }
         tsc_t t1 = get_tsc();
+        log_cost(update_cost());
         log_end_fun(lgr, t0, t1);
     }
 
@@ -206,7 +316,7 @@ struct Linear{
                 for(idx_t k0 = 0;k0 < K0;k0++){
                     for(idx_t k1 = 0;k1 < K1;k1++){
                         for(idx_t k2 = 0;k2 < K2;k2++){
-                            v += x(i,k0,k1,k2) * w(k0,k1,k2,j);
+                            v += x_in(x,i,k0,k1,k2) * w(k0,k1,k2,j);
                         }
                     }
                 }
@@ -245,8 +355,28 @@ struct Linear{
         #else
             realv vec;
         #endif
+        real xp[K0 * K1 * K2];          // a row of x with the dropout applied (set_input_dropout)
 
         for(idx_t i = 0;i < m;i++){
+            /* with a dropout, the row is packed once with it applied,
+               instead of at each read in the loop over j */
+            const real * xr = &x.w[i][0][0][0];
+            if(x_keep){
+                const unsigned char * kr = &x_keep->w[i][0][0][0];
+                idx_t k = 0;
+                #ifndef __ARM_64BIT_STATE
+                    const __m512 vs = _mm512_set1_ps(x_scale);
+                    for(;k + L <= K0 * K1 * K2;k += L){
+                        const __m512i kv = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(kr + k)));
+                        const __mmask16 km = _mm512_test_epi32_mask(kv, kv);
+                        _mm512_storeu_ps(xp + k, _mm512_maskz_mul_ps(km, _mm512_loadu_ps(xr + k), vs));
+                    }
+                #endif
+                for(;k < K0 * K1 * K2;k++){
+                    xp[k] = (kr[k] ? xr[k] * x_scale : (real)0);
+                }
+                xr = xp;
+            }
             idx_t j = 0;
             #ifdef __ARM_64BIT_STATE
                 for(;j+3 < N;j+=4){
@@ -259,7 +389,7 @@ struct Linear{
                         for(idx_t k1 = 0;k1 < K1;k1++){
                             for(idx_t k2 = 0;k2 < K2;k2++){
                                 // v += x(i,k0,k1,k2) * w(k0,k1,k2,j);
-                                vec = vfmaq_f32(vec,w.V4(k0,k1,k2,j),vdupq_n_f32(x(i,k0,k1,k2)));
+                                vec = vfmaq_f32(vec,w.V4(k0,k1,k2,j),vdupq_n_f32(xr[(k0 * K1 + k1) * K2 + k2]));
                                     // vfma(a,b,c) = a + b * c
                             }
                         }
@@ -279,13 +409,13 @@ struct Linear{
                         for(idx_t k1 = 0;k1 < K1;k1++){
                             for(idx_t k2 = 0;k2 < K2;k2++){
                                 // v += x(i,k0,k1,k2) * w(k0,k1,k2,j);
-                                vec = _mm512_fmadd_ps(w.V16(k0,k1,k2,j),_mm512_set1_ps(x(i,k0,k1,k2)),vec);
+                                vec = _mm512_fmadd_ps(w.V16(k0,k1,k2,j),_mm512_set1_ps(xr[(k0 * K1 + k1) * K2 + k2]),vec);
                                     // _mm512_fmadd_ps(a,b,c) = a * b + c
                             }
                         }
                     }
-                    vec = _mm512_add_ps(vec,b.V16(j));
-                    y.V16(i,j) = vec;
+                    vec = _mm512_add_ps(vec,b.V16_flat(j));
+                    y.V16_flat(i,j) = vec;
                     // y(i,j) = v + b(j);
                 }
             #endif
@@ -295,7 +425,7 @@ struct Linear{
                 for(idx_t k0 = 0;k0 < K0;k0++){
                     for(idx_t k1 = 0;k1 < K1;k1++){
                         for(idx_t k2 = 0;k2 < K2;k2++){
-                            v += x(i,k0,k1,k2) * w(k0,k1,k2,j);
+                            v += xr[(k0 * K1 + k1) * K2 + k2] * w(k0,k1,k2,j);
                         }
                     }
                 }
@@ -394,6 +524,7 @@ struct Linear{
             }                
         }
         tsc_t t1 = get_tsc();
+        log_cost(forward_cost(x.n0));
         log_end_fun(lgr, t0, t1);
         return y;
     }
@@ -424,9 +555,9 @@ struct Linear{
             for(idx_t k1 = 0;k1 < K1;k1++){
                 for(idx_t k2 = 0;k2 < K2;k2++){
                     for(idx_t j = 0;j < N;j++){
-                        real v = 0.0;
+                        real v = (accumulate ? gw(k0,k1,k2,j) : 0);
                         for(idx_t i = 0;i < m;i++){
-                            v += gy(i,j) * x(i,k0,k1,k2);
+                            v += gy(i,j) * x_in(x,i,k0,k1,k2);
                         }
                         gw(k0,k1,k2,j) = v;
                     }
@@ -434,7 +565,7 @@ struct Linear{
             }
         }
         for(idx_t j = 0;j < N;j++){
-            real v = 0.0;
+            real v = (accumulate ? gb(j) : 0);
             for(idx_t i = 0;i < m;i++){
                 v += gy(i, j);
             }
@@ -448,7 +579,7 @@ struct Linear{
                         for(idx_t j = 0;j < N;j++){
                             v += gy(i,j) * w(k0,k1,k2,j);
                         }
-                        gx(i,k0,k1,k2) = v;
+                        gx(i,k0,k1,k2) = gx_out(i,k0,k1,k2,v);
                     }
                 }
             }
@@ -485,16 +616,20 @@ struct Linear{
             #endif
 
             tensor<real,M,K0,K1,K2>& x = *x_ptr;
+            real xc[M];                 // a column of x as the layer sees it (x_in)
 
             for(idx_t k0 = 0;k0 < K0;k0++){
                 for(idx_t k1 = 0;k1 < K1;k1++){
                     for(idx_t k2 = 0;k2 < K2;k2++){
+                        for(idx_t i = 0;i < m;i++){
+                            xc[i] = x_in(x,i,k0,k1,k2);
+                        }
                         idx_t j = 0;
                         #ifdef __ARM_64BIT_STATE
                             for(;j + 3 < N;j+=4){
-                                vec = vdupq_n_f32(0);
+                                vec = (accumulate ? gw.V4(k0,k1,k2,j) : vdupq_n_f32(0));
                                 for(idx_t i = 0;i < m;i++){
-                                    vec = vfmaq_f32(vec,gy.V4(i,j),vdupq_n_f32(x(i,k0,k1,k2)));
+                                    vec = vfmaq_f32(vec,gy.V4(i,j),vdupq_n_f32(xc[i]));
                                         // vfma(a,b,c) = a + b * c
                                     // v += gy(i,j) * x(i,k0,k1,k2);
                                 }
@@ -502,9 +637,9 @@ struct Linear{
                             }
                         #else
                             for(;j + L - 1 < N;j+=L){
-                                vec = _mm512_set1_ps(0);
+                                vec = (accumulate ? gw.V16(k0,k1,k2,j) : _mm512_set1_ps(0));
                                 for(idx_t i = 0;i < m;i++){
-                                    vec = _mm512_fmadd_ps(gy.V16(i,j),_mm512_set1_ps(x(i,k0,k1,k2)),vec);
+                                    vec = _mm512_fmadd_ps(gy.V16_flat(i,j),_mm512_set1_ps(xc[i]),vec);
                                         // _mm512_fmadd_ps(a,b,c) = a * b + c
                                     // v += gy(i,j) * x(i,k0,k1,k2);
                                 }
@@ -513,9 +648,9 @@ struct Linear{
                         #endif
 
                         for(;j < N;j++){        // remainder iterations
-                            v = 0;
+                            v = (accumulate ? gw(k0,k1,k2,j) : 0);
                             for(idx_t i = 0;i < m;i++){
-                                v += gy(i,j) * x(i,k0,k1,k2);
+                                v += gy(i,j) * xc[i];
                             }
                             gw(k0,k1,k2,j) = v;
                         }
@@ -526,7 +661,7 @@ struct Linear{
             idx_t j = 0;
             #ifdef __ARM_64BIT_STATE
                 for(;j + 3 < N;j+=4){
-                    vec = vdupq_n_f32(0);
+                    vec = (accumulate ? gb.V4(j) : vdupq_n_f32(0));
                     for(idx_t i = 0;i < m;i++){
                         vec = vaddq_f32(vec,gy.V4(i,j));
                         // v += gy(i, j);
@@ -535,17 +670,17 @@ struct Linear{
                 }
             #else
                 for(;j + L - 1 < N;j+=L){
-                    vec = _mm512_set1_ps(0);
+                    vec = (accumulate ? gb.V16_flat(j) : _mm512_set1_ps(0));
                     for(idx_t i = 0;i < m;i++){
-                        vec = _mm512_add_ps(vec,gy.V16(i,j));
+                        vec = _mm512_add_ps(vec,gy.V16_flat(i,j));
                         // v += gy(i, j);
                     }
-                    gb.V16(j) = vec;
+                    gb.V16_flat(j) = vec;
                 }
             #endif
 
             for(;j < N;j++){                // remainder iterations
-                v = 0;
+                v = (accumulate ? gb(j) : 0);
                 for(idx_t i = 0;i < m;i++){
                     v += gy(i, j);
                 }
@@ -567,7 +702,7 @@ struct Linear{
                             #else
                                 vec = _mm512_set1_ps(0);
                                 for(;j + L - 1 < N;j+=L){
-                                    vec = _mm512_fmadd_ps(gy.V16(i,j),w.V16(k0,k1,k2,j),vec);
+                                    vec = _mm512_fmadd_ps(gy.V16_flat(i,j),w.V16(k0,k1,k2,j),vec);
                                         // _mm512_fmadd_ps(a,b,c) = a * b + c
                                     // v += gy(i,j) * w(k0,k1,k2,j);
                                 }
@@ -579,9 +714,9 @@ struct Linear{
                             }
 
                             #ifdef __ARM_64BIT_STATE
-                                gx(i,k0,k1,k2) = v + vaddvq_f32(vec);
+                                gx(i,k0,k1,k2) = gx_out(i,k0,k1,k2,v + vaddvq_f32(vec));
                             #else
-                                gx(i,k0,k1,k2) = v + _mm512_reduce_add_ps(vec);
+                                gx(i,k0,k1,k2) = gx_out(i,k0,k1,k2,v + _mm512_reduce_add_ps(vec));
                             #endif
                         }
                     }
@@ -632,6 +767,79 @@ struct Linear{
         backward_base(gy);
     }
 
+    /**
+     @brief an omp version of backward
+     @param (gy) gradient of loss with respect to the output
+     @details samples are split among threads. gw and gb are
+     reductions over samples, added up by par_reduce in the mode
+     given by --deterministic (par_reduce.h); gx is computed
+     per sample and needs no reduction.
+     @sa backward
+     @sa backward_base
+    */
+    void backward_omp(tensor<real,M,N>& gy){
+        const idx_t m = gy.n0;
+        gw.set_n0(K0);
+        gb.set_n0(N);
+        gx.set_n0(m);
+        tensor<real,M,K0,K1,K2>& x = *x_ptr;
+        par_reduce(&gw.w[0][0][0][0], K0 * K1 * K2 * N, m, accumulate, opt.deterministic,
+                   [&](long lo, long hi, real * acc){
+                       real xc[M];  // a column of x as the layer sees it (x_in)
+                       for(idx_t k0 = 0;k0 < K0;k0++){
+                           for(idx_t k1 = 0;k1 < K1;k1++){
+                               for(idx_t k2 = 0;k2 < K2;k2++){
+                                   for(idx_t i = lo;i < hi;i++){
+                                       xc[i] = x_in(x,i,k0,k1,k2);
+                                   }
+                                   for(idx_t j = 0;j < N;j++){
+                                       real v = 0;
+                                       for(idx_t i = lo;i < hi;i++){
+                                           v += gy(i,j) * xc[i];
+                                       }
+                                       acc[((k0 * K1 + k1) * K2 + k2) * N + j] += v;
+                                   }
+                               }
+                           }
+                       }
+                   });
+        par_reduce(&gb.w[0][0][0][0], N, m, accumulate, opt.deterministic,
+                   [&](long lo, long hi, real * acc){
+                       for(idx_t j = 0;j < N;j++){
+                           real v = 0;
+                           for(idx_t i = lo;i < hi;i++){
+                               v += gy(i, j);
+                           }
+                           acc[j] += v;
+                       }
+                   });
+        #pragma omp parallel for schedule(static)
+        for(idx_t i = 0;i < m;i++){
+            for(idx_t k0 = 0;k0 < K0;k0++){
+                for(idx_t k1 = 0;k1 < K1;k1++){
+                    for(idx_t k2 = 0;k2 < K2;k2++){
+                        real v = 0.0;
+                        for(idx_t j = 0;j < N;j++){
+                            v += gy(i,j) * w(k0,k1,k2,j);
+                        }
+                        gx(i,k0,k1,k2) = gx_out(i,k0,k1,k2,v);
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     @brief an omp version of backward called from the 
+     entry function (backward)
+     @param (gy) gradient of loss with respect to the output
+     @sa backward
+     @sa backward_omp
+    */
+    void backward_cpu_omp(tensor<real,M,N>& gy){
+        backward_omp(gy);
+    }
+
     /**
      @brief an ARM / x86 simd version of baseline code called from the 
      entry function (backward)
@@ -670,6 +878,8 @@ struct Linear{
             backward_cuda_base(gy);break;
         case algo_cpu_simd:
             backward_cpu_simd(gy);break;
+        case algo_cpu_omp:
+            backward_cpu_omp(gy);break;
         default:
             if (opt.cuda_algo){
                 backward_cuda_base(gy);
@@ -678,10 +888,27 @@ struct Linear{
             }                
         }
         tsc_t t1 = get_tsc();
+        log_cost(backward_cost(gy.n0));
         log_end_fun(lgr, t0, t1);
         return gx;
     }
 
+    /**
+     @brief backward from the gradient wrt the output of the
+     elementwise layers after this one (--fuse-backward 1)
+     @param (gp) gradient of loss wrt the output of the last of them
+     @param (r) how it reaches the output of this layer (grad_route)
+     @param (gy) the tensor the gradient wrt the output is made in
+     @details r makes gy in one pass (dropout mask and ReLU mask at
+     once), and backward takes it as usual; gx of those layers is
+     never written. cpu algorithms only.
+     @sa backward
+    */
+    template<typename GP,typename R>
+    tensor<real,M,K0,K1,K2>& backward_routed(GP& gp, R& r, tensor<real,M,N>& gy){
+        return backward(r.backward(gp, gy));
+    }
+
     /**
      @brief randomly set all gradients to values between p and q
      @param (rg) random number generator
@@ -722,8 +949,76 @@ struct Linear{
     double grad_dot_grad(Linear<M,N,K0,K1,K2>& o){
         return gw.dot(o.gw) + gb.dot(o.gb);
     }
+
+    /**
+     @brief register weights and optimizer states to a checkpoint
+     @param (ck) the checkpoint
+     @param (name) name of this layer (e.g., "conv1")
+     @details data must be on the host when the checkpoint is
+         saved or restored
+    */
+    void ckpt_sections(checkpoint& ck, const char * name){
+        char sub[CKPT_NAME_MAX];
+        ck.add(name, "w", &w.w, sizeof(w.w));
+        ck.add(name, "b", &b.w, sizeof(b.w));
+        snprintf(sub, sizeof(sub), "%s.opt_w", name);
+        opt_w.ckpt_sections(ck, sub);
+        snprintf(sub, sizeof(sub), "%s.opt_b", name);
+        opt_b.ckpt_sections(ck, sub);
+    }
 };
 
+/**
+ @brief compare Linear applying a dropout to its input
+ (set_input_dropout) with Dropout followed by Linear, and time both
+ @return 1 if y, gw, gb and gx are bitwise the same and the generators
+ of the dropouts end up in the same state
+*/
+template<idx_t maxB,idx_t N,idx_t K0,idx_t K1,idx_t K2>
+static int linear_dropout_check(cmdline_opt opt, logger * lgr, rnd_gen_t& rg, idx_t B, int reps){
+    typedef Linear<maxB,N,K0,K1,K2> linear_t;
+    typedef Dropout<maxB,K0,K1,K2> dropout_t;
+    linear_t * la = new linear_t();
+    linear_t * lb = new linear_t();
+    dropout_t * da = new dropout_t();
+    dropout_t * db = new dropout_t();
+    tensor<real,maxB,K0,K1,K2> * x = new tensor<real,maxB,K0,K1,K2>();
+    tensor<real,maxB,N> * gy = new tensor<real,maxB,N>();
+    rnd_gen_t rgb = rg;
+    la->init(opt, lgr, rg, LinearCfg());
+    lb->init(opt, lgr, rgb, LinearCfg());
+    da->init(opt, lgr, rg, DropoutCfg{ 0.25, opt.dropout_seed_1 });
+    db->init(opt, lgr, rg, DropoutCfg{ 0.25, opt.dropout_seed_1 });
+    x->init_uniform(B, rg, -1.0, 1.0);
+    gy->init_uniform(B, rg, -1.0, 1.0);
+    double ms[2] = { 0.0, 0.0 };
+    int same = 1;
+    for(int r = 0;r < reps;r++){
+        struct timespec ts0, ts1, ts2;
+        clock_gettime(CLOCK_MONOTONIC, &ts0);
+        la->forward(da->forward(*x, 1), 1);
+        da->backward(la->backward(*gy));
+        clock_gettime(CLOCK_MONOTONIC, &ts1);
+        db->forward_mask(B, 1);
+        lb->set_input_dropout(&db->keep, db->scale(1));
+        lb->forward(*x, 1);
+        lb->backward(*gy);
+        clock_gettime(CLOCK_MONOTONIC, &ts2);
+        ms[0] += (ts1.tv_sec - ts0.tv_sec) * 1.0e3 + (ts1.tv_nsec - ts0.tv_nsec) * 1.0e-6;
+        ms[1] += (ts2.tv_sec - ts1.tv_sec) * 1.0e3 + (ts2.tv_nsec - ts1.tv_nsec) * 1.0e-6;
+        same = same && memcmp(&la->y.w, &lb->y.w, sizeof(real) * B * N) == 0
+            && memcmp(&la->gw.w, &lb->gw.w, sizeof(la->gw.w)) == 0
+            && memcmp(&la->gb.w, &lb->gb.w, sizeof(la->gb.w)) == 0
+            && memcmp(&da->gx.w, &lb->gx.w, sizeof(real) * B * K0 * K1 * K2) == 0;
+    }
+    same = same && da->rg.get_state() == db->rg.get_state();
+    printf("Linear<%d,%d,%d,%d> after Dropout, %d samples: separate %.3f ms, fused %.3f ms, %s\n",
+           (int)N, (int)K0, (int)K1, (int)K2, (int)B, ms[0] / reps, ms[1] / reps,
+           (same ? "bitwise same" : "DIFFER"));
+    delete la; delete lb; delete da; delete db; delete x; delete gy;
+    return same;
+}
+
 /**
  @brief entry point of this header file
  @param (argc) the number of command line args
@@ -734,7 +1029,9 @@ struct Linear{
  (e.g., with -Dlinear_main=main), then this
  function becomes th main function of the executable.
  it calls grad_check repeatedly to test
- the implementation of backward of linear.
+ the implementation of backward of linear, and then checks
+ a dropout applied by the layer in the shape of fc1 of MNIST
+ (linear_dropout_check).
 */
 int linear_main(int argc, char ** argv){
     cmdline_opt opt = parse_args(argc, argv);
@@ -764,6 +1061,8 @@ int linear_main(int argc, char ** argv){
     }
     printf("max relative error = %.9f\n", max_e);
     printf("avg relative error = %.9f\n", sum_e / n_checks);
+    int ok = linear_dropout_check<maxB,128,64,12,12>(opt, &lgr, rg, M, 10);
     lgr.end_log();
-    return 0;
+    printf("%s\n", ok ? "OK" : "NG");
+    return ok ? 0 : 1;
 }
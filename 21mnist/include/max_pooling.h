@@ -52,6 +52,32 @@ struct MaxPooling2D {
     (void)rg;
     (void)cfg;
   }
+  /**
+     @brief the static footprint of the layer (layer_mem; no parameters)
+  */
+  static constexpr layer_mem memory() {
+    return layer_mem{ 0, 0, 0, sizeof(y) + sizeof(argmax_i) + sizeof(argmax_j) + sizeof(gx),
+                      sizeof(MaxPooling2D<maxB,C,H,W,S>) };
+  }
+  /**
+     @brief the cost of forward with B images (a comparison per input pixel; layer_cost)
+     @param (B) the number of images
+     @details argmax_i/argmax_j are written as well
+  */
+  static constexpr layer_cost forward_cost(idx_t B) {
+    return layer_cost{ (uint64_t)B * C * H * W,
+                       (uint64_t)sizeof(real) * B * C * (H * W + (H/S) * (W/S))
+                       + 2 * (uint64_t)sizeof(idx_t) * B * C * (H/S) * (W/S) };
+  }
+  /**
+     @brief the cost of backward with B images (no arithmetic; layer_cost)
+     @param (B) the number of images
+  */
+  static constexpr layer_cost backward_cost(idx_t B) {
+    return layer_cost{ 0,
+                       (uint64_t)sizeof(real) * B * C * (H * W + (H/S) * (W/S))
+                       + 2 * (uint64_t)sizeof(idx_t) * B * C * (H/S) * (W/S) };
+  }
   /**
      @brief set the device pointer for this and all subobjects
      @param (dev) a device memory or null
@@ -193,6 +219,7 @@ struct MaxPooling2D {
       }        
     }
     tsc_t t1 = get_tsc();
+    log_cost(forward_cost(x.n0));
     log_end_fun(lgr, t0, t1);
     return y;
   }
@@ -309,6 +336,7 @@ struct MaxPooling2D {
       }        
     }
     tsc_t t1 = get_tsc();
+    log_cost(backward_cost(gy.n0));
     log_end_fun(lgr, t0, t1);
     return gx;
   }
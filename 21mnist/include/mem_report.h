@@ -0,0 +1,143 @@
+/**
+   @file mem_report.h
+   @brief memory usage reports (--mem-report 1)
+   @details two kinds of numbers are logged, so features reducing
+   memory (e.g., --recompute) can be evaluated:
+
+   - the static footprint of each layer by what its tensors hold
+     (weights, their gradients, optimizer states and activations,
+     i.e., outputs, gradients wrt inputs and whatever else is kept
+     per sample), all computed from template extents
+     (layer_mem, by the static memory() of each layer), and
+   - the resident set size (RSS) and its peak (VmHWM) of the
+     process, sampled at points of a run (model built, data
+     loaded, the first training step, each epoch and the end).
+
+   the footprint is what is allocated; pages never touched (e.g.,
+   outputs not kept with --recompute, which are allocated lazily)
+   count toward it but not toward RSS.
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/**
+   @brief the static footprint (bytes) of a layer
+*/
+struct layer_mem {
+  uint64_t weights;             /**< parameters */
+  uint64_t grads;               /**< gradients wrt parameters */
+  uint64_t opt;                 /**< optimizer states */
+  uint64_t act;                 /**< outputs, gradients wrt inputs and other per-sample tensors */
+  uint64_t total;               /**< sizeof the layer (the rest is options, pointers, etc.) */
+  /**
+     @brief the sum of two footprints
+  */
+  constexpr layer_mem operator+(const layer_mem& o) const {
+    return layer_mem{ weights + o.weights, grads + o.grads, opt + o.opt,
+                      act + o.act, total + o.total };
+  }
+};
+
+/**
+   @brief read the resident set size and its peak of this process
+   @param (rss) gets the resident set size (bytes)
+   @param (peak) gets the peak of it so far (bytes)
+   @return 0 if succeeded (they are -1 otherwise)
+*/
+static int mem_rss(long * rss, long * peak) {
+  *rss = *peak = -1;
+  FILE * fp = fopen("/proc/self/status", "rb");
+  if (!fp) return -1;
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    long kb;
+    if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) *rss = kb * 1024;
+    else if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) *peak = kb * 1024;
+  }
+  fclose(fp);
+  return (*rss >= 0 && *peak >= 0 ? 0 : -1);
+}
+
+/**
+   @brief format a row of the footprint table
+   @param (name) name of the layer (null for the header)
+   @param (type) its type (e.g., "Convolution2D<64,1,28,28,3,32>")
+   @param (m) its footprint
+   @param (line) gets the row
+*/
+static void mem_format_row(const char * name, const char * type, layer_mem m,
+                           char * line, size_t sz) {
+  if (!name) {
+    snprintf(line, sz, "%-16s %-34s %10s %10s %10s %12s %10s %12s",
+             "layer", "type", "weights", "grads", "optimizer", "activations", "other", "total");
+    return;
+  }
+  snprintf(line, sz, "%-16s %-34s %10lu %10lu %10lu %12lu %10lu %12lu",
+           name, type, (unsigned long)m.weights, (unsigned long)m.grads, (unsigned long)m.opt,
+           (unsigned long)m.act,
+           (unsigned long)(m.total - m.weights - m.grads - m.opt - m.act),
+           (unsigned long)m.total);
+}
+
+/**
+   @brief a layer-like struct, for the test
+*/
+struct mem_report_test_layer {
+  float w[1000];                /**< weights */
+  float gw[1000];               /**< gradients */
+  float v[2000];                /**< optimizer states */
+  float y[64][100];             /**< outputs */
+  long n;                       /**< something else */
+  /**
+     @brief the footprint
+  */
+  static constexpr layer_mem memory() {
+    return layer_mem{ sizeof(w), sizeof(gw), sizeof(v), sizeof(y), sizeof(mem_report_test_layer) };
+  }
+};
+
+/**
+   @brief entry point of this header file
+   @details if this header file is included from
+   a main C++ file and define mem_report_main to be main
+   (e.g., with -Dmem_report_main=main), then this
+   function becomes th main function of the executable.
+   it checks the footprint of a layer-like struct, and that
+   touching 64MB raises RSS and its peak by about as much and
+   freeing it lowers RSS but not the peak.
+*/
+int mem_report_main(int argc, char ** argv) {
+  (void)argc;
+  (void)argv;
+  char line[256];
+  layer_mem m = mem_report_test_layer::memory();
+  mem_format_row(0, 0, m, line, sizeof(line));
+  printf("%s\n", line);
+  mem_format_row("test", "mem_report_test_layer", m, line, sizeof(line));
+  printf("%s\n", line);
+  int ok = (m.weights == 4000 && m.grads == 4000 && m.opt == 8000 && m.act == 25600
+            && m.total == sizeof(mem_report_test_layer)
+            && (m + m).act == 2 * m.act);
+  long rss0, peak0, rss1, peak1, rss2, peak2;
+  const long sz = 64L << 20;
+  ok = ok && mem_rss(&rss0, &peak0) == 0;
+  char * a = (char *)malloc(sz);
+  memset(a, 1, sz);
+  ok = ok && mem_rss(&rss1, &peak1) == 0;
+  asm volatile("" : : "r"(a) : "memory");
+  free(a);
+  ok = ok && mem_rss(&rss2, &peak2) == 0;
+  printf("rss %.1f -> %.1f -> %.1f MB, peak %.1f -> %.1f -> %.1f MB\n",
+         rss0 / 1048576.0, rss1 / 1048576.0, rss2 / 1048576.0,
+         peak0 / 1048576.0, peak1 / 1048576.0, peak2 / 1048576.0);
+  /* the kernel updates the counters lazily, so they may be off by a little */
+  const long slack = 1L << 20;
+  ok = ok && rss1 - rss0 > sz * 9 / 10 && peak1 >= rss1 - slack
+    && rss2 < rss1 - sz / 2 && peak2 >= peak1 - slack;
+  printf("%s\n", ok ? "OK" : "NG");
+  return ok ? 0 : 1;
+}
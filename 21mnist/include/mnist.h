@@ -13,6 +13,8 @@
 #include "linear.h"
 #include "nll_softmax.h"
 #include "grad_check.h"
+#include "feature_store.h"
+#include "grad_route.h"
 
 /**
    @file mnist.h
@@ -20,6 +22,103 @@
  */
 #pragma once
 
+/**
+   @brief which layer outputs are recomputed in backward rather
+   than kept from forward (activation checkpointing)
+   @details each flag names a cheap elementwise layer (relu or dropout).
+   when set, the layer writes its output to a shared scratch buffer
+   instead of its own y, which therefore never gets touched.
+   if backward needs the output (i.e., the next layer is conv or fc,
+   whose gradient wrt weights needs their input), it is regenerated
+   from the kept input of the layer right before it is needed.
+   outputs consumed only by max pooling or dropout (relu2, relu3)
+   are never needed in backward, so they are dropped for free.
+*/
+struct MNISTRecomputeCfg {
+  int relu1;                    /**< recompute relu1.y from conv1.y before conv2.backward */
+  int relu2;                    /**< do not keep relu2.y (max pooling keeps argmax) */
+  int dropout1;                 /**< recompute dropout1.y from max_pooling_2d.y before fc1.backward */
+  int relu3;                    /**< do not keep relu3.y (recomputed from fc1.y if dropout2 needs it) */
+  int dropout2;                 /**< recompute dropout2.y before fc2.backward */
+  int error;                    /**< 1 if the spec given to parse_recompute was invalid */
+};
+
+/**
+   @brief parse a --recompute spec (comma-separated layer names, "all" or "none")
+   @param (s) the string given to --recompute
+   @return the configuration; its error field is set if s has an unknown name
+*/
+__attribute__((unused))
+static MNISTRecomputeCfg parse_recompute(const char * s) {
+  MNISTRecomputeCfg rc = {};
+  const char * p = s;
+  while (*p) {
+    size_t n = strcspn(p, ",");
+    if (n == 3 && strncmp(p, "all", n) == 0) {
+      rc.relu1 = rc.relu2 = rc.dropout1 = rc.relu3 = rc.dropout2 = 1;
+    } else if (n == 4 && strncmp(p, "none", n) == 0) {
+    } else if (n == 5 && strncmp(p, "relu1", n) == 0) {
+      rc.relu1 = 1;
+    } else if (n == 5 && strncmp(p, "relu2", n) == 0) {
+      rc.relu2 = 1;
+    } else if (n == 8 && strncmp(p, "dropout1", n) == 0) {
+      rc.dropout1 = 1;
+    } else if (n == 5 && strncmp(p, "relu3", n) == 0) {
+      rc.relu3 = 1;
+    } else if (n == 8 && strncmp(p, "dropout2", n) == 0) {
+      rc.dropout2 = 1;
+    } else if (n > 0) {
+      fprintf(stderr, "error: invalid layer in --recompute (%.*s)\n", (int)n, p);
+      rc.error = 1;
+    }
+    p += n;
+    if (*p == ',') p++;
+  }
+  return rc;
+}
+
+/**
+   @brief a scratch buffer recomputed outputs go to (--recompute)
+   @details a copy of MNIST (e.g., make_copy in gradient checks)
+   gets a buffer of its own with the same contents, so copies
+   neither write to nor free the buffer of the original.
+*/
+struct mnist_scratch {
+  char * p;                     /**< the buffer (null if unused) */
+  size_t bytes;                 /**< its size */
+  mnist_scratch() : p(0), bytes(0) { }
+  mnist_scratch(const mnist_scratch& o) : p(0), bytes(0) {
+    alloc(o.bytes);
+    if (p) memcpy(p, o.p, bytes);
+  }
+  mnist_scratch& operator=(const mnist_scratch& o) {
+    if (this != &o) {
+      alloc(o.bytes);
+      if (p) memcpy(p, o.p, bytes);
+    }
+    return *this;
+  }
+  ~mnist_scratch() { release(); }
+  /**
+     @brief (re)allocate the buffer with sz bytes of zeros (none if sz == 0)
+  */
+  void alloc(size_t sz) {
+    release();
+    if (sz == 0) return;
+    p = (char *)calloc(1, sz);
+    if (!p) { perror("calloc"); bail(); }
+    bytes = sz;
+  }
+  /**
+     @brief free the buffer
+  */
+  void release() {
+    free(p);
+    p = 0;
+    bytes = 0;
+  }
+};
+
 /**
    @brief configuration data for MNIST
 */
@@ -35,6 +134,7 @@ struct MNISTCfg {
   DropoutCfg dropout2;            /**< dropout2's cfg parameter */
   LinearCfg fc2;                  /**< fc2's cfg parameter */
   NLLSoftmaxCfg nll_softmax;   /**< nll_softmax's cfg parameter */
+  MNISTRecomputeCfg recompute; /**< which layer outputs are recomputed in backward */
 };
 
 /**
@@ -75,6 +175,21 @@ struct MNIST {
   Dropout<maxB,nF> dropout2;
   Linear<maxB,nC,nF> fc2;
   NLLSoftmax<maxB,nC> nll_softmax;
+  MNISTRecomputeCfg rc;         /**< which layer outputs are recomputed in backward */
+  mnist_scratch scratch[2];     /**< buffers recomputed outputs go to (each copy has its own) */
+  size_t scratch_bytes;         /**< bytes of scratch[0] and scratch[1] */
+  tensor<real,maxB,C,H,W> sb_x; /**< samples selected for backward (--sb-fraction), packed */
+  tensor<idx_t,maxB> sb_t;      /**< true labels of sb_x */
+  tensor<real,maxB> sb_gy;      /**< importance weights of sb_x (the gradient of the loss wrt their outputs) */
+  rnd_gen_t sb_rg;              /**< random number generator to draw samples (--sb-mode sample) */
+  long sb_seen;                 /**< samples forwarded by selective backprop in the current epoch */
+  long sb_selected;             /**< samples backpropagated among them */
+  feature_store feats;          /**< max_pooling_2d outputs of training images (--freeze-conv 1) */
+  long feat_hits;               /**< samples whose features came from feats in the current epoch */
+  long feat_misses;             /**< samples whose features were computed in the current epoch */
+  conv_patches<maxB,C,H,W,K> xp; /**< precomputed conv1 patches of x (--conv1-patches) */
+  grad_route<maxB,C2,H2,W2,2> route2; /**< dropout1 -> max_pooling_2d -> relu2 in one pass (--fuse-backward) */
+  grad_route<maxB,nF,1,1,1> route3;   /**< dropout2 -> relu3 in one pass (--fuse-backward) */
   
   /**
      @brief initialize everything
@@ -97,6 +212,186 @@ struct MNIST {
     dropout2.init(opt, lgr, rg, cfg.dropout2);
     fc2.init(opt, lgr, rg, cfg.fc2);
     nll_softmax.init(opt, lgr, rg, cfg.nll_softmax);
+    if (opt.fuse_dropout && opt.algo != algo_cpu_simd && opt.algo != algo_cpu_omp) {
+      lgr->log(1, "# fuse dropout: not supported by %s, running dropout1 as a layer", opt.algo_s);
+      this->opt.fuse_dropout = 0;
+    }
+    init_recompute(cfg.recompute);
+    init_selective();
+    feats.base = 0;
+    feats.filled = 0;
+    feat_hits = feat_misses = 0;
+    xp.fmt = patch_fmt_none;
+    xp.n0 = 0;
+    xp.x = 0;
+    if (strcmp(opt.conv1_patches, "none") != 0) {
+      if (opt.cuda_algo) {
+        lgr->log(1, "# conv1 patches: not supported by %s, gathering from images", opt.algo_s);
+        this->opt.conv1_patches = "none";
+      } else {
+        conv1.patches = &xp;
+      }
+    }
+    if (strcmp(opt.conv_fft, "off") != 0) {
+      if (opt.cuda_algo) {
+        lgr->log(1, "# conv fft: not supported by %s, running direct convolution", opt.algo_s);
+        this->opt.conv_fft = "off";
+      } else {
+        lgr->log(1, "# conv fft (%s): conv1 %s, conv2 %s", opt.conv_fft,
+                 (conv1.patches ? "patches" : conv1.use_fft ? "fft" : "direct"),
+                 (conv2.use_fft ? "fft" : "direct"));
+      }
+    }
+    if (opt.cuda_algo && opt.fuse_backward) {
+      lgr->log(1, "# fuse backward: not supported by %s, running backward of each layer", opt.algo_s);
+      this->opt.fuse_backward = 0;
+    }
+    route2.init(this->opt, lgr);
+    route3.init(this->opt, lgr);
+    if (opt.cuda_algo && opt.freeze_conv) {
+      lgr->log(1, "# freeze conv: not supported by %s, training all layers", opt.algo_s);
+      this->opt.freeze_conv = 0;
+    }
+  }
+  /**
+     @brief set up selective backprop (--sb-fraction)
+     @details samples are gathered on the host, so selective
+     backprop is turned off for cuda algorithms.
+  */
+  void init_selective() {
+    if (opt.cuda_algo && opt.sb_fraction < 1.0) {
+      lgr->log(1, "# selective backprop: not supported by %s, backpropagating all samples", opt.algo_s);
+      opt.sb_fraction = 1.0;
+    }
+    sb_rg.seed(opt.weight_seed + 1);
+    sb_seen = sb_selected = 0;
+  }
+  /**
+     @brief set up scratch buffers for recomputed layer outputs
+     @param (rc) which layer outputs are recomputed
+     @details slot 0 holds whichever recomputed output is live
+     (at most one of relu1/relu2/dropout1/dropout2 is live at any
+     time, both in forward and backward). slot 1 holds relu3's
+     output, which is live together with dropout2's.
+     the kernels writing to scratch are cpu-only, so
+     recomputation is turned off for cuda algorithms.
+  */
+  void init_recompute(MNISTRecomputeCfg rc) {
+    if (opt.cuda_algo && (rc.relu1 || rc.relu2 || rc.dropout1 || rc.relu3 || rc.dropout2)) {
+      lgr->log(1, "# recompute: not supported by %s, keeping all outputs", opt.algo_s);
+      rc = MNISTRecomputeCfg();
+    }
+    if (rc.dropout1 && opt.fuse_dropout) {
+      lgr->log(1, "# recompute: dropout1 is applied by fc1 (--fuse-dropout 1), no output to recompute");
+      rc.dropout1 = 0;
+    }
+    this->rc = rc;
+    size_t sz0 = 0;
+    if (rc.relu1)    sz0 = max_sz(sz0, sizeof(relu1.y));
+    if (rc.relu2)    sz0 = max_sz(sz0, sizeof(relu2.y));
+    if (rc.dropout1) sz0 = max_sz(sz0, sizeof(dropout1.y));
+    if (rc.dropout2) sz0 = max_sz(sz0, sizeof(dropout2.y));
+    size_t sz1 = (rc.relu3 ? sizeof(relu3.y) : 0);
+    scratch[0].alloc(sz0);
+    scratch[1].alloc(sz1);
+    scratch_bytes = sz0 + sz1;
+    log_recompute();
+  }
+  /**
+     @brief the larger of two sizes
+  */
+  static size_t max_sz(size_t a, size_t b) {
+    return (a < b ? b : a);
+  }
+  /**
+     @brief release scratch buffers
+  */
+  void fini() {
+    scratch[0].release();
+    scratch[1].release();
+    feats.close();
+  }
+  /**
+     @brief view scratch buffer i as a tensor of type T
+  */
+  template<typename T>
+  T& slot(int i) {
+    return *(T *)scratch[i].p;
+  }
+  /**
+     @brief report the memory saved and the work added by recomputation
+     @details memory is counted for the actual batch size
+     (--batch-size); work is the number of elementwise operations
+     redone in backward, relative to the flops of a forward pass
+     (multiply-add = 2 flops, elementwise = 1 flop)
+  */
+  void log_recompute() {
+    if (!(rc.relu1 || rc.relu2 || rc.dropout1 || rc.relu3 || rc.dropout2)) return;
+    const long B = opt.batch_size;
+    const long n1 = C1 * H1 * W1, n2 = C2 * H2 * W2, n3 = C2 * H3 * W3;
+    const long fwd = 2L * C * K * K * n1 + n1 + 2L * C1 * K * K * n2 + n2 + n2
+      + n3 + 2L * n3 * nF + nF + nF + 2L * nF * nC + 3L * nC;
+    long dropped = 0, extra = 0, slot0 = 0;
+    if (rc.relu1)    { dropped += n1; extra += n1; slot0 = max_i(slot0, n1); }
+    if (rc.relu2)    { dropped += n2;              slot0 = max_i(slot0, n2); }
+    if (rc.dropout1) { dropped += n3; extra += n3; slot0 = max_i(slot0, n3); }
+    if (rc.relu3)    { dropped += nF; extra += (rc.dropout2 ? nF : 0); }
+    if (rc.dropout2) { dropped += nF; extra += nF; slot0 = max_i(slot0, nF); }
+    long scratch_n = slot0 + (rc.relu3 ? nF : 0);
+    lgr->log(1, "# recompute: relu1=%d relu2=%d dropout1=%d relu3=%d dropout2=%d",
+             rc.relu1, rc.relu2, rc.dropout1, rc.relu3, rc.dropout2);
+    lgr->log(1, "# recompute: outputs not kept %ld bytes, scratch %ld bytes, saved %ld bytes (batch %ld)",
+             dropped * B * (long)sizeof(real), scratch_n * B * (long)sizeof(real),
+             (dropped - scratch_n) * B * (long)sizeof(real), B);
+    lgr->log(1, "# recompute: extra %ld flops/sample in backward = %.2f%% of forward (%ld flops/sample)",
+             extra, 100.0 * extra / fwd, fwd);
+  }
+  /**
+     @brief log the footprint of layer L as a row of the memory table
+     and add it to sum
+  */
+  template<typename L>
+  void log_layer_mem(const char * name, const char * type, layer_mem& sum) {
+    char line[256];
+    layer_mem m = L::memory();
+    mem_format_row(name, type, m, line, sizeof(line));
+    lgr->log(2, "# memory: %s", line);
+    sum = sum + m;
+  }
+  /**
+     @brief log the static footprint of each layer and the model
+     (--mem-report 1)
+     @details activations are for the batch size compiled in
+     (MAX_BATCH_SIZE), not --batch-size. the model row adds
+     the inputs, labels, predictions, the gradient of the loss,
+     the packed sub-batch of selective backprop and the conv1
+     patches of a mini batch held by MNIST to the activations; recompute scratch
+     buffers (--recompute) are allocated separately.
+  */
+  void log_memory() {
+    if (!opt.mem_report) return;
+    char line[256];
+    layer_mem sum = { 0, 0, 0, 0, 0 };
+    mem_format_row(0, 0, sum, line, sizeof(line));
+    lgr->log(2, "# memory: %s", line);
+    log_layer_mem<decltype(conv1)>("conv1", "Convolution2D", sum);
+    log_layer_mem<decltype(relu1)>("relu1", "Relu", sum);
+    log_layer_mem<decltype(conv2)>("conv2", "Convolution2D", sum);
+    log_layer_mem<decltype(relu2)>("relu2", "Relu", sum);
+    log_layer_mem<decltype(max_pooling_2d)>("max_pooling_2d", "MaxPooling2D", sum);
+    log_layer_mem<decltype(dropout1)>("dropout1", "Dropout", sum);
+    log_layer_mem<decltype(fc1)>("fc1", "Linear", sum);
+    log_layer_mem<decltype(relu3)>("relu3", "Relu", sum);
+    log_layer_mem<decltype(dropout2)>("dropout2", "Dropout", sum);
+    log_layer_mem<decltype(fc2)>("fc2", "Linear", sum);
+    log_layer_mem<decltype(nll_softmax)>("nll_softmax", "NLLSoftmax", sum);
+    layer_mem m = sum;
+    m.act += sizeof(x) + sizeof(t) + sizeof(idxs) + sizeof(pred) + sizeof(gy)
+      + sizeof(sb_x) + sizeof(sb_t) + sizeof(sb_gy) + sizeof(xp);
+    m.total = sizeof(*this);
+    mem_format_row("model", "MNIST", m, line, sizeof(line));
+    lgr->log(1, "# memory: %s", line);
+    lgr->log(1, "# memory: recompute scratch %lu bytes", (unsigned long)scratch_bytes);
   }
   /**
      @brief set the device pointer for this and all subobjects
@@ -142,8 +437,10 @@ struct MNIST {
      @sa backward
   */
   void update() {
-    conv1.update();
-    conv2.update();
+    if (!opt.freeze_conv) {
+      conv1.update();
+      conv2.update();
+    }
     fc1.update();
     fc2.update();
   }
@@ -160,19 +457,66 @@ struct MNIST {
      @sa update
   */
   tensor<real,maxB>& forward(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t, int training) {
+    return forward_classifier(forward_features(x, training), t, training);
+  }
+  /**
+     @brief the first half of forward (conv1 to max_pooling_2d)
+     @param (x) input images
+     @param (training) 1 if it is called in training not testing
+     @return the output of max_pooling_2d (features)
+     @sa forward
+  */
+  tensor<real,maxB,C2,H3,W3>& forward_features(tensor<real,maxB,C,H,W>& x, int training) {
+    typedef tensor<real,maxB,C1,H1,W1> t2;
+    typedef tensor<real,maxB,C2,H2,W2> t4;
     tensor<real,maxB,C1,H1,W1>& x1  = conv1.forward(x, training);
-    tensor<real,maxB,C1,H1,W1>& x2  = relu1.forward(x1, training);
+    tensor<real,maxB,C1,H1,W1>& x2  = (rc.relu1 ? relu1.forward_to(x1, slot<t2>(0), training)
+                                       : relu1.forward(x1, training));
     tensor<real,maxB,C2,H2,W2>& x3  = conv2.forward(x2, training);
-    tensor<real,maxB,C2,H2,W2>& x4  = relu2.forward(x3, training);
+    tensor<real,maxB,C2,H2,W2>& x4  = (rc.relu2 ? relu2.forward_to(x3, slot<t4>(0), training)
+                                       : relu2.forward(x3, training));
     tensor<real,maxB,C2,H3,W3>& x5  = max_pooling_2d.forward(x4, training);
-    tensor<real,maxB,C2,H3,W3>& x6  = dropout1.forward(x5, training);
-    tensor<real,maxB,nF>&       x7  = fc1.forward(x6, training);
-    tensor<real,maxB,nF>&       x8  = relu3.forward(x7, training);
-    tensor<real,maxB,nF>&       x9  = dropout2.forward(x8, training);
+    return x5;
+  }
+  /**
+     @brief the second half of forward (dropout1 to nll_softmax)
+     @param (x5) features (the output of max_pooling_2d)
+     @param (t) true labels
+     @param (training) 1 if it is called in training not testing
+     @return the loss of each sample
+     @details with --fuse-dropout 1, dropout1 only decides which
+     elements it keeps and fc1 reads x5 applying them
+     @sa forward
+  */
+  tensor<real,maxB>& forward_classifier(tensor<real,maxB,C2,H3,W3>& x5, tensor<idx_t,maxB>& t, int training) {
+    typedef tensor<real,maxB,C2,H3,W3> t6;
+    typedef tensor<real,maxB,nF> t8;
+    tensor<real,maxB,nF>&       x7  = (opt.fuse_dropout ? forward_fc1_fused(x5, training)
+                                       : fc1.forward(rc.dropout1 ? dropout1.forward_to(x5, slot<t6>(0), training)
+                                                     : dropout1.forward(x5, training), training));
+    tensor<real,maxB,nF>&       x8  = (rc.relu3 ? relu3.forward_to(x7, slot<t8>(1), training)
+                                       : relu3.forward(x7, training));
+    tensor<real,maxB,nF>&       x9  = (rc.dropout2 ? dropout2.forward_to(x8, slot<t8>(0), training)
+                                       : dropout2.forward(x8, training));
     tensor<real,maxB,nC>&       x10 = fc2.forward(x9, training);
     tensor<real,maxB>&          l   = nll_softmax.forward(x10, t, training);
     return l;
   }
+  /**
+     @brief forward of dropout1 and fc1 with the mask and scale of
+     dropout1 applied as fc1 reads x5 (--fuse-dropout 1)
+     @param (x5) features (the output of max_pooling_2d)
+     @param (training) 1 if it is called in training not testing
+     @return the output of fc1
+     @details dropout1.y is not written. when not training,
+     nothing is dropped and fc1 reads x5 as is
+     @sa forward_classifier
+  */
+  tensor<real,maxB,nF>& forward_fc1_fused(tensor<real,maxB,C2,H3,W3>& x5, int training) {
+    dropout1.forward_mask(x5.n0, training);
+    fc1.set_input_dropout(training ? &dropout1.keep : 0, dropout1.scale(training));
+    return fc1.forward(x5, training);
+  }
   /**
      @brief calc the gradient of loss wrt the input (x)
      @param (gy) gradient of loss with respect to the output
@@ -181,6 +525,14 @@ struct MNIST {
      all sublayers that have weights. since this is the entire
      network, gy is actually a vector whose components are all 1.
      (loss = sum of losses of each data).
+     outputs selected by --recompute are regenerated into the
+     same scratch buffers forward wrote them to, right before
+     the layer consuming them (conv2, fc1 or fc2) runs backward.
+     with --fuse-backward 1, conv2 and fc1 take the gradient wrt
+     the output of dropout1/dropout2 and make their own gy in one
+     pass (grad_route); backward of the layers in between is skipped.
+     with --fuse-dropout 1, the gradient fc1 returns is already
+     wrt the input of dropout1, and dropout1.backward is skipped.
      @sa backward_cpu_base
      @sa backward_cuda_base
      @sa backward_cuda_base_global
@@ -190,18 +542,75 @@ struct MNIST {
      @sa update
   */
   tensor<real,maxB,C,H,W>& backward(tensor<real,maxB>& gl, tensor<idx_t,maxB>& t) {
+    typedef tensor<real,maxB,C1,H1,W1> t2;
+    tensor<real,maxB,C2,H3,W3>& gx6  = backward_classifier(gl, t);
+    if (rc.relu1) {
+      relu1.forward_to(conv1.y, slot<t2>(0), 1);
+    }
+    tensor<real,maxB,C1,H1,W1>& gx2  = (opt.fuse_backward ? backward_conv2_fused(gx6) : backward_conv2(gx6));
+    tensor<real,maxB,C1,H1,W1>& gx1  = relu1.backward(gx2);
+    tensor<real,maxB,C,H,W>&    gx   = conv1.backward(gx1);
+    return gx;
+  }
+  /**
+     @brief the part of backward for layers of forward_classifier
+     but dropout1 (nll_softmax to fc1)
+     @param (gl) gradient of loss with respect to the output
+     @param (t) true labels
+     @return the gradient of loss wrt the output of dropout1
+     (its input with --fuse-dropout 1)
+     @sa backward
+  */
+  tensor<real,maxB,C2,H3,W3>& backward_classifier(tensor<real,maxB>& gl, tensor<idx_t,maxB>& t) {
+    typedef tensor<real,maxB,C2,H3,W3> t6;
+    typedef tensor<real,maxB,nF> t8;
     tensor<real,maxB,nC>&       gx10 = nll_softmax.backward(gl, t);
+    if (rc.dropout2) {
+      tensor<real,maxB,nF>& x8 = (rc.relu3 ? relu3.forward_to(fc1.y, slot<t8>(1), 1) : relu3.y);
+      dropout2.recompute_to(x8, slot<t8>(0));
+    }
     tensor<real,maxB,nF>&       gx9  = fc2.backward(gx10);
+    if (opt.fuse_backward) {
+      route3.set(relu3, 0, &dropout2);
+      if (rc.dropout1) {
+        dropout1.recompute_to(max_pooling_2d.y, slot<t6>(0));
+      }
+      return fc1.backward_routed(gx9, route3, relu3.gx);
+    }
     tensor<real,maxB,nF>&       gx8  = dropout2.backward(gx9);
     tensor<real,maxB,nF>&       gx7  = relu3.backward(gx8);
+    if (rc.dropout1) {
+      dropout1.recompute_to(max_pooling_2d.y, slot<t6>(0));
+    }
     tensor<real,maxB,C2,H3,W3>& gx6  = fc1.backward(gx7);
-    tensor<real,maxB,C2,H3,W3>& gx5  = dropout1.backward(gx6);
+    return gx6;
+  }
+  /**
+     @brief backward of dropout1, max_pooling_2d, relu2 and conv2,
+     one layer after another
+     @param (gx6) gradient of loss wrt the output of dropout1
+     (its input with --fuse-dropout 1)
+     @return the gradient of loss wrt the input of conv2
+     @sa backward
+  */
+  tensor<real,maxB,C1,H1,W1>& backward_conv2(tensor<real,maxB,C2,H3,W3>& gx6) {
+    tensor<real,maxB,C2,H3,W3>& gx5  = (opt.fuse_dropout ? gx6 : dropout1.backward(gx6));
     tensor<real,maxB,C2,H2,W2>& gx4  = max_pooling_2d.backward(gx5);
     tensor<real,maxB,C2,H2,W2>& gx3  = relu2.backward(gx4);
-    tensor<real,maxB,C1,H1,W1>& gx2  = conv2.backward(gx3);
-    tensor<real,maxB,C1,H1,W1>& gx1  = relu1.backward(gx2);
-    tensor<real,maxB,C,H,W>&    gx   = conv1.backward(gx1);
-    return gx;
+    return conv2.backward(gx3);
+  }
+  /**
+     @brief backward of conv2 from the gradient wrt the output of
+     dropout1, routed through dropout1, max_pooling_2d and relu2 in
+     one pass into relu2.gx (--fuse-backward 1)
+     @param (gx6) gradient of loss wrt the output of dropout1
+     (its input with --fuse-dropout 1, and routing skips dropout1)
+     @return the gradient of loss wrt the input of conv2
+     @sa backward
+  */
+  tensor<real,maxB,C1,H1,W1>& backward_conv2_fused(tensor<real,maxB,C2,H3,W3>& gx6) {
+    route2.set(relu2, &max_pooling_2d, (opt.fuse_dropout ? 0 : &dropout1));
+    return conv2.backward_routed(gx6, route2, relu2.gx);
   }
   /**
      @brief write the predicted class of all samples of the batch into pred
@@ -239,6 +648,7 @@ struct MNIST {
     for (idx_t s = 0; s < B; s++) {
       lgr->log(3, "sample %d image %d pred %d truth %d",
                start_offset + s, idxs(s), pred(s), t(s));
+      lgr->record(3, run_rec_sample, 0, start_offset + s, idxs(s), pred(s), t(s));
       if (pred(s) == t(s)) {
         correct++;
       }
@@ -258,7 +668,28 @@ struct MNIST {
      gradients
   */
   real forward_backward_update(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t) {
+    real Lsum = forward_backward(x, t, 0);
+    /* update */
+    update();
+    return Lsum;
+  }
+  /**
+     @brief forward and backward on a mini batch without updating weights
+     @param (x) input images (a mini batch)
+     @param (t) true labels
+     @param (accumulate) 1 if gradients wrt weights are added to those
+     of previous calls rather than overwriting them
+     @return the sum of the losses of all samples in the batch
+     @details calling this k times (accumulate = 0 first, then 1)
+     and then update is equivalent to forward_backward_update on
+     a single batch made of all k micro batches, as the loss (and
+     therefore its gradient) is the sum over samples
+     @sa forward_backward_update
+     @sa set_accumulate
+  */
+  real forward_backward(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t, int accumulate) {
     const idx_t B = x.n0;
+    set_accumulate(accumulate);
     /* forward */
     tensor<real,maxB>& L = forward(x, t, 1);
     /* a vector (1,1,1,...) to make the single loss value from loss of each sample */
@@ -266,13 +697,221 @@ struct MNIST {
     to_dev(&gy, opt.cuda_algo);
     /* backward (set weights of all sublayers) */
     backward(gy, t);
-    /* update */
-    update();
     /* get the loss of each sample back to host if we are working on GPU */
     to_host(&L, opt.cuda_algo);
     double Lsum = gy.dot(L);
     return Lsum;
   }
+  /**
+     @brief 1 if mini batches of epoch are trained by
+     forward_backward_selective (--sb-fraction < 1 and the
+     warm-up epochs (--sb-warmup) are over)
+  */
+  int selective(long epoch) {
+    return opt.sb_fraction < 1.0 && epoch > opt.sb_warmup;
+  }
+  /**
+     @brief choose samples of a mini batch to backpropagate by their losses
+     @param (L) the loss of each sample
+     @param (B) the number of samples
+     @param (sel) gets the samples chosen (indexes into the mini batch)
+     @param (wt) gets their importance weights
+     @return the number of samples chosen (k = round(B * --sb-fraction), at least 1)
+     @details with --sb-mode hard, the k samples of the largest losses
+     are chosen, each weighted by B/k so the gradient keeps the scale
+     of the whole mini batch. with --sb-mode sample, k samples are
+     drawn with replacement with probabilities p_i proportional to
+     their losses (plus a small floor, so that every sample may be
+     drawn) and weighted by 1/(k p_i), which makes the gradient an
+     unbiased estimate of that of the whole mini batch.
+  */
+  idx_t select_by_loss(tensor<real,maxB>& L, idx_t B, idx_t * sel, real * wt) {
+    idx_t k = (idx_t)(B * opt.sb_fraction + 0.5);
+    if (k < 1) k = 1;
+    if (k > B) k = B;
+    if (strcmp(opt.sb_mode, "hard") == 0) {
+      /* partial selection sort of indexes by decreasing loss */
+      idx_t idx[maxB];
+      for (idx_t s = 0; s < B; s++) idx[s] = s;
+      for (idx_t j = 0; j < k; j++) {
+        idx_t m = j;
+        for (idx_t s = j + 1; s < B; s++) {
+          if (L(idx[s]) > L(idx[m])) m = s;
+        }
+        idx_t tmp = idx[j]; idx[j] = idx[m]; idx[m] = tmp;
+        sel[j] = idx[j];
+        wt[j] = (real)B / k;
+      }
+    } else {
+      double cum[maxB];
+      double sum = 0.0;
+      for (idx_t s = 0; s < B; s++) sum += L(s);
+      const double floor = 1.0e-3 * sum / B + 1.0e-12;
+      double tot = 0.0;
+      for (idx_t s = 0; s < B; s++) {
+        tot += L(s) + floor;
+        cum[s] = tot;
+      }
+      for (idx_t j = 0; j < k; j++) {
+        double u = sb_rg.rand01() * tot;
+        idx_t lo = 0, hi = B - 1;
+        while (lo < hi) {       /* the first s with cum[s] > u */
+          idx_t mid = (lo + hi) / 2;
+          if (cum[mid] > u) hi = mid; else lo = mid + 1;
+        }
+        double p = (L(lo) + floor) / tot;
+        sel[j] = lo;
+        wt[j] = (real)(1.0 / (k * p));
+      }
+    }
+    return k;
+  }
+  /**
+     @brief forward a mini batch, and backward only the samples
+     selected by their losses (selective backprop, --sb-fraction)
+     @param (x) input images (a mini batch)
+     @param (t) true labels
+     @param (accumulate) 1 if gradients wrt weights are added to those
+     of previous calls rather than overwriting them
+     @return the sum of the losses of all samples in the batch
+     @details the whole mini batch is forwarded without dropout
+     to score samples (pred gets their predicted classes, so the
+     caller need not call predict). the selected samples are packed
+     into a dense sub-batch (sb_x, sb_t), which is forwarded again
+     with dropout and backwarded with the gradient of the loss
+     wrt each of its outputs set to the sample's importance weight
+     (select_by_loss). this costs a forward of the whole batch
+     plus a forward and backward of the fraction selected, instead
+     of a forward and backward of the whole batch.
+     @sa forward_backward
+     @sa select_by_loss
+  */
+  real forward_backward_selective(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t, int accumulate) {
+    const idx_t B = x.n0;
+    /* score all samples */
+    tensor<real,maxB>& L = forward(x, t, 0);
+    double Lsum = 0.0;
+    for (idx_t s = 0; s < B; s++) Lsum += L(s);
+    predict(pred);
+    /* choose and pack them */
+    idx_t sel[maxB];
+    real wt[maxB];
+    const idx_t k = select_by_loss(L, B, sel, wt);
+    sb_x.set_n0(k);
+    sb_t.set_n0(k);
+    sb_gy.set_n0(k);
+    for (idx_t j = 0; j < k; j++) {
+      memcpy(sb_x.w[j], x.w[sel[j]], sizeof(x.w[0]));
+      sb_t(j) = t(sel[j]);
+      sb_gy(j) = wt[j];
+    }
+    /* forward and backward the sub-batch */
+    set_accumulate(accumulate);
+    forward(sb_x, sb_t, 1);
+    backward(sb_gy, sb_t);
+    sb_seen += B;
+    sb_selected += k;
+    return Lsum;
+  }
+  /**
+     @brief log how many samples selective backprop backpropagated
+     in an epoch and reset the counts
+  */
+  void log_selective(long epoch) {
+    if (sb_seen == 0) return;
+    lgr->log(1, "# selective backprop: epoch %ld backpropagated %ld of %ld samples (%.1f%%, %s)",
+             epoch, sb_selected, sb_seen, 100.0 * sb_selected / sb_seen, opt.sb_mode);
+    sb_seen = sb_selected = 0;
+  }
+  /**
+     @brief set up the store of features of training images (--freeze-conv 1)
+     @param (n_items) the number of training images
+     @return 0 if succeeded
+  */
+  int init_frozen(long n_items) {
+    if (!opt.freeze_conv) return 0;
+    const long m = C2 * H3 * W3;
+    if (feats.open(opt.feature_store, n_items, m, opt.feature_fp16) != 0) return -1;
+    lgr->log(1, "# freeze conv: conv1/conv2 frozen, features of %ld images x %ld %s = %lu bytes in %s",
+             n_items, m, (opt.feature_fp16 ? "fp16" : "floats"), (unsigned long)feats.bytes,
+             (opt.feature_store[0] ? opt.feature_store : "anonymous memory"));
+    return 0;
+  }
+  /**
+     @brief forward and backward a mini batch with conv1/conv2
+     frozen, getting their outputs from the feature store
+     (--freeze-conv 1)
+     @param (x) input images (a mini batch)
+     @param (t) true labels
+     @param (idxs) indexes of images (keys of the feature store)
+     @param (accumulate) 1 if gradients wrt weights are added to those
+     of previous calls rather than overwriting them
+     @return the sum of the losses of all samples in the batch
+     @details if the features of all images of the batch are in
+     the store, they are copied into max_pooling_2d.y and forward
+     starts at dropout1; otherwise (the first epoch) conv1 to
+     max_pooling_2d run forward and the features of images not in
+     the store are put. backward stops at fc1 either way, as
+     nothing below it is updated.
+     @sa forward_backward
+  */
+  real forward_backward_frozen(tensor<real,maxB,C,H,W>& x, tensor<idx_t,maxB>& t,
+                               tensor<idx_t,maxB>& idxs, int accumulate) {
+    const idx_t B = x.n0;
+    tensor<real,maxB,C2,H3,W3>& x5 = max_pooling_2d.y;
+    idx_t miss = 0;
+    for (idx_t s = 0; s < B; s++) {
+      if (!feats.has(idxs(s))) miss++;
+    }
+    if (miss) {
+      forward_features(x, 0);
+      for (idx_t s = 0; s < B; s++) {
+        if (!feats.has(idxs(s))) feats.put(idxs(s), &x5.w[s][0][0][0]);
+      }
+    } else {
+      x5.set_n0(B);
+      for (idx_t s = 0; s < B; s++) {
+        feats.get(idxs(s), &x5.w[s][0][0][0]);
+      }
+    }
+    feat_misses += miss;
+    feat_hits += B - miss;
+    set_accumulate(accumulate);
+    tensor<real,maxB>& L = forward_classifier(x5, t, 1);
+    gy.init_const(B, 1.0);
+    backward_classifier(gy, t);
+    double Lsum = gy.dot(L);
+    return Lsum;
+  }
+  /**
+     @brief log how many features came from the store in an epoch
+     and reset the counts
+  */
+  void log_frozen(long epoch) {
+    if (!opt.freeze_conv) return;
+    lgr->log(1, "# freeze conv: epoch %ld features of %ld images from the store, %ld computed (%ld of %ld stored)",
+             epoch, feat_hits, feat_misses, feats.n_filled, feats.n);
+    feat_hits = feat_misses = 0;
+  }
+  /**
+     @brief log the sparsity of gy the convolutions saw in backward
+     in an epoch (--sparse-backward) and reset the counts
+  */
+  void log_sparsity(long epoch) {
+    conv1.log_sparsity("conv1", epoch);
+    conv2.log_sparsity("conv2", epoch);
+  }
+  /**
+     @brief make backward of all sublayers with weights overwrite (0)
+     or add to (1) their gradients
+     @param (accumulate) 0 to overwrite, 1 to add
+  */
+  void set_accumulate(int accumulate) {
+    conv1.set_accumulate(accumulate);
+    conv2.set_accumulate(accumulate);
+    fc1.set_accumulate(accumulate);
+    fc2.set_accumulate(accumulate);
+  }
   /* member functions below assume data are on the host.
      they are only for checking (debugging) implementations */
   /**
@@ -324,6 +963,48 @@ struct MNIST {
     s += a.fc2.grad_dot_grad(b.fc2);
     return s;
   }
+  /**
+     @brief register all the state needed to resume training
+     (weights, optimizer states, dropout generators and the generator
+     of selective backprop) to a checkpoint
+     @param (ck) the checkpoint
+  */
+  void ckpt_sections(checkpoint& ck) {
+    conv1.ckpt_sections(ck, "conv1");
+    conv2.ckpt_sections(ck, "conv2");
+    dropout1.ckpt_sections(ck, "dropout1");
+    fc1.ckpt_sections(ck, "fc1");
+    dropout2.ckpt_sections(ck, "dropout2");
+    fc2.ckpt_sections(ck, "fc2");
+    ck.add("selective", "rg", &sb_rg.x, sizeof(sb_rg.x));
+  }
+  /**
+     @brief bring the state registered by ckpt_sections back to the host
+     @details noop unless we are working on GPU
+  */
+  void ckpt_to_host() {
+    to_host(&conv1, opt.cuda_algo);
+    to_host(&conv2, opt.cuda_algo);
+    to_host(&dropout1, opt.cuda_algo);
+    to_host(&fc1, opt.cuda_algo);
+    to_host(&dropout2, opt.cuda_algo);
+    to_host(&fc2, opt.cuda_algo);
+  }
+  /**
+     @brief advance random number generators of dropout layers
+     as forward (not training) on n samples would
+     @details used when test data are evaluated off this network
+     (--test-threads), so training takes the same course as when
+     they are evaluated on it
+  */
+  void skip_test_forward(long n) {
+    to_host(&dropout1, opt.cuda_algo);
+    to_host(&dropout2, opt.cuda_algo);
+    dropout1.skip_forward(n);
+    dropout2.skip_forward(n);
+    to_dev(&dropout1, opt.cuda_algo);
+    to_dev(&dropout2, opt.cuda_algo);
+  }
 };
 
 /**
@@ -336,7 +1017,8 @@ struct MNIST {
    (e.g., with -Dmnist_main=main), then this
    function becomes th main function of the executable.
    it calls grad_check repeatedly to test
-   the implementation of backward of mnist.
+   the implementation of backward of mnist
+   (with the outputs --recompute gives recomputed).
 */
 int mnist_main(int argc, char ** argv) {
   cmdline_opt opt = parse_args(argc, argv);
@@ -369,7 +1051,8 @@ int mnist_main(int argc, char ** argv) {
     .relu3 = {},
     .dropout2 = { .ratio =  0.5f * (seed2 != 0), .seed = seed2 },
     .fc2 = {},
-    .nll_softmax = {}
+    .nll_softmax = {},
+    .recompute = parse_recompute(opt.recompute)
   };
   for (int iter = 0; iter < n_checks; iter++) {
     printf("==== %d ====\n", iter);
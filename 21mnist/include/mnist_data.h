@@ -11,6 +11,7 @@
 #include <unistd.h>
 #include "mnist_util.h"
 #include "tensor.h"
+#include "im2col_cache.h"
 
 /**
    @brief read a 32 bit int
@@ -122,6 +123,11 @@ struct mnist_dataset {
   long n_data;                  /**< the total number of images  */
   data_item<IC,H,W> * data;     /**< data (n_data items) */
   rnd_gen_t rg; /**< random number generator to pick images for a mini batch  */
+  patch_fmt_t patch_fmt;        /**< format of patches (--conv1-patches) */
+  size_t patch_bytes;           /**< bytes of patches of an image */
+  unsigned char * patches;      /**< patches of conv1 of all images (n_data x patch_bytes; null if none) */
+  real patch_scale;             /**< value = patch_scale * byte + patch_shift (u8) */
+  real patch_shift;             /**< ditto */
   
   /**
      @brief set seed for random number generator
@@ -181,6 +187,11 @@ struct mnist_dataset {
     lgr.log(1, "use %ld data items out of %ld", n_used_data, n_data);
     n_data = n_used_data;
     cur = 0;
+    patch_fmt = patch_fmt_none;
+    patch_bytes = 0;
+    patches = 0;
+    patch_scale = 1.0 / (255.0 * std);
+    patch_shift = -mean / std;
 
     free(img_pv.data);
     delete[] img_pv.dim;
@@ -195,6 +206,36 @@ struct mnist_dataset {
   void close() {
     delete[] data;
     data = 0;
+    free(patches);
+    patches = 0;
+  }
+
+  /**
+     @brief precompute the input patches of a KxK convolution of
+     all images (--conv1-patches; im2col_cache.h)
+     @param (lgr) logger
+     @param (fmt) format (nothing is done for patch_fmt_none)
+     @return bytes of all patches
+   */
+  template<idx_t K>
+  size_t make_patches(logger& lgr, patch_fmt_t fmt) {
+    typedef conv_patches<maxB,IC,H,W,K> cp_t;
+    patch_fmt = fmt;
+    if (fmt == patch_fmt_none) return 0;
+    patch_bytes = cp_t::item_bytes(fmt);
+    tsc_t t0 = get_tsc();
+    patches = (unsigned char *)malloc(patch_bytes * n_data);
+    if (!patches) { perror("malloc"); bail(); }
+    for (long k = 0; k < n_data; k++) {
+      cp_t::encode(fmt, data[k].rgb, data[k].w, patches + patch_bytes * k);
+    }
+    tsc_t t1 = get_tsc();
+    lgr.log(1, "# conv1 patches: %ld images x %lu bytes (%s) = %lu bytes"
+            " (images themselves %lu bytes), made in %ld nsec",
+            n_data, (unsigned long)patch_bytes, (fmt == patch_fmt_u8 ? "u8" : "fp16"),
+            (unsigned long)(patch_bytes * n_data),
+            (unsigned long)(sizeof(data[0].w) * n_data), t1.ns - t0.ns);
+    return patch_bytes * n_data;
   }
   
   /**
@@ -237,6 +278,33 @@ struct mnist_dataset {
     to_dev(&idxs, cuda_algo);
     return actual_B;
   }
+
+  /**
+     @brief load x, t and idxs as get_data does and xp with the
+     patches of the images (the images themselves if patches
+     were not made)
+     @param (xp) patches of the mini batch
+     @return the actual number of data returned
+     @sa make_patches
+   */
+  template<idx_t K>
+  idx_t get_data(tensor<real,maxB,IC,H,W>& x, tensor<idx_t,maxB>& t, tensor<idx_t,maxB>& idxs,
+                 idx_t B, int cuda_algo, conv_patches<maxB,IC,H,W,K>& xp) {
+    long start = cur;
+    idx_t actual_B = get_data(x, t, idxs, B, cuda_algo);
+    xp.fmt = patch_fmt;
+    xp.n0 = actual_B;
+    xp.x = (patch_fmt == patch_fmt_none ? 0 : &x);
+    xp.scale = patch_scale;
+    xp.shift = patch_shift;
+    if (patch_fmt != patch_fmt_none) {
+      assert(patch_bytes <= sizeof(xp.w[0]));
+      for (long b = 0; b < actual_B; b++) {
+        memcpy(xp.w[b], patches + patch_bytes * (start + b), patch_bytes);
+      }
+    }
+    return actual_B;
+  }
 };
 
 /**
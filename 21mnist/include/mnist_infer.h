@@ -0,0 +1,678 @@
+/**
+   @file mnist_infer.h
+   @brief inference-only MNIST network
+   @details the same network as MNIST (mnist.h) without anything
+   needed only for training; no gradients, no optimizer states,
+   no dropout and no buffers kept for backward. weights are loaded
+   from a checkpoint written by mnist --save-ckpt.
+
+   weights (MNISTInferWeights) and per-batch buffers (MNISTInfer)
+   are separate objects, so several MNISTInfer objects (e.g., one
+   per thread) can share a single set of weights.
+
+   relu and max pooling are fused into the convolutions that
+   produce their inputs, so the output of the second convolution
+   (the largest activation in the network) is never stored.
+
+   a single image (B = 1) takes a separate path (forward1) tuned
+   for latency rather than throughput: activations are laid out
+   with channels innermost so that SIMD lanes run over output
+   channels, and rows (of convolutions) and output features (of
+   fc1) are divided among OpenMP threads. fc1 skips zero inputs
+   (about half of them after relu) and each thread reads the same
+   slice of fc1 weights every time, so with enough threads the
+   slices stay in their caches.
+
+   the same kernels classify a batch (B > 1) one image after
+   another on the calling thread (forward_each); they are faster
+   than the batch kernels even without threads, and callers that
+   evaluate many images (parallel_eval.h) run one network per
+   thread instead.
+ */
+#pragma once
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include "mnist_util.h"
+#include "tensor.h"
+#include "checkpoint.h"
+#include "mnist.h"
+
+/**
+   @brief SIMD vector of the single-image path (portable gcc/clang vector extension)
+ */
+typedef real infer_vec __attribute__((vector_size(64),__may_alias__,aligned(sizeof(real))));
+/** @brief lanes of infer_vec */
+enum { IL = sizeof(infer_vec) / sizeof(real) };
+
+/**
+   @brief a vector of real at p
+*/
+static infer_vec& IV(const real& p) { return *((infer_vec *)&p); }
+
+/**
+   @brief elementwise max of two vectors
+*/
+static infer_vec max_iv(infer_vec a, infer_vec b) {
+  infer_vec c;
+  for (idx_t l = 0; l < IL; l++) c[l] = (a[l] > b[l] ? a[l] : b[l]);
+  return c;
+}
+
+/**
+   @brief weights of the inference-only MNIST network
+   @param (C) number of channels in the input
+   @param (H) image height
+   @param (W) image width
+   @param (nC) number of classes
+   @details shapes (and section names in a checkpoint) are the same
+   as those of the corresponding layers of MNIST
+ */
+template<idx_t C,idx_t H,idx_t W,idx_t nC>
+struct MNISTInferWeights {
+  static const idx_t K = 3;     /**< kernel size = 3 x 3 */
+  static const idx_t H1 =  H - K + 1, W1 =  W - K + 1;
+  static const idx_t H2 = H1 - K + 1, W2 = W1 - K + 1;
+  static const idx_t H3 = H2 / 2, W3 = W2 / 2;
+  static const idx_t C1 = 32;   /* channels after first convolution */
+  static const idx_t C2 = 64;   /* channels after second convolution */
+  static const idx_t nF = 128;  /* features output by first fully-connected */
+  tensor<real,C1,C,K,K> conv1_w;    /**< conv1 weight */
+  tensor<real,C1> conv1_b;          /**< conv1 bias */
+  tensor<real,C2,C1,K,K> conv2_w;   /**< conv2 weight */
+  tensor<real,C2> conv2_b;          /**< conv2 bias */
+  tensor<real,C2,H3,W3,nF> fc1_w;   /**< fc1 weight */
+  tensor<real,nF> fc1_b;            /**< fc1 bias */
+  tensor<real,nF,1,1,nC> fc2_w;     /**< fc2 weight */
+  tensor<real,nC> fc2_b;            /**< fc2 bias */
+  real conv1_wp[C][K][K][C1];       /**< conv1_w with output channels innermost (forward1) */
+  real conv2_wp[C1][K][K][C2];      /**< conv2_w with output channels innermost (forward1) */
+
+  /**
+     @brief register weights to a checkpoint (for loading)
+     @param (ck) the checkpoint
+  */
+  void ckpt_sections(checkpoint& ck) {
+    ck.add("conv1", "w", &conv1_w.w, sizeof(conv1_w.w));
+    ck.add("conv1", "b", &conv1_b.w, sizeof(conv1_b.w));
+    ck.add("conv2", "w", &conv2_w.w, sizeof(conv2_w.w));
+    ck.add("conv2", "b", &conv2_b.w, sizeof(conv2_b.w));
+    ck.add("fc1", "w", &fc1_w.w, sizeof(fc1_w.w));
+    ck.add("fc1", "b", &fc1_b.w, sizeof(fc1_b.w));
+    ck.add("fc2", "w", &fc2_w.w, sizeof(fc2_w.w));
+    ck.add("fc2", "b", &fc2_b.w, sizeof(fc2_b.w));
+  }
+  /**
+     @brief load weights from a checkpoint file
+     @param (file) checkpoint written by mnist --save-ckpt
+     @return 0 on success, -1 on failure
+  */
+  int load(const char * file) {
+    checkpoint ck;
+    ck.init();
+    ckpt_sections(ck);
+    ck.layout();
+    int64_t epoch = 0;
+    /* optimizer states in the file are not needed; do not read them */
+    if (ck.restore(file, &epoch, 0) != 0) return -1;
+    conv1_w.set_n0(C1);
+    conv1_b.set_n0(C1);
+    conv2_w.set_n0(C2);
+    conv2_b.set_n0(C2);
+    fc1_w.set_n0(C2);
+    fc1_b.set_n0(nF);
+    fc2_w.set_n0(nF);
+    fc2_b.set_n0(nC);
+    pack();
+    return 0;
+  }
+  /**
+     @brief rearrange convolution weights for the single-image path
+     @details called whenever weights change
+  */
+  void pack() {
+    for (idx_t oc = 0; oc < C1; oc++)
+      for (idx_t ic = 0; ic < C; ic++)
+        for (idx_t di = 0; di < K; di++)
+          for (idx_t dj = 0; dj < K; dj++)
+            conv1_wp[ic][di][dj][oc] = conv1_w.w[oc][ic][di][dj];
+    for (idx_t oc = 0; oc < C2; oc++)
+      for (idx_t ic = 0; ic < C1; ic++)
+        for (idx_t di = 0; di < K; di++)
+          for (idx_t dj = 0; dj < K; dj++)
+            conv2_wp[ic][di][dj][oc] = conv2_w.w[oc][ic][di][dj];
+  }
+};
+
+/**
+   @brief inference-only MNIST network (buffers for a batch)
+   @param (maxB) maximum batch size it can accommodate
+   @param (C) number of channels in the input
+   @param (H) image height
+   @param (W) image width
+   @param (nC) number of classes
+ */
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC>
+struct MNISTInfer {
+  typedef MNISTInferWeights<C,H,W,nC> weights_t;
+  static const idx_t K = weights_t::K;
+  static const idx_t H1 = weights_t::H1, W1 = weights_t::W1;
+  static const idx_t H2 = weights_t::H2, W2 = weights_t::W2;
+  static const idx_t H3 = weights_t::H3, W3 = weights_t::W3;
+  static const idx_t C1 = weights_t::C1;
+  static const idx_t C2 = weights_t::C2;
+  static const idx_t nF = weights_t::nF;
+  const weights_t * wt;         /**< weights (shared, read only) */
+  tensor<real,maxB,C,H,W> x;    /**< input images */
+  tensor<real,maxB,C1,H1,W1> a1; /**< relu(conv1(x)) */
+  tensor<real,maxB,C2,H3,W3> a3; /**< maxpool(relu(conv2(a1))) */
+  tensor<real,maxB,nF> a4;      /**< relu(fc1(a3)) */
+  tensor<real,maxB,nC> y;       /**< log softmax(fc2(a4)) */
+  tensor<idx_t,maxB> pred;      /**< predicted classes */
+  /* buffers of the single-image path (forward1), channels innermost */
+  real a1c[H1][W1][C1];         /**< relu(conv1(x)) */
+  real a3c[H3][W3][C2];         /**< maxpool(relu(conv2(a1))) */
+  idx_t nz_idx[C2 * H3 * W3];   /**< fc1 rows of nonzero elements of a3c */
+  real nz_val[C2 * H3 * W3];    /**< nonzero elements of a3c */
+  idx_t n_nz;                   /**< the number of nonzero elements of a3c */
+  int latency_path;             /**< 1 if forward takes forward1/forward_each */
+
+  /**
+     @brief initialize
+     @param (wt) weights (loaded or copied from a training network)
+  */
+  void init(const weights_t * wt) {
+    this->wt = wt;
+    latency_path = 1;
+  }
+  /**
+     @brief y = relu(conv1(x))
+  */
+  void conv1_relu(idx_t B) {
+    const weights_t& p = *wt;
+    a1.set_n0(B);
+    for (idx_t s = 0; s < B; s++) {
+      for (idx_t oc = 0; oc < C1; oc++) {
+        for (idx_t i = 0; i < H1; i++) {
+          real v[W1];
+          for (idx_t j = 0; j < W1; j++) v[j] = p.conv1_b.w[oc][0][0][0];
+          for (idx_t ic = 0; ic < C; ic++) {
+            for (idx_t di = 0; di < K; di++) {
+              for (idx_t dj = 0; dj < K; dj++) {
+                const real w = p.conv1_w.w[oc][ic][di][dj];
+                const real * xr = &x.w[s][ic][i+di][dj];
+                for (idx_t j = 0; j < W1; j++) v[j] += w * xr[j];
+              }
+            }
+          }
+          for (idx_t j = 0; j < W1; j++) a1.w[s][oc][i][j] = max_r(0, v[j]);
+        }
+      }
+    }
+  }
+  /**
+     @brief a3 = maxpool(relu(conv2(a1)))
+     @details computes two rows of the convolution at a time and
+     pools them right away (max commutes with relu)
+  */
+  void conv2_relu_pool(idx_t B) {
+    const weights_t& p = *wt;
+    a3.set_n0(B);
+    for (idx_t s = 0; s < B; s++) {
+      for (idx_t oc = 0; oc < C2; oc++) {
+        for (idx_t pi = 0; pi < H3; pi++) {
+          real v0[W2], v1[W2];
+          const real b = p.conv2_b.w[oc][0][0][0];
+          for (idx_t j = 0; j < W2; j++) v0[j] = v1[j] = b;
+          for (idx_t ic = 0; ic < C1; ic++) {
+            for (idx_t di = 0; di < K; di++) {
+              for (idx_t dj = 0; dj < K; dj++) {
+                const real w = p.conv2_w.w[oc][ic][di][dj];
+                const real * x0 = &a1.w[s][ic][2 * pi + di][dj];
+                const real * x1 = &a1.w[s][ic][2 * pi + 1 + di][dj];
+                for (idx_t j = 0; j < W2; j++) {
+                  v0[j] += w * x0[j];
+                  v1[j] += w * x1[j];
+                }
+              }
+            }
+          }
+          for (idx_t pj = 0; pj < W3; pj++) {
+            real m = max_r(max_r(v0[2 * pj], v0[2 * pj + 1]),
+                           max_r(v1[2 * pj], v1[2 * pj + 1]));
+            a3.w[s][oc][pi][pj] = max_r(0, m);
+          }
+        }
+      }
+    }
+  }
+  /**
+     @brief a4 = relu(fc1(a3))
+  */
+  void fc1_relu(idx_t B) {
+    const weights_t& p = *wt;
+    a4.set_n0(B);
+    for (idx_t s = 0; s < B; s++) {
+      real v[nF];
+      for (idx_t n = 0; n < nF; n++) v[n] = p.fc1_b.w[n][0][0][0];
+      for (idx_t c = 0; c < C2; c++) {
+        for (idx_t i = 0; i < H3; i++) {
+          for (idx_t j = 0; j < W3; j++) {
+            const real xv = a3.w[s][c][i][j];
+            const real * wr = p.fc1_w.w[c][i][j];
+            for (idx_t n = 0; n < nF; n++) v[n] += xv * wr[n];
+          }
+        }
+      }
+      for (idx_t n = 0; n < nF; n++) a4.w[s][n][0][0] = max_r(0, v[n]);
+    }
+  }
+  /**
+     @brief y = log_softmax(fc2(a4)) and pred = argmax y
+  */
+  void fc2_log_softmax(idx_t B) {
+    const weights_t& p = *wt;
+    y.set_n0(B);
+    pred.set_n0(B);
+    for (idx_t s = 0; s < B; s++) {
+      real v[nC];
+      for (idx_t c = 0; c < nC; c++) v[c] = p.fc2_b.w[c][0][0][0];
+      for (idx_t n = 0; n < nF; n++) {
+        const real xv = a4.w[s][n][0][0];
+        const real * wr = p.fc2_w.w[n][0][0];
+        for (idx_t c = 0; c < nC; c++) v[c] += xv * wr[c];
+      }
+      idx_t m = 0;
+      for (idx_t c = 1; c < nC; c++) {
+        if (v[m] < v[c]) m = c;
+      }
+      real se = 0.0;
+      for (idx_t c = 0; c < nC; c++) se += exp(v[c] - v[m]);
+      real lse = v[m] + log(se);
+      for (idx_t c = 0; c < nC; c++) y.w[s][c][0][0] = v[c] - lse;
+      pred.w[s][0][0][0] = m;
+    }
+  }
+  /**
+     @brief a1c = relu(conv1(x[s])) (single image)
+     @details a row of the output per iteration; lanes over output channels
+  */
+  void conv1_relu_1(idx_t s) {
+    const weights_t& p = *wt;
+    const idx_t nv = C1 / IL;
+#pragma omp for schedule(static)
+    for (idx_t i = 0; i < H1; i++) {
+      for (idx_t j = 0; j < W1; j++) {
+        infer_vec v[nv];
+        for (idx_t q = 0; q < nv; q++) v[q] = IV(p.conv1_b.w[q * IL][0][0][0]);
+        for (idx_t ic = 0; ic < C; ic++) {
+          for (idx_t di = 0; di < K; di++) {
+            for (idx_t dj = 0; dj < K; dj++) {
+              const real xv = x.w[s][ic][i+di][j+dj];
+              for (idx_t q = 0; q < nv; q++) {
+                v[q] += xv * IV(p.conv1_wp[ic][di][dj][q * IL]);
+              }
+            }
+          }
+        }
+        const infer_vec zero = {};
+        for (idx_t q = 0; q < nv; q++) IV(a1c[i][j][q * IL]) = max_iv(v[q], zero);
+      }
+    }
+  }
+  /**
+     @brief a3c = maxpool(relu(conv2(a1c))) (single image)
+     @details a row of the pooled output per iteration. the four
+     pixels of a pooling window are computed together (C2/IL
+     vectors each, 16 registers for float on AVX-512) and reduced
+     right away
+  */
+  void conv2_relu_pool_1() {
+    const weights_t& p = *wt;
+    const idx_t nv = C2 / IL;
+#pragma omp for schedule(static)
+    for (idx_t pi = 0; pi < H3; pi++) {
+      for (idx_t pj = 0; pj < W3; pj++) {
+        infer_vec v[4][nv];
+        for (idx_t r = 0; r < 4; r++) {
+          for (idx_t q = 0; q < nv; q++) v[r][q] = IV(p.conv2_b.w[q * IL][0][0][0]);
+        }
+        const idx_t i = 2 * pi, j = 2 * pj;
+        for (idx_t ic = 0; ic < C1; ic++) {
+          for (idx_t di = 0; di < K; di++) {
+            for (idx_t dj = 0; dj < K; dj++) {
+              const real x00 = a1c[i+di][j+dj][ic];
+              const real x01 = a1c[i+di][j+1+dj][ic];
+              const real x10 = a1c[i+1+di][j+dj][ic];
+              const real x11 = a1c[i+1+di][j+1+dj][ic];
+              for (idx_t q = 0; q < nv; q++) {
+                const infer_vec w = IV(p.conv2_wp[ic][di][dj][q * IL]);
+                v[0][q] += x00 * w;
+                v[1][q] += x01 * w;
+                v[2][q] += x10 * w;
+                v[3][q] += x11 * w;
+              }
+            }
+          }
+        }
+        const infer_vec zero = {};
+        for (idx_t q = 0; q < nv; q++) {
+          infer_vec m = max_iv(max_iv(v[0][q], v[1][q]), max_iv(v[2][q], v[3][q]));
+          IV(a3c[pi][pj][q * IL]) = max_iv(m, zero);
+        }
+      }
+    }
+  }
+  /**
+     @brief collect nonzero elements of a3c (and the fc1 rows they multiply)
+  */
+  void gather_nonzeros_1() {
+    idx_t n = 0;
+    for (idx_t pi = 0; pi < H3; pi++) {
+      for (idx_t pj = 0; pj < W3; pj++) {
+        for (idx_t c = 0; c < C2; c++) {
+          const real v = a3c[pi][pj][c];
+          if (v != 0) {
+            nz_idx[n] = (c * H3 + pi) * W3 + pj;
+            nz_val[n] = v;
+            n++;
+          }
+        }
+      }
+    }
+    n_nz = n;
+  }
+  /**
+     @brief a4[s] = relu(fc1(a3c)) (single image)
+     @details IL output features per iteration, so a thread reads
+     the same columns of fc1_w every time; only rows of nonzero
+     inputs are read. four partial sums hide the latency of fma
+  */
+  void fc1_relu_1(idx_t s) {
+    const weights_t& p = *wt;
+    const real * w = &p.fc1_w.w[0][0][0][0];
+#pragma omp for schedule(static)
+    for (idx_t n0 = 0; n0 < nF; n0 += IL) {
+      infer_vec v0 = IV(p.fc1_b.w[n0][0][0][0]);
+      infer_vec v1 = {}, v2 = {}, v3 = {};
+      idx_t k = 0;
+      for (; k + 3 < n_nz; k += 4) {
+        v0 += nz_val[k]     * IV(w[nz_idx[k]     * nF + n0]);
+        v1 += nz_val[k + 1] * IV(w[nz_idx[k + 1] * nF + n0]);
+        v2 += nz_val[k + 2] * IV(w[nz_idx[k + 2] * nF + n0]);
+        v3 += nz_val[k + 3] * IV(w[nz_idx[k + 3] * nF + n0]);
+      }
+      for (; k < n_nz; k++) {
+        v0 += nz_val[k] * IV(w[nz_idx[k] * nF + n0]);
+      }
+      const infer_vec zero = {};
+      IV(a4.w[s][n0][0][0]) = max_iv((v0 + v1) + (v2 + v3), zero);
+    }
+  }
+  /**
+     @brief a4[s] = relu(fc1(maxpool(relu(conv2(relu(conv1(x[s])))))))
+     @details work-shared among the threads of the enclosing
+     parallel region, or done by the caller alone if there is none
+  */
+  void image_1(idx_t s) {
+    static_assert(C1 % IL == 0 && C2 % IL == 0 && nF % IL == 0,
+                  "channels must be multiples of the SIMD width");
+    conv1_relu_1(s);
+    conv2_relu_pool_1();
+#pragma omp single
+    gather_nonzeros_1();
+    fc1_relu_1(s);
+  }
+  /**
+     @brief classify x[0] with the single-image path
+     @details results are in y[0] and pred[0], as with forward(1).
+     one parallel region for the whole network, so threads fork once
+  */
+  void forward1() {
+    a4.set_n0(1);
+#pragma omp parallel
+    image_1(0);
+    fc2_log_softmax(1);
+  }
+  /**
+     @brief classify the first B images of x one at a time with the
+     single-image kernels, on the calling thread
+  */
+  void forward_each(idx_t B) {
+    a4.set_n0(B);
+    for (idx_t s = 0; s < B; s++) {
+      image_1(s);
+    }
+    fc2_log_softmax(B);
+  }
+  /**
+     @brief classify the first B images of x
+     @param (B) the number of images (<= maxB)
+     @details results are in y (log probabilities) and pred
+  */
+  void forward(idx_t B) {
+    assert(B <= maxB);
+    x.set_n0(B);
+    if (latency_path) {
+      if (B == 1) forward1();
+      else forward_each(B);
+      return;
+    }
+    conv1_relu(B);
+    conv2_relu_pool(B);
+    fc1_relu(B);
+    fc2_log_softmax(B);
+  }
+  /**
+     @brief set the image b of x from raw pixel values
+     @param (b) index in the batch
+     @param (px) C*H*W bytes (0-255)
+     @details normalized in the same way as mnist_dataset::load
+  */
+  void set_image(idx_t b, const unsigned char * px) {
+    const real mean = 0.1307;   // pytorch
+    const real std = 0.3081;    // pytorch
+    for (idx_t c = 0; c < C; c++) {
+      for (idx_t i = 0; i < H; i++) {
+        for (idx_t j = 0; j < W; j++) {
+          x.w[b][c][i][j] = ((px[(c * H + i) * W + j] / 255.0) - mean) / std;
+        }
+      }
+    }
+  }
+};
+
+/**
+   @brief images to classify, mapped from an idx (pascal vincent)
+   file or a raw file of concatenated C*H*W-byte images
+ */
+struct infer_images {
+  const unsigned char * map;    /**< the mapped file */
+  size_t map_sz;                /**< size of the mapping */
+  const unsigned char * px;     /**< the first image */
+  long n;                       /**< the number of images */
+  long image_sz;                /**< bytes per image */
+  /**
+     @brief map a file of images
+     @param (file) idx3 (magic 0x00000803) or raw file
+     @param (image_sz) bytes per image (C*H*W)
+     @return 0 on success, -1 on failure
+  */
+  int open_images(const char * file, long image_sz) {
+    this->image_sz = image_sz;
+    if (map_file(file) != 0) return -1;
+    if (is_idx(0x00000803)) {
+      n = be32(4);
+      long hdr = 16;
+      if (be32(8) * be32(12) != image_sz || hdr + n * image_sz > (long)map_sz) {
+        fprintf(stderr, "error: %s: images are not %ld bytes each\n", file, image_sz);
+        return -1;
+      }
+      px = map + hdr;
+    } else {
+      if (map_sz % image_sz != 0) {
+        fprintf(stderr, "error: %s: neither an idx file nor a multiple of %ld bytes\n",
+                file, image_sz);
+        return -1;
+      }
+      n = map_sz / image_sz;
+      px = map;
+    }
+    return 0;
+  }
+  /**
+     @brief map an idx1 (magic 0x00000801) label file
+     @return 0 on success, -1 on failure
+  */
+  int open_labels(const char * file) {
+    image_sz = 1;
+    if (map_file(file) != 0) return -1;
+    if (!is_idx(0x00000801) || 8 + be32(4) > (long)map_sz) {
+      fprintf(stderr, "error: %s: not an idx label file\n", file);
+      return -1;
+    }
+    n = be32(4);
+    px = map + 8;
+    return 0;
+  }
+  /**
+     @brief map a file read-only
+  */
+  int map_file(const char * file) {
+    int fd = open(file, O_RDONLY);
+    if (fd == -1) { perror(file); return -1; }
+    struct stat sb[1];
+    if (fstat(fd, sb) == -1) { perror("fstat"); close(fd); return -1; }
+    map_sz = sb->st_size;
+    void * a = mmap(0, map_sz, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (a == MAP_FAILED) { perror("mmap"); return -1; }
+    map = (const unsigned char *)a;
+    return 0;
+  }
+  /**
+     @brief big endian 32 bit int at offset off
+  */
+  long be32(size_t off) {
+    return ((long)map[off] << 24) | (map[off + 1] << 16) | (map[off + 2] << 8) | map[off + 3];
+  }
+  /**
+     @brief 1 if the file starts with the given idx magic
+  */
+  int is_idx(long magic) {
+    return map_sz >= 16 && be32(0) == magic;
+  }
+  /**
+     @brief the k-th image (or label)
+  */
+  const unsigned char * get(long k) {
+    return px + k * image_sz;
+  }
+  /**
+     @brief unmap the file
+  */
+  void close_images() {
+    if (map) munmap((void *)map, map_sz);
+    map = 0;
+  }
+};
+
+/**
+   @brief copy weights of a training network into inference weights
+   @param (wt) inference weights
+   @param (mnist) training network
+   @details used to check MNISTInfer against MNIST without a file
+*/
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC>
+void copy_infer_weights(MNISTInferWeights<C,H,W,nC>& wt, MNIST<maxB,C,H,W,nC>& mnist) {
+  wt.conv1_w = mnist.conv1.w;
+  wt.conv1_b = mnist.conv1.b;
+  wt.conv2_w = mnist.conv2.w;
+  wt.conv2_b = mnist.conv2.b;
+  wt.fc1_w = mnist.fc1.w;
+  wt.fc1_b = mnist.fc1.b;
+  wt.fc2_w = mnist.fc2.w;
+  wt.fc2_b = mnist.fc2.b;
+  wt.pack();
+}
+
+/**
+   @brief entry point of this header file
+   @param (argc) the number of command line args
+   @param (argv) command line args
+   @details if this header file is included from
+   a main C++ file and define mnist_infer_main to be main
+   (e.g., with -Dmnist_infer_main=main), then this
+   function becomes th main function of the executable.
+   it initializes a training network with random weights,
+   copies them to an inference network and checks both
+   give the same outputs for random inputs, with the batch
+   kernels, with the single-image kernels applied to each image
+   of the batch (forward_each) and to each image alone (forward1).
+*/
+int mnist_infer_main(int argc, char ** argv) {
+  cmdline_opt opt = parse_args(argc, argv);
+  if (opt.error || opt.help) usage(argv[0]);
+  const idx_t maxB = MAX_BATCH_SIZE;
+  const idx_t B = min_i(maxB, opt.batch_size);
+  const idx_t C = 1;
+  const idx_t H = 28;
+  const idx_t W = 28;
+  const idx_t nC = 10;
+  logger lgr;
+  lgr.start_log(opt);
+  rnd_gen_t rg;
+  rg.seed(opt.weight_seed);
+  MNISTCfg cfg = {};
+  MNIST<maxB,C,H,W,nC> * mnist = new_lazy<MNIST<maxB,C,H,W,nC> >();
+  mnist->init(opt, &lgr, rg, cfg);
+  MNISTInferWeights<C,H,W,nC> * wt = new_lazy<MNISTInferWeights<C,H,W,nC> >();
+  copy_infer_weights(*wt, *mnist);
+  MNISTInfer<maxB,C,H,W,nC> * inf = new_lazy<MNISTInfer<maxB,C,H,W,nC> >();
+  inf->init(wt);
+  MNISTInfer<maxB,C,H,W,nC> * one = new_lazy<MNISTInfer<maxB,C,H,W,nC> >();
+  one->init(wt);
+  double max_e[2] = { 0.0, 0.0 };
+  double max_e1 = 0.0;
+  for (int iter = 0; iter < opt.epochs; iter++) {
+    mnist->x.init_uniform(B, rg, -1.0, 1.0);
+    mnist->t.init_const(B, 0);
+    mnist->idxs.init_const(B, 0);
+    inf->x = mnist->x;
+    mnist->forward(mnist->x, mnist->t, 0);
+    mnist->predict(mnist->pred);
+    idx_t mismatch = 0;
+    for (int path = 0; path < 2; path++) {
+      inf->latency_path = path;
+      inf->forward(B);
+      for (idx_t s = 0; s < B; s++) {
+        for (idx_t c = 0; c < nC; c++) {
+          max_e[path] = max_r(max_e[path], fabs(inf->y(s,c) - mnist->nll_softmax.y(s,c)));
+        }
+        mismatch += (inf->pred(s) != mnist->pred(s));
+      }
+    }
+    for (idx_t s = 0; s < B; s++) {
+      /* the same image alone */
+      for (idx_t c = 0; c < C; c++)
+        for (idx_t i = 0; i < H; i++)
+          for (idx_t j = 0; j < W; j++)
+            one->x.w[0][c][i][j] = inf->x.w[s][c][i][j];
+      one->forward(1);
+      for (idx_t c = 0; c < nC; c++) {
+        max_e1 = max_r(max_e1, fabs(one->y(0,c) - mnist->nll_softmax.y(s,c)));
+      }
+      mismatch += (one->pred(0) != mnist->pred(s));
+    }
+    printf("==== %d ==== mismatched predictions %d/%d\n", iter, mismatch, 3 * B);
+  }
+  printf("max absolute error of log probabilities = %.9f (batch) %.9f (each) %.9f (single image)\n",
+         max_e[0], max_e[1], max_e1);
+  delete_lazy(one);
+  delete_lazy(inf);
+  delete_lazy(wt);
+  mnist->fini();
+  delete_lazy(mnist);
+  lgr.end_log();
+  return 0;
+}
@@ -14,6 +14,7 @@
 #include<stdint.h>
 #include<time.h>
 #include<iostream>
+#include<new>
 #include<unistd.h>
 #ifdef __ARM_64BIT_STATE
     #include<arm_neon.h>
@@ -24,6 +25,11 @@
 #if 0
     #include<ieee754.h>
 #endif
+#include "tracer.h"
+#include "perf_counters.h"
+#include "async_log.h"
+#include "run_records.h"
+#include "mem_report.h"
 
 #if __CUDACC__
 #include "cuda_util.h"
@@ -129,6 +135,22 @@ static algo_t parse_algo(const char * s) {
     }
 }
 
+/**
+   @brief convert an algorithm enum to its string (the inverse of parse_algo)
+   @details when you add your algorithm, add it here too
+ */
+__attribute__((unused))
+static const char * algo_name(algo_t a) {
+    switch(a){
+    case algo_cpu_base: return "cpu_base";
+    case algo_cuda_base: return "cuda_base";
+    case algo_cpu_test: return "cpu_test";
+    case algo_cpu_simd: return "cpu_simd";
+    case algo_cpu_omp: return "cpu_omp";
+    default: return 0;
+    }
+}
+
 /**
    @brief return 1 if the algorithm name (s) or its
    enum value (a) is a CUDA algorithm 
@@ -170,6 +192,33 @@ struct cmdline_opt {
   algo_t algo;                  /**< parse_algo(algo_s)  */
   int cuda_algo;                 /**< 1 if this is a CUDA algorithm  */
   const char * log;             /**< log file name */
+  const char * recompute;       /**< comma-separated layers whose outputs are recomputed in backward */
+  long accum_steps;             /**< number of mini batches whose gradients are accumulated before an update */
+  const char * save_ckpt;       /**< file checkpoints are saved to ("" if none) */
+  long ckpt_interval;           /**< save a checkpoint every this epochs */
+  const char * resume;          /**< checkpoint file to resume from ("" if none) */
+  int test_threads;             /**< threads to evaluate test data with (0 : on the training network) */
+  int async_test;               /**< 1 if test data are evaluated while the next epoch trains */
+  const char * trace;           /**< file a Chrome trace of layer functions is written to ("" if none) */
+  int perf;                     /**< 1 if performance counters of layer functions are reported */
+  int roofline;                 /**< 1 if a roofline report of layer functions is logged at the end */
+  const char * bench;           /**< file a summary of the benchmark mode is written to ("" if not in the mode) */
+  double bench_target;          /**< test accuracy the benchmark mode measures the time to */
+  int async_log;                /**< 1 if log entries are formatted and written by a background thread */
+  int records;                  /**< 1 if structured run records (LOG.rec, LOG.sites) are written alongside the log */
+  int mem_report;               /**< 1 if the memory footprint of layers and RSS at points of a run are logged */
+  int deterministic;            /**< 1 if parallel gradient reductions give the same result with any number of threads */
+  double sb_fraction;           /**< fraction of each mini batch backpropagated (selective backprop; 1 for all) */
+  const char * sb_mode;         /**< how samples are selected by loss ("hard" or "sample") */
+  int sb_warmup;                /**< epochs trained on whole mini batches before selective backprop starts */
+  int freeze_conv;              /**< 1 if conv1/conv2 are not updated and their features are cached */
+  const char * feature_store;   /**< file cached features are mapped from ("" for anonymous memory) */
+  int feature_fp16;             /**< 1 if cached features are kept in half precision */
+  const char * conv1_patches;   /**< format of precomputed conv1 input patches ("none", "u8" or "fp16") */
+  const char * sparse_backward; /**< how convolution backward skips zeros of gy ("off", "auto", "mask" or "lists") */
+  int fuse_backward;            /**< 1 if gradients through relu/max pooling/dropout are routed in one pass (grad_route.h) */
+  int fuse_dropout;             /**< 1 if dropout1 is applied by fc1 as it reads its input, instead of a separate pass */
+  const char * conv_fft;        /**< when convolutions run on FFT ("off", "on" or "auto") */
   int help;                     /**< 1 if -h,--help is given  */
   int error;                    /**< set to one if any option is invalid */
   /**
@@ -197,6 +246,33 @@ struct cmdline_opt {
 #endif
     algo = algo_invalid;
     log = "mnist.log";
+    recompute = "none";
+    accum_steps = 1;
+    save_ckpt = "";
+    ckpt_interval = 1;
+    resume = "";
+    test_threads = 0;
+    async_test = 0;
+    trace = "";
+    perf = 0;
+    roofline = 1;
+    bench = "";
+    bench_target = 0.99;
+    async_log = 0;
+    records = 0;
+    mem_report = 1;
+    deterministic = 0;
+    sb_fraction = 1.0;
+    sb_mode = "hard";
+    sb_warmup = 1;
+    freeze_conv = 0;
+    feature_store = "";
+    feature_fp16 = 0;
+    conv1_patches = "none";
+    sparse_backward = "off";
+    fuse_backward = 1;
+    fuse_dropout = 0;
+    conv_fft = "off";
     help = 0;
     error = 0;
   }
@@ -220,6 +296,33 @@ static struct option long_options[] = {
   {"grad-dbg",          required_argument, 0,  0  },
   {"algo",              required_argument, 0, 'a' },
   {"log",               required_argument, 0,  0  },
+  {"recompute",         required_argument, 0,  0  },
+  {"accum-steps",       required_argument, 0,  0  },
+  {"save-ckpt",         required_argument, 0,  0  },
+  {"ckpt-interval",     required_argument, 0,  0  },
+  {"resume",            required_argument, 0,  0  },
+  {"test-threads",      required_argument, 0,  0  },
+  {"async-test",        required_argument, 0,  0  },
+  {"trace",             required_argument, 0,  0  },
+  {"perf",              required_argument, 0,  0  },
+  {"roofline",          required_argument, 0,  0  },
+  {"bench",             required_argument, 0,  0  },
+  {"bench-target",      required_argument, 0,  0  },
+  {"async-log",         required_argument, 0,  0  },
+  {"records",           required_argument, 0,  0  },
+  {"mem-report",        required_argument, 0,  0  },
+  {"deterministic",     required_argument, 0,  0  },
+  {"sb-fraction",       required_argument, 0,  0  },
+  {"sb-mode",           required_argument, 0,  0  },
+  {"sb-warmup",         required_argument, 0,  0  },
+  {"freeze-conv",       required_argument, 0,  0  },
+  {"feature-store",     required_argument, 0,  0  },
+  {"feature-fp16",      required_argument, 0,  0  },
+  {"conv1-patches",     required_argument, 0,  0  },
+  {"sparse-backward",   required_argument, 0,  0  },
+  {"fuse-backward",     required_argument, 0,  0  },
+  {"fuse-dropout",      required_argument, 0,  0  },
+  {"conv-fft",          required_argument, 0,  0  },
   {"help",              required_argument, 0, 'h' },
   {0,                   0,                 0,  0  }
 };
@@ -248,6 +351,33 @@ static void usage(const char * prog) {
           " --weight-seed S : set seed for initial weights to S [%ld]\n"
           " --grad-dbg 0/1 : debug gradient computation [%d]\n"
           " --log FILE : write log to FILE [%s]\n"
+          " --recompute L1,L2,.. : recompute outputs of layers L1,L2,.. (relu1,relu2,dropout1,relu3,dropout2, all or none) in backward instead of keeping them [%s]\n"
+          " --accum-steps K : accumulate gradients of K mini batches before updating weights [%ld]\n"
+          " --save-ckpt FILE : save checkpoints (weights, optimizer and random number states) to FILE [%s]\n"
+          " --ckpt-interval N : save a checkpoint every N epochs [%ld]\n"
+          " --resume FILE : resume training from checkpoint FILE [%s]\n"
+          " --test-threads N : evaluate test data with N threads, each with its own buffers (0 : on the training network) [%d]\n"
+          " --async-test 0/1 : evaluate test data of an epoch while the next epoch trains (requires --test-threads) [%d]\n"
+          " --trace FILE : record layer functions with a low-overhead tracer and write a Chrome trace to FILE [%s]\n"
+          " --perf 0/1 : count cycles, instructions, cache misses and FP ops of layer functions (perf_event_open) and report them per function [%d]\n"
+          " --roofline 0/1 : measure memory bandwidth and peak flops of the host at the end and log a roofline report of layer functions [%d]\n"
+          " --bench FILE : benchmark mode; log only level 1, measure training and inference images/sec and the time to reach --bench-target, and write a summary to FILE [%s]\n"
+          " --bench-target A : test accuracy (0-1) the benchmark mode measures the time to; it stops once reached [%.3f]\n"
+          " --async-log 0/1 : format and write log entries in a background thread; the caller only queues their arguments [%d]\n"
+          " --records 0/1 : write mini batches, function times, losses and predictions as fixed-width binary rows to LOG.rec and the table of functions to LOG.sites (LOG given by --log) [%d]\n"
+          " --mem-report 0/1 : log the memory footprint of each layer (weights, gradients, optimizer states, activations) and the resident set size and its peak after model building, data loading, the first training step and each epoch [%d]\n"
+          " --deterministic 0/1 : add up partial gradients of threads (cpu_omp backward) over fixed-size chunks of samples by a fixed pairwise tree, so results do not depend on the number of threads [%d]\n"
+          " --sb-fraction F : selective backprop; backpropagate only a fraction F (0-1) of each mini batch, chosen by the loss of a forward pass [%.3f]\n"
+          " --sb-mode hard/sample : hard: the samples of the largest losses; sample: draw samples with probabilities proportional to losses, weighted to keep the gradient unbiased [%s]\n"
+          " --sb-warmup E : train the first E epochs on whole mini batches before selective backprop starts [%d]\n"
+          " --freeze-conv 0/1 : do not update conv1/conv2 (e.g., fine-tune fc1/fc2 of a --resume'd model); features of training images are computed in the first epoch and later epochs start at dropout1 [%d]\n"
+          " --feature-store FILE : file the cached features of --freeze-conv 1 are mapped from (anonymous memory if empty) [%s]\n"
+          " --feature-fp16 0/1 : keep the cached features in half precision [%d]\n"
+          " --conv1-patches none/u8/fp16 : precompute the input patches of conv1 (im2col) of all images at load time, as pixel bytes or half precision, and run conv1 forward and its gw as dense matrix products over them [%s]\n"
+          " --sparse-backward off/auto/mask/lists : convolution backward skips zeros of gy (the output gradient after ReLU); mask: skips all-zero vectors by compare masks; lists: works on compacted lists of nonzeros; auto: chooses dense, mask or lists by the fraction of zeros measured in each call; the fraction of each layer is logged every epoch [%s]\n"
+          " --fuse-backward 0/1 : conv2 and fc1 backward take the gradient wrt the output of dropout1/dropout2 and apply dropout, max pooling and ReLU in one pass, instead of backward of each of those layers [%d]\n"
+          " --fuse-dropout 0/1 : fc1 applies the mask and scale of dropout1 as it reads its input (forward and the gradient wrt its weights) and masks the gradient wrt its input as it writes it, instead of dropout1 writing its output and gradient (cpu_simd and cpu_omp) [%d]\n"
+          " --conv-fft off/on/auto : convolution layers run forward and backward as products of FFTs (cpu algorithms; filter spectra cached per layer); auto: only layers whose estimated flops are much fewer than direct ones (large kernels); convolution with this option benchmarks the crossover [%s]\n"
           " -h,--help\n",
           prog,
           o.data_dir,
@@ -263,7 +393,34 @@ static void usage(const char * prog) {
           o.dropout_seed_2,
           o.weight_seed,
           o.grad_dbg,
-          o.log
+          o.log,
+          o.recompute,
+          o.accum_steps,
+          o.save_ckpt,
+          o.ckpt_interval,
+          o.resume,
+          o.test_threads,
+          o.async_test,
+          o.trace,
+          o.perf,
+          o.roofline,
+          o.bench,
+          o.bench_target,
+          o.async_log,
+          o.records,
+          o.mem_report,
+          o.deterministic,
+          o.sb_fraction,
+          o.sb_mode,
+          o.sb_warmup,
+          o.freeze_conv,
+          o.feature_store,
+          o.feature_fp16,
+          o.conv1_patches,
+          o.sparse_backward,
+          o.fuse_backward,
+          o.fuse_dropout,
+          o.conv_fft
           );
   exit(1);
 }
@@ -299,6 +456,60 @@ static cmdline_opt parse_args(int argc, char ** argv) {
           opt.grad_dbg = atoi(optarg);
         } else if (strcmp(o, "log") == 0) {
           opt.log = strdup(optarg);
+        } else if (strcmp(o, "recompute") == 0) {
+          opt.recompute = strdup(optarg);
+        } else if (strcmp(o, "accum-steps") == 0) {
+          opt.accum_steps = atol(optarg);
+        } else if (strcmp(o, "save-ckpt") == 0) {
+          opt.save_ckpt = strdup(optarg);
+        } else if (strcmp(o, "ckpt-interval") == 0) {
+          opt.ckpt_interval = atol(optarg);
+        } else if (strcmp(o, "resume") == 0) {
+          opt.resume = strdup(optarg);
+        } else if (strcmp(o, "test-threads") == 0) {
+          opt.test_threads = atoi(optarg);
+        } else if (strcmp(o, "async-test") == 0) {
+          opt.async_test = atoi(optarg);
+        } else if (strcmp(o, "trace") == 0) {
+          opt.trace = strdup(optarg);
+        } else if (strcmp(o, "perf") == 0) {
+          opt.perf = atoi(optarg);
+        } else if (strcmp(o, "roofline") == 0) {
+          opt.roofline = atoi(optarg);
+        } else if (strcmp(o, "bench") == 0) {
+          opt.bench = strdup(optarg);
+        } else if (strcmp(o, "bench-target") == 0) {
+          opt.bench_target = atof(optarg);
+        } else if (strcmp(o, "async-log") == 0) {
+          opt.async_log = atoi(optarg);
+        } else if (strcmp(o, "records") == 0) {
+          opt.records = atoi(optarg);
+        } else if (strcmp(o, "mem-report") == 0) {
+          opt.mem_report = atoi(optarg);
+        } else if (strcmp(o, "deterministic") == 0) {
+          opt.deterministic = atoi(optarg);
+        } else if (strcmp(o, "sb-fraction") == 0) {
+          opt.sb_fraction = atof(optarg);
+        } else if (strcmp(o, "sb-mode") == 0) {
+          opt.sb_mode = strdup(optarg);
+        } else if (strcmp(o, "sb-warmup") == 0) {
+          opt.sb_warmup = atoi(optarg);
+        } else if (strcmp(o, "freeze-conv") == 0) {
+          opt.freeze_conv = atoi(optarg);
+        } else if (strcmp(o, "feature-store") == 0) {
+          opt.feature_store = strdup(optarg);
+        } else if (strcmp(o, "feature-fp16") == 0) {
+          opt.feature_fp16 = atoi(optarg);
+        } else if (strcmp(o, "conv1-patches") == 0) {
+          opt.conv1_patches = strdup(optarg);
+        } else if (strcmp(o, "sparse-backward") == 0) {
+          opt.sparse_backward = strdup(optarg);
+        } else if (strcmp(o, "fuse-backward") == 0) {
+          opt.fuse_backward = atoi(optarg);
+        } else if (strcmp(o, "fuse-dropout") == 0) {
+          opt.fuse_dropout = atoi(optarg);
+        } else if (strcmp(o, "conv-fft") == 0) {
+          opt.conv_fft = strdup(optarg);
         } else {
           fprintf(stderr,
                   "bug:%s:%d: should handle option %s\n",
@@ -341,6 +552,69 @@ static cmdline_opt parse_args(int argc, char ** argv) {
     opt.error = 1;
     return opt;
   }
+  if (opt.accum_steps < 1) {
+    fprintf(stderr, "error: --accum-steps (%ld) must be >= 1\n", opt.accum_steps);
+    opt.error = 1;
+    return opt;
+  }
+  if (opt.ckpt_interval < 1) {
+    fprintf(stderr, "error: --ckpt-interval (%ld) must be >= 1\n", opt.ckpt_interval);
+    opt.error = 1;
+    return opt;
+  }
+  if (opt.test_threads < 0) {
+    fprintf(stderr, "error: --test-threads (%d) must be >= 0\n", opt.test_threads);
+    opt.error = 1;
+    return opt;
+  }
+  if (opt.async_test && opt.test_threads == 0) {
+    fprintf(stderr, "error: --async-test requires --test-threads >= 1\n");
+    opt.error = 1;
+    return opt;
+  }
+  if (!(opt.bench_target > 0.0 && opt.bench_target <= 1.0)) {
+    fprintf(stderr, "error: --bench-target (%f) must be in (0, 1]\n", opt.bench_target);
+    opt.error = 1;
+    return opt;
+  }
+  if (!(opt.sb_fraction > 0.0 && opt.sb_fraction <= 1.0)) {
+    fprintf(stderr, "error: --sb-fraction (%f) must be in (0, 1]\n", opt.sb_fraction);
+    opt.error = 1;
+    return opt;
+  }
+  if (strcmp(opt.sb_mode, "hard") != 0 && strcmp(opt.sb_mode, "sample") != 0) {
+    fprintf(stderr, "error: --sb-mode (%s) must be hard or sample\n", opt.sb_mode);
+    opt.error = 1;
+    return opt;
+  }
+  if (opt.sb_warmup < 0) {
+    fprintf(stderr, "error: --sb-warmup (%d) must be >= 0\n", opt.sb_warmup);
+    opt.error = 1;
+    return opt;
+  }
+  if (strcmp(opt.conv1_patches, "none") != 0 && strcmp(opt.conv1_patches, "u8") != 0
+      && strcmp(opt.conv1_patches, "fp16") != 0) {
+    fprintf(stderr, "error: --conv1-patches (%s) must be none, u8 or fp16\n", opt.conv1_patches);
+    opt.error = 1;
+    return opt;
+  }
+  if (strcmp(opt.sparse_backward, "off") != 0 && strcmp(opt.sparse_backward, "auto") != 0
+      && strcmp(opt.sparse_backward, "mask") != 0 && strcmp(opt.sparse_backward, "lists") != 0) {
+    fprintf(stderr, "error: --sparse-backward (%s) must be off, auto, mask or lists\n", opt.sparse_backward);
+    opt.error = 1;
+    return opt;
+  }
+  if (strcmp(opt.conv_fft, "off") != 0 && strcmp(opt.conv_fft, "on") != 0
+      && strcmp(opt.conv_fft, "auto") != 0) {
+    fprintf(stderr, "error: --conv-fft (%s) must be off, on or auto\n", opt.conv_fft);
+    opt.error = 1;
+    return opt;
+  }
+  if (opt.freeze_conv && opt.sb_fraction < 1.0) {
+    fprintf(stderr, "error: --freeze-conv 1 and --sb-fraction < 1 cannot be used together\n");
+    opt.error = 1;
+    return opt;
+  }
   opt.algo = parse_algo(opt.algo_s);
   if (opt.algo == algo_invalid) {
     fprintf(stderr, "error: invalid algorithm (%s)\n", opt.algo_s);
@@ -486,6 +760,27 @@ struct rnd_gen_t {
     real x = sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
     return mu + x * sigma;
   }
+  /**
+     @brief advance the state as n calls to next would
+     @details the composition of n steps x -> a x + c is again
+     x -> A x + C, obtained by repeated squaring in O(log n)
+  */
+  __device__ __host__
+  void skip(uint64_t n) {
+    const uint64_t mask = (1UL << 48) - 1;
+    uint64_t a = 0x5deece66dull, c = 0xb; /* 2^k steps */
+    uint64_t A = 1, C = 0;                /* steps taken so far */
+    while (n) {
+      if (n & 1) {
+        A = (A * a) & mask;
+        C = (C * a + c) & mask;
+      }
+      c = (c * a + c) & mask;
+      a = (a * a) & mask;
+      n >>= 1;
+    }
+    x = (A * x + C) & mask;
+  }
   /**
      @brief return the current state of the generator
   */
@@ -603,6 +898,47 @@ void to_host(T * layer, int cuda_algo) {
 
 
 
+/**
+   @brief allocate a zero-filled object of type T without touching its pages
+   @details unlike new T(), which writes zeros to every byte of the
+   object, calloc gets large blocks directly from the kernel as
+   zero pages, so parts of the object never written (e.g., layer
+   outputs that are recomputed rather than kept) never become
+   resident. the object is then default-constructed in place.
+   @sa delete_lazy
+*/
+template<typename T>
+T * new_lazy() {
+  void * p = calloc(1, sizeof(T));
+  if (!p) { perror("calloc"); bail(); }
+  return new (p) T;
+}
+
+/**
+   @brief destroy and free an object allocated by new_lazy
+   @sa new_lazy
+*/
+template<typename T>
+void delete_lazy(T * p) {
+  p->~T();
+  free(p);
+}
+
+/**
+   @brief the relative error of a gradient check, without showing anything
+   @param (gx_dx) ∂L/∂x・dx
+   @param (gw_dw) ∂L/∂w・dw
+   @param (L_minus) L(w-dw,x-dx)
+   @param (L_plus) L(w+dw,x+dx)
+   @return |A-B|/max(|A|,|B|), where A = ∂L/∂x・dx + ∂L/∂w・dw and B = L_plus - L_minus
+ */
+__attribute__((unused))
+static double rel_error(double gx_dx, double gw_dw, double L_minus, double L_plus) {
+  double A = gx_dx + gw_dw;
+  double B = L_plus - L_minus;
+  return (A == B ? 0.0 : fabs(A - B) / max_r(fabs(A), fabs(B)));
+}
+
 /**
    @brief show various errors 
    @param (gx_gx) ∂L/∂x・∂L/∂x
@@ -629,9 +965,7 @@ static real show_error(/* double gx_gx, double dx_dx, */ double gx_dx,
   printf("L  = %.9f\n", L);
   printf("L+ = %.9f\n", L_plus);
   double dL = L_plus - L_minus;
-  double A = gx_dx + gw_dw;
-  double B = dL;
-  double e = (A == B ? 0.0 : fabs(A - B) / max_r(fabs(A), fabs(B)));
+  double e = rel_error(gx_dx, gw_dw, L_minus, L_plus);
   printf("A = ∂L/∂x・dx + ∂L/∂w・dw = %.9f\n", gx_dx + gw_dw);
   printf("B = ΔL = %.9f\n", dL);
   printf("relative error = |A-B|/max(|A|,|B|) = %.9f\n", e);
@@ -645,6 +979,9 @@ struct logger {
   cmdline_opt opt;              /**< command line options */
   FILE * log_fp;                /**< log file object */
   tsc_t t0;                     /**< the start time stamp */
+  int max_level;                /**< entries above this level are dropped (1 with --bench) */
+  async_log * alog;             /**< the background writer (--async-log 1; null if synchronous) */
+  run_records * rec;            /**< structured run records (--records 1; null if none) */
   /**
      @brief return the current time string like "Wed Jun 30 21:49:08 1993"
    */
@@ -663,11 +1000,21 @@ struct logger {
      @brief write a formatted string to the log and may be to standard out
      @param (level) the level of this entry. if opt.verbose>=level, then 
      the string will be output to the standard out (in addition to the log file)
-     @param (format) the printf-like format string
+     @param (format) the printf-like format string (a string literal)
+     @details with --async-log 1, the entry is queued and formatted later
+     by a background thread
    */
   int log(int level, const char * format, ...) {
+    if (level > max_level) return 1;
     tsc_t t = get_tsc();
     long dt = t.ns - t0.ns;
+    if (alog) {
+      va_list ap;
+      va_start(ap, format);
+      alog->push(level, dt, format, ap);
+      va_end(ap);
+      return 1;
+    }
     if (log_fp) {
       va_list ap;
       fprintf(log_fp, "%ld: ", dt);
@@ -696,10 +1043,27 @@ struct logger {
     log_fp = fopen(opt.log, "wb");
     if (!log_fp) { perror("fopen"); exit(1); }
     t0 = get_tsc();
+    max_level = INT_MAX;
+    alog = 0;
+    rec = 0;
+    if (opt.records) {
+      rec = new run_records();
+      if (rec->open(opt.log) != 0) {
+        delete rec;
+        rec = 0;
+      }
+    }
+    if (opt.async_log) {
+      alog = new async_log();
+      alog->start(log_fp, opt.verbose);
+    }
     log(2, "open a log %s", cur_time_str());
     log_opt();
     log_host();
     log_envs();
+    /* in the benchmark mode, per batch/sample entries (and their
+       cost) are out of what is measured */
+    if (opt.bench[0]) max_level = 1;
     return 1;
   }
   /**
@@ -708,6 +1072,16 @@ struct logger {
   int end_log() {
     if (log_fp) {
       log(2, "close a log %s", cur_time_str());
+      if (alog) {
+        alog->finish();
+        delete alog;
+        alog = 0;
+      }
+      if (rec) {
+        rec->close();
+        delete rec;
+        rec = 0;
+      }
       fclose(log_fp);
       log_fp = 0;
     }
@@ -732,6 +1106,33 @@ struct logger {
     log(2, "algo_s=%s", opt.algo_s);       // added
     log(2, "cuda_algo=%d", opt.cuda_algo); // added
     log(2, "log=%s", opt.log);
+    log(2, "recompute=%s", opt.recompute);
+    log(2, "accum-steps=%ld", opt.accum_steps);
+    log(2, "save-ckpt=%s", (opt.save_ckpt[0] ? opt.save_ckpt : "none"));
+    log(2, "ckpt-interval=%ld", opt.ckpt_interval);
+    log(2, "resume=%s", (opt.resume[0] ? opt.resume : "none"));
+    log(2, "test-threads=%d", opt.test_threads);
+    log(2, "async-test=%d", opt.async_test);
+    log(2, "trace=%s", (opt.trace[0] ? opt.trace : "none"));
+    log(2, "perf=%d", opt.perf);
+    log(2, "roofline=%d", opt.roofline);
+    log(2, "bench=%s", (opt.bench[0] ? opt.bench : "none"));
+    log(2, "bench-target=%f", opt.bench_target);
+    log(2, "async-log=%d", opt.async_log);
+    log(2, "records=%d", opt.records);
+    log(2, "mem-report=%d", opt.mem_report);
+    log(2, "deterministic=%d", opt.deterministic);
+    log(2, "sb-fraction=%f", opt.sb_fraction);
+    log(2, "sb-mode=%s", opt.sb_mode);
+    log(2, "sb-warmup=%d", opt.sb_warmup);
+    log(2, "freeze-conv=%d", opt.freeze_conv);
+    log(2, "feature-store=%s", (opt.feature_store[0] ? opt.feature_store : "none"));
+    log(2, "feature-fp16=%d", opt.feature_fp16);
+    log(2, "conv1-patches=%s", opt.conv1_patches);
+    log(2, "sparse-backward=%s", opt.sparse_backward);
+    log(2, "fuse-backward=%d", opt.fuse_backward);
+    log(2, "fuse-dropout=%d", opt.fuse_dropout);
+    log(2, "conv-fft=%s", opt.conv_fft);
     return 1;
   }
   /**
@@ -792,6 +1193,35 @@ struct logger {
     log_env("SLURMD_NODENAME");
     return 1;                   /* OK */
   }
+  /**
+     @brief add a row to the run records (run_records.h), if they are written
+     and the entry of the same level is logged
+     @param (level) the level of the corresponding text entry
+     @param (kind) the kind of the row (run_rec_kind_t)
+     @details see run_rec_kind_t for the meaning of id, a, b, c, d, x and y
+   */
+  void record(int level, int kind, int id, long a, long b = 0, long c = 0, long d = 0,
+              double x = 0.0, double y = 0.0) {
+    if (!rec || level > max_level) return;
+    long t = get_tsc().ns - t0.ns;
+    run_rec r = { t, t, kind, id, a, b, c, d, x, y };
+    rec->add(r);
+  }
+  /**
+     @brief log the resident set size and its peak at a point of a run
+     (--mem-report 1)
+     @param (level) the level of the entry
+     @param (phase) the point (e.g., "model built")
+   */
+  void log_rss(int level, const char * phase) {
+    if (!opt.mem_report) return;
+    long rss, peak;
+    if (mem_rss(&rss, &peak) == 0) {
+      log(level, "# memory: %s: rss %.1f MB, peak %.1f MB", phase, rss / 1048576.0, peak / 1048576.0);
+    } else {
+      log(level, "# memory: %s: rss unknown", phase);
+    }
+  }
   /**
      @brief log the start of a function (f) 
    */
@@ -801,23 +1231,45 @@ struct logger {
   /**
      @brief log the end of a function (f) 
    */
-  void log_end_fun_(const char * f, tsc_t t0, tsc_t t1) {
+  void log_end_fun_(const char * f, int site, tsc_t t0, tsc_t t1) {
     log(4, "%s: ends. took %ld nsec", f, t1.ns - t0.ns);
+    if (rec && 4 <= max_level) {
+      run_rec r = { t0.ns - this->t0.ns, t1.ns - this->t0.ns, run_rec_kernel, site,
+                    t1.ns - t0.ns, 0, 0, 0, 0.0, 0.0 };
+      rec->add(r);
+    }
   }
 };
 
 /**
    @brief log the start of the current function
    @details just log_start_fun(lgr) and you get the caller's function
-   name to the log
+   name to the log. it also starts a span of the tracer (tracer.h)
+   and reads performance counters (perf_counters.h), both ended by
+   log_end_fun in the same scope
   */
-#define log_start_fun(lgr) lgr->log_start_fun_(__PRETTY_FUNCTION__)
+#define log_start_fun(lgr)                                              \
+  lgr->log_start_fun_(__PRETTY_FUNCTION__);                             \
+  static int trace_site_ = trace_site(__PRETTY_FUNCTION__);             \
+  perf_reading perf_r0_;                                                \
+  perf_begin(perf_r0_);                                                 \
+  uint64_t trace_t0_ = trace_begin()
 /**
    @brief log the end of the current function
    @details just log_end_fun(lgr, t0, t1) and you get the caller's function
    name to the log along with its execution time
   */
-#define log_end_fun(lgr, t0, t1)   lgr->log_end_fun_(__PRETTY_FUNCTION__, t0, t1)
+#define log_end_fun(lgr, t0, t1)                                        \
+  trace_end(trace_site_, trace_t0_);                                    \
+  perf_end(trace_site_, perf_r0_);                                      \
+  lgr->log_end_fun_(__PRETTY_FUNCTION__, trace_site_, t0, t1)
+/**
+   @brief record the cost of the current function according to the
+   model of the layer (layer_cost in perf_counters.h)
+   @details call it between log_start_fun and log_end_fun, e.g.,
+   log_cost(forward_cost(x.n0))
+  */
+#define log_cost(c) perf_add_cost(trace_site_, c)
 
 /**
    @brief entry point
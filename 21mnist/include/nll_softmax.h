@@ -56,6 +56,32 @@ struct NLLSoftmax {
     (void)cfg;
   }
 
+  /**
+     @brief the static footprint of the layer (layer_mem; no parameters)
+  */
+  static constexpr layer_mem memory() {
+    return layer_mem{ 0, 0, 0, sizeof(y) + sizeof(l) + sizeof(gx), sizeof(NLLSoftmax<maxB,nC>) };
+  }
+  /**
+   @brief the cost of forward with B samples (layer_cost)
+   @param (B) the number of samples
+   @details max, subtraction, exp, sum and subtraction of the log
+   over classes, counting exp and log as one op each
+  */
+  static constexpr layer_cost forward_cost(idx_t B){
+      return layer_cost{ (uint64_t)B * (5 * nC + 1),
+                         (uint64_t)sizeof(real) * B * (2 * nC + 1) + (uint64_t)sizeof(idx_t) * B };
+  }
+
+  /**
+   @brief the cost of backward with B samples (layer_cost)
+   @param (B) the number of samples
+  */
+  static constexpr layer_cost backward_cost(idx_t B){
+      return layer_cost{ 3 * (uint64_t)B * nC,
+                         (uint64_t)sizeof(real) * B * (2 * nC + 1) + (uint64_t)sizeof(idx_t) * B };
+  }
+
   /**
      @brief set the device pointer for this and all subobjects
      @param (dev) a device memory or null
@@ -268,6 +294,7 @@ struct NLLSoftmax {
             }        
         }
         tsc_t t1 = get_tsc();
+        log_cost(forward_cost(x.n0));
         log_end_fun(lgr, t0, t1);
         return l;
     }
@@ -423,6 +450,7 @@ struct NLLSoftmax {
             }        
         }
         tsc_t t1 = get_tsc();
+        log_cost(backward_cost(gy.n0));
         log_end_fun(lgr, t0, t1);
         return gx;
     }
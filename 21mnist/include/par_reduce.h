@@ -0,0 +1,231 @@
+/**
+   @file par_reduce.h
+   @brief parallel reductions of gradients over mini batch samples
+   (gw and gb of backward), in two modes (--deterministic 0/1)
+   @details a gradient wrt a parameter is a sum over samples (and
+   pixels), so threads splitting the samples each produce partial
+   sums that must be added up. floating point addition is not
+   associative, so the result depends on how samples are split and
+   the order partials are added.
+
+   - fast (--deterministic 0) : each thread sums a contiguous range
+     of samples (omp static schedule) into its own partial, and the
+     partials are added in the order of threads. the result is
+     the same from run to run with the same number of threads, but
+     changes with OMP_NUM_THREADS (and differs from cpu_base).
+   - deterministic (--deterministic 1) : samples are split into
+     chunks of a fixed size (PAR_REDUCE_CHUNK), each chunk summed
+     sequentially into its partial by whichever thread, and partials
+     are added by a pairwise tree of a fixed shape (partial i gets
+     i + 1, i + 2, i + 4, ...). the result depends only on the
+     number of samples, so runs are bitwise reproducible with any
+     number of threads.
+
+   the cost of the latter is a partial per chunk rather than per
+   thread (more memory traffic when there are fewer threads than
+   chunks) and log2 (chunks) levels of the tree; the test below
+   measures it.
+
+   without -fopenmp, pragmas are ignored and both modes run on
+   one thread (and still give their respective results).
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if _OPENMP
+#include <omp.h>
+#endif
+#include "mnist_util.h"
+
+/** @brief samples per chunk of the deterministic mode */
+#define PAR_REDUCE_CHUNK 8
+
+/**
+   @brief the number of threads a parallel region gets
+*/
+static int par_reduce_max_threads() {
+#if _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+/**
+   @brief a scratch buffer of (at least) n reals for partials
+   @details it only grows and is shared by all reductions called
+   from a thread (e.g., gradient checks run layers on several
+   threads at once, grad_check_all.h)
+*/
+static real * par_reduce_buf(size_t n) {
+  static thread_local real * buf = 0;
+  static thread_local size_t cap = 0;
+  if (cap < n) {
+    free(buf);
+    buf = (real *)malloc(sizeof(real) * n);
+    if (!buf) { perror("malloc"); bail(); }
+    cap = n;
+  }
+  return buf;
+}
+
+/**
+   @brief add up partials by a pairwise tree of a fixed shape
+   @param (p) n_parts partials of m elements each (p[i * m + j])
+   @param (n_parts) the number of partials
+   @param (m) the number of elements
+   @details p[j] gets the sum; the order of additions of each element
+   depends only on n_parts
+*/
+static void par_reduce_tree(real * p, long n_parts, long m) {
+#pragma omp parallel for schedule(static)
+  for (long j = 0; j < m; j++) {
+    for (long s = 1; s < n_parts; s *= 2) {
+      for (long i = 0; i + s < n_parts; i += 2 * s) {
+        p[i * m + j] += p[(i + s) * m + j];
+      }
+    }
+  }
+}
+
+/**
+   @brief out[0:m] = (accumulate ? out[0:m] : 0) + the sum of
+   contributions of n samples
+   @param (out) m elements the sum goes to
+   @param (m) the number of elements
+   @param (n) the number of samples
+   @param (accumulate) 1 to add the sum to out
+   @param (deterministic) 1 for the deterministic mode (see the top of the file)
+   @param (part) part(lo, hi, acc) adds contributions of samples [lo,hi) to acc[0:m]
+*/
+template<typename F>
+static void par_reduce(real * out, long m, long n, int accumulate, int deterministic, F part) {
+  real * p;
+  long n_parts;
+  if (deterministic) {
+    n_parts = (n + PAR_REDUCE_CHUNK - 1) / PAR_REDUCE_CHUNK;
+    if (n_parts == 0) n_parts = 1;
+    p = par_reduce_buf(n_parts * m);
+#pragma omp parallel for schedule(static)
+    for (long c = 0; c < n_parts; c++) {
+      real * acc = p + c * m;
+      memset(acc, 0, sizeof(real) * m);
+      long lo = c * PAR_REDUCE_CHUNK;
+      long hi = (lo + PAR_REDUCE_CHUNK < n ? lo + PAR_REDUCE_CHUNK : n);
+      part(lo, hi, acc);
+    }
+    par_reduce_tree(p, n_parts, m);
+  } else {
+    n_parts = par_reduce_max_threads();
+    p = par_reduce_buf(n_parts * m);
+    long n_used = 1;
+#pragma omp parallel
+    {
+#if _OPENMP
+      long nt = omp_get_num_threads();
+      long t = omp_get_thread_num();
+#else
+      long nt = 1;
+      long t = 0;
+#endif
+      if (t == 0) n_used = nt;
+      real * acc = p + t * m;
+      memset(acc, 0, sizeof(real) * m);
+      long lo = n * t / nt;
+      long hi = n * (t + 1) / nt;
+      part(lo, hi, acc);
+    }
+    for (long t = 1; t < n_used; t++) {
+      for (long j = 0; j < m; j++) {
+        p[j] += p[t * m + j];
+      }
+    }
+  }
+  for (long j = 0; j < m; j++) {
+    out[j] = (accumulate ? out[j] : 0) + p[j];
+  }
+}
+
+/**
+   @brief the test reduction: out[j] = sum_i x[i][j] * y[i]
+*/
+static void par_reduce_test_run(real * out, const real * x, const real * y,
+                                long m, long n, int deterministic) {
+  par_reduce(out, m, n, 0, deterministic,
+             [&](long lo, long hi, real * acc) {
+               for (long i = lo; i < hi; i++) {
+                 for (long j = 0; j < m; j++) {
+                   acc[j] += x[i * m + j] * y[i];
+                 }
+               }
+             });
+}
+
+/**
+   @brief entry point of this header file
+   @details if this header file is included from
+   a main C++ file and define par_reduce_main to be main
+   (e.g., with -Dpar_reduce_main=main), then this
+   function becomes th main function of the executable.
+   it reduces 64 samples x 18432 elements (the shape of gw of
+   conv2) with 1, 2, 3 and 4 threads in both modes, checks the
+   deterministic one gives bitwise the same result with all
+   and both are close to a sum in double, and reports time per
+   reduction of each mode.
+*/
+int par_reduce_main(int argc, char ** argv) {
+  const long m = (argc > 1 ? atol(argv[1]) : 18432);
+  const long n = (argc > 2 ? atol(argv[2]) : 64);
+  const int reps = (argc > 3 ? atoi(argv[3]) : 20);
+  real * x = (real *)malloc(sizeof(real) * m * n);
+  real * y = (real *)malloc(sizeof(real) * n);
+  real * ref = (real *)malloc(sizeof(real) * m);
+  real * out[2] = { (real *)malloc(sizeof(real) * m), (real *)malloc(sizeof(real) * m) };
+  unsigned long long s = 12345;
+  for (long k = 0; k < m * n; k++) {
+    s = s * 6364136223846793005ULL + 1442695040888963407ULL;
+    x[k] = (real)((s >> 40) * (1.0 / (1 << 24)) - 0.5);
+  }
+  for (long i = 0; i < n; i++) y[i] = (real)(1.0 + 1.0e-3 * i);
+  for (long j = 0; j < m; j++) {
+    double v = 0;
+    for (long i = 0; i < n; i++) v += (double)x[i * m + j] * y[i];
+    ref[j] = (real)v;
+  }
+  int ok = 1;
+  for (int deterministic = 0; deterministic < 2; deterministic++) {
+    int differ = 0;
+    for (int nt = 1; nt <= 4; nt++) {
+#if _OPENMP
+      omp_set_num_threads(nt);
+#endif
+      real * o = out[nt > 1];
+      struct timespec ts0, ts1;
+      clock_gettime(CLOCK_MONOTONIC, &ts0);
+      for (int r = 0; r < reps; r++) {
+        par_reduce_test_run(o, x, y, m, n, deterministic);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &ts1);
+      double ns = ((ts1.tv_sec - ts0.tv_sec) * 1.0e9 + (ts1.tv_nsec - ts0.tv_nsec)) / reps;
+      double err = 0;
+      for (long j = 0; j < m; j++) {
+        double e = (double)o[j] - ref[j];
+        err = (e * e > err ? e * e : err);
+      }
+      int same = (nt == 1 || memcmp(out[0], out[1], sizeof(real) * m) == 0);
+      differ |= !same;
+      printf("%s threads=%d : %.0f ns/reduction, max err %.3g, %s 1 thread\n",
+             (deterministic ? "deterministic" : "fast         "), nt, ns, err,
+             (same ? "bitwise same as" : "differs from"));
+      ok = ok && err < 1.0e-9;
+    }
+    /* the fast mode may or may not differ, depending on the threads actually given */
+    if (deterministic) ok = ok && !differ;
+  }
+  free(x); free(y); free(ref); free(out[0]); free(out[1]);
+  printf("%s\n", ok ? "OK" : "NG");
+  return ok ? 0 : 1;
+}
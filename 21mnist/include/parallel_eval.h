@@ -0,0 +1,295 @@
+/**
+   @file parallel_eval.h
+   @brief evaluating the test data with multiple threads
+   @details the training network (MNIST) holds buffers for a single
+   mini batch, so test() in mnist.cc evaluates the test data one
+   mini batch after another on one thread. parallel_evaluator
+   instead takes a snapshot of the weights (MNISTInferWeights,
+   read only while evaluating) and gives each thread its own
+   inference network (MNISTInfer) sharing them. threads grab mini
+   batches from a shared counter and record the loss and the
+   prediction of each sample; the main thread sums them up in the
+   order of samples, so results do not depend on the number of
+   threads.
+
+   since the snapshot is separate from the training network, the
+   evaluation of epoch i can run in background while epoch i+1
+   trains (start/wait instead of run).
+ */
+#pragma once
+
+#include <pthread.h>
+#include "mnist_util.h"
+#include "mnist_data.h"
+#include "mnist.h"
+#include "mnist_infer.h"
+
+/**
+   @brief multithreaded evaluator of the test data
+   @param (maxB) maximum batch size
+   @param (C) number of channels in the input
+   @param (H) image height
+   @param (W) image width
+   @param (nC) number of classes
+ */
+template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC>
+struct parallel_evaluator {
+  typedef MNISTInferWeights<C,H,W,nC> weights_t;
+  typedef MNISTInfer<maxB,C,H,W,nC> infer_t;
+  /**
+     @brief argument of a worker thread
+  */
+  struct worker_arg {
+    parallel_evaluator * ev;    /**< the evaluator */
+    int tid;                    /**< thread index */
+  };
+  int n_threads;                /**< the number of threads */
+  idx_t B;                      /**< samples a thread takes at a time */
+  mnist_dataset<maxB,C,H,W> * data; /**< the test data */
+  weights_t * wt;               /**< snapshot of weights being evaluated */
+  infer_t ** nets;              /**< a network for each thread */
+  real * loss;                  /**< loss of each sample */
+  idx_t * pred;                 /**< prediction of each sample */
+  long next;                    /**< the first sample not taken by any thread yet */
+  long epoch;                   /**< the epoch after which the snapshot was taken */
+  long elapsed_ns;              /**< time the last evaluation took */
+  int running;                  /**< 1 while a background evaluation is in flight */
+  int has_result;               /**< 1 if there is a result not reported yet */
+  pthread_t master;             /**< thread running a background evaluation */
+
+  /**
+     @brief initialize
+     @param (n_threads) the number of threads
+     @param (data) the test data
+     @param (B) samples a thread takes at a time (<= maxB)
+  */
+  void init(int n_threads, mnist_dataset<maxB,C,H,W> * data, idx_t B) {
+    assert(B <= maxB);
+    this->n_threads = n_threads;
+    this->data = data;
+    this->B = B;
+    wt = new_lazy<weights_t>();
+    nets = (infer_t **)malloc(sizeof(infer_t *) * n_threads);
+    for (int t = 0; t < n_threads; t++) {
+      nets[t] = new_lazy<infer_t>();
+      nets[t]->init(wt);
+    }
+    long n = (data->n_data > 0 ? data->n_data : 1);
+    loss = (real *)malloc(sizeof(real) * n);
+    pred = (idx_t *)malloc(sizeof(idx_t) * n);
+    epoch = 0;
+    elapsed_ns = 0;
+    running = 0;
+    has_result = 0;
+  }
+  /**
+     @brief take a snapshot of the weights of a training network
+     @param (mnist) the network (whose weights must be on the host)
+     @param (epoch) the number of epochs it has been trained
+     @details waits for a background evaluation in flight, which
+     is still reading the previous snapshot
+  */
+  void snapshot(MNIST<maxB,C,H,W,nC>& mnist, long epoch) {
+    wait();
+    copy_infer_weights(*wt, mnist);
+    this->epoch = epoch;
+  }
+  /**
+     @brief the body of a worker thread
+  */
+  static void * worker_thread(void * arg_) {
+    worker_arg * arg = (worker_arg *)arg_;
+    arg->ev->work(arg->tid);
+    return 0;
+  }
+  /**
+     @brief evaluate mini batches until none is left
+     @param (tid) thread index (which network to use)
+  */
+  void work(int tid) {
+    infer_t * net = nets[tid];
+    const long n = data->n_data;
+    while (1) {
+      long k0 = __sync_fetch_and_add(&next, (long)B);
+      if (k0 >= n) break;
+      idx_t b = (n - k0 < B ? n - k0 : B);
+      for (idx_t s = 0; s < b; s++) {
+        data_item<C,H,W>& itm = data->data[k0 + s];
+        for (idx_t c = 0; c < C; c++)
+          for (idx_t i = 0; i < H; i++)
+            for (idx_t j = 0; j < W; j++)
+              net->x.w[s][c][i][j] = itm.w[c][i][j];
+      }
+      net->forward(b);
+      for (idx_t s = 0; s < b; s++) {
+        idx_t t = data->data[k0 + s].label;
+        loss[k0 + s] = -net->y(s,t);
+        pred[k0 + s] = net->pred(s);
+      }
+    }
+  }
+  /**
+     @brief evaluate the snapshot with all threads and wait for them
+  */
+  void run() {
+    tsc_t t0 = get_tsc();
+    next = 0;
+    pthread_t * th = (pthread_t *)malloc(sizeof(pthread_t) * n_threads);
+    worker_arg * args = (worker_arg *)malloc(sizeof(worker_arg) * n_threads);
+    for (int t = 0; t < n_threads; t++) {
+      args[t].ev = this;
+      args[t].tid = t;
+      pthread_create(&th[t], 0, worker_thread, &args[t]);
+    }
+    for (int t = 0; t < n_threads; t++) {
+      pthread_join(th[t], 0);
+    }
+    free(th);
+    free(args);
+    tsc_t t1 = get_tsc();
+    elapsed_ns = t1.ns - t0.ns;
+    has_result = 1;
+  }
+  /**
+     @brief the body of the thread running a background evaluation
+  */
+  static void * master_thread(void * arg) {
+    ((parallel_evaluator *)arg)->run();
+    return 0;
+  }
+  /**
+     @brief start evaluating the snapshot in background
+     @sa wait
+  */
+  void start() {
+    wait();
+    running = 1;
+    pthread_create(&master, 0, master_thread, this);
+  }
+  /**
+     @brief wait for the background evaluation (if any) to finish
+  */
+  void wait() {
+    if (running) {
+      pthread_join(master, 0);
+      running = 0;
+    }
+  }
+  /**
+     @brief log the result of the last evaluation (if not yet)
+     @param (lgr) logger
+     @return the accuracy (-1 if there was nothing to report)
+     @details the whole test data is logged as a single batch,
+     in the same format test() in mnist.cc uses
+  */
+  double report(logger& lgr) {
+    if (!has_result) return -1.0;
+    has_result = 0;
+    const long n = data->n_data;
+    double acc = -1.0;
+    lgr.log(2, "Test Epoch %ld starts", epoch);
+    if (n > 0) {
+      lgr.log(2, "Test Epoch %ld batch 0 (samples 0 - %ld) starts", epoch, n);
+      lgr.record(2, run_rec_batch, epoch, 0, n, 1);
+      lgr.log(2, "Test Epoch %ld batch 0 (samples 0 - %ld) ends", epoch, n);
+      double Lsum = 0.0;
+      long n_correct = 0;
+      for (long k = 0; k < n; k++) {
+        data_item<C,H,W>& itm = data->data[k];
+        lgr.log(3, "sample %ld image %d pred %d truth %d",
+                k, itm.index, pred[k], (idx_t)itm.label);
+        lgr.record(3, run_rec_sample, 0, k, itm.index, pred[k], itm.label);
+        Lsum += loss[k];
+        n_correct += (pred[k] == itm.label);
+      }
+      lgr.log(1, "# test: epoch %ld evaluated by %d threads in %ld nsec",
+              epoch, n_threads, elapsed_ns);
+      lgr.log(1, "Test set: Average loss: %.4f, Accuracy: %ld/%ld (%.0f%%)",
+              Lsum / n, n_correct, n, (100. * n_correct) / n);
+      acc = (double)n_correct / n;
+      lgr.record(1, run_rec_test_loss, epoch, n_correct, n, 0, 0, Lsum / n, acc);
+    }
+    lgr.log(2, "Test Epoch %ld ends", epoch);
+    return acc;
+  }
+  /**
+     @brief wait for evaluation in flight and free everything
+  */
+  void fini() {
+    wait();
+    for (int t = 0; t < n_threads; t++) delete_lazy(nets[t]);
+    free(nets);
+    delete_lazy(wt);
+    free(loss);
+    free(pred);
+  }
+};
+
+/**
+   @brief entry point of this header file
+   @param (argc) the number of command line args
+   @param (argv) command line args
+   @details if this header file is included from
+   a main C++ file and define parallel_eval_main to be main
+   (e.g., with -Dparallel_eval_main=main), then this
+   function becomes th main function of the executable.
+   it evaluates test data (--test-data-size) with a randomly
+   initialized network, serially on the training network and
+   with 1 and 4 threads (in background), and checks all give
+   the same accuracy and loss.
+*/
+int parallel_eval_main(int argc, char ** argv) {
+  cmdline_opt opt = parse_args(argc, argv);
+  if (opt.error || opt.help) usage(argv[0]);
+  const idx_t maxB = MAX_BATCH_SIZE;
+  const idx_t B = min_i(maxB, opt.batch_size);
+  const idx_t C = 1;
+  const idx_t H = 28;
+  const idx_t W = 28;
+  const idx_t nC = 10;
+  logger lgr;
+  lgr.start_log(opt);
+  rnd_gen_t rg;
+  rg.seed(opt.weight_seed);
+  MNISTCfg cfg = {};
+  MNIST<maxB,C,H,W,nC> * mnist = new_lazy<MNIST<maxB,C,H,W,nC> >();
+  mnist->init(opt, &lgr, rg, cfg);
+  mnist_dataset<maxB,C,H,W> data;
+  data.load(lgr, opt.data_dir, opt.test_data_size, 0.1307, 0.3081, 0);
+  /* serially on the training network */
+  double Lsum = 0.0;
+  long n_correct = 0;
+  data.rewind();
+  while (data.get_data(mnist->x, mnist->t, mnist->idxs, B, 0)) {
+    tensor<real,maxB>& y = mnist->forward(mnist->x, mnist->t, 0);
+    mnist->predict(mnist->pred);
+    Lsum += y.sum();
+    for (idx_t s = 0; s < mnist->x.n0; s++) n_correct += (mnist->pred(s) == mnist->t(s));
+  }
+  printf("serial     : loss %.6f correct %ld/%ld\n", Lsum / data.n_data, n_correct, data.n_data);
+  int ok = 1;
+  int threads[2] = { 1, 4 };
+  for (int r = 0; r < 2; r++) {
+    parallel_evaluator<maxB,C,H,W,nC> ev;
+    ev.init(threads[r], &data, B);
+    ev.snapshot(*mnist, 0);
+    ev.start();
+    ev.wait();
+    double L = 0.0;
+    long c = 0;
+    for (long k = 0; k < data.n_data; k++) {
+      L += ev.loss[k];
+      c += (ev.pred[k] == data.data[k].label);
+    }
+    printf("%d thread(s): loss %.6f correct %ld/%ld (%.3f ms)\n",
+           threads[r], L / data.n_data, c, data.n_data, ev.elapsed_ns * 1.0e-6);
+    ok = ok && (c == n_correct) && fabs(L - Lsum) <= 1.0e-4 * fabs(Lsum) + 1.0e-4;
+    ev.fini();
+  }
+  printf("%s\n", ok ? "OK" : "NG");
+  data.close();
+  mnist->fini();
+  delete_lazy(mnist);
+  lgr.end_log();
+  return ok ? 0 : 1;
+}
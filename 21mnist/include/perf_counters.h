@@ -0,0 +1,492 @@
+/**
+   @file perf_counters.h
+   @brief hardware performance counters per layer function (--perf 1)
+   @details with --perf 1, each thread that calls layer functions
+   opens counters with perf_event_open(2) (cycles, instructions,
+   L1D and last level cache accesses/misses and, on Intel,
+   floating point operations retired) the first time it calls one.
+   log_start_fun/log_end_fun (mnist_util.h) read them before and
+   after the function and add the differences to the call site
+   (the same call sites as the tracer, tracer.h), so the counts
+   are attributed to e.g. Convolution2D<...>::forward. at the end
+   a table of IPC, miss rates and GFLOP/s per function is logged.
+
+   counters are opened in a few groups, each read with one
+   read(2). when there are more counters than the PMU has, the
+   kernel multiplexes groups; counts are scaled by the time each
+   group was actually counting. counters that cannot be opened
+   (e.g., in a container or a VM without a virtual PMU, or with
+   kernel.perf_event_paranoid too high) are left out and shown
+   as "-"; if none can be opened, the table still has the number
+   of calls and the time of each function.
+
+   layers also report what a call should cost in an ideal
+   implementation (floating point ops and bytes moved, see
+   layer_cost), which roofline.h compares with the time taken.
+ */
+#pragma once
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if !defined(__ARM_64BIT_STATE)
+#include <cpuid.h>
+#endif
+#include "tracer.h"
+
+/**
+   @brief counters
+*/
+enum {
+  PERF_TASK_CLOCK,              /**< cpu time (ns) */
+  PERF_CYCLES,                  /**< cycles */
+  PERF_INSTRUCTIONS,            /**< instructions retired */
+  PERF_L1D_ACCESS,              /**< L1D read accesses */
+  PERF_L1D_MISS,                /**< L1D read misses */
+  PERF_LLC_REF,                 /**< last level cache references */
+  PERF_LLC_MISS,                /**< last level cache misses */
+  PERF_FP_1,                    /**< scalar floating point ops retired */
+  PERF_FP_4,                    /**< 128 bit packed (4 x float) */
+  PERF_FP_8,                    /**< 256 bit packed (8 x float) */
+  PERF_FP_16,                   /**< 512 bit packed (16 x float) */
+  PERF_N_EVENTS,
+};
+
+/**
+   @brief groups of counters (read at once)
+*/
+enum {
+  PERF_GROUP_SW,                /**< software (task clock) */
+  PERF_GROUP_HW,                /**< cycles, instructions and caches */
+  PERF_GROUP_FP,                /**< floating point ops (Intel only) */
+  PERF_N_GROUPS,
+};
+
+/**
+   @brief definition of a counter
+*/
+struct perf_event_def {
+  const char * name;            /**< name */
+  int group;                    /**< group (PERF_GROUP_xxx) */
+  uint32_t type;                /**< perf_event_attr.type */
+  uint64_t config;              /**< perf_event_attr.config */
+  int lanes;                    /**< floating point ops per count (FP events) */
+};
+
+/**
+   @brief config of a hardware cache event
+*/
+#define PERF_CACHE_CONFIG(cache, op, result) \
+  ((cache) | ((op) << 8) | ((result) << 16))
+
+/**
+   @brief FP_ARITH_INST_RETIRED (event 0xc7) of Intel with a umask
+   @details umasks for single precision are 0x02 (scalar), 0x08
+   (128 bit), 0x20 (256 bit) and 0x80 (512 bit); those for double
+   precision are half of them. an FMA counts as two
+*/
+#define PERF_INTEL_FP_CONFIG(umask) (0xc7 | ((umask) << 8))
+
+/**
+   @brief the state of counters of a thread
+*/
+struct perf_thread {
+  int state;                    /**< 0 : not opened yet, 1 : opened */
+  int fd[PERF_N_GROUPS];        /**< fd of the leader of each group (-1 if not opened) */
+  int pos[PERF_N_EVENTS];       /**< position of each counter in its group (-1 if not opened) */
+  int nr[PERF_N_GROUPS];        /**< number of counters opened in each group */
+};
+
+/**
+   @brief counter values at a point
+*/
+struct perf_reading {
+  long ns;                      /**< wall clock (0 if not reading) */
+  uint64_t v[PERF_N_EVENTS];    /**< counter values */
+  uint64_t en[PERF_N_GROUPS];   /**< time each group was enabled */
+  uint64_t run[PERF_N_GROUPS];  /**< time each group was counting */
+};
+
+/**
+   @brief the cost of a layer function according to the model of the layer
+   @details flops are the floating point ops the computation needs
+   (a multiply-add is two); bytes are what must be read from and
+   written to memory at least, i.e., all inputs, outputs and
+   parameters once
+*/
+struct layer_cost {
+  uint64_t flops;               /**< floating point ops */
+  uint64_t bytes;               /**< bytes moved */
+};
+
+/**
+   @brief counts accumulated for a call site
+*/
+struct perf_site_stat {
+  uint64_t calls;               /**< number of calls */
+  uint64_t ns;                  /**< wall clock time */
+  uint64_t flops;               /**< floating point ops (layer_cost) */
+  uint64_t bytes;               /**< bytes moved (layer_cost) */
+  uint64_t v[PERF_N_EVENTS];    /**< counts (while the group was counting) */
+  uint64_t en[PERF_N_GROUPS];   /**< time each group was enabled */
+  uint64_t run[PERF_N_GROUPS];  /**< time each group was counting */
+};
+
+/**
+   @brief the global state of counters
+*/
+struct perf_counter_state {
+  volatile int on;              /**< 1 if calls are timed (--perf or --roofline) */
+  int hw;                       /**< 1 if counters are read too (--perf) */
+  int intel;                    /**< 1 on an Intel processor (FP events available) */
+  int fp_shift;                 /**< 1 if real is double (umasks of FP events are halved) */
+  volatile int n_threads;       /**< threads that opened counters */
+  volatile int opened[PERF_N_EVENTS]; /**< threads on which each counter was opened */
+  int first_errno;              /**< errno of the first counter that could not be opened */
+  const char * first_failed;    /**< name of the first counter that could not be opened */
+  perf_site_stat sites[TRACE_MAX_SITES]; /**< counts of each call site */
+};
+
+/** @brief counters */
+static perf_counter_state perfc = {};
+/** @brief counters of this thread */
+static __thread perf_thread perf_my = {};
+
+/**
+   @brief the definitions of all counters
+*/
+static const perf_event_def perf_events[PERF_N_EVENTS] = {
+  { "task-clock",   PERF_GROUP_SW, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, 0 },
+  { "cycles",       PERF_GROUP_HW, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 0 },
+  { "instructions", PERF_GROUP_HW, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 0 },
+  { "L1-dcache-loads", PERF_GROUP_HW, PERF_TYPE_HW_CACHE,
+    PERF_CACHE_CONFIG(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                      PERF_COUNT_HW_CACHE_RESULT_ACCESS), 0 },
+  { "L1-dcache-load-misses", PERF_GROUP_HW, PERF_TYPE_HW_CACHE,
+    PERF_CACHE_CONFIG(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                      PERF_COUNT_HW_CACHE_RESULT_MISS), 0 },
+  { "cache-references", PERF_GROUP_HW, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, 0 },
+  { "cache-misses", PERF_GROUP_HW, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 0 },
+  { "fp_arith_inst_retired.scalar",   PERF_GROUP_FP, PERF_TYPE_RAW, PERF_INTEL_FP_CONFIG(0x02), 1 },
+  { "fp_arith_inst_retired.128b_packed", PERF_GROUP_FP, PERF_TYPE_RAW, PERF_INTEL_FP_CONFIG(0x08), 4 },
+  { "fp_arith_inst_retired.256b_packed", PERF_GROUP_FP, PERF_TYPE_RAW, PERF_INTEL_FP_CONFIG(0x20), 8 },
+  { "fp_arith_inst_retired.512b_packed", PERF_GROUP_FP, PERF_TYPE_RAW, PERF_INTEL_FP_CONFIG(0x80), 16 },
+};
+
+/**
+   @brief perf_event_open(2)
+*/
+static int perf_event_open_(perf_event_attr * attr, int group_fd) {
+  return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+/**
+   @brief 1 if this is an Intel processor
+*/
+static int perf_is_intel() {
+#if defined(__ARM_64BIT_STATE)
+  return 0;
+#else
+  unsigned a, b, c, d;
+  if (!__get_cpuid(0, &a, &b, &c, &d)) return 0;
+  return (b == 0x756e6547 && d == 0x49656e69 && c == 0x6c65746e); /* GenuineIntel */
+#endif
+}
+
+/**
+   @brief open counters of this thread
+   @details the first counter of a group that opens becomes the
+   leader of the group; a counter that cannot be opened is left out
+*/
+static void perf_open_thread() {
+  perf_thread& t = perf_my;
+  t.state = 1;
+  for (int g = 0; g < PERF_N_GROUPS; g++) {
+    t.fd[g] = -1;
+    t.nr[g] = 0;
+  }
+  for (int e = 0; e < PERF_N_EVENTS; e++) {
+    const perf_event_def& d = perf_events[e];
+    t.pos[e] = -1;
+    if (d.group == PERF_GROUP_FP && !perfc.intel) continue;
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = d.type;
+    attr.config = d.config;
+    if (d.group == PERF_GROUP_FP) {
+      attr.config = PERF_INTEL_FP_CONFIG(((d.config >> 8) & 0xff) >> perfc.fp_shift);
+    }
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = (PERF_FORMAT_GROUP
+                        | PERF_FORMAT_TOTAL_TIME_ENABLED
+                        | PERF_FORMAT_TOTAL_TIME_RUNNING);
+    int fd = perf_event_open_(&attr, t.fd[d.group]);
+    if (fd == -1) {
+      if (!perfc.first_failed) {
+        perfc.first_failed = d.name;
+        perfc.first_errno = errno;
+      }
+      continue;
+    }
+    if (t.fd[d.group] == -1) t.fd[d.group] = fd;
+    t.pos[e] = t.nr[d.group]++;
+    __sync_fetch_and_add(&perfc.opened[e], 1);
+  }
+  __sync_fetch_and_add(&perfc.n_threads, 1);
+}
+
+/**
+   @brief read all counters of this thread
+   @param (r) gets the values
+*/
+static void perf_read(perf_reading& r) {
+  r.ns = trace_wall_ns();
+  if (!perfc.hw) return;
+  perf_thread& t = perf_my;
+  if (!t.state) perf_open_thread();
+  for (int g = 0; g < PERF_N_GROUPS; g++) {
+    r.en[g] = r.run[g] = 0;
+    if (t.fd[g] == -1) continue;
+    /* nr, time_enabled, time_running, values */
+    uint64_t buf[3 + PERF_N_EVENTS];
+    ssize_t sz = read(t.fd[g], buf, sizeof(buf));
+    if (sz < (ssize_t)(sizeof(uint64_t) * (3 + t.nr[g]))) continue;
+    r.en[g] = buf[1];
+    r.run[g] = buf[2];
+    for (int e = 0; e < PERF_N_EVENTS; e++) {
+      if (perf_events[e].group == g && t.pos[e] >= 0) r.v[e] = buf[3 + t.pos[e]];
+    }
+  }
+}
+
+/**
+   @brief read counters at the start of a function
+   @param (r) gets the values (r.ns = 0 if not counting)
+*/
+static inline void perf_begin(perf_reading& r) {
+  r.ns = 0;
+  if (perfc.on) perf_read(r);
+}
+
+/**
+   @brief read counters at the end of a function and add the differences to the call site
+   @param (site) the call site (trace_site)
+   @param (r0) what perf_begin read
+*/
+static inline void perf_end(int site, perf_reading& r0) {
+  if (!perfc.on || r0.ns == 0) return;
+  perf_reading r1;
+  perf_read(r1);
+  perf_site_stat& s = perfc.sites[site];
+  __sync_fetch_and_add(&s.calls, 1);
+  __sync_fetch_and_add(&s.ns, (uint64_t)(r1.ns - r0.ns));
+  if (!perfc.hw) return;
+  for (int g = 0; g < PERF_N_GROUPS; g++) {
+    __sync_fetch_and_add(&s.en[g], r1.en[g] - r0.en[g]);
+    __sync_fetch_and_add(&s.run[g], r1.run[g] - r0.run[g]);
+  }
+  for (int e = 0; e < PERF_N_EVENTS; e++) {
+    if (perf_my.pos[e] >= 0) __sync_fetch_and_add(&s.v[e], r1.v[e] - r0.v[e]);
+  }
+}
+
+/**
+   @brief add the model cost of a call to its call site
+   @param (site) the call site (trace_site)
+   @param (c) the cost
+*/
+static inline void perf_add_cost(int site, layer_cost c) {
+  if (!perfc.on) return;
+  perf_site_stat& s = perfc.sites[site];
+  __sync_fetch_and_add(&s.flops, c.flops);
+  __sync_fetch_and_add(&s.bytes, c.bytes);
+}
+
+/**
+   @brief start timing calls (and counting if hw)
+   @param (real_bytes) sizeof(real), to choose FP events of the right precision
+   @param (hw) 1 to read performance counters, 0 to time calls only
+   @return the number of counters that could be opened on the calling thread
+*/
+static int perf_start(int real_bytes, int hw) {
+  perfc.intel = perf_is_intel();
+  perfc.fp_shift = (real_bytes == 8);
+  perfc.hw = (perfc.hw || hw);
+  perfc.on = 1;
+  if (!perfc.hw) return 0;
+  if (!perf_my.state) perf_open_thread();
+  int n = 0;
+  for (int e = 0; e < PERF_N_EVENTS; e++) n += (perf_my.pos[e] >= 0);
+  return n;
+}
+
+/**
+   @brief 1 if a counter was opened on any thread
+*/
+static int perf_available(int e) {
+  return perfc.opened[e] > 0;
+}
+
+/**
+   @brief the count of a counter for a call site, scaled for multiplexing
+   @return the count or -1 if not available
+*/
+static double perf_count(const perf_site_stat& s, int e) {
+  if (!perf_available(e)) return -1.0;
+  int g = perf_events[e].group;
+  if (s.run[g] == 0) return -1.0;
+  return s.v[e] * ((double)s.en[g] / (double)s.run[g]);
+}
+
+/**
+   @brief floating point ops of a call site
+   @return the count or -1 if not available
+*/
+static double perf_flops(const perf_site_stat& s) {
+  double f = 0.0;
+  int any = 0;
+  for (int e = PERF_FP_1; e <= PERF_FP_16; e++) {
+    double c = perf_count(s, e);
+    if (c < 0) continue;
+    f += c * (perf_events[e].lanes >> perfc.fp_shift);
+    any = 1;
+  }
+  return (any ? f : -1.0);
+}
+
+/**
+   @brief format a ratio (or "-" if not available)
+*/
+static const char * perf_fmt(char * buf, size_t sz, double num, double den, double scale, const char * fmt) {
+  if (num < 0 || den <= 0) snprintf(buf, sz, "-");
+  else snprintf(buf, sz, fmt, num * scale / den);
+  return buf;
+}
+
+/**
+   @brief the number of rows in the table (call sites)
+*/
+static int perf_n_rows() {
+  return (tracer.n_sites < TRACE_MAX_SITES ? tracer.n_sites : TRACE_MAX_SITES);
+}
+
+/**
+   @brief format a row of the table
+   @param (i) the call site (-1 for the header)
+   @param (line) gets the row
+   @return 0 if the site was never called while counting (nothing written)
+*/
+static int perf_format_row(int i, char * line, size_t sz) {
+  if (i < 0) {
+    snprintf(line, sz, "%-48s %8s %10s %6s %10s %6s %8s %8s %9s",
+             "function", "calls", "ms", "%", "cpu ms", "IPC", "L1D mis%", "LLC mis%", "GFLOP/s");
+    return 1;
+  }
+  const perf_site_stat& s = perfc.sites[i];
+  if (s.calls == 0) return 0;
+  uint64_t total_ns = 0;
+  for (int j = 0; j < perf_n_rows(); j++) total_ns += perfc.sites[j].ns;
+  char name[256];
+  const char * phase;
+  trace_parse_site(tracer.sites[i], name, sizeof(name), &phase);
+  char cpu[32], ipc[32], l1[32], llc[32], gf[32];
+  snprintf(line, sz, "%-48s %8lu %10.3f %6.1f %10s %6s %8s %8s %9s",
+           name, (unsigned long)s.calls, s.ns * 1.0e-6,
+           (total_ns ? 100.0 * s.ns / total_ns : 0.0),
+           perf_fmt(cpu, sizeof(cpu), perf_count(s, PERF_TASK_CLOCK), 1.0, 1.0e-6, "%.3f"),
+           perf_fmt(ipc, sizeof(ipc), perf_count(s, PERF_INSTRUCTIONS),
+                    perf_count(s, PERF_CYCLES), 1.0, "%.2f"),
+           perf_fmt(l1, sizeof(l1), perf_count(s, PERF_L1D_MISS),
+                    perf_count(s, PERF_L1D_ACCESS), 100.0, "%.2f"),
+           perf_fmt(llc, sizeof(llc), perf_count(s, PERF_LLC_MISS),
+                    perf_count(s, PERF_LLC_REF), 100.0, "%.2f"),
+           perf_fmt(gf, sizeof(gf), perf_flops(s), (double)s.ns, 1.0, "%.2f"));
+  return 1;
+}
+
+/**
+   @brief describe which counters are available
+   @param (buf) gets e.g. "hardware counters unavailable (cycles: No such file or directory), timing only"
+*/
+static void perf_describe(char * buf, size_t sz) {
+  int hw = perf_available(PERF_CYCLES) || perf_available(PERF_INSTRUCTIONS);
+  if (!perfc.first_failed) {
+    snprintf(buf, sz, "all counters available on %d thread(s)", perfc.n_threads);
+  } else if (hw) {
+    snprintf(buf, sz, "some counters unavailable (%s: %s) on %d thread(s)",
+             perfc.first_failed, strerror(perfc.first_errno), perfc.n_threads);
+  } else {
+    snprintf(buf, sz, "hardware counters unavailable (%s: %s), timing only",
+             perfc.first_failed, strerror(perfc.first_errno));
+  }
+}
+
+/**
+   @brief stop counting and close counters of this thread
+*/
+static void perf_fini() {
+  perfc.on = 0;
+  for (int g = 0; g < PERF_N_GROUPS; g++) {
+    if (perf_my.state && perf_my.fd[g] != -1) close(perf_my.fd[g]);
+  }
+  perf_my.state = 0;
+}
+
+/**
+   @brief a counted function for the test
+*/
+struct perf_test_layer {
+  /**
+     @brief a function doing n float multiply-adds
+  */
+  static float forward(const float * a, long n) {
+    static int site = trace_site(__PRETTY_FUNCTION__);
+    perf_reading r0;
+    perf_begin(r0);
+    float s = 0.0;
+    for (long i = 0; i < n; i++) s += a[i] * a[i];
+    perf_end(site, r0);
+    return s;
+  }
+};
+
+/**
+   @brief entry point of this header file
+   @details if this header file is included from
+   a main C++ file and define perf_counters_main to be main
+   (e.g., with -Dperf_counters_main=main), then this
+   function becomes th main function of the executable.
+   it counts a simple loop and prints the table; it succeeds
+   whether or not hardware counters are available, as long as
+   the calls and the time are accounted for.
+*/
+int perf_counters_main(int argc, char ** argv) {
+  (void)argc;
+  (void)argv;
+  const long n = 1 << 20;
+  float * a = (float *)malloc(sizeof(float) * n);
+  for (long i = 0; i < n; i++) a[i] = (float)(i % 7);
+  float x = perf_test_layer::forward(a, n); /* not counted */
+  int n_opened = perf_start(sizeof(float), 1);
+  for (int r = 0; r < 10; r++) x += perf_test_layer::forward(a, n);
+  char line[512];
+  perf_describe(line, sizeof(line));
+  printf("%d counters opened: %s\n", n_opened, line);
+  for (int i = -1; i < perf_n_rows(); i++) {
+    if (perf_format_row(i, line, sizeof(line))) printf("%s\n", line);
+  }
+  const perf_site_stat& s = perfc.sites[0];
+  int ok = (s.calls == 10 && s.ns > 0);
+  if (perf_available(PERF_INSTRUCTIONS)) ok = ok && perf_count(s, PERF_INSTRUCTIONS) >= n * 10;
+  perf_fini();
+  free(a);
+  printf("(x=%f)\n%s\n", x, ok ? "OK" : "NG");
+  return ok ? 0 : 1;
+}
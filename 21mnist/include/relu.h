@@ -49,6 +49,28 @@ struct Relu {
     (void)rg;
     (void)cfg;
   }
+  /**
+     @brief the static footprint of the layer (layer_mem; no parameters)
+  */
+  static constexpr layer_mem memory() {
+    return layer_mem{ 0, 0, 0, sizeof(y) + sizeof(gx), sizeof(Relu<N0,N1,N2,N3>) };
+  }
+  /**
+     @brief the cost of forward with B samples (a comparison per element; layer_cost)
+     @param (B) the number of samples
+  */
+  static constexpr layer_cost forward_cost(idx_t B) {
+    return layer_cost{ (uint64_t)B * N1 * N2 * N3,
+                       2 * (uint64_t)sizeof(real) * B * N1 * N2 * N3 };
+  }
+  /**
+     @brief the cost of backward with B samples (reads gy and x, writes gx; layer_cost)
+     @param (B) the number of samples
+  */
+  static constexpr layer_cost backward_cost(idx_t B) {
+    return layer_cost{ (uint64_t)B * N1 * N2 * N3,
+                       3 * (uint64_t)sizeof(real) * B * N1 * N2 * N3 };
+  }
   /**
      @brief set the device pointer for this and all subobjects
      @param (dev) a device memory or null
@@ -86,15 +108,31 @@ struct Relu {
   */
   __device__ __host__
   void forward_base(tensor<real,N0,N1,N2,N3>& x, int training) {
+    forward_base_to(x, y, training);
+  }
+  /**
+     @brief the baseline (serial) implementation of forward writing
+     its output to an arbitrary tensor (y_) instead of y
+     @param (x) input images
+     @param (y_) the tensor the output is written to
+     @param (training) 1 if it is called in training not testing
+     @details used by activation recomputation, which keeps the
+     output in a scratch buffer and regenerates it during backward
+     @sa forward_base
+     @sa forward_to
+  */
+  __device__ __host__
+  void forward_base_to(tensor<real,N0,N1,N2,N3>& x,
+                       tensor<real,N0,N1,N2,N3>& y_, int training) {
     (void)training;
     const idx_t n0 = x.n0;
-    y.set_n0(n0);
+    y_.set_n0(n0);
     x_ptr = &x;
     for (idx_t i0 = 0; i0 < n0; i0++) {
       for (idx_t i1 = 0; i1 < N1; i1++) {
         for (idx_t i2 = 0; i2 < N2; i2++) {
           for (idx_t i3 = 0; i3 < N3; i3++) {
-            y(i0,i1,i2,i3) = max_r(0, x(i0,i1,i2,i3));
+            y_(i0,i1,i2,i3) = max_r(0, x(i0,i1,i2,i3));
           }
         }
       }
@@ -173,9 +211,31 @@ struct Relu {
       }        
     }
     tsc_t t1 = get_tsc();
+    log_cost(forward_cost(x.n0));
     log_end_fun(lgr, t0, t1);
     return y;
   }
+  /**
+     @brief forward phase of the layer writing its output to y_
+     @param (x) input images
+     @param (y_) the tensor the output is written to (host memory)
+     @param (training) 1 if it is called in training not testing
+     @details the same as forward except for the output tensor.
+     only cpu algorithms are supported; the caller (MNIST) turns
+     recomputation off for cuda algorithms.
+     @sa forward
+     @sa forward_base_to
+  */
+  tensor<real,N0,N1,N2,N3>& forward_to(tensor<real,N0,N1,N2,N3>& x,
+                                       tensor<real,N0,N1,N2,N3>& y_, int training) {
+    log_start_fun(lgr);
+    tsc_t t0 = get_tsc();
+    forward_base_to(x, y_, training);
+    tsc_t t1 = get_tsc();
+    log_cost(forward_cost(x.n0));
+    log_end_fun(lgr, t0, t1);
+    return y_;
+  }
   /**
      @brief the baseline (serial) implementation of backward
      @param (gy) gradient of loss with respect to the output
@@ -279,6 +339,7 @@ struct Relu {
       }        
     }
     tsc_t t1 = get_tsc();
+    log_cost(backward_cost(gy.n0));
     log_end_fun(lgr, t0, t1);
     return gx;
   }
@@ -0,0 +1,242 @@
+/**
+   @file roofline.h
+   @brief a roofline report of layer functions (--roofline 1)
+   @details every layer tells what each call of forward, backward
+   and update should cost (layer_cost: floating point ops and the
+   minimum bytes moved, computed from its template parameters);
+   log_cost in the layer adds it to the call site along with the
+   time the call took (perf_counters.h). at the end of a run,
+   roofline_probe measures the host with a STREAM triad (memory
+   bandwidth) and independent FMAs on 64 byte vectors (peak flops) on the
+   calling thread, and each function is reported with
+
+   - its arithmetic intensity (flops / bytes),
+   - achieved GFLOP/s (flops / time),
+   - attainable GFLOP/s = min(peak, intensity x bandwidth), and
+   - whether it is bound by memory or compute (whether the
+     intensity is below or above the ridge point peak/bandwidth).
+
+   layers of the training network run on a single thread, so the
+   probes use a single thread too.
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "mnist_util.h"
+#include "perf_counters.h"
+
+/**
+   @brief SIMD vector of the probes (portable gcc/clang vector extension)
+ */
+typedef real roofline_vec __attribute__((vector_size(64),__may_alias__,aligned(sizeof(real))));
+/** @brief lanes of roofline_vec */
+enum { RL = sizeof(roofline_vec) / sizeof(real) };
+
+/**
+   @brief a vector all of whose lanes are x
+*/
+static roofline_vec RV(real x) {
+  roofline_vec v = {};
+  return v + x;
+}
+
+/**
+   @brief what the host can do on a thread
+*/
+struct roofline_host {
+  double bw;                    /**< memory bandwidth (GB/s) of a STREAM triad */
+  double peak;                  /**< GFLOP/s of independent FMAs on roofline_vec */
+  /**
+     @brief attainable GFLOP/s at an arithmetic intensity
+  */
+  double attainable(double intensity) const {
+    double m = intensity * bw;
+    return (m < peak ? m : peak);
+  }
+  /**
+     @brief the arithmetic intensity at which compute becomes the bound
+  */
+  double ridge() const {
+    return peak / bw;
+  }
+};
+
+/**
+   @brief STREAM triad a = b + s c
+   @param (n) elements of each array (roofline_vec)
+   @param (reps) repetitions
+   @return the best bandwidth (GB/s)
+   @details unlike STREAM, it counts 4 arrays moved per repetition,
+   as stores to a read it into caches first (write allocate)
+*/
+static double roofline_stream(long n, int reps) {
+  roofline_vec * a = (roofline_vec *)aligned_alloc(64, sizeof(roofline_vec) * n);
+  roofline_vec * b = (roofline_vec *)aligned_alloc(64, sizeof(roofline_vec) * n);
+  roofline_vec * c = (roofline_vec *)aligned_alloc(64, sizeof(roofline_vec) * n);
+  if (!a || !b || !c) {
+    perror("aligned_alloc");
+    exit(1);
+  }
+  for (long i = 0; i < n; i++) {
+    a[i] = RV(0.0);
+    b[i] = RV(1.0);
+    c[i] = RV(2.0);
+  }
+  roofline_vec s = RV(0.5);
+  long best = LONG_MAX;
+  for (int r = 0; r < reps; r++) {
+    long t0 = trace_wall_ns();
+    for (long i = 0; i < n; i++) a[i] = b[i] + s * c[i];
+    long t1 = trace_wall_ns();
+    if (t1 - t0 < best) best = t1 - t0;
+    asm volatile("" : : "r"(a) : "memory");
+  }
+  free(a);
+  free(b);
+  free(c);
+  return 4.0 * sizeof(roofline_vec) * n / (best > 0 ? best : 1);
+}
+
+/**
+   @brief peak GFLOP/s of multiply-adds on roofline_vec
+   @param (n) iterations, each doing a multiply-add on 12 independent vectors
+   @return GFLOP/s (a multiply-add is two)
+   @details 12 independent chains hide the latency of FMAs on
+   current processors (4 cycles x 2 pipes + some)
+*/
+static double roofline_peak(long n) {
+  roofline_vec x0 = RV(0.0), x1 = RV(0.1), x2 = RV(0.2), x3 = RV(0.3);
+  roofline_vec x4 = RV(0.4), x5 = RV(0.5), x6 = RV(0.6), x7 = RV(0.7);
+  roofline_vec x8 = RV(0.8), x9 = RV(0.9), x10 = RV(1.0), x11 = RV(1.1);
+  roofline_vec a = RV(0.999), b = RV(0.001);
+  long t0 = trace_wall_ns();
+  for (long i = 0; i < n; i++) {
+    x0 = x0 * a + b; x1 = x1 * a + b; x2 = x2 * a + b; x3 = x3 * a + b;
+    x4 = x4 * a + b; x5 = x5 * a + b; x6 = x6 * a + b; x7 = x7 * a + b;
+    x8 = x8 * a + b; x9 = x9 * a + b; x10 = x10 * a + b; x11 = x11 * a + b;
+  }
+  long t1 = trace_wall_ns();
+  roofline_vec s = x0 + x1 + x2 + x3 + x4 + x5 + x6 + x7 + x8 + x9 + x10 + x11;
+  asm volatile("" : : "m"(s));
+  return 2.0 * RL * 12 * n / (t1 > t0 ? t1 - t0 : 1);
+}
+
+/**
+   @brief measure the host
+   @details each array of the triad is as large as the last level
+   cache (between 32MB and 256MB), so the triad mostly goes to
+   memory; both take a fraction of a second
+*/
+static roofline_host roofline_probe() {
+  roofline_host h;
+  long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (llc <= 0) llc = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  long bytes = (llc < (32L << 20) ? (32L << 20) : llc > (256L << 20) ? (256L << 20) : llc);
+  h.bw = roofline_stream(bytes / sizeof(roofline_vec), 5);
+  h.peak = roofline_peak(10L << 20);
+  return h;
+}
+
+/**
+   @brief format a row of the roofline report
+   @param (h) the host
+   @param (i) the call site (-1 for the header)
+   @param (line) gets the row
+   @return 0 if the site has no model cost or was never called (nothing written)
+*/
+static int roofline_format_row(const roofline_host& h, int i, char * line, size_t sz) {
+  if (i < 0) {
+    snprintf(line, sz, "%-48s %8s %10s %10s %10s %8s %9s %9s %6s %s",
+             "function", "calls", "ms", "GFLOP", "MB", "flop/B", "GFLOP/s", "attain", "%", "bound");
+    return 1;
+  }
+  const perf_site_stat& s = perfc.sites[i];
+  if (s.calls == 0 || s.ns == 0 || s.bytes == 0) return 0;
+  char name[256];
+  const char * phase;
+  trace_parse_site(tracer.sites[i], name, sizeof(name), &phase);
+  double ai = (double)s.flops / s.bytes;
+  double achieved = (double)s.flops / s.ns;
+  double attainable = h.attainable(ai);
+  int memory_bound = (ai < h.ridge());
+  /* % of the roof; for memory bound functions, that of bandwidth
+     (the same as that of flops, but defined without flops too) */
+  double pct = (memory_bound ? 100.0 * s.bytes / s.ns / h.bw : 100.0 * achieved / h.peak);
+  snprintf(line, sz, "%-48s %8lu %10.3f %10.3f %10.1f %8.2f %9.2f %9.2f %6.1f %s",
+           name, (unsigned long)s.calls, s.ns * 1.0e-6, s.flops * 1.0e-9, s.bytes * 1.0e-6,
+           ai, achieved, attainable, pct, (memory_bound ? "memory" : "compute"));
+  return 1;
+}
+
+/**
+   @brief a function whose cost is recorded, for the test
+*/
+template<int compute>
+struct roofline_test_layer {
+  /**
+     @brief a triad (compute = 0) or a chain of multiply-adds (compute = 1) over n roofline_vec's
+  */
+  static void forward(roofline_vec * a, const roofline_vec * b, long n) {
+    static int site = trace_site(__PRETTY_FUNCTION__);
+    perf_reading r0;
+    perf_begin(r0);
+    roofline_vec s = RV(0.5);
+    if (compute) {
+      for (long i = 0; i < n; i++) {
+        roofline_vec x = b[i];
+        for (int k = 0; k < 64; k++) x = x * s + s;
+        a[i] = x;
+      }
+      perf_add_cost(site, layer_cost{ 2 * 64 * RL * (uint64_t)n, 2 * sizeof(roofline_vec) * (uint64_t)n });
+    } else {
+      for (long i = 0; i < n; i++) a[i] = a[i] + s * b[i];
+      perf_add_cost(site, layer_cost{ 2 * RL * (uint64_t)n, 3 * sizeof(roofline_vec) * (uint64_t)n });
+    }
+    perf_end(site, r0);
+  }
+};
+
+/**
+   @brief entry point of this header file
+   @details if this header file is included from
+   a main C++ file and define roofline_main to be main
+   (e.g., with -Droofline_main=main), then this
+   function becomes th main function of the executable.
+   it probes the host, runs a triad (memory bound) and a chain of
+   multiply-adds (compute bound) with recorded costs, prints the
+   report and checks the bound of each.
+*/
+int roofline_main(int argc, char ** argv) {
+  (void)argc;
+  (void)argv;
+  perf_start(sizeof(real), 0);
+  const long n = (32L << 20) / sizeof(roofline_vec);
+  roofline_vec * a = (roofline_vec *)aligned_alloc(64, sizeof(roofline_vec) * n);
+  roofline_vec * b = (roofline_vec *)aligned_alloc(64, sizeof(roofline_vec) * n);
+  for (long i = 0; i < n; i++) {
+    a[i] = RV(1.0);
+    b[i] = RV(2.0);
+  }
+  for (int r = 0; r < 3; r++) {
+    roofline_test_layer<0>::forward(a, b, n);
+    roofline_test_layer<1>::forward(a, b, n / 16);
+  }
+  roofline_host h = roofline_probe();
+  printf("host: stream triad %.2f GB/s, peak %.2f GFLOP/s (%d lanes), ridge %.2f flop/B\n",
+         h.bw, h.peak, (int)RL, h.ridge());
+  char line[512];
+  int ok = (h.bw > 0 && h.peak > 0);
+  for (int i = -1; i < perf_n_rows(); i++) {
+    if (roofline_format_row(h, i, line, sizeof(line))) printf("%s\n", line);
+    if (i >= 0) {
+      int is_compute = (strstr(line, "compute") != 0);
+      ok = ok && (is_compute == (strstr(tracer.sites[i], "compute = 1") != 0));
+    }
+  }
+  perf_fini();
+  free(a);
+  free(b);
+  printf("%s\n", ok ? "OK" : "NG");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,211 @@
+/**
+   @file run_records.h
+   @brief structured run records written alongside the text log (--records 1)
+   @details the text log carries the full signature of a function
+   (__PRETTY_FUNCTION__) at each of its calls and records/parse_log.py
+   has to match every line against regular expressions and parse
+   every signature. the logger therefore also writes
+
+   - LOG.rec : fixed-width binary rows (run_rec) of mini batches,
+     function calls (kernels), losses and predictions, after a
+     16 byte header ("MNISTREC", the version and the bytes of a row), and
+   - LOG.sites : the table of functions, "id<TAB>signature" a line,
+     where id is the call site of the tracer (tracer.h) that kernel
+     rows refer to; it is written when the log is closed.
+
+   records/run_records.py reads them into the same tables parse_log.py
+   makes from the text (submit.py uses it when they are there), with
+   each signature parsed once.
+
+   rows are written with a single fwrite each (stdio locks the file,
+   so threads may add rows at once) through a large buffer.
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tracer.h"
+
+/** @brief version of the format */
+#define RUN_RECORDS_VERSION 1
+/** @brief bytes of the buffer of the file */
+#define RUN_RECORDS_BUF_BYTES (1 << 20)
+
+/**
+   @brief kinds of rows
+*/
+typedef enum {
+  run_rec_batch,                /**< a mini batch starts (id: epoch, a - b: samples, c: 0 train/1 test) */
+  run_rec_kernel,               /**< a function call (id: call site, t0 - t1: start and end, a: ns it took) */
+  run_rec_train_loss,           /**< training loss (id: epoch, a: samples of the epoch so far, b: of the epoch, x: loss) */
+  run_rec_test_loss,            /**< test loss (id: epoch, a: correct, b: samples, x: loss, y: accuracy) */
+  run_rec_sample,               /**< a prediction (a: sample, b: image, c: predicted, d: true class) */
+} run_rec_kind_t;
+
+/**
+   @brief a row
+*/
+struct run_rec {
+  int64_t t0;                   /**< time (ns since the log started) */
+  int64_t t1;                   /**< end time (kernels; t0 otherwise) */
+  int32_t kind;                 /**< run_rec_kind_t */
+  int32_t id;                   /**< call site or epoch (see run_rec_kind_t) */
+  int64_t a;                    /**< integer fields (see run_rec_kind_t) */
+  int64_t b;                    /**< ditto */
+  int64_t c;                    /**< ditto */
+  int64_t d;                    /**< ditto */
+  double x;                     /**< real fields (see run_rec_kind_t) */
+  double y;                     /**< ditto */
+};
+
+/**
+   @brief the header of LOG.rec
+*/
+struct run_rec_header {
+  char magic[8];                /**< "MNISTREC" */
+  uint32_t version;             /**< RUN_RECORDS_VERSION */
+  uint32_t row_bytes;           /**< sizeof(run_rec) */
+};
+
+/**
+   @brief writer of LOG.rec and LOG.sites
+*/
+struct run_records {
+  FILE * fp;                    /**< LOG.rec */
+  char * sites_file;            /**< LOG.sites */
+  char * buf;                   /**< buffer of fp */
+  long n_rows;                  /**< rows written so far */
+  /**
+     @brief open LOG.rec
+     @param (log) the name of the text log (LOG)
+     @return 0 if succeeded
+  */
+  int open(const char * log) {
+    size_t len = strlen(log) + 8;
+    char * rec_file = (char *)malloc(len);
+    sites_file = (char *)malloc(len);
+    snprintf(rec_file, len, "%s.rec", log);
+    snprintf(sites_file, len, "%s.sites", log);
+    fp = fopen(rec_file, "wb");
+    if (!fp) {
+      perror(rec_file);
+      free(rec_file);
+      free(sites_file);
+      return -1;
+    }
+    free(rec_file);
+    buf = (char *)malloc(RUN_RECORDS_BUF_BYTES);
+    setvbuf(fp, buf, _IOFBF, RUN_RECORDS_BUF_BYTES);
+    run_rec_header h;
+    memcpy(h.magic, "MNISTREC", 8);
+    h.version = RUN_RECORDS_VERSION;
+    h.row_bytes = sizeof(run_rec);
+    fwrite(&h, sizeof(h), 1, fp);
+    n_rows = 0;
+    return 0;
+  }
+  /**
+     @brief write a row
+  */
+  void add(const run_rec& r) {
+    fwrite(&r, sizeof(r), 1, fp);
+    __sync_fetch_and_add(&n_rows, 1);
+  }
+  /**
+     @brief close LOG.rec and write LOG.sites (call sites registered so far)
+     @return 0 if succeeded
+  */
+  int close() {
+    int err = 0;
+    if (fclose(fp) != 0) {
+      perror("fclose");
+      err = -1;
+    }
+    free(buf);
+    FILE * sp = fopen(sites_file, "wb");
+    if (sp) {
+      int n = (tracer.n_sites < TRACE_MAX_SITES ? tracer.n_sites : TRACE_MAX_SITES);
+      for (int i = 0; i < n; i++) {
+        fprintf(sp, "%d\t%s\n", i, tracer.sites[i]);
+      }
+      if (fclose(sp) != 0) err = -1;
+    } else {
+      perror(sites_file);
+      err = -1;
+    }
+    free(sites_file);
+    return err;
+  }
+};
+
+/**
+   @brief a function whose calls are recorded, for the test
+*/
+template<int k>
+static int run_records_test_site() {
+  static int site = trace_site(__PRETTY_FUNCTION__);
+  return site;
+}
+
+/**
+   @brief entry point of this header file
+   @details if this header file is included from
+   a main C++ file and define run_records_main to be main
+   (e.g., with -Drun_records_main=main), then this
+   function becomes th main function of the executable.
+   it writes rows of every kind, reads them back and checks
+   them and the table of functions.
+*/
+int run_records_main(int argc, char ** argv) {
+  const char * log = (argc > 1 ? argv[1] : "run_records_test.log");
+  const long n = 1000;
+  int sites[2] = { run_records_test_site<0>(), run_records_test_site<1>() };
+  run_records rr;
+  if (rr.open(log) != 0) return 1;
+  for (long i = 0; i < n; i++) {
+    run_rec r = { i * 10, i * 10 + (i % 5), (int32_t)(i % 5), (int32_t)sites[i % 2],
+                  i, -i, 3 * i, i % 10, i * 0.5, 1.0 / (i + 1) };
+    rr.add(r);
+  }
+  if (rr.close() != 0) return 1;
+  /* read them back */
+  int ok = 1;
+  char file[1024];
+  snprintf(file, sizeof(file), "%s.rec", log);
+  FILE * fp = fopen(file, "rb");
+  run_rec_header h;
+  ok = ok && fp && fread(&h, sizeof(h), 1, fp) == 1;
+  ok = ok && memcmp(h.magic, "MNISTREC", 8) == 0 && h.version == RUN_RECORDS_VERSION
+    && h.row_bytes == sizeof(run_rec);
+  long m = 0;
+  run_rec r;
+  while (ok && fread(&r, sizeof(r), 1, fp) == 1) {
+    ok = ok && r.t0 == m * 10 && r.t1 == m * 10 + (m % 5) && r.kind == m % 5
+      && r.id == sites[m % 2] && r.a == m && r.b == -m && r.c == 3 * m && r.d == m % 10
+      && r.x == m * 0.5 && r.y == 1.0 / (m + 1);
+    m++;
+  }
+  ok = ok && m == n;
+  if (fp) fclose(fp);
+  snprintf(file, sizeof(file), "%s.sites", log);
+  fp = fopen(file, "rb");
+  char line[1024];
+  int n_sites = 0;
+  while (fp && fgets(line, sizeof(line), fp)) {
+    int id = atoi(line);
+    const char * name = strchr(line, '\t');
+    ok = ok && id == n_sites && name && strncmp(name + 1, tracer.sites[id], strlen(tracer.sites[id])) == 0;
+    n_sites++;
+  }
+  ok = ok && n_sites == tracer.n_sites;
+  if (fp) fclose(fp);
+  unlink(file);
+  snprintf(file, sizeof(file), "%s.rec", log);
+  unlink(file);
+  printf("%ld rows of %d bytes, %d functions\n", m, (int)sizeof(run_rec), n_sites);
+  printf("%s\n", ok ? "OK" : "NG");
+  return ok ? 0 : 1;
+}
@@ -542,6 +542,24 @@ struct tensor{
         // return ::V16(w[i0][i1][i2][i3]);
         return ::V16(a(i0,i1,i2,i3));
     }
+
+    /**
+     @brief the same as V16, except that the vector may run across the
+     last dimensions as long as it stays within the elements of the tensor;
+     e.g., y.V16_flat(i,j) of a 2-D tensor y (whose N2 and N3 are 1)
+     @param i0,i1,i2,i3 indices
+     @return A vector containing the 16 elements from x[i0][i1][i2][i3] in the memory layout
+     */
+    realv& V16_flat(idx_t i0,idx_t i1=0,idx_t i2=0,idx_t i3=0){
+        range_chk(0,i0,n0);
+        range_chk(0,i1,N1);
+        range_chk(0,i2,N2);
+        range_chk(0,i3,N3);
+        range_chk(0,((i0*N1+i1)*N2+i2)*N3+i3+L-1,n0*N1*N2*N3);
+
+        tensor<T,N0,N1,N2,N3>& a = *this;
+        return ::V16(a(i0,i1,i2,i3));
+    }
     
     #endif
 
@@ -0,0 +1,344 @@
+/**
+   @file tracer.h
+   @brief a low-overhead event tracer (--trace FILE)
+   @details log_start_fun/log_end_fun (mnist_util.h) record a span
+   for every layer function they surround: the call site, the
+   thread and timestamps read from the cycle counter. each thread
+   appends to its own ring buffer (no locks, no atomics on the
+   fast path); the oldest events are overwritten when a ring is
+   full. nothing is formatted until tracer_dump writes all rings
+   as a Chrome trace (JSON) file at the end, which chrome://tracing
+   or https://ui.perfetto.dev displays as per-thread timelines.
+
+   call sites are registered once (a function-local static),
+   so an event is just an index, and the name (e.g.,
+   "Convolution2D<64,1,28,28,3,32>::forward") and the phase
+   (forward, backward, update, ...) are derived from
+   __PRETTY_FUNCTION__ only when dumping.
+
+   when tracing is off (the default), an event costs a load and a
+   branch.
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __ARM_64BIT_STATE
+#include <arm_neon.h>
+#else
+#include <x86intrin.h>
+#endif
+
+/** @brief events kept per thread (older ones are overwritten) */
+#ifndef TRACE_RING_EVENTS
+#define TRACE_RING_EVENTS (1 << 16)
+#endif
+/** @brief maximum number of distinct call sites */
+#define TRACE_MAX_SITES 1024
+
+/**
+   @brief an event (a span of a call site on a thread)
+*/
+struct trace_event {
+  uint64_t t0;                  /**< start (cycle counter) */
+  uint64_t t1;                  /**< end (cycle counter) */
+  uint32_t site;                /**< index of the call site */
+};
+
+/**
+   @brief events recorded by a thread
+*/
+struct trace_ring {
+  trace_event ev[TRACE_RING_EVENTS]; /**< events (ev[n % TRACE_RING_EVENTS]) */
+  uint64_t n;                   /**< events recorded so far */
+  int tid;                      /**< thread number (0, 1, 2, ... in the order of the first event) */
+  trace_ring * next;            /**< next ring in the list of all rings */
+};
+
+/**
+   @brief the global state of the tracer
+*/
+struct tracer_state {
+  volatile int on;              /**< 1 if events are recorded */
+  trace_ring * volatile rings;  /**< list of all rings */
+  volatile int n_threads;       /**< rings created so far */
+  volatile int n_sites;         /**< call sites registered so far */
+  const char * sites[TRACE_MAX_SITES]; /**< __PRETTY_FUNCTION__ of each call site */
+  uint64_t tsc0;                /**< cycle counter when started */
+  long ns0;                     /**< time (ns) when started */
+};
+
+/** @brief the tracer */
+static tracer_state tracer = {};
+/** @brief the ring of this thread (created by the first event of the thread) */
+static __thread trace_ring * trace_my_ring = 0;
+
+/**
+   @brief read the cycle counter
+*/
+static inline uint64_t trace_clock() {
+#if defined(__ARM_64BIT_STATE)
+  uint64_t v;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+  return v;
+#else
+  return __rdtsc();
+#endif
+}
+
+/**
+   @brief wall clock (monotonic) time in ns, to calibrate the cycle counter
+*/
+static long trace_wall_ns() {
+  struct timespec ts[1];
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  return ts->tv_sec * 1000000000L + ts->tv_nsec;
+}
+
+/**
+   @brief register a call site
+   @param (pretty) __PRETTY_FUNCTION__ of the site
+   @return the index of the site
+   @details called once per site (initializer of a function-local static)
+*/
+static int trace_site(const char * pretty) {
+  int i = __sync_fetch_and_add(&tracer.n_sites, 1);
+  if (i >= TRACE_MAX_SITES) return TRACE_MAX_SITES - 1;
+  tracer.sites[i] = pretty;
+  return i;
+}
+
+/**
+   @brief create the ring of this thread and add it to the list
+*/
+static trace_ring * trace_new_ring() {
+  trace_ring * r = (trace_ring *)calloc(1, sizeof(trace_ring));
+  if (!r) {
+    perror("calloc");
+    exit(1);
+  }
+  r->tid = __sync_fetch_and_add(&tracer.n_threads, 1);
+  trace_ring * head;
+  do {
+    head = tracer.rings;
+    r->next = head;
+  } while (!__sync_bool_compare_and_swap(&tracer.rings, head, r));
+  trace_my_ring = r;
+  return r;
+}
+
+/**
+   @brief the start of a span
+   @return the cycle counter (0 if not tracing)
+*/
+static inline uint64_t trace_begin() {
+  return (tracer.on ? trace_clock() : 0);
+}
+
+/**
+   @brief the end of a span; record it
+   @param (site) the call site (trace_site)
+   @param (t0) what trace_begin returned
+*/
+static inline void trace_end(int site, uint64_t t0) {
+  if (!tracer.on || t0 == 0) return;
+  uint64_t t1 = trace_clock();
+  trace_ring * r = trace_my_ring;
+  if (!r) r = trace_new_ring();
+  trace_event& e = r->ev[r->n % TRACE_RING_EVENTS];
+  e.t0 = t0;
+  e.t1 = t1;
+  e.site = site;
+  r->n++;
+}
+
+/**
+   @brief start recording events
+*/
+static void tracer_start() {
+  tracer.tsc0 = trace_clock();
+  tracer.ns0 = trace_wall_ns();
+  tracer.on = 1;
+}
+
+/**
+   @brief split __PRETTY_FUNCTION__ into a short name and a phase
+   @param (pretty) e.g., "void Convolution2D<maxB, IC, ...>::forward(...) [with int maxB = 64; ...]"
+   @param (name) gets e.g., "Convolution2D<64,1,28,28,3,32>::forward"
+   @param (phase) gets "forward", "backward", "update" or "other"
+*/
+static void trace_parse_site(const char * pretty, char * name, size_t sz, const char ** phase) {
+  /* the parameter list: the first '(' outside <> */
+  const char * p = pretty;
+  int depth = 0;
+  for (; *p; p++) {
+    if (*p == '<') depth++;
+    else if (*p == '>') depth--;
+    else if (*p == '(' && depth == 0) break;
+  }
+  /* the method name and the class name before it */
+  const char * m = p;
+  while (m > pretty && m[-1] != ':' && m[-1] != ' ') m--;
+  const char * c = m;
+  if (c - pretty >= 2 && c[-1] == ':') c -= 2;
+  const char * k = c;
+  depth = 0;
+  while (k > pretty) {
+    char ch = k[-1];
+    if (ch == '>') depth++;
+    else if (ch == '<') depth--;
+    else if (ch == ' ' && depth == 0) break;
+    k--;
+  }
+  /* the class name without template parameters */
+  const char * lt = k;
+  while (lt < c && *lt != '<') lt++;
+  /* template arguments: values after " = " in "[with ...]" or "[...]" */
+  char targs[256] = "";
+  size_t tn = 0;
+  const char * w = strchr(p, '[');
+  while (w && (w = strstr(w, " = ")) != 0) {
+    w += 3;
+    const char * e = w;
+    while (*e && *e != ';' && *e != ',' && *e != ']') e++;
+    if (tn + (e - w) + 2 < sizeof(targs)) {
+      if (tn) targs[tn++] = ',';
+      memcpy(targs + tn, w, e - w);
+      tn += e - w;
+      targs[tn] = 0;
+    }
+    w = e;
+  }
+  if (tn) {
+    snprintf(name, sz, "%.*s<%s>::%.*s", (int)(lt - k), k, targs, (int)(p - m), m);
+  } else {
+    snprintf(name, sz, "%.*s::%.*s", (int)(c - k), k, (int)(p - m), m);
+  }
+  if (strncmp(m, "forward", 7) == 0 || strncmp(m, "recompute", 9) == 0) *phase = "forward";
+  else if (strncmp(m, "backward", 8) == 0) *phase = "backward";
+  else if (strncmp(m, "update", 6) == 0) *phase = "update";
+  else *phase = "other";
+}
+
+/**
+   @brief stop recording and write all events as a Chrome trace
+   @param (file) the file to write
+   @param (n_events) gets the number of events written
+   @param (n_dropped) gets the number of events overwritten in rings
+   @return 0 on success, -1 on failure
+*/
+static int tracer_dump(const char * file, long * n_events, long * n_dropped) {
+  tracer.on = 0;
+  *n_events = *n_dropped = 0;
+  FILE * fp = fopen(file, "wb");
+  if (!fp) {
+    perror(file);
+    return -1;
+  }
+  /* cycles per microsecond, from the whole traced interval */
+  uint64_t tsc1 = trace_clock();
+  long ns1 = trace_wall_ns();
+  double cyc_per_us = (ns1 > tracer.ns0 ? (tsc1 - tracer.tsc0) * 1.0e3 / (ns1 - tracer.ns0) : 1.0);
+  int n_sites = (tracer.n_sites < TRACE_MAX_SITES ? tracer.n_sites : TRACE_MAX_SITES);
+  static char names[TRACE_MAX_SITES][256];
+  const char * phases[TRACE_MAX_SITES];
+  for (int i = 0; i < n_sites; i++) {
+    trace_parse_site(tracer.sites[i], names[i], sizeof(names[i]), &phases[i]);
+  }
+  fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"mnist\"}}");
+  for (trace_ring * r = tracer.rings; r; r = r->next) {
+    fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,"
+            "\"args\":{\"name\":\"thread %d\"}}", r->tid, r->tid);
+    uint64_t first = (r->n > TRACE_RING_EVENTS ? r->n - TRACE_RING_EVENTS : 0);
+    *n_dropped += first;
+    for (uint64_t i = first; i < r->n; i++) {
+      trace_event& e = r->ev[i % TRACE_RING_EVENTS];
+      double ts = (double)(int64_t)(e.t0 - tracer.tsc0) / cyc_per_us;
+      double dur = (e.t1 - e.t0) / cyc_per_us;
+      fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,"
+              "\"ts\":%.3f,\"dur\":%.3f}",
+              names[e.site], phases[e.site], r->tid, ts, dur);
+      (*n_events)++;
+    }
+  }
+  fprintf(fp, "\n]}\n");
+  if (fclose(fp) != 0) {
+    perror(file);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+   @brief free all rings
+*/
+static void tracer_fini() {
+  tracer.on = 0;
+  trace_ring * r = tracer.rings;
+  tracer.rings = 0;
+  while (r) {
+    trace_ring * next = r->next;
+    free(r);
+    r = next;
+  }
+  trace_my_ring = 0;
+}
+
+/**
+   @brief a traced function for the test
+*/
+template<int N>
+struct trace_test_layer {
+  /**
+     @brief a function with a traced span
+  */
+  static long forward(long x) {
+    static int site = trace_site(__PRETTY_FUNCTION__);
+    uint64_t t0 = trace_begin();
+    x = x * 3 + N;
+    trace_end(site, t0);
+    return x;
+  }
+};
+
+/**
+   @brief entry point of this header file
+   @details if this header file is included from
+   a main C++ file and define tracer_main to be main
+   (e.g., with -Dtracer_main=main), then this
+   function becomes th main function of the executable.
+   it measures the cost of an event with tracing on and off,
+   writes a trace and checks the name of the traced function.
+*/
+int tracer_main(int argc, char ** argv) {
+  (void)argc;
+  (void)argv;
+  const long n = 1000000;
+  long x = 0;
+  long t0 = trace_wall_ns();
+  for (long i = 0; i < n; i++) x = trace_test_layer<1>::forward(x);
+  long t1 = trace_wall_ns();
+  tracer_start();
+  long t2 = trace_wall_ns();
+  for (long i = 0; i < n; i++) x = trace_test_layer<2>::forward(x);
+  long t3 = trace_wall_ns();
+  printf("ns per event: %.1f (off) %.1f (on)\n", (t1 - t0) / (double)n, (t3 - t2) / (double)n);
+  long n_events, n_dropped;
+  if (tracer_dump("tracer_test.json", &n_events, &n_dropped) != 0) return 1;
+  char name[256];
+  const char * phase;
+  trace_parse_site(tracer.sites[1], name, sizeof(name), &phase);
+  printf("events %ld dropped %ld site \"%s\" phase %s (x=%ld)\n",
+         n_events, n_dropped, name, phase, x);
+  int ok = (n_events == TRACE_RING_EVENTS && n_dropped == n - TRACE_RING_EVENTS
+            && strstr(name, "trace_test_layer<2>::forward") != 0 && strcmp(phase, "forward") == 0);
+  tracer_fini();
+  unlink("tracer_test.json");
+  printf("%s\n", ok ? "OK" : "NG");
+  return ok ? 0 : 1;
+}
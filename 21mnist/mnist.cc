@@ -5,46 +5,83 @@
 #include "include/mnist_util.h"
 #include "include/mnist_data.h"
 #include "include/mnist.h"
+#include "include/parallel_eval.h"
+#include "include/roofline.h"
 
 
 
 /**
    @brief grab a mini batch (B training samples), forward, backward and update.
+   @details with accum_steps > 1, gradients of accum_steps consecutive
+   mini batches are summed before a single update, which amounts to
+   training with batch size B * accum_steps. a trailing group of
+   fewer mini batches at the end of the epoch is updated as well.
+   once the warm-up epochs are over, --sb-fraction < 1 backpropagates
+   only samples selected by their losses (forward_backward_selective).
+   with --freeze-conv 1, conv1/conv2 are skipped once the features
+   of the images are in the store (forward_backward_frozen).
    @return the average loss of the mini batch.
  */
 template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC>
 static void train(MNIST<maxB,C,H,W,nC> * mnist,
                   mnist_dataset<maxB,C,H,W>& data, idx_t B,
-                  logger& lgr, int cuda_algo, long epoch, long log_interval) {
+                  logger& lgr, int cuda_algo, long epoch, long log_interval,
+                  long accum_steps) {
   data.rewind();
   long n_samples = 0;
+  long pending = 0;             /* mini batches accumulated since the last update */
+  const int sb = mnist->selective(epoch);
   lgr.log(2, "Train Epoch %ld starts", epoch);
-  for (long batch_idx = 0; data.get_data(mnist->x, mnist->t, mnist->idxs, B, cuda_algo); batch_idx++) {
+  for (long batch_idx = 0; data.get_data(mnist->x, mnist->t, mnist->idxs, B, cuda_algo, mnist->xp); batch_idx++) {
     lgr.log(2, "Train Epoch %ld batch %ld (samples %ld - %ld) starts",
             epoch, batch_idx, n_samples, n_samples + mnist->x.n0);
-    real Lsum = mnist->forward_backward_update(mnist->x, mnist->t);
+    lgr.record(2, run_rec_batch, epoch, n_samples, n_samples + mnist->x.n0, 0);
+    real Lsum = (mnist->opt.freeze_conv ?
+                 mnist->forward_backward_frozen(mnist->x, mnist->t, mnist->idxs, pending > 0) :
+                 sb ?
+                 mnist->forward_backward_selective(mnist->x, mnist->t, pending > 0) :
+                 mnist->forward_backward(mnist->x, mnist->t, pending > 0));
+    pending++;
+    if (pending == accum_steps) {
+      mnist->update();
+      pending = 0;
+    }
     real L = Lsum / mnist->idxs.n0;
-    mnist->predict(mnist->pred);
+    /* forward_backward_selective has predicted the whole batch */
+    if (!sb) mnist->predict(mnist->pred);
     mnist->log_prediction(n_samples, mnist->pred, mnist->t);
     if (batch_idx % log_interval == 0) {
       lgr.log(1, "Train Epoch: %ld [%ld/%ld (%.0f%%)]\tLoss: %.6f",
               epoch, n_samples, data.n_data,
               100. * n_samples / data.n_data, L);
+      lgr.record(1, run_rec_train_loss, epoch, n_samples, data.n_data, 0, 0, L);
     }
     lgr.log(2, "Train Epoch %ld batch %ld (samples %ld - %ld) ends",
             epoch, batch_idx, n_samples, n_samples + mnist->x.n0);
     n_samples += mnist->x.n0;
+    /* gradients and optimizer states have been touched once all layers ran backward and update */
+    static int first_step = 1;
+    if (first_step && pending == 0) {
+      first_step = 0;
+      lgr.log_rss(2, "first training step");
+    }
   }
+  if (pending > 0) {
+    mnist->update();
+  }
+  mnist->log_selective(epoch);
+  mnist->log_frozen(epoch);
+  mnist->log_sparsity(epoch);
   lgr.log(2, "Train Epoch %ld ends", epoch);
 }
 
 /**
    @brief forward compute B_validate validation samples 
    (taking several mini batches if necessary)
-   @return the average loss of the validation data
+   @return the accuracy of the validation data (-1 if there is none)
  */
 template<idx_t maxB,idx_t C,idx_t H,idx_t W,idx_t nC>
-static void test(MNIST<maxB,C,H,W,nC> * mnist,
+static double test(MNIST<maxB,C,H,W,nC> * mnist,
                  mnist_dataset<maxB,C,H,W>& data, idx_t B,
                  logger& lgr, int cuda_algo, long epoch) {
   real Lsum = 0.0;
@@ -52,9 +89,10 @@ static void test(MNIST<maxB,C,H,W,nC> * mnist,
   long n_correct = 0;
   data.rewind();
   lgr.log(2, "Test Epoch %ld starts", epoch);
-  for (long batch_idx = 0; data.get_data(mnist->x, mnist->t, mnist->idxs, B, cuda_algo); batch_idx++) {
+  for (long batch_idx = 0; data.get_data(mnist->x, mnist->t, mnist->idxs, B, cuda_algo, mnist->xp); batch_idx++) {
     lgr.log(2, "Test Epoch %ld batch %ld (samples %ld - %ld) starts",
             epoch, batch_idx, n_samples, n_samples + mnist->x.n0);
+    lgr.record(2, run_rec_batch, epoch, n_samples, n_samples + mnist->x.n0, 1);
     tensor<real,maxB>& y = mnist->forward(mnist->x, mnist->t, 0);
     to_host(&y, cuda_algo);
     mnist->predict(mnist->pred);
@@ -68,10 +106,152 @@ static void test(MNIST<maxB,C,H,W,nC> * mnist,
   if (n_samples > 0) {
     lgr.log(1, "Test set: Average loss: %.4f, Accuracy: %ld/%ld (%.0f%%)",
             Lsum / n_samples, n_correct, n_samples, (100. * n_correct) / n_samples);
+    lgr.record(1, run_rec_test_loss, epoch, n_correct, n_samples, 0, 0,
+               Lsum / n_samples, (double)n_correct / n_samples);
   }
   lgr.log(2, "Test Epoch %ld ends", epoch);
+  return (n_samples > 0 ? (double)n_correct / n_samples : -1.0);
 }
 
+/**
+   @brief measurements of the benchmark mode (--bench)
+   @details only the training and test loops are timed; building
+   the model, loading data and staging checkpoints are not. the
+   first epoch (cold caches, page faults) is left out of the
+   steady state training throughput unless it is the only one
+ */
+struct train_bench {
+  long n_train;                 /**< training data size */
+  long n_test;                  /**< test data size */
+  long n_epochs;                /**< epochs measured */
+  long * train_ns;              /**< time the training of each epoch took */
+  long * train_images;          /**< images trained in each epoch */
+  long infer_ns;                /**< time evaluating test data took in total */
+  long infer_images;            /**< images evaluated in total */
+  long elapsed_ns;              /**< training and test time of finished epochs */
+  long epoch_t0;                /**< when the current epoch started */
+  long target_ns;               /**< training and test time until the target was reached (-1 if not) */
+  long target_epoch;            /**< the epoch whose accuracy reached the target */
+  double acc;                   /**< the last accuracy (-1 if none) */
+  /**
+     @brief initialize
+     @param (max_epochs) the maximum number of epochs measured
+     @param (n_train) training data size
+     @param (n_test) test data size
+  */
+  void init(long max_epochs, long n_train, long n_test) {
+    this->n_train = n_train;
+    this->n_test = n_test;
+    n_epochs = 0;
+    train_ns = (long *)calloc(max_epochs + 1, sizeof(long));
+    train_images = (long *)calloc(max_epochs + 1, sizeof(long));
+    infer_ns = infer_images = elapsed_ns = 0;
+    target_ns = target_epoch = -1;
+    acc = -1.0;
+  }
+  /**
+     @brief an epoch starts
+  */
+  void begin_epoch() {
+    epoch_t0 = get_tsc().ns;
+  }
+  /**
+     @brief the training of the current epoch took ns
+  */
+  void trained(long ns) {
+    train_ns[n_epochs] = ns;
+    train_images[n_epochs] = n_train;
+  }
+  /**
+     @brief test data after epoch were evaluated in ns with accuracy a (-1 if not evaluated)
+     @param (target) the accuracy to reach
+     @return 1 if a reaches the target for the first time
+  */
+  int tested(long epoch, double a, long ns, double target) {
+    if (a < 0) return 0;
+    acc = a;
+    infer_ns += ns;
+    infer_images += n_test;
+    if (target_ns < 0 && a >= target) {
+      target_ns = elapsed_ns + get_tsc().ns - epoch_t0;
+      target_epoch = epoch;
+      return 1;
+    }
+    return 0;
+  }
+  /**
+     @brief the current epoch ends
+  */
+  void end_epoch() {
+    long t = get_tsc().ns;
+    elapsed_ns += t - epoch_t0;
+    epoch_t0 = t;
+    n_epochs++;
+  }
+  /**
+     @brief steady state training images/sec
+  */
+  double train_ips() {
+    long ns = 0, n = 0;
+    for (long i = (n_epochs > 1 ? 1 : 0); i < n_epochs; i++) {
+      ns += train_ns[i];
+      n += train_images[i];
+    }
+    return (ns > 0 ? 1.0e9 * n / ns : 0.0);
+  }
+  /**
+     @brief inference images/sec
+  */
+  double infer_ips() {
+    return (infer_ns > 0 ? 1.0e9 * infer_images / infer_ns : 0.0);
+  }
+  /**
+     @brief write the summary as a JSON object to file
+     @return 0 if succeeded
+  */
+  int write_json(const char * file, const cmdline_opt& opt, long load_ns) {
+    FILE * fp = fopen(file, "wb");
+    if (!fp) {
+      perror(file);
+      return -1;
+    }
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    fprintf(fp, "{\"host\": \"%s\", \"algo\": \"%s\", \"batch_size\": %d, \"real_bytes\": %d,"
+            " \"train_data_size\": %ld, \"test_data_size\": %ld, \"test_threads\": %d, \"async_test\": %d,\n",
+            host, opt.algo_s, opt.batch_size, (int)sizeof(real), n_train, n_test,
+            opt.test_threads, opt.async_test);
+    fprintf(fp, "\"weight_seed\": %ld, \"dropout_seed_1\": %ld, \"dropout_seed_2\": %ld, \"lr\": %f,\n",
+            opt.weight_seed, opt.dropout_seed_1, opt.dropout_seed_2, opt.lr);
+    fprintf(fp, "\"epochs\": %ld, \"load_sec\": %.3f, \"train_test_sec\": %.3f,"
+            " \"train_images_per_sec\": %.1f, \"infer_images_per_sec\": %.1f,\n",
+            n_epochs, load_ns * 1.0e-9, elapsed_ns * 1.0e-9, train_ips(), infer_ips());
+    fprintf(fp, "\"train_images_per_sec_by_epoch\": [");
+    for (long i = 0; i < n_epochs; i++) {
+      fprintf(fp, "%s%.1f", (i ? ", " : ""), (train_ns[i] > 0 ? 1.0e9 * train_images[i] / train_ns[i] : 0.0));
+    }
+    fprintf(fp, "],\n");
+    fprintf(fp, "\"target_accuracy\": %.4f, \"final_accuracy\": %.4f, ", opt.bench_target, acc);
+    if (target_ns >= 0) {
+      fprintf(fp, "\"time_to_target_sec\": %.3f, \"epochs_to_target\": %ld}\n", target_ns * 1.0e-9, target_epoch);
+    } else {
+      fprintf(fp, "\"time_to_target_sec\": null, \"epochs_to_target\": null}\n");
+    }
+    if (fclose(fp) != 0) {
+      perror(file);
+      return -1;
+    }
+    return 0;
+  }
+  /**
+     @brief free everything
+  */
+  void fini() {
+    free(train_ns);
+    free(train_images);
+  }
+};
+
 /**
    @brief main function of MNIST
    @details Train MNIST network with data from the file specified by
@@ -114,31 +294,171 @@ int main(int argc, char ** argv) {
     .relu3 = {},
     .dropout2 = { .ratio =  0.5f * (seed2 != 0), .seed = seed2 },
     .fc2 = {},
-    .nll_softmax = {}
+    .nll_softmax = {},
+    .recompute = parse_recompute(opt.recompute)
   };
-  MNIST<maxB,C,H,W,nC> * mnist = new MNIST<maxB,C,H,W,nC>();
+  if (cfg.recompute.error) usage(argv[0]);
+  /* allocated lazily so that outputs not kept (--recompute) never become resident */
+  MNIST<maxB,C,H,W,nC> * mnist = new_lazy<MNIST<maxB,C,H,W,nC> >();
   mnist->init(opt, &lgr, rg, cfg);
+  /* checkpoint (saved every --ckpt-interval epochs and/or resumed from) */
+  checkpoint ck;
+  ck.init();
+  int64_t start_epoch = 0;
+  if (opt.save_ckpt[0] || opt.resume[0]) {
+    mnist->ckpt_sections(ck);
+    ck.layout();
+  }
+  if (opt.resume[0]) {
+    tsc_t t0 = get_tsc();
+    if (ck.restore(opt.resume, &start_epoch) != 0) bail();
+    tsc_t t1 = get_tsc();
+    lgr.log(1, "# checkpoint: resumed from %s after epoch %ld (%ld bytes, %ld nsec)",
+            opt.resume, (long)start_epoch, (long)ck.file_size, t1.ns - t0.ns);
+  }
+  if (opt.save_ckpt[0]) {
+    ck.start_writer(opt.save_ckpt);
+  }
   to_dev(mnist, opt.cuda_algo);
   lgr.log(1, "model building ends");
+  mnist->log_memory();
+  lgr.log_rss(2, "model built");
   /* load data */
+  tsc_t load_t0 = get_tsc();
   mnist_dataset<maxB,C,H,W> train_data;
   mnist_dataset<maxB,C,H,W> test_data;
   real mean = 0.1307;           // pytorch
   real std = 0.3081;            // pytorch
   train_data.load(lgr, opt.data_dir, opt.train_data_size, mean, std, 1);
   test_data.load(lgr, opt.data_dir, opt.test_data_size, mean, std, 0);
+  /* conv1 input patches (--conv1-patches; the format was checked by parse_args) */
+  patch_fmt_t patch_fmt = parse_patch_fmt(mnist->opt.conv1_patches);
+  train_data.make_patches<MNIST<maxB,C,H,W,nC>::K>(lgr, patch_fmt);
+  test_data.make_patches<MNIST<maxB,C,H,W,nC>::K>(lgr, patch_fmt);
+  tsc_t load_t1 = get_tsc();
+  if (opt.mem_report) {
+    lgr.log(2, "# memory: data items used %lu + %lu bytes",
+            (unsigned long)(train_data.n_data * sizeof(train_data.data[0])),
+            (unsigned long)(test_data.n_data * sizeof(test_data.data[0])));
+  }
+  lgr.log_rss(2, "data loaded");
+  /* features of training images for frozen convolutions (--freeze-conv) */
+  if (mnist->init_frozen(train_data.n_data) != 0) bail();
+  /* evaluator of test data on a snapshot of weights (--test-threads) */
+  parallel_evaluator<maxB,C,H,W,nC> ev;
+  if (opt.test_threads > 0) {
+    ev.init(opt.test_threads, &test_data, B);
+  }
   /* training loop */
+  if (opt.trace[0]) {
+    tracer_start();
+  }
+  if (opt.perf || opt.roofline) {
+    perf_start(sizeof(real), opt.perf);
+  }
+  /* benchmark mode (--bench) */
+  train_bench bn;
+  bn.init(opt.epochs - start_epoch, train_data.n_data, test_data.n_data);
+  int reached = 0;
   lgr.log(1, "training starts");
-  for (long i = 0; i < opt.epochs; i++) {
-    train(mnist, train_data, B, lgr, opt.cuda_algo, i + 1, opt.log_interval);
-    test(mnist, test_data, B, lgr, opt.cuda_algo, i + 1);
+  for (long i = start_epoch; i < opt.epochs && !reached; i++) {
+    bn.begin_epoch();
+    tsc_t t0 = get_tsc();
+    train(mnist, train_data, B, lgr, opt.cuda_algo, i + 1, opt.log_interval,
+          opt.accum_steps);
+    tsc_t t1 = get_tsc();
+    bn.trained(t1.ns - t0.ns);
+    if (opt.test_threads > 0) {
+      /* with --async-test, the previous epoch has been evaluated in background */
+      ev.wait();
+      reached |= bn.tested(ev.epoch, ev.report(lgr), ev.elapsed_ns, opt.bench_target);
+      mnist->ckpt_to_host();
+      ev.snapshot(*mnist, i + 1);
+      mnist->skip_test_forward(test_data.n_data);
+      if (opt.async_test) {
+        ev.start();
+      } else {
+        ev.run();
+        reached |= bn.tested(i + 1, ev.report(lgr), ev.elapsed_ns, opt.bench_target);
+      }
+    } else {
+      double acc = test(mnist, test_data, B, lgr, opt.cuda_algo, i + 1);
+      tsc_t t2 = get_tsc();
+      reached |= bn.tested(i + 1, acc, t2.ns - t1.ns, opt.bench_target);
+    }
+    bn.end_epoch();
+    if (opt.mem_report) {
+      char phase[32];
+      snprintf(phase, sizeof(phase), "epoch %ld", i + 1);
+      lgr.log_rss(2, phase);
+    }
+    /* only the benchmark mode stops once the target is reached */
+    reached = reached && opt.bench[0];
+    if (opt.save_ckpt[0] && ((i + 1) % opt.ckpt_interval == 0 || i + 1 == opt.epochs)) {
+      mnist->ckpt_to_host();
+      long dt = ck.snapshot(i + 1);
+      lgr.log(1, "# checkpoint: epoch %ld staged in %ld nsec", i + 1, dt);
+    }
+  }
+  if (opt.test_threads > 0) {
+    ev.wait();
+    bn.tested(ev.epoch, ev.report(lgr), ev.elapsed_ns, opt.bench_target);
+    ev.fini();
+  }
+  if (opt.bench[0]) {
+    lgr.log(1, "# bench: %ld epochs in %.3f sec (load %.3f sec), train %.1f images/sec (steady),"
+            " inference %.1f images/sec, accuracy %.4f",
+            bn.n_epochs, bn.elapsed_ns * 1.0e-9, (load_t1.ns - load_t0.ns) * 1.0e-9,
+            bn.train_ips(), bn.infer_ips(), bn.acc);
+    if (bn.target_ns >= 0) {
+      lgr.log(1, "# bench: accuracy %.4f reached after epoch %ld in %.3f sec",
+              opt.bench_target, bn.target_epoch, bn.target_ns * 1.0e-9);
+    } else {
+      lgr.log(1, "# bench: accuracy %.4f not reached", opt.bench_target);
+    }
+    if (bn.write_json(opt.bench, opt, load_t1.ns - load_t0.ns) == 0) {
+      lgr.log(1, "# bench: summary written to %s", opt.bench);
+    }
+  }
+  bn.fini();
+  if (opt.save_ckpt[0]) {
+    ck.finish();
+    ck.log_stats(&lgr);
+  }
+  if (opt.trace[0]) {
+    long n_events, n_dropped;
+    if (tracer_dump(opt.trace, &n_events, &n_dropped) == 0) {
+      lgr.log(1, "# trace: %ld events (%ld overwritten) from %d threads written to %s",
+              n_events, n_dropped, tracer.n_threads, opt.trace);
+    }
+    tracer_fini();
+  }
+  if (opt.perf) {
+    char line[512];
+    perf_describe(line, sizeof(line));
+    lgr.log(1, "# perf: %s", line);
+    for (int i = -1; i < perf_n_rows(); i++) {
+      if (perf_format_row(i, line, sizeof(line))) lgr.log(1, "# perf: %s", line);
+    }
+  }
+  if (opt.roofline && !opt.cuda_algo) {
+    roofline_host h = roofline_probe();
+    lgr.log(1, "# roofline: host (1 thread): memory %.2f GB/s, peak %.2f GFLOP/s, ridge %.2f flop/B",
+            h.bw, h.peak, h.ridge());
+    char line[512];
+    for (int i = -1; i < perf_n_rows(); i++) {
+      if (roofline_format_row(h, i, line, sizeof(line))) lgr.log(1, "# roofline: %s", line);
+    }
   }
+  perf_fini();
+  lgr.log_rss(1, "end");
   lgr.log(1, "training ends");
   lgr.end_log();
 
   train_data.close();
   test_data.close();
-  delete mnist;
+  mnist->fini();
+  delete_lazy(mnist);
   return 0;
 }
 
@@ -0,0 +1,257 @@
+/**
+   @file mnist_infer.cc --- classify images with a trained MNIST network
+   @details loads a checkpoint written by mnist --save-ckpt into an
+   inference-only network (mnist_infer.h) and classifies images in
+   an idx file or a raw file of 28x28-byte images, a batch at a time
+   (-b 1 for one image at a time). reports latency percentiles
+   per image, throughput and the memory footprint.
+ */
+
+#include "include/mnist_util.h"
+#include "include/mnist_infer.h"
+
+#ifndef INFER_MAX_BATCH
+/**
+   @brief the maximum batch size of mnist_infer (buffers are allocated for this many images)
+ */
+#define INFER_MAX_BATCH 16
+#endif
+
+/**
+   @brief command line options of mnist_infer
+*/
+struct infer_opt {
+  const char * ckpt;            /**< checkpoint file */
+  const char * images;          /**< idx or raw image file */
+  const char * labels;          /**< idx label file ("" if none) */
+  idx_t batch_size;             /**< images classified at a time */
+  long n_images;                /**< images classified (-1 : all) */
+  int latency_path;             /**< 1 to classify a single image with MNISTInfer::forward1 */
+  int verbose;                  /**< verbosity */
+  int help;                     /**< 1 if -h,--help is given */
+  int error;                    /**< set to one if any option is invalid */
+  /**
+     @brief initialize options with default values
+  */
+  infer_opt() {
+    ckpt = "mnist.ckpt";
+    images = "data/t10k-images-idx3-ubyte";
+    labels = "data/t10k-labels-idx1-ubyte";
+    batch_size = 1;
+    n_images = -1;
+    latency_path = 1;
+    verbose = 1;
+    help = 0;
+    error = 0;
+  }
+};
+
+/**
+   @brief command line options for getopt
+*/
+static struct option infer_long_options[] = {
+  {"ckpt",              required_argument, 0, 'c' },
+  {"images",            required_argument, 0, 'i' },
+  {"labels",            required_argument, 0, 't' },
+  {"batch-size",        required_argument, 0, 'b' },
+  {"n-images",          required_argument, 0, 'n' },
+  {"latency-path",      required_argument, 0, 'l' },
+  {"verbose",           required_argument, 0, 'v' },
+  {"help",              no_argument,       0, 'h' },
+  {0,                   0,                 0,  0  }
+};
+
+/**
+   @brief show usage
+*/
+static void infer_usage(const char * prog) {
+  infer_opt o;
+  fprintf(stderr,
+          "usage:\n"
+          "\n"
+          "%s [options]\n"
+          "\n"
+          " -c,--ckpt FILE : load weights from checkpoint FILE (written by mnist --save-ckpt) [%s]\n"
+          " -i,--images FILE : classify images in FILE (idx file or concatenated raw 28x28 bytes) [%s]\n"
+          " -t,--labels FILE : check predictions against labels in idx FILE (\"\" for none) [%s]\n"
+          " -b,--batch-size N : classify N images at a time (<= %d) [%d]\n"
+          " -n,--n-images N : classify only the first N images (-1 : all) [%ld]\n"
+          " -l,--latency-path 0/1 : classify images one at a time (-b 1) with the single-image path [%d]\n"
+          " -v,--verbose L : 2 to print the prediction of each image [%d]\n"
+          " -h,--help\n",
+          prog,
+          o.ckpt,
+          o.images,
+          o.labels,
+          INFER_MAX_BATCH,
+          o.batch_size,
+          o.n_images,
+          o.latency_path,
+          o.verbose);
+  exit(1);
+}
+
+/**
+   @brief parse command line args
+*/
+static infer_opt parse_infer_args(int argc, char ** argv) {
+  infer_opt opt;
+  while (1) {
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "c:i:t:b:n:l:v:h", infer_long_options, &option_index);
+    if (c == -1) break;
+    switch (c) {
+    case 'c':
+      opt.ckpt = strdup(optarg);
+      break;
+    case 'i':
+      opt.images = strdup(optarg);
+      break;
+    case 't':
+      opt.labels = strdup(optarg);
+      break;
+    case 'b':
+      opt.batch_size = atoi(optarg);
+      break;
+    case 'n':
+      opt.n_images = atol(optarg);
+      break;
+    case 'l':
+      opt.latency_path = atoi(optarg);
+      break;
+    case 'v':
+      opt.verbose = atoi(optarg);
+      break;
+    case 'h':
+      opt.help = 1;
+      break;
+    default: /* '?' */
+      opt.error = 1;
+      return opt;
+    }
+  }
+  if (opt.batch_size < 1 || opt.batch_size > INFER_MAX_BATCH) {
+    fprintf(stderr, "error: --batch-size (%d) must be between 1 and %d\n",
+            opt.batch_size, INFER_MAX_BATCH);
+    opt.error = 1;
+  }
+  return opt;
+}
+
+/**
+   @brief compare two longs (for qsort)
+*/
+static int cmp_long(const void * a, const void * b) {
+  long x = *(const long *)a;
+  long y = *(const long *)b;
+  return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+/**
+   @brief the p-th percentile of n sorted values
+*/
+static long percentile(const long * sorted, long n, double p) {
+  long k = (long)(p / 100.0 * (n - 1) + 0.5);
+  return sorted[k];
+}
+
+/**
+   @brief a field (in kB) of /proc/self/status (e.g., VmRSS); -1 if unavailable
+*/
+static long proc_status_kb(const char * field) {
+  FILE * fp = fopen("/proc/self/status", "rb");
+  if (!fp) return -1;
+  char line[256];
+  long v = -1;
+  size_t n = strlen(field);
+  while (fgets(line, sizeof(line), fp)) {
+    if (strncmp(line, field, n) == 0 && line[n] == ':') {
+      v = atol(line + n + 1);
+      break;
+    }
+  }
+  fclose(fp);
+  return v;
+}
+
+/**
+   @brief main function of mnist_infer
+ */
+int main(int argc, char ** argv) {
+  infer_opt opt = parse_infer_args(argc, argv);
+  if (opt.error || opt.help) infer_usage(argv[0]);
+  const idx_t maxB = INFER_MAX_BATCH;
+  const idx_t C = 1;
+  const idx_t H = 28;
+  const idx_t W = 28;
+  const idx_t nC = 10;
+  typedef MNISTInferWeights<C,H,W,nC> weights_t;
+  typedef MNISTInfer<maxB,C,H,W,nC> infer_t;
+  /* load weights */
+  tsc_t t0 = get_tsc();
+  weights_t * wt = new_lazy<weights_t>();
+  if (wt->load(opt.ckpt) != 0) return 1;
+  infer_t * net = new_lazy<infer_t>();
+  net->init(wt);
+  net->latency_path = opt.latency_path;
+  tsc_t t1 = get_tsc();
+  printf("loaded %s in %.3f ms (weights %ld bytes, buffers %ld bytes)\n",
+         opt.ckpt, (t1.ns - t0.ns) * 1.0e-6, (long)sizeof(weights_t), (long)sizeof(infer_t));
+  /* map images (and labels) */
+  infer_images images = {};
+  infer_images labels = {};
+  if (images.open_images(opt.images, C * H * W) != 0) return 1;
+  int has_labels = (opt.labels[0] != 0);
+  if (has_labels && labels.open_labels(opt.labels) != 0) return 1;
+  long n = images.n;
+  if (opt.n_images >= 0 && opt.n_images < n) n = opt.n_images;
+  if (has_labels && labels.n < n) {
+    fprintf(stderr, "error: %s has only %ld labels for %ld images\n", opt.labels, labels.n, n);
+    return 1;
+  }
+  /* classify */
+  const idx_t B = opt.batch_size;
+  long * lat = (long *)malloc(sizeof(long) * (n > 0 ? n : 1));
+  long correct = 0;
+  long total_ns = 0;
+  for (long k = 0; k < n; k += B) {
+    idx_t b = (n - k < B ? n - k : B);
+    tsc_t s0 = get_tsc();
+    for (idx_t i = 0; i < b; i++) {
+      net->set_image(i, images.get(k + i));
+    }
+    net->forward(b);
+    tsc_t s1 = get_tsc();
+    long dt = s1.ns - s0.ns;
+    total_ns += dt;
+    for (idx_t i = 0; i < b; i++) {
+      /* every image of a batch waits for the whole batch */
+      lat[k + i] = dt;
+      int truth = (has_labels ? *labels.get(k + i) : -1);
+      correct += (net->pred(i) == truth);
+      if (opt.verbose >= 2) {
+        printf("image %ld pred %d truth %d\n", k + i, net->pred(i), truth);
+      }
+    }
+  }
+  /* report */
+  if (n > 0) {
+    qsort(lat, n, sizeof(long), cmp_long);
+    printf("images: %ld, batch size: %d\n", n, B);
+    printf("latency per image [us]: p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+           percentile(lat, n, 50) * 1.0e-3, percentile(lat, n, 90) * 1.0e-3,
+           percentile(lat, n, 99) * 1.0e-3, lat[n - 1] * 1.0e-3);
+    printf("throughput: %.1f images/sec\n", n / (total_ns * 1.0e-9));
+    if (has_labels) {
+      printf("accuracy: %ld/%ld (%.2f%%)\n", correct, n, 100.0 * correct / n);
+    }
+  }
+  printf("memory: VmRSS %ld kB, VmHWM %ld kB\n",
+         proc_status_kb("VmRSS"), proc_status_kb("VmHWM"));
+  free(lat);
+  images.close_images();
+  labels.close_images();
+  delete_lazy(net);
+  delete_lazy(wt);
+  return 0;
+}
@@ -0,0 +1,148 @@
+/**
+   @file mnist_loadgen.cc --- send classification requests to mnist_serve
+   @details opens a number of connections to mnist_serve, each of
+   which sends an image and waits for its reply before sending the
+   next (closed loop), and reports throughput, latency seen by
+   clients, batch sizes and accuracy.
+ */
+
+#include "include/mnist_util.h"
+#include "include/infer_server.h"
+
+/**
+   @brief command line options of mnist_loadgen
+*/
+struct loadgen_opt {
+  const char * socket;          /**< socket path */
+  const char * images;          /**< idx or raw image file */
+  const char * labels;          /**< idx label file ("" if none) */
+  int connections;              /**< concurrent connections */
+  long n_requests;              /**< requests in total */
+  int help;                     /**< 1 if -h,--help is given */
+  int error;                    /**< set to one if any option is invalid */
+  /**
+     @brief initialize options with default values
+  */
+  loadgen_opt() {
+    socket = "mnist.sock";
+    images = "data/t10k-images-idx3-ubyte";
+    labels = "data/t10k-labels-idx1-ubyte";
+    connections = 16;
+    n_requests = 10000;
+    help = 0;
+    error = 0;
+  }
+};
+
+/**
+   @brief command line options for getopt
+*/
+static struct option loadgen_long_options[] = {
+  {"socket",            required_argument, 0, 's' },
+  {"images",            required_argument, 0, 'i' },
+  {"labels",            required_argument, 0, 't' },
+  {"connections",       required_argument, 0, 'j' },
+  {"n-requests",        required_argument, 0, 'n' },
+  {"help",              no_argument,       0, 'h' },
+  {0,                   0,                 0,  0  }
+};
+
+/**
+   @brief show usage
+*/
+static void loadgen_usage(const char * prog) {
+  loadgen_opt o;
+  fprintf(stderr,
+          "usage:\n"
+          "\n"
+          "%s [options]\n"
+          "\n"
+          " -s,--socket PATH : connect to mnist_serve on UNIX-domain socket PATH [%s]\n"
+          " -i,--images FILE : send images in FILE (idx file or concatenated raw 28x28 bytes) [%s]\n"
+          " -t,--labels FILE : check replies against labels in idx FILE (\"\" for none) [%s]\n"
+          " -j,--connections N : send requests from N connections concurrently [%d]\n"
+          " -n,--n-requests N : send N requests in total (images are reused cyclically) [%ld]\n"
+          " -h,--help\n",
+          prog,
+          o.socket,
+          o.images,
+          o.labels,
+          o.connections,
+          o.n_requests);
+  exit(1);
+}
+
+/**
+   @brief parse command line args
+*/
+static loadgen_opt parse_loadgen_args(int argc, char ** argv) {
+  loadgen_opt opt;
+  while (1) {
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "s:i:t:j:n:h", loadgen_long_options, &option_index);
+    if (c == -1) break;
+    switch (c) {
+    case 's':
+      opt.socket = strdup(optarg);
+      break;
+    case 'i':
+      opt.images = strdup(optarg);
+      break;
+    case 't':
+      opt.labels = strdup(optarg);
+      break;
+    case 'j':
+      opt.connections = atoi(optarg);
+      break;
+    case 'n':
+      opt.n_requests = atol(optarg);
+      break;
+    case 'h':
+      opt.help = 1;
+      break;
+    default: /* '?' */
+      opt.error = 1;
+      return opt;
+    }
+  }
+  if (opt.connections < 1) {
+    fprintf(stderr, "error: --connections (%d) must be >= 1\n", opt.connections);
+    opt.error = 1;
+  }
+  if (opt.n_requests < 0) {
+    fprintf(stderr, "error: --n-requests (%ld) must be >= 0\n", opt.n_requests);
+    opt.error = 1;
+  }
+  return opt;
+}
+
+/**
+   @brief main function of mnist_loadgen
+ */
+int main(int argc, char ** argv) {
+  loadgen_opt opt = parse_loadgen_args(argc, argv);
+  if (opt.error || opt.help) loadgen_usage(argv[0]);
+  infer_images images = {};
+  infer_images labels = {};
+  if (images.open_images(opt.images, SERVE_IMAGE_BYTES) != 0) return 1;
+  if (images.n == 0) {
+    fprintf(stderr, "error: %s has no images\n", opt.images);
+    return 1;
+  }
+  int has_labels = (opt.labels[0] != 0);
+  if (has_labels && labels.open_labels(opt.labels) != 0) return 1;
+  if (has_labels && labels.n < images.n) {
+    fprintf(stderr, "error: %s has only %ld labels for %ld images\n",
+            opt.labels, labels.n, images.n);
+    return 1;
+  }
+  infer_loadgen g;
+  g.init(opt.socket, opt.connections, opt.n_requests, images.get(0), images.n);
+  g.run();
+  g.report(has_labels ? labels.get(0) : 0);
+  int ok = (g.n_errors == 0);
+  g.fini();
+  images.close_images();
+  labels.close_images();
+  return ok ? 0 : 1;
+}
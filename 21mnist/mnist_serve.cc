@@ -0,0 +1,169 @@
+/**
+   @file mnist_serve.cc --- serve MNIST classification on a UNIX-domain socket
+   @details loads a checkpoint written by mnist --save-ckpt and
+   classifies images sent to a UNIX-domain socket, batching
+   concurrent requests (infer_server.h). runs until interrupted
+   (or until it has served --max-requests requests) and then
+   reports batch sizes, throughput and latency.
+   use mnist_loadgen to send requests.
+ */
+
+#include "include/mnist_util.h"
+#include "include/infer_server.h"
+
+#ifndef SERVE_MAX_BATCH
+/**
+   @brief the maximum batch size of mnist_serve (buffers are allocated for this many images)
+ */
+#define SERVE_MAX_BATCH 64
+#endif
+
+/**
+   @brief command line options of mnist_serve
+*/
+struct serve_opt {
+  const char * ckpt;            /**< checkpoint file */
+  const char * socket;          /**< socket path */
+  idx_t max_batch;              /**< requests classified at a time at most */
+  long max_delay_us;            /**< how long the oldest request waits for others at most */
+  long max_requests;            /**< exit after this many requests (0 : never) */
+  int help;                     /**< 1 if -h,--help is given */
+  int error;                    /**< set to one if any option is invalid */
+  /**
+     @brief initialize options with default values
+  */
+  serve_opt() {
+    ckpt = "mnist.ckpt";
+    socket = "mnist.sock";
+    max_batch = 16;
+    max_delay_us = 1000;
+    max_requests = 0;
+    help = 0;
+    error = 0;
+  }
+};
+
+/**
+   @brief command line options for getopt
+*/
+static struct option serve_long_options[] = {
+  {"ckpt",              required_argument, 0, 'c' },
+  {"socket",            required_argument, 0, 's' },
+  {"max-batch",         required_argument, 0, 'b' },
+  {"max-delay",         required_argument, 0, 'd' },
+  {"max-requests",      required_argument, 0, 'n' },
+  {"help",              no_argument,       0, 'h' },
+  {0,                   0,                 0,  0  }
+};
+
+/**
+   @brief show usage
+*/
+static void serve_usage(const char * prog) {
+  serve_opt o;
+  fprintf(stderr,
+          "usage:\n"
+          "\n"
+          "%s [options]\n"
+          "\n"
+          " -c,--ckpt FILE : load weights from checkpoint FILE (written by mnist --save-ckpt) [%s]\n"
+          " -s,--socket PATH : listen on UNIX-domain socket PATH [%s]\n"
+          " -b,--max-batch N : classify up to N requests at a time (<= %d) [%d]\n"
+          " -d,--max-delay US : wait up to US microseconds for a batch to fill [%ld]\n"
+          " -n,--max-requests N : exit after serving N requests (0 : run until interrupted) [%ld]\n"
+          " -h,--help\n",
+          prog,
+          o.ckpt,
+          o.socket,
+          SERVE_MAX_BATCH,
+          o.max_batch,
+          o.max_delay_us,
+          o.max_requests);
+  exit(1);
+}
+
+/**
+   @brief parse command line args
+*/
+static serve_opt parse_serve_args(int argc, char ** argv) {
+  serve_opt opt;
+  while (1) {
+    int option_index = 0;
+    int c = getopt_long(argc, argv, "c:s:b:d:n:h", serve_long_options, &option_index);
+    if (c == -1) break;
+    switch (c) {
+    case 'c':
+      opt.ckpt = strdup(optarg);
+      break;
+    case 's':
+      opt.socket = strdup(optarg);
+      break;
+    case 'b':
+      opt.max_batch = atoi(optarg);
+      break;
+    case 'd':
+      opt.max_delay_us = atol(optarg);
+      break;
+    case 'n':
+      opt.max_requests = atol(optarg);
+      break;
+    case 'h':
+      opt.help = 1;
+      break;
+    default: /* '?' */
+      opt.error = 1;
+      return opt;
+    }
+  }
+  if (opt.max_batch < 1 || opt.max_batch > SERVE_MAX_BATCH) {
+    fprintf(stderr, "error: --max-batch (%d) must be between 1 and %d\n",
+            opt.max_batch, SERVE_MAX_BATCH);
+    opt.error = 1;
+  }
+  if (opt.max_delay_us < 0) {
+    fprintf(stderr, "error: --max-delay (%ld) must be >= 0\n", opt.max_delay_us);
+    opt.error = 1;
+  }
+  return opt;
+}
+
+/**
+   @brief SIGINT/SIGTERM handler to stop the server
+*/
+static void on_signal(int) {
+  serve_interrupted = 1;
+}
+
+/**
+   @brief main function of mnist_serve
+ */
+int main(int argc, char ** argv) {
+  serve_opt opt = parse_serve_args(argc, argv);
+  if (opt.error || opt.help) serve_usage(argv[0]);
+  const idx_t maxB = SERVE_MAX_BATCH;
+  const idx_t C = 1;
+  const idx_t H = 28;
+  const idx_t W = 28;
+  const idx_t nC = 10;
+  typedef infer_server<maxB,C,H,W,nC> server_t;
+  server_t::weights_t * wt = new_lazy<server_t::weights_t>();
+  if (wt->load(opt.ckpt) != 0) return 1;
+  server_t * sv = (server_t *)calloc(1, sizeof(server_t));
+  if (sv->init(wt, opt.socket, opt.max_batch, opt.max_delay_us, opt.max_requests) != 0) return 1;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;
+  sigaction(SIGINT, &sa, 0);
+  sigaction(SIGTERM, &sa, 0);
+  printf("serving %s on %s (max batch %d, max delay %ld us)\n",
+         opt.ckpt, opt.socket, opt.max_batch, opt.max_delay_us);
+  fflush(stdout);
+  sv->start();
+  sv->run();
+  sv->fini();
+  sv->report();
+  sv->free_all();
+  free(sv);
+  delete_lazy(wt);
+  return 0;
+}
@@ -53,6 +53,8 @@ class log_parser_base:
         pat_time = r"(?P<t>\d+): "
         self.patterns = {tok : re.compile(pat_time + pat) for tok, pat in tokens.items()}
         self.patterns["EOF"] = re.compile("^$")
+        # report lines (e.g., "123: # recompute: ...") carry no token
+        self.comment = re.compile(pat_time + "# ")
         self.kpsr = kernel_parser()
         self.lines = []
         self.next_line()
@@ -62,6 +64,9 @@ class log_parser_base:
         get next line, set token kind
         """
         self.line = self.fp.readline()
+        while self.comment.match(self.line):
+            self.lines.append(self.line)
+            self.line = self.fp.readline()
         if self.line != "":
             #print(self.line.strip())
             self.lines.append(self.line)
@@ -192,9 +197,13 @@ class log_parser_base:
         self.eat("load_start")
         self.eat("load_end")
         self.eat("training_start")
-        while self.tok == "train_epoch_start":
-            self.parse_train_epoch()
-            self.parse_test_epoch()
+        # with --async-test, the test of an epoch comes after
+        # the training of the next epoch
+        while self.tok in ("train_epoch_start", "test_epoch_start"):
+            if self.tok == "train_epoch_start":
+                self.parse_train_epoch()
+            else:
+                self.parse_test_epoch()
         self.eat("training_end")
         self.eat("close_log")
         self.eat("EOF")
@@ -443,6 +452,8 @@ class log_parser(log_parser_base):
         self.samples = []
         self.phase = None
         self.n_training_samples = 0
+        self.samples_after_epoch = {}
+        self.test_epoch = None
         self.loss_acc = []
         self.kernels = []
         self.key_vals = []
@@ -475,13 +486,25 @@ class log_parser(log_parser_base):
         """
         self.loss_acc.append((self.n_training_samples, "train",
                               int(data["t"]), float(data["loss"]), None))
+    def action_train_epoch_end(self, data):
+        """
+        action on train epoch end
+        """
+        self.samples_after_epoch[int(data["epoch"])] = self.n_training_samples
+    def action_test_epoch_start(self, data):
+        """
+        action on test epoch start
+        """
+        self.test_epoch = int(data["epoch"])
     def action_test_loss(self, data):
         """
         action on validate loss
         """
         loss = float(data["loss"])
         acc = float(data["c"]) / float(data["n"])
-        self.loss_acc.append((self.n_training_samples, "test",
+        # samples trained when the tested weights were taken
+        n = self.samples_after_epoch.get(self.test_epoch, self.n_training_samples)
+        self.loss_acc.append((n, "test",
                               int(data["t"]), loss, acc))
     def xxx_action_train_accuracy(self, data):
         """
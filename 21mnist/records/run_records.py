@@ -0,0 +1,191 @@
+#!/usr/bin/python3
+"""
+run_records
+
+read structured run records (LOG.rec and LOG.sites, written by
+--records 1 alongside the text log LOG) into the same tables
+parse_log.parse_log makes from the text.  only the header and the
+last line of the text are looked at (for key_vals); every function
+signature is parsed once, not once per call.
+"""
+import io
+import json
+import os
+import struct
+import sys
+import time
+import parse_log
+
+HEADER = struct.Struct("<8sII")
+ROW = struct.Struct("<qqiiqqqqdd")
+VERSION = 1
+
+# kinds of rows (run_rec_kind_t in include/run_records.h)
+REC_BATCH, REC_KERNEL, REC_TRAIN_LOSS, REC_TEST_LOSS, REC_SAMPLE = range(5)
+
+def has_records(log):
+    """
+    true if log has run records next to it
+    """
+    return (log != "-" and os.path.exists(log + ".rec")
+            and os.path.exists(log + ".sites"))
+
+def read_sites(sites_file):
+    """
+    read the table of functions into {id : (cls, cargs, fun, fargs)}
+    """
+    psr = parse_log.log_parser(io.StringIO(""))
+    kpsr = parse_log.kernel_parser()
+    sites = {}
+    with open(sites_file) as fp:
+        for line in fp:
+            site, sig = line.rstrip("\n").split("\t", 1)
+            try:
+                cls, cargs, fun, fargs = psr.instantiate(kpsr.parse(sig))
+            except (parse_log.parse_error, AssertionError, KeyError):
+                # not a layer function (e.g., of a test); keep the signature as is
+                cls, cargs, fun, fargs = None, None, sig, None
+            if cargs is not None:
+                cargs = "<%s>" % ",".join("%s" % x for x in cargs)
+            if fargs is not None:
+                fargs = "<%s>" % ",".join("%s" % x for x in fargs)
+            sites[int(site)] = (cls, cargs, fun, fargs)
+    return sites
+
+def read_key_vals(log):
+    """
+    key_vals from the header of the text log (up to model building)
+    and its last line
+    """
+    psr = parse_log.log_parser(io.StringIO(""))
+    pats = psr.patterns
+    key_vals = []
+    last = ""
+    with open(log) as fp:
+        for line in fp:
+            if pats["model_start"].match(line):
+                break
+            match = pats["open_log"].match(line)
+            if match:
+                psr.action_open_log(match.groupdict())
+                continue
+            match = pats["env"].match(line)
+            if match:
+                psr.action_env(match.groupdict())
+        # the last line
+        fp.seek(0, os.SEEK_END)
+        size = fp.tell()
+        fp.seek(max(0, size - 4096))
+        tail = fp.read().rstrip("\n").split("\n")
+        last = tail[-1] if tail else ""
+    match = pats["close_log"].match(last + "\n")
+    if match:
+        psr.action_close_log(match.groupdict())
+    key_vals = psr.get_key_vals()
+    return key_vals
+
+def read_rows(rec_file):
+    """
+    read all rows of LOG.rec
+    """
+    with open(rec_file, "rb") as fp:
+        data = fp.read()
+    magic, version, row_bytes = HEADER.unpack_from(data, 0)
+    if magic != b"MNISTREC" or version != VERSION or row_bytes != ROW.size:
+        raise parse_log.parse_error("%s: not run records of version %d (%s %d %d)"
+                                    % (rec_file, VERSION, magic, version, row_bytes))
+    body = memoryview(data)[HEADER.size:]
+    n = len(body) // ROW.size
+    return ROW.iter_unpack(body[:n * ROW.size])
+
+def read_records(log):
+    """
+    read LOG.rec and LOG.sites and make the tables parse_log.parse_log makes
+    """
+    sites = read_sites(log + ".sites")
+    samples = []
+    loss_acc = []
+    kernels = []
+    n_training_samples = 0
+    samples_after_epoch = {}
+    last_train_epoch = None
+    n_batches = -1
+    train_test, a0, b0 = None, None, None
+    for t0, t1, kind, i, a, b, c, d, x, y in read_rows(log + ".rec"):
+        if kind == REC_KERNEL:
+            cls, cargs, fun, fargs = sites[i]
+            kernels.append(dict(t0=t0, t1=t1, cls=cls, cargs=cargs, fun=fun, fargs=fargs,
+                                dt=a, train_test=train_test, a=a0, b=b0))
+        elif kind == REC_BATCH:
+            n_batches += 1
+            if c == 0:
+                if last_train_epoch is not None and last_train_epoch != i:
+                    samples_after_epoch[last_train_epoch] = n_training_samples
+                last_train_epoch = i
+                train_test = "train"
+                n_training_samples += b - a
+            else:
+                if last_train_epoch is not None:
+                    samples_after_epoch[last_train_epoch] = n_training_samples
+                train_test = "test"
+            a0, b0 = a, b
+        elif kind == REC_SAMPLE:
+            samples.append(dict(iter=n_batches, train_test=train_test, t="%d" % t0,
+                                sample="%d" % a, image="%d" % b, pred="%d" % c, truth="%d" % d))
+        elif kind == REC_TRAIN_LOSS:
+            loss_acc.append({"samples" : n_training_samples, "t" : t0,
+                             "train_loss" : x, "train_accuracy" : "",
+                             "test_loss" : "", "test_accuracy" : ""})
+        elif kind == REC_TEST_LOSS:
+            n = samples_after_epoch.get(i, n_training_samples)
+            loss_acc.append({"samples" : n, "t" : t0,
+                             "train_loss" : "", "train_accuracy" : "",
+                             "test_loss" : x, "test_accuracy" : y})
+    classes = ["airplane", "automobile", "bird", "cat",
+               "deer", "dog", "frog", "horse", "ship", "truck"]
+    return {"key_vals"      : read_key_vals(log),
+            "samples"       : samples,
+            "loss_accuracy" : loss_acc,
+            "kernel_times"  : kernels,
+            "meta"          : [{"class": x} for x in classes]}
+
+def parse_log_or_records(log):
+    """
+    what parse_log.parse_log returns, from run records if log has them
+    """
+    if not has_records(log):
+        return parse_log.parse_log(log)
+    with open(log) as fp:
+        raw_data = fp.read()
+    return read_records(log), raw_data
+
+def main():
+    """
+    main: read run records of LOG (with --compare, parse LOG too and
+    check both make the same tables)
+    """
+    log = sys.argv[1] if len(sys.argv) > 1 else "mnist.log"
+    t0 = time.time()
+    rec = read_records(log)
+    t1 = time.time()
+    sys.stdout.write("run records: %.3f sec, %s\n"
+                     % (t1 - t0, ", ".join("%s %d" % (k, len(v)) for k, v in rec.items())))
+    if len(sys.argv) > 2 and sys.argv[2] == "--compare":
+        plog, _ = parse_log.parse_log(log)
+        t2 = time.time()
+        sys.stdout.write("parse_log  : %.3f sec, %s\n"
+                         % (t2 - t1, ", ".join("%s %d" % (k, len(v)) for k, v in plog.items())))
+        # timestamps are taken separately and the text has fewer digits
+        def strip(rows):
+            return [{k : (round(v, 4) if isinstance(v, float) else v)
+                     for k, v in row.items() if k not in ("t", "t0", "t1")} for row in rows]
+        for k in ["key_vals", "samples", "loss_accuracy", "kernel_times"]:
+            if json.dumps(strip(rec[k])) != json.dumps(strip(plog[k])):
+                sys.stdout.write("%s differ\n" % k)
+                return 1
+        sys.stdout.write("same tables (except timestamps)\n")
+        return 0
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
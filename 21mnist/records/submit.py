@@ -15,6 +15,7 @@ import sys
 import tempfile
 import time
 import parse_log
+import run_records
 
 default_data_dir = "/home/share/public_html/parallel-distributed/21mnist/records/mnist_records"
 #default_data_dir = "mnist_records"
@@ -171,11 +172,22 @@ def insert_row(con, schema, tbl, row, seqid):
 
 def insert_rows(con, schema, tbl, rows, seqid):
     """
-    insert rows into database
+    insert rows into database.
+    rows having the same columns are inserted by a single executemany
     """
-    n_inserted = 0
+    groups = {}
     for row in rows:
-        n_inserted += insert_row(con, schema, tbl, row, seqid)
+        groups.setdefault(tuple(row.keys()), []).append(row)
+    n_inserted = 0
+    for keys, group in groups.items():
+        fields = ["seqid"] + [k.replace("-", "_") for k in keys]
+        ins_cmd = ("insert into {}({}) values({})"
+                   .format(tbl, ",".join(fields), ",".join(["?"] * len(fields))))
+        ensure_columns(con, schema, tbl, fields)
+        if 2 <= dbg:
+            Es("%s with %d rows\n" % (ins_cmd, len(group)))
+        con.executemany(ins_cmd, [[seqid] + [row[k] for k in keys] for row in group])
+        n_inserted += len(group)
     return n_inserted
 
 def make_row_from_key_vals(rows):
@@ -244,7 +256,8 @@ def parse_logs(logs, q_dir):
     """
     result = []
     for log in logs:
-        parsed, raw_data = parse_log.parse_log(log)
+        # LOG.rec and LOG.sites (--records 1), if any, are much faster to read
+        parsed, raw_data = run_records.parse_log_or_records(log)
         if q_dir is None:
             q_log = None
         else: